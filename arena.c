@@ -0,0 +1,449 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    arena.c
+
+Abstract:
+
+    This module implements arenas. Allocations bump a pointer in the current
+    block, and resetting an arena just rewinds to its first block, so
+    everything a request or an upstream call allocated is released in O(1)
+    and the blocks are reused by the next one.
+
+    cJSON is pointed at the current thread's arena with cJSON_InitHooks, so
+    parsed trees don't need to be deleted node by node.
+
+--*/
+
+#include "server.h"
+
+static THREAD_LOCAL PARENA CurrentArena;
+
+static PARENA_BLOCK
+AllocateBlock(
+    IN SIZE_T Size
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates an arena block.
+
+Arguments:
+
+    Size - The minimum number of usable bytes in the block.
+
+Return Value:
+
+    The block, or NULL if it couldn't be allocated.
+
+--*/
+{
+    PARENA_BLOCK Block;
+
+    Size = MAX(Size, ARENA_BLOCK_SIZE);
+    Block = malloc(sizeof(ARENA_BLOCK) + Size);
+    if ( !Block )
+    {
+        LOG("Failed to allocate %zu-byte arena block: %s (errno %d)\n", Size, ERRNO_STRING());
+        return NULL;
+    }
+
+    Block->Next = NULL;
+    Block->Size = Size;
+    Block->Used = 0;
+    return Block;
+}
+
+PVOID
+ArenaAlloc(
+    IN OUT PARENA Arena,
+    IN SIZE_T Size
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates memory from an arena.
+
+Arguments:
+
+    Arena - The arena.
+
+    Size - The number of bytes to allocate.
+
+Return Value:
+
+    The memory, aligned to ARENA_ALIGNMENT, or NULL if it couldn't be
+    allocated.
+
+--*/
+{
+    PARENA_BLOCK Block;
+    PVOID Memory;
+
+    Size = (Size + ARENA_ALIGNMENT - 1) & ~(SIZE_T)(ARENA_ALIGNMENT - 1);
+
+    if ( !Arena->Current )
+    {
+        if ( !Arena->First )
+        {
+            Arena->First = AllocateBlock(Size);
+            if ( !Arena->First )
+            {
+                return NULL;
+            }
+        }
+        Arena->Current = Arena->First;
+        Arena->Current->Used = 0;
+    }
+
+    Block = Arena->Current;
+    if ( Block->Size - Block->Used < Size )
+    {
+        // Reuse the next block if it's big enough, otherwise put a new one
+        // in front of it
+        if ( Block->Next && Block->Next->Size >= Size )
+        {
+            Block = Block->Next;
+        }
+        else
+        {
+            Block = AllocateBlock(Size);
+            if ( !Block )
+            {
+                return NULL;
+            }
+            Block->Next = Arena->Current->Next;
+            Arena->Current->Next = Block;
+        }
+
+        Block->Used = 0;
+        Arena->Current = Block;
+    }
+
+    // Blocks are malloc'd and the header is a multiple of the alignment
+    Memory = (PBYTE)(Block + 1) + Block->Used;
+    Block->Used += Size;
+    return Memory;
+}
+
+PCHAR
+ArenaPrintf(
+    IN OUT PARENA Arena,
+    IN PCCHAR Format,
+    ...
+    )
+/*++
+
+Routine Description:
+
+    This routine formats a string into arena memory.
+
+Arguments:
+
+    Arena - The arena.
+
+    Format - The format string.
+
+    ... - The format arguments.
+
+Return Value:
+
+    The string, or NULL if it couldn't be allocated.
+
+--*/
+{
+    va_list Arguments;
+    PCHAR String;
+    INT Length;
+
+    va_start(
+        Arguments,
+        Format
+        );
+    Length = vsnprintf(
+        NULL,
+        0,
+        Format,
+        Arguments
+        );
+    va_end(Arguments);
+    if ( Length < 0 )
+    {
+        return NULL;
+    }
+
+    String = ArenaAlloc(
+        Arena,
+        Length + 1
+        );
+    if ( !String )
+    {
+        return NULL;
+    }
+
+    va_start(
+        Arguments,
+        Format
+        );
+    vsnprintf(
+        String,
+        Length + 1,
+        Format,
+        Arguments
+        );
+    va_end(Arguments);
+
+    return String;
+}
+
+VOID
+ArenaReset(
+    IN OUT PARENA Arena
+    )
+/*++
+
+Routine Description:
+
+    This routine releases everything allocated from an arena. The blocks are
+    kept for the next allocations.
+
+Arguments:
+
+    Arena - The arena.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Arena->Current = NULL;
+}
+
+VOID
+ArenaFree(
+    IN OUT PARENA Arena
+    )
+/*++
+
+Routine Description:
+
+    This routine frees all of an arena's blocks.
+
+Arguments:
+
+    Arena - The arena.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PARENA_BLOCK Block;
+    PARENA_BLOCK Next;
+
+    for ( Block = Arena->First; Block; Block = Next )
+    {
+        Next = Block->Next;
+        free(Block);
+    }
+
+    Arena->First = NULL;
+    Arena->Current = NULL;
+}
+
+VOID
+ArenaBegin(
+    IN OUT PARENA Arena
+    )
+/*++
+
+Routine Description:
+
+    This routine makes an arena the current thread's scratch arena. Scopes
+    can be nested, and each must be closed with ArenaEnd.
+
+Arguments:
+
+    Arena - The arena.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Arena->Previous = CurrentArena;
+    CurrentArena = Arena;
+}
+
+VOID
+ArenaEnd(
+    IN OUT PARENA Arena
+    )
+/*++
+
+Routine Description:
+
+    This routine resets the current thread's scratch arena and makes the
+    previous one current again.
+
+Arguments:
+
+    Arena - The arena, which must be the current one.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    assert(CurrentArena == Arena);
+
+    ArenaReset(Arena);
+    CurrentArena = Arena->Previous;
+    Arena->Previous = NULL;
+}
+
+static BOOLEAN
+ArenaContains(
+    IN PARENA Arena,
+    IN PVOID Pointer
+    )
+/*++
+
+Routine Description:
+
+    This routine checks if memory is in one of an arena's blocks in use.
+
+Arguments:
+
+    Arena - The arena.
+
+    Pointer - The memory.
+
+Return Value:
+
+    TRUE - The memory belongs to the arena.
+
+    FALSE - The memory came from somewhere else.
+
+--*/
+{
+    PARENA_BLOCK Block;
+
+    for ( Block = Arena->First; Block; Block = Block->Next )
+    {
+        if ( (PBYTE)Pointer >= (PBYTE)(Block + 1) &&
+             (PBYTE)Pointer < (PBYTE)(Block + 1) + Block->Size )
+        {
+            return TRUE;
+        }
+
+        if ( Block == Arena->Current )
+        {
+            break;
+        }
+    }
+
+    return FALSE;
+}
+
+static PVOID
+JsonAlloc(
+    IN SIZE_T Size
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates memory for cJSON, from the current thread's
+    arena if it has one.
+
+Arguments:
+
+    Size - The number of bytes to allocate.
+
+Return Value:
+
+    The memory, or NULL if it couldn't be allocated.
+
+--*/
+{
+    if ( CurrentArena )
+    {
+        return ArenaAlloc(
+            CurrentArena,
+            Size
+            );
+    }
+
+    return malloc(Size);
+}
+
+static VOID
+JsonFree(
+    IN PVOID Pointer
+    )
+/*++
+
+Routine Description:
+
+    This routine frees memory for cJSON. Arena memory is left for the arena
+    to release.
+
+Arguments:
+
+    Pointer - The memory to free.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( CurrentArena && ArenaContains(
+                             CurrentArena,
+                             Pointer
+                             ) )
+    {
+        return;
+    }
+
+    free(Pointer);
+}
+
+VOID
+ArenaInitializeJsonHooks(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine makes cJSON allocate from the current thread's arena.
+    Threads without one still get malloc and free.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    cJSON_Hooks Hooks = {
+        .malloc_fn = JsonAlloc,
+        .free_fn = JsonFree
+    };
+
+    cJSON_InitHooks(&Hooks);
+}
@@ -0,0 +1,120 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    arena.h
+
+Abstract:
+
+    This module contains definitions for arenas, which hand out scratch
+    memory that's all released at once.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Default size of an arena block
+//
+
+#define ARENA_BLOCK_SIZE 16384
+
+//
+// Alignment of arena allocations
+//
+
+#define ARENA_ALIGNMENT 16
+
+//
+// A block of arena memory, the data follows the header
+//
+
+typedef struct _ARENA_BLOCK
+{
+    struct _ARENA_BLOCK* Next;
+    SIZE_T Size;
+    SIZE_T Used;
+} ARENA_BLOCK, *PARENA_BLOCK;
+
+//
+// An arena. Blocks are kept when it's reset, so a reused arena stops
+// allocating once it's grown to fit its biggest scope.
+//
+
+typedef struct _ARENA
+{
+    PARENA_BLOCK First;
+    PARENA_BLOCK Current;
+    struct _ARENA* Previous;
+} ARENA, *PARENA;
+
+//
+// Allocate memory from an arena
+//
+
+PVOID
+ArenaAlloc(
+    IN OUT PARENA Arena,
+    IN SIZE_T Size
+    );
+
+//
+// Format a string into arena memory
+//
+
+PCHAR
+ArenaPrintf(
+    IN OUT PARENA Arena,
+    IN PCCHAR Format,
+    ...
+    );
+
+//
+// Release everything allocated from an arena
+//
+
+VOID
+ArenaReset(
+    IN OUT PARENA Arena
+    );
+
+//
+// Free an arena's blocks
+//
+
+VOID
+ArenaFree(
+    IN OUT PARENA Arena
+    );
+
+//
+// Make an arena the current thread's scratch arena, which cJSON allocates
+// from
+//
+
+VOID
+ArenaBegin(
+    IN OUT PARENA Arena
+    );
+
+//
+// Reset the current thread's scratch arena and restore the previous one
+//
+
+VOID
+ArenaEnd(
+    IN OUT PARENA Arena
+    );
+
+//
+// Install the cJSON allocation hooks
+//
+
+VOID
+ArenaInitializeJsonHooks(
+    VOID
+    );
@@ -0,0 +1,188 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    assets.c
+
+Abstract:
+
+    This module implements serving the static files built into the server.
+    They're compiled in as arrays by cmake/EmbedAssets.cmake, so the server
+    doesn't need its working directory to have them in it and doesn't open
+    a file per page view. Each one has its hash as an ETag, so browsers
+    that already have it get a 304, and a gzipped copy for browsers that
+    accept it, which has its own ETag.
+
+--*/
+
+#include "server.h"
+
+PCHAR AssetPath;
+
+static PCASSET
+FindAsset(
+    IN struct mg_str Path
+    )
+/*++
+
+Routine Description:
+
+    This routine finds a built in file by its path.
+
+Arguments:
+
+    Path - The path, starting with a slash.
+
+Return Value:
+
+    The file, or NULL if there isn't one with that path.
+
+--*/
+{
+    UINT32 i;
+
+    for ( i = 0; i < AssetCount; i++ )
+    {
+        if ( mg_vcmp(
+                 &Path,
+                 Assets[i].Path
+                 ) == 0 )
+        {
+            return &Assets[i];
+        }
+    }
+
+    return NULL;
+}
+
+VOID
+AssetServe(
+    IN struct mg_connection* Connection,
+    IN struct mg_http_message* HttpMessage
+    )
+/*++
+
+Routine Description:
+
+    This routine serves the built in file a request is for, or the page
+    for any other path, like requests for the page used to get. With
+    asset_path set, the file is read from that directory instead, but only
+    files that are built in can be read that way.
+
+Arguments:
+
+    Connection - The connection to write to.
+
+    HttpMessage - The request.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct mg_http_serve_opts Options = {0};
+    struct mg_str* Header;
+    CHAR Path[512];
+    PCASSET Asset;
+    PCCHAR ETag;
+    BOOLEAN Gzip;
+
+    Asset = FindAsset(HttpMessage->uri);
+    if ( !Asset )
+    {
+        Asset = FindAsset(mg_str("/" STATIC_PAGE));
+    }
+    if ( !Asset )
+    {
+        mg_http_reply(
+            Connection,
+            404,
+            "Content-Type: text/plain\r\n",
+            "Not found\n"
+            );
+        return;
+    }
+
+    if ( AssetPath )
+    {
+        snprintf(
+            Path,
+            ARRAY_SIZE(Path),
+            "%s%s",
+            AssetPath,
+            Asset->Path
+            );
+        Options.extra_headers = "Cache-Control: no-cache\r\n";
+        mg_http_serve_file(
+            Connection,
+            HttpMessage,
+            Path,
+            &Options
+            );
+        return;
+    }
+
+    Header = mg_http_get_header(
+        HttpMessage,
+        "Accept-Encoding"
+        );
+    Gzip = Asset->Gzip && Header && mg_strstr(
+                                        *Header,
+                                        mg_str("gzip")
+                                        );
+    ETag = Gzip ? Asset->GzipETag : Asset->ETag;
+
+    // The header can list more than one ETag, and the quotes keep one
+    // encoding's ETag from matching the other's
+    Header = mg_http_get_header(
+        HttpMessage,
+        "If-None-Match"
+        );
+    if ( Header && mg_strstr(
+                       *Header,
+                       mg_str(ETag)
+                       ) )
+    {
+        mg_printf(
+            Connection,
+            "HTTP/1.1 304 Not Modified\r\n"
+            "ETag: %s\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Vary: Accept-Encoding\r\n"
+            "Content-Length: 0\r\n"
+            "\r\n",
+            ETag
+            );
+        return;
+    }
+
+    mg_printf(
+        Connection,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "ETag: %s\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Vary: Accept-Encoding\r\n"
+        "%s"
+        "Content-Length: %lu\r\n"
+        "\r\n",
+        Asset->ContentType,
+        ETag,
+        Gzip ? "Content-Encoding: gzip\r\n" : "",
+        (unsigned long)(Gzip ? Asset->GzipSize : Asset->Size)
+        );
+    if ( mg_vcmp(
+             &HttpMessage->method,
+             "HEAD"
+             ) != 0 )
+    {
+        mg_send(
+            Connection,
+            Gzip ? Asset->Gzip : Asset->Data,
+            Gzip ? Asset->GzipSize : Asset->Size
+            );
+    }
+}
@@ -0,0 +1,61 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    assets.h
+
+Abstract:
+
+    This module contains definitions for the static files built into the
+    server.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// A file built into the server, with its hash as an ETag and a gzipped
+// copy if that's smaller. The gzipped copy has its own ETag, since a
+// strong ETag has to be different for each encoding.
+//
+
+typedef struct _ASSET
+{
+    PCCHAR Path;
+    PCCHAR ContentType;
+    PCCHAR ETag;
+    PCUINT8 Data;
+    SIZE_T Size;
+    PCUINT8 Gzip;
+    SIZE_T GzipSize;
+    PCCHAR GzipETag;
+} ASSET, *PASSET;
+typedef const ASSET* PCASSET;
+
+//
+// The files, generated from DATA in CMakeLists.txt
+//
+
+extern const ASSET Assets[];
+extern const UINT32 AssetCount;
+
+//
+// Directory to serve the files from instead, so they can be changed
+// without rebuilding, or NULL to serve the built in ones
+//
+
+extern PCHAR AssetPath;
+
+//
+// Serve the file a request is for, or the page for anything else
+//
+
+VOID
+AssetServe(
+    IN struct mg_connection* Connection,
+    IN struct mg_http_message* HttpMessage
+    );
@@ -0,0 +1,602 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    attendance.c
+
+Abstract:
+
+    This module implements the attendance index. Each meeting day has a
+    bitmap over dense member IDs from the roster, which starts as a sorted
+    array and switches to a bitset once enough members have shown up. Counts
+    are answered with popcounts, so they don't depend on how many check-ins
+    there have been.
+
+--*/
+
+#include "server.h"
+
+static PATTENDANCE_DAY Days;
+static UINT32 DayCount;
+static UINT32 DayCapacity;
+
+UINT32
+AttendanceGetDate(
+    IN time_t Timestamp
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the local date of a timestamp.
+
+Arguments:
+
+    Timestamp - The timestamp.
+
+Return Value:
+
+    The date as YYYYMMDD.
+
+--*/
+{
+    struct tm Time;
+
+    LOCALTIME(
+        &Timestamp,
+        &Time
+        );
+
+    return (Time.tm_year + 1900) * 10000 + (Time.tm_mon + 1) * 100 + Time.tm_mday;
+}
+
+BOOLEAN
+AttendanceParseDate(
+    IN PCCHAR String,
+    OUT PUINT32 Date
+    )
+/*++
+
+Routine Description:
+
+    This routine parses a date.
+
+Arguments:
+
+    String - The date as YYYY-MM-DD.
+
+    Date - Receives the date as YYYYMMDD.
+
+Return Value:
+
+    TRUE - The date was parsed.
+
+    FALSE - The date is invalid.
+
+--*/
+{
+    UINT Year;
+    UINT Month;
+    UINT Day;
+
+    if ( sscanf(
+             String,
+             "%4u-%2u-%2u",
+             &Year,
+             &Month,
+             &Day
+             ) != 3 ||
+         Month < 1 || Month > 12 || Day < 1 || Day > 31 )
+    {
+        return FALSE;
+    }
+
+    *Date = Year * 10000 + Month * 100 + Day;
+    return TRUE;
+}
+
+static BOOLEAN
+FindDay(
+    IN UINT32 Date,
+    OUT PUINT32 Index
+    )
+/*++
+
+Routine Description:
+
+    This routine does a binary search for a day.
+
+Arguments:
+
+    Date - The date to find.
+
+    Index - Receives the index of the day, or where it should be inserted.
+
+Return Value:
+
+    TRUE - The day exists.
+
+    FALSE - The day doesn't exist.
+
+--*/
+{
+    UINT32 Low;
+    UINT32 High;
+    UINT32 Middle;
+
+    // Check-ins almost always happen on the latest day
+    if ( DayCount && Days[DayCount - 1].Date <= Date )
+    {
+        *Index = Days[DayCount - 1].Date == Date ? DayCount - 1 : DayCount;
+        return Days[DayCount - 1].Date == Date;
+    }
+
+    Low = 0;
+    High = DayCount;
+    while ( Low < High )
+    {
+        Middle = Low + (High - Low) / 2;
+        if ( Days[Middle].Date < Date )
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+
+    *Index = Low;
+    return Low < DayCount && Days[Low].Date == Date;
+}
+
+static BOOLEAN
+FindId(
+    IN PATTENDANCE_BITMAP Bitmap,
+    IN UINT32 Id,
+    OUT PUINT32 Index
+    )
+/*++
+
+Routine Description:
+
+    This routine does a binary search for an ID in a sparse bitmap.
+
+Arguments:
+
+    Bitmap - The bitmap.
+
+    Id - The ID to find.
+
+    Index - Receives the index of the ID, or where it should be inserted.
+
+Return Value:
+
+    TRUE - The ID is in the bitmap.
+
+    FALSE - The ID isn't in the bitmap.
+
+--*/
+{
+    UINT32 Low;
+    UINT32 High;
+    UINT32 Middle;
+
+    Low = 0;
+    High = Bitmap->Count;
+    while ( Low < High )
+    {
+        Middle = Low + (High - Low) / 2;
+        if ( Bitmap->Ids[Middle] < Id )
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+
+    *Index = Low;
+    return Low < Bitmap->Count && Bitmap->Ids[Low] == Id;
+}
+
+static BOOLEAN
+TestBitmap(
+    IN PATTENDANCE_BITMAP Bitmap,
+    IN UINT32 Id
+    )
+/*++
+
+Routine Description:
+
+    This routine checks if an ID is in a bitmap.
+
+Arguments:
+
+    Bitmap - The bitmap.
+
+    Id - The ID.
+
+Return Value:
+
+    TRUE - The ID is set.
+
+    FALSE - The ID isn't set.
+
+--*/
+{
+    UINT32 Index;
+
+    if ( Bitmap->Dense )
+    {
+        return Id / 64 < Bitmap->Capacity &&
+               (Bitmap->Words[Id / 64] >> (Id % 64)) & 1;
+    }
+
+    return FindId(
+        Bitmap,
+        Id,
+        &Index
+        );
+}
+
+static BOOLEAN
+MakeBitmapDense(
+    IN OUT PATTENDANCE_BITMAP Bitmap,
+    IN UINT32 WordCount
+    )
+/*++
+
+Routine Description:
+
+    This routine converts a sparse bitmap to a bitset.
+
+Arguments:
+
+    Bitmap - The bitmap.
+
+    WordCount - The number of words in the bitset.
+
+Return Value:
+
+    TRUE - The bitmap was converted.
+
+    FALSE - Memory couldn't be allocated.
+
+--*/
+{
+    PUINT64 Words;
+    UINT32 i;
+
+    Words = calloc(
+        WordCount,
+        sizeof(UINT64)
+        );
+    if ( !Words )
+    {
+        LOG("Failed to allocate %u-word bitmap: %s (errno %d)\n", WordCount, ERRNO_STRING());
+        return FALSE;
+    }
+
+    for ( i = 0; i < Bitmap->Count; i++ )
+    {
+        Words[Bitmap->Ids[i] / 64] |= 1ull << (Bitmap->Ids[i] % 64);
+    }
+
+    free(Bitmap->Ids);
+    Bitmap->Words = Words;
+    Bitmap->Capacity = WordCount;
+    Bitmap->Dense = TRUE;
+    return TRUE;
+}
+
+static BOOLEAN
+SetBitmap(
+    IN OUT PATTENDANCE_BITMAP Bitmap,
+    IN UINT32 Id
+    )
+/*++
+
+Routine Description:
+
+    This routine adds an ID to a bitmap.
+
+Arguments:
+
+    Bitmap - The bitmap.
+
+    Id - The ID.
+
+Return Value:
+
+    TRUE - The ID was added.
+
+    FALSE - The ID was already set, or memory couldn't be allocated.
+
+--*/
+{
+    PUINT64 NewWords;
+    PUINT32 NewIds;
+    UINT32 WordCount;
+    UINT32 NewCapacity;
+    UINT32 Index;
+
+    WordCount = (MAX(Id + 1, RosterGetMemberCount()) + 63) / 64;
+
+    if ( !Bitmap->Dense )
+    {
+        if ( FindId(
+                 Bitmap,
+                 Id,
+                 &Index
+                 ) )
+        {
+            return FALSE;
+        }
+
+        if ( (Bitmap->Count + 1) * sizeof(UINT32) > WordCount * sizeof(UINT64) )
+        {
+            if ( !MakeBitmapDense(
+                     Bitmap,
+                     WordCount
+                     ) )
+            {
+                return FALSE;
+            }
+        }
+        else
+        {
+            if ( Bitmap->Count >= Bitmap->Capacity )
+            {
+                NewCapacity = Bitmap->Capacity ? Bitmap->Capacity * 2 : 8;
+                NewIds = realloc(
+                    Bitmap->Ids,
+                    NewCapacity * sizeof(UINT32)
+                    );
+                if ( !NewIds )
+                {
+                    LOG("Failed to grow bitmap to %u IDs: %s (errno %d)\n", NewCapacity, ERRNO_STRING());
+                    return FALSE;
+                }
+                Bitmap->Ids = NewIds;
+                Bitmap->Capacity = NewCapacity;
+            }
+
+            memmove(
+                Bitmap->Ids + Index + 1,
+                Bitmap->Ids + Index,
+                (Bitmap->Count - Index) * sizeof(UINT32)
+                );
+            Bitmap->Ids[Index] = Id;
+            Bitmap->Count++;
+            return TRUE;
+        }
+    }
+
+    if ( Id / 64 >= Bitmap->Capacity )
+    {
+        NewWords = realloc(
+            Bitmap->Words,
+            WordCount * sizeof(UINT64)
+            );
+        if ( !NewWords )
+        {
+            LOG("Failed to grow bitmap to %u words: %s (errno %d)\n", WordCount, ERRNO_STRING());
+            return FALSE;
+        }
+        memset(
+            NewWords + Bitmap->Capacity,
+            0,
+            (WordCount - Bitmap->Capacity) * sizeof(UINT64)
+            );
+        Bitmap->Words = NewWords;
+        Bitmap->Capacity = WordCount;
+    }
+
+    if ( (Bitmap->Words[Id / 64] >> (Id % 64)) & 1 )
+    {
+        return FALSE;
+    }
+
+    Bitmap->Words[Id / 64] |= 1ull << (Id % 64);
+    Bitmap->Count++;
+    return TRUE;
+}
+
+BOOLEAN
+AttendanceRecord(
+    IN UINT32 MemberId,
+    IN time_t Timestamp
+    )
+/*++
+
+Routine Description:
+
+    This routine marks a member as present on the day of a timestamp,
+    creating the day if it's the first check-in.
+
+Arguments:
+
+    MemberId - The member's dense ID.
+
+    Timestamp - The time of the check-in.
+
+Return Value:
+
+    TRUE - The member wasn't already marked present that day.
+
+    FALSE - The member was already present, or memory couldn't be allocated.
+
+--*/
+{
+    PATTENDANCE_DAY NewDays;
+    UINT32 NewCapacity;
+    UINT32 Date;
+    UINT32 Index;
+
+    Date = AttendanceGetDate(Timestamp);
+    if ( !FindDay(
+             Date,
+             &Index
+             ) )
+    {
+        if ( DayCount >= DayCapacity )
+        {
+            NewCapacity = DayCapacity ? DayCapacity * 2 : 64;
+            NewDays = realloc(
+                Days,
+                NewCapacity * sizeof(ATTENDANCE_DAY)
+                );
+            if ( !NewDays )
+            {
+                LOG("Failed to grow attendance index to %u days: %s (errno %d)\n", NewCapacity, ERRNO_STRING());
+                return FALSE;
+            }
+            Days = NewDays;
+            DayCapacity = NewCapacity;
+        }
+
+        memmove(
+            Days + Index + 1,
+            Days + Index,
+            (DayCount - Index) * sizeof(ATTENDANCE_DAY)
+            );
+        memset(
+            &Days[Index],
+            0,
+            sizeof(ATTENDANCE_DAY)
+            );
+        Days[Index].Date = Date;
+        DayCount++;
+    }
+
+    return SetBitmap(
+        &Days[Index].Members,
+        MemberId
+        );
+}
+
+UINT32
+AttendanceGetHeadcount(
+    IN UINT32 Date
+    )
+/*++
+
+Routine Description:
+
+    This routine counts the members present on a day.
+
+Arguments:
+
+    Date - The date as YYYYMMDD.
+
+Return Value:
+
+    The number of members present.
+
+--*/
+{
+    PATTENDANCE_BITMAP Bitmap;
+    UINT32 Headcount;
+    UINT32 Index;
+    UINT32 i;
+
+    if ( !FindDay(
+             Date,
+             &Index
+             ) )
+    {
+        return 0;
+    }
+
+    Bitmap = &Days[Index].Members;
+    if ( !Bitmap->Dense )
+    {
+        return Bitmap->Count;
+    }
+
+    Headcount = 0;
+    for ( i = 0; i < Bitmap->Capacity; i++ )
+    {
+        Headcount += POPCOUNT64(Bitmap->Words[i]);
+    }
+
+    return Headcount;
+}
+
+VOID
+AttendanceGetMemberDays(
+    IN UINT32 MemberId,
+    OUT PUINT32 DaysPresent,
+    OUT PUINT32 MeetingDays
+    )
+/*++
+
+Routine Description:
+
+    This routine counts the days a member was present.
+
+Arguments:
+
+    MemberId - The member's dense ID.
+
+    DaysPresent - Receives the number of days the member was present.
+
+    MeetingDays - Receives the total number of meeting days.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 i;
+
+    *DaysPresent = 0;
+    for ( i = 0; i < DayCount; i++ )
+    {
+        *DaysPresent += TestBitmap(
+            &Days[i].Members,
+            MemberId
+            );
+    }
+
+    *MeetingDays = DayCount;
+}
+
+VOID
+AttendanceFree(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the attendance index.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 i;
+
+    for ( i = 0; i < DayCount; i++ )
+    {
+        // Both members of the union are the same pointer
+        free(Days[i].Members.Ids);
+    }
+
+    free(Days);
+    Days = NULL;
+    DayCount = 0;
+    DayCapacity = 0;
+}
@@ -0,0 +1,103 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    attendance.h
+
+Abstract:
+
+    This module contains definitions for the attendance index, which keeps a
+    compressed bitmap of member IDs for each meeting day.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Sparse bitmaps are sorted arrays of IDs, and become dense bitsets once the
+// array would be bigger than the bitset
+//
+
+typedef struct _ATTENDANCE_BITMAP
+{
+    BOOLEAN Dense;
+    UINT32 Count;
+    UINT32 Capacity;
+    union
+    {
+        PUINT32 Ids;
+        PUINT64 Words;
+    };
+} ATTENDANCE_BITMAP, *PATTENDANCE_BITMAP;
+
+//
+// The members present on a meeting day, Date is YYYYMMDD
+//
+
+typedef struct _ATTENDANCE_DAY
+{
+    UINT32 Date;
+    ATTENDANCE_BITMAP Members;
+} ATTENDANCE_DAY, *PATTENDANCE_DAY;
+
+//
+// Get the YYYYMMDD date of a timestamp, in local time
+//
+
+UINT32
+AttendanceGetDate(
+    IN time_t Timestamp
+    );
+
+//
+// Parse a YYYY-MM-DD string into a YYYYMMDD date
+//
+
+BOOLEAN
+AttendanceParseDate(
+    IN PCCHAR String,
+    OUT PUINT32 Date
+    );
+
+//
+// Mark a member as present on the day of a timestamp
+//
+
+BOOLEAN
+AttendanceRecord(
+    IN UINT32 MemberId,
+    IN time_t Timestamp
+    );
+
+//
+// Get the number of members present on a day
+//
+
+UINT32
+AttendanceGetHeadcount(
+    IN UINT32 Date
+    );
+
+//
+// Get the number of days a member was present and the number of meeting days
+//
+
+VOID
+AttendanceGetMemberDays(
+    IN UINT32 MemberId,
+    OUT PUINT32 DaysPresent,
+    OUT PUINT32 MeetingDays
+    );
+
+//
+// Free the index
+//
+
+VOID
+AttendanceFree(
+    VOID
+    );
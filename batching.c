@@ -0,0 +1,617 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    batching.c
+
+Abstract:
+
+    This module implements the controller that batches spreadsheet writes.
+    When submissions trickle in, each one is sent as soon as it arrives.
+    When they arrive faster than the write quota allows, the controller
+    holds them for a window sized so requests stay under the quota, and
+    when Google answers with 429 the window is stretched and sending backs
+    off until requests succeed again.
+
+    The controller doesn't do any I/O or read the clock itself, so the
+    simulation below drives it with the same code the delivery thread uses.
+
+--*/
+
+#include "server.h"
+
+static DOUBLE
+GetArrivalRate(
+    IN PCBATCH_CONTROLLER Controller,
+    IN UINT64 Now
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the smoothed arrival rate, decayed for the time since
+    the last arrival.
+
+Arguments:
+
+    Controller - The controller.
+
+    Now - The current time.
+
+Return Value:
+
+    Submissions per second.
+
+--*/
+{
+    DOUBLE Elapsed;
+
+    if ( Now <= Controller->LastArrival )
+    {
+        return Controller->ArrivalRate;
+    }
+
+    Elapsed = (DOUBLE)(Now - Controller->LastArrival) / 1000;
+    return Controller->ArrivalRate * BATCH_RATE_PERIOD / (BATCH_RATE_PERIOD + Elapsed);
+}
+
+static DOUBLE
+GetPlannedRate(
+    IN PCBATCH_CONTROLLER Controller
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the request rate the controller plans for.
+
+Arguments:
+
+    Controller - The controller.
+
+Return Value:
+
+    Requests per second.
+
+--*/
+{
+    return (DOUBLE)Controller->Quota * BATCH_QUOTA_HEADROOM / 100 / 60;
+}
+
+static VOID
+RefillBudget(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now
+    )
+/*++
+
+Routine Description:
+
+    This routine refills the request budget at the planned rate. The budget
+    is capped at the headroom, so a full budget spent at once plus a minute
+    of refills can't go over the quota.
+
+Arguments:
+
+    Controller - The controller.
+
+    Now - The current time.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DOUBLE Limit;
+
+    if ( Now > Controller->LastRefill )
+    {
+        Limit = MAX(1.0, (DOUBLE)Controller->Quota * (100 - BATCH_QUOTA_HEADROOM) / 100);
+        Controller->Budget += GetPlannedRate(Controller) * (Now - Controller->LastRefill) / 1000;
+        Controller->Budget = MIN(Controller->Budget, Limit);
+        Controller->LastRefill = Now;
+    }
+}
+
+static VOID
+UpdateWindow(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now
+    )
+/*++
+
+Routine Description:
+
+    This routine sizes the window and batch from the arrival rate, latency
+    and throttling penalty.
+
+    If submissions arrive slower than the planned request rate, they're sent
+    right away. Otherwise the window is one request interval, so each
+    request carries everything that arrived since the last one. Submissions
+    keep arriving while a request is in flight, so the latency is taken off
+    the window. The batch size is the number of submissions expected in a
+    window, so a burst is sent early instead of waiting out the window.
+
+Arguments:
+
+    Controller - The controller.
+
+    Now - The current time.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DOUBLE ArrivalRate;
+    DOUBLE PlannedRate;
+    DOUBLE Window;
+    DOUBLE BatchSize;
+
+    ArrivalRate = GetArrivalRate(
+        Controller,
+        Now
+        );
+    PlannedRate = GetPlannedRate(Controller);
+
+    Window = 0;
+    if ( ArrivalRate > PlannedRate || Controller->Penalty > 1 )
+    {
+        Window = 1000 / PlannedRate * Controller->Penalty - Controller->Latency;
+        Window = CLAMP(Window, 0, BATCH_MAX_WINDOW);
+    }
+
+    BatchSize = ArrivalRate * (Window + Controller->Latency) / 1000 + 0.5;
+    BatchSize = CLAMP(BatchSize, 1, BATCH_MAX_SIZE);
+
+    Controller->Window = (UINT32)Window;
+    Controller->BatchSize = (UINT32)BatchSize;
+}
+
+VOID
+BatchControllerInitialize(
+    OUT PBATCH_CONTROLLER Controller,
+    IN UINT32 Quota,
+    IN UINT64 Now
+    )
+/*++
+
+Routine Description:
+
+    This routine sets up a controller with a full budget.
+
+Arguments:
+
+    Controller - The controller.
+
+    Quota - Write requests allowed per minute.
+
+    Now - The current time.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    memset(
+        Controller,
+        0,
+        sizeof(BATCH_CONTROLLER)
+        );
+    Controller->Quota = MAX(Quota, 1);
+    Controller->Penalty = 1;
+    Controller->LastArrival = Now;
+    Controller->LastRefill = Now;
+    Controller->Budget = MAX(1.0, (DOUBLE)Controller->Quota * (100 - BATCH_QUOTA_HEADROOM) / 100);
+    UpdateWindow(
+        Controller,
+        Now
+        );
+}
+
+VOID
+BatchControllerArrival(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a submission to the arrival rate.
+
+Arguments:
+
+    Controller - The controller.
+
+    Now - The time the submission was queued.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Controller->ArrivalRate = GetArrivalRate(
+        Controller,
+        Now
+        ) + 1.0 / BATCH_RATE_PERIOD;
+    Controller->LastArrival = MAX(Now, Controller->LastArrival);
+}
+
+UINT32
+BatchControllerPoll(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now,
+    IN UINT32 Queued,
+    IN UINT64 OldestArrival,
+    OUT PUINT32 Wait
+    )
+/*++
+
+Routine Description:
+
+    This routine decides whether to send a request now. If it says to, a
+    request is taken out of the budget, and the caller has to report how it
+    went with BatchControllerComplete.
+
+Arguments:
+
+    Controller - The controller.
+
+    Now - The current time.
+
+    Queued - The number of submissions waiting.
+
+    OldestArrival - When the oldest waiting submission was queued.
+
+    Wait - Receives how long to wait before polling again if nothing is to
+           be sent, unless something else is queued first.
+
+Return Value:
+
+    The number of submissions to send, or 0 to wait.
+
+--*/
+{
+    UINT64 Age;
+
+    *Wait = WAIT_FOREVER;
+    if ( !Queued )
+    {
+        return 0;
+    }
+
+    UpdateWindow(
+        Controller,
+        Now
+        );
+
+    if ( Now < Controller->BackoffUntil )
+    {
+        *Wait = (UINT32)(Controller->BackoffUntil - Now);
+        return 0;
+    }
+
+    RefillBudget(
+        Controller,
+        Now
+        );
+    if ( Controller->Budget < 1 )
+    {
+        *Wait = (UINT32)((1 - Controller->Budget) * 1000 / GetPlannedRate(Controller)) + 1;
+        return 0;
+    }
+
+    Age = Now > OldestArrival ? Now - OldestArrival : 0;
+    if ( !Controller->Flush && Queued < Controller->BatchSize && Age < Controller->Window )
+    {
+        *Wait = (UINT32)(Controller->Window - Age);
+        return 0;
+    }
+
+    Controller->Budget -= 1;
+    Controller->Requests++;
+    return MIN(Queued, BATCH_MAX_SIZE);
+}
+
+VOID
+BatchControllerComplete(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now,
+    IN UINT32 Size,
+    IN UINT32 Latency,
+    IN INT Status
+    )
+/*++
+
+Routine Description:
+
+    This routine updates the controller with the result of a request. A 429
+    doubles the window penalty, empties the budget and backs off. Other
+    failures only back off, and successes ease the penalty back down.
+
+Arguments:
+
+    Controller - The controller.
+
+    Now - When the request finished.
+
+    Size - The number of submissions in the request.
+
+    Latency - How long the request took, in milliseconds.
+
+    Status - The HTTP status, or 0 if there wasn't a response.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Controller->Latency = Controller->Latency > 0 ? Controller->Latency * 0.8 + Latency * 0.2 : Latency;
+
+    if ( Status >= 200 && Status < 300 )
+    {
+        Controller->Delivered += Size;
+        Controller->Backoff = 0;
+        Controller->Penalty = MAX(Controller->Penalty * 0.8, 1.0);
+    }
+    else
+    {
+        if ( Status == 429 )
+        {
+            Controller->Throttled++;
+            Controller->Penalty = MIN(Controller->Penalty * 2, BATCH_MAX_PENALTY);
+            Controller->Budget = 0;
+            Controller->LastRefill = Now;
+        }
+        else
+        {
+            Controller->Failed++;
+        }
+
+        Controller->Backoff = Controller->Backoff ? MIN(Controller->Backoff * 2, BATCH_MAX_BACKOFF) : BATCH_MIN_BACKOFF;
+        Controller->BackoffUntil = Now + Controller->Backoff;
+    }
+
+    UpdateWindow(
+        Controller,
+        Now
+        );
+}
+
+//
+// Synthetic trace phases for the simulation
+//
+
+typedef struct _SIMULATION_PHASE
+{
+    PCCHAR Name;
+    UINT32 Minutes;
+    DOUBLE ArrivalRate;
+    UINT32 Latency;
+    UINT32 UpstreamQuota;
+} SIMULATION_PHASE, *PSIMULATION_PHASE;
+
+typedef const SIMULATION_PHASE* PCSIMULATION_PHASE;
+
+static const SIMULATION_PHASE SimulationPhases[] = {
+    {"quiet", 10, 1.0 / 90, 250, BATCH_DEFAULT_QUOTA},
+    {"arriving", 10, 0.5, 250, BATCH_DEFAULT_QUOTA},
+    {"rush", 5, 4.0, 250, BATCH_DEFAULT_QUOTA},
+    {"rush, slow", 5, 4.0, 1500, BATCH_DEFAULT_QUOTA},
+    {"rush, shared", 5, 4.0, 250, BATCH_DEFAULT_QUOTA / 2},
+    {"leaving", 10, 1.0 / 60, 250, BATCH_DEFAULT_QUOTA},
+};
+
+//
+// Simulation time step, in milliseconds
+//
+
+#define SIMULATION_STEP 10
+
+INT
+BatchControllerSimulate(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine runs the controller against a synthetic arrival trace, with
+    a simulated upstream that has a latency and answers 429 once more
+    requests than its quota have succeeded in the last minute. It polls the
+    controller the way the delivery thread does, and prints what happened
+    in each phase.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    0 - Every submission was delivered.
+
+    1 - Submissions were left in the queue.
+
+--*/
+{
+    BATCH_CONTROLLER Controller;
+    PCSIMULATION_PHASE Phase;
+    PUINT64 Queue;
+    UINT32 QueueCapacity;
+    UINT32 QueueHead;
+    UINT32 Queued;
+    UINT64 Accepted[BATCH_DEFAULT_QUOTA];
+    UINT32 AcceptedCount;
+    UINT64 Now;
+    UINT64 End;
+    UINT64 NextPoll;
+    UINT64 InFlightUntil;
+    UINT32 InFlight;
+    UINT32 InFlightLatency;
+    UINT32 Wait;
+    UINT32 Random;
+    UINT64 Arrivals;
+    UINT64 Requests;
+    UINT64 Throttled;
+    UINT64 Rows;
+    UINT64 TotalDelay;
+    UINT64 MaxDelay;
+    UINT64 Delay;
+    UINT32 Recent;
+    UINT32 i;
+    UINT32 j;
+    INT Status;
+
+    QueueCapacity = 1 << 16;
+    Queue = calloc(
+        QueueCapacity,
+        sizeof(UINT64)
+        );
+    if ( !Queue )
+    {
+        LOG("Failed to allocate simulation queue: %s (errno %d)\n", ERRNO_STRING());
+        return 1;
+    }
+    QueueHead = 0;
+    Queued = 0;
+    AcceptedCount = 0;
+    InFlight = 0;
+    InFlightUntil = 0;
+    InFlightLatency = 0;
+    Random = 0x2545F491;
+    Now = 0;
+    NextPoll = 0;
+
+    BatchControllerInitialize(
+        &Controller,
+        BATCH_DEFAULT_QUOTA,
+        Now
+        );
+
+    printf("%-14s %8s %8s %5s %9s %10s %10s %8s %6s\n",
+           "phase", "arrived", "requests", "429s", "rows/req",
+           "mean delay", "max delay", "window", "batch");
+
+    for ( i = 0; i < ARRAY_SIZE(SimulationPhases); i++ )
+    {
+        Phase = &SimulationPhases[i];
+        End = Now + (UINT64)Phase->Minutes * 60000;
+        Arrivals = 0;
+        Requests = 0;
+        Throttled = 0;
+        Rows = 0;
+        TotalDelay = 0;
+        MaxDelay = 0;
+
+        for ( ; Now < End; Now += SIMULATION_STEP )
+        {
+            // xorshift32, so the trace is the same every run
+            Random ^= Random << 13;
+            Random ^= Random >> 17;
+            Random ^= Random << 5;
+            if ( (DOUBLE)Random / UINT32_MAX < Phase->ArrivalRate * SIMULATION_STEP / 1000 &&
+                 Queued < QueueCapacity )
+            {
+                Queue[(QueueHead + Queued++) % QueueCapacity] = Now;
+                BatchControllerArrival(
+                    &Controller,
+                    Now
+                    );
+                Arrivals++;
+                NextPoll = Now;
+            }
+
+            if ( InFlight && Now >= InFlightUntil )
+            {
+                Recent = 0;
+                for ( j = 0; j < AcceptedCount; j++ )
+                {
+                    if ( Accepted[j] + 60000 > Now )
+                    {
+                        Accepted[Recent++] = Accepted[j];
+                    }
+                }
+                AcceptedCount = Recent;
+
+                Status = 429;
+                if ( AcceptedCount < Phase->UpstreamQuota )
+                {
+                    Status = 200;
+                    Accepted[AcceptedCount++] = Now;
+                    for ( j = 0; j < InFlight; j++ )
+                    {
+                        Delay = Now - Queue[QueueHead];
+                        TotalDelay += Delay;
+                        MaxDelay = MAX(MaxDelay, Delay);
+                        QueueHead = (QueueHead + 1) % QueueCapacity;
+                        Queued--;
+                    }
+                    Rows += InFlight;
+                }
+                else
+                {
+                    Throttled++;
+                }
+
+                BatchControllerComplete(
+                    &Controller,
+                    Now,
+                    InFlight,
+                    InFlightLatency,
+                    Status
+                    );
+                InFlight = 0;
+                NextPoll = Now;
+            }
+
+            if ( !InFlight && Now >= NextPoll )
+            {
+                InFlight = BatchControllerPoll(
+                    &Controller,
+                    Now,
+                    Queued,
+                    Queued ? Queue[QueueHead] : Now,
+                    &Wait
+                    );
+                if ( InFlight )
+                {
+                    InFlightLatency = Phase->Latency + InFlight * 2;
+                    InFlightUntil = Now + InFlightLatency;
+                    Requests++;
+                }
+                else
+                {
+                    NextPoll = Wait == WAIT_FOREVER ? UINT64_MAX : Now + Wait;
+                }
+            }
+        }
+
+        printf("%-14s %8" PRIu64 " %8" PRIu64 " %5" PRIu64 " %9.1f %8.0fms %8" PRIu64 "ms %6ums %6u\n",
+               Phase->Name,
+               Arrivals,
+               Requests,
+               Throttled,
+               Requests ? (DOUBLE)Rows / (Requests - Throttled ? Requests - Throttled : 1) : 0.0,
+               Rows ? (DOUBLE)TotalDelay / Rows : 0.0,
+               MaxDelay,
+               Controller.Window,
+               Controller.BatchSize);
+    }
+
+    printf("delivered %" PRIu64 " in %" PRIu64 " requests, %" PRIu64 " throttled, %u left queued\n",
+           Controller.Delivered,
+           Controller.Requests,
+           Controller.Throttled,
+           Queued);
+
+    free(Queue);
+    return Queued ? 1 : 0;
+}
@@ -0,0 +1,194 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    batching.h
+
+Abstract:
+
+    This module contains definitions for the controller that decides when
+    queued submissions are written to the spreadsheet, and how many go in
+    each request.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Default Sheets API write requests allowed per minute
+//
+
+#define BATCH_DEFAULT_QUOTA 60
+
+//
+// Percentage of the quota the controller plans to use, leaving room for
+// roster syncs and other clients of the project
+//
+
+#define BATCH_QUOTA_HEADROOM 80
+
+//
+// Longest time a submission waits in the queue for others to join it, in
+// milliseconds
+//
+
+#define BATCH_MAX_WINDOW 10000
+
+//
+// Most rows in one append request
+//
+
+#define BATCH_MAX_SIZE 500
+
+//
+// Seconds over which the arrival rate is smoothed
+//
+
+#define BATCH_RATE_PERIOD 30
+
+//
+// Backoff after the first throttled or failed request, doubled for each one
+// after it, in milliseconds
+//
+
+#define BATCH_MIN_BACKOFF 1000
+#define BATCH_MAX_BACKOFF 64000
+
+//
+// Longest the window is stretched after throttling, as a multiple of the
+// window the arrival rate calls for
+//
+
+#define BATCH_MAX_PENALTY 32.0
+
+//
+// Controller state. Times are in milliseconds from any fixed point.
+//
+
+typedef struct _BATCH_CONTROLLER
+{
+    //
+    // Write requests allowed per minute
+    //
+
+    UINT32 Quota;
+
+    //
+    // Smoothed submissions per second
+    //
+
+    DOUBLE ArrivalRate;
+    UINT64 LastArrival;
+
+    //
+    // Smoothed request latency
+    //
+
+    DOUBLE Latency;
+
+    //
+    // Requests that can be sent right now, refilled at the quota's rate
+    //
+
+    DOUBLE Budget;
+    UINT64 LastRefill;
+
+    //
+    // Window multiplier, doubled when throttled and eased back on success
+    //
+
+    DOUBLE Penalty;
+
+    //
+    // Current backoff step, and when sending can resume
+    //
+
+    UINT32 Backoff;
+    UINT64 BackoffUntil;
+
+    //
+    // How long to hold the oldest submission, and how many submissions
+    // flush the queue without waiting that long
+    //
+
+    UINT32 Window;
+    UINT32 BatchSize;
+
+    //
+    // Send whatever is queued without waiting for the window, set while
+    // shutting down
+    //
+
+    BOOLEAN Flush;
+
+    //
+    // Totals
+    //
+
+    UINT64 Requests;
+    UINT64 Delivered;
+    UINT64 Throttled;
+    UINT64 Failed;
+} BATCH_CONTROLLER, *PBATCH_CONTROLLER;
+
+typedef const BATCH_CONTROLLER* PCBATCH_CONTROLLER;
+
+//
+// Set up a controller
+//
+
+VOID
+BatchControllerInitialize(
+    OUT PBATCH_CONTROLLER Controller,
+    IN UINT32 Quota,
+    IN UINT64 Now
+    );
+
+//
+// Note a submission being queued
+//
+
+VOID
+BatchControllerArrival(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now
+    );
+
+//
+// Decide how many queued submissions to send now
+//
+
+UINT32
+BatchControllerPoll(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now,
+    IN UINT32 Queued,
+    IN UINT64 OldestArrival,
+    OUT PUINT32 Wait
+    );
+
+//
+// Note the result of a request
+//
+
+VOID
+BatchControllerComplete(
+    IN OUT PBATCH_CONTROLLER Controller,
+    IN UINT64 Now,
+    IN UINT32 Size,
+    IN UINT32 Latency,
+    IN INT Status
+    );
+
+//
+// Run the controller against a synthetic arrival trace and print what it did
+//
+
+INT
+BatchControllerSimulate(
+    VOID
+    );
@@ -0,0 +1,178 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    buffer.c
+
+Abstract:
+
+    This module implements segmented buffers. Data is copied once into the
+    last segment, and a new segment twice the size of the last is added when
+    it fills up, so appending never moves what's already there.
+
+--*/
+
+#include "server.h"
+
+BOOLEAN
+BufferAppend(
+    IN OUT PSEGMENTED_BUFFER Buffer,
+    IN PCVOID Data,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine appends data to a buffer.
+
+Arguments:
+
+    Buffer - The buffer.
+
+    Data - The data to append.
+
+    Length - The length of the data.
+
+Return Value:
+
+    TRUE - The data was appended.
+
+    FALSE - A segment couldn't be allocated.
+
+--*/
+{
+    PBUFFER_SEGMENT Segment;
+    SIZE_T Size;
+    SIZE_T Amount;
+
+    while ( Length )
+    {
+        Segment = Buffer->Last;
+        if ( !Segment || Segment->Length == Segment->Size )
+        {
+            Size = Segment ? MIN(Segment->Size * 2, BUFFER_MAX_SEGMENT_SIZE) : BUFFER_FIRST_SEGMENT_SIZE;
+            Segment = malloc(sizeof(BUFFER_SEGMENT) + Size);
+            if ( !Segment )
+            {
+                LOG("Failed to allocate %zu-byte buffer segment: %s (errno %d)\n", Size, ERRNO_STRING());
+                return FALSE;
+            }
+
+            Segment->Next = NULL;
+            Segment->Size = Size;
+            Segment->Length = 0;
+            if ( Buffer->Last )
+            {
+                Buffer->Last->Next = Segment;
+            }
+            else
+            {
+                Buffer->First = Segment;
+            }
+            Buffer->Last = Segment;
+        }
+
+        Amount = MIN(Length, Segment->Size - Segment->Length);
+        memcpy(
+            SEGMENT_DATA(Segment) + Segment->Length,
+            Data,
+            Amount
+            );
+        Segment->Length += Amount;
+        Buffer->Length += Amount;
+        Data = (PCBYTE)Data + Amount;
+        Length -= Amount;
+    }
+
+    return TRUE;
+}
+
+PCHAR
+BufferFlatten(
+    IN PSEGMENTED_BUFFER Buffer,
+    IN OUT PARENA Arena
+    )
+/*++
+
+Routine Description:
+
+    This routine copies a buffer into contiguous memory, for things like
+    cJSON that need the whole thing at once.
+
+Arguments:
+
+    Buffer - The buffer.
+
+    Arena - The arena to allocate from.
+
+Return Value:
+
+    The NUL terminated contents of the buffer, or NULL if memory couldn't
+    be allocated.
+
+--*/
+{
+    PBUFFER_SEGMENT Segment;
+    PCHAR Flat;
+    SIZE_T Offset;
+
+    Flat = ArenaAlloc(
+        Arena,
+        Buffer->Length + 1
+        );
+    if ( !Flat )
+    {
+        return NULL;
+    }
+
+    Offset = 0;
+    for ( Segment = Buffer->First; Segment; Segment = Segment->Next )
+    {
+        memcpy(
+            Flat + Offset,
+            SEGMENT_DATA(Segment),
+            Segment->Length
+            );
+        Offset += Segment->Length;
+    }
+    Flat[Offset] = 0;
+
+    return Flat;
+}
+
+VOID
+BufferFree(
+    IN OUT PSEGMENTED_BUFFER Buffer
+    )
+/*++
+
+Routine Description:
+
+    This routine frees a buffer's segments.
+
+Arguments:
+
+    Buffer - The buffer.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PBUFFER_SEGMENT Segment;
+    PBUFFER_SEGMENT Next;
+
+    for ( Segment = Buffer->First; Segment; Segment = Next )
+    {
+        Next = Segment->Next;
+        free(Segment);
+    }
+
+    Buffer->First = NULL;
+    Buffer->Last = NULL;
+    Buffer->Length = 0;
+}
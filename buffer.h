@@ -0,0 +1,89 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    buffer.h
+
+Abstract:
+
+    This module contains definitions for segmented buffers, which grow by
+    adding segments instead of reallocating.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+#include "arena.h"
+
+//
+// Size of the first segment
+//
+
+#define BUFFER_FIRST_SEGMENT_SIZE 4096
+
+//
+// Segments double in size up to this
+//
+
+#define BUFFER_MAX_SEGMENT_SIZE 1048576
+
+//
+// A segment, the data follows the header
+//
+
+typedef struct _BUFFER_SEGMENT
+{
+    struct _BUFFER_SEGMENT* Next;
+    SIZE_T Size;
+    SIZE_T Length;
+} BUFFER_SEGMENT, *PBUFFER_SEGMENT;
+
+//
+// Segmented buffer
+//
+
+typedef struct _SEGMENTED_BUFFER
+{
+    PBUFFER_SEGMENT First;
+    PBUFFER_SEGMENT Last;
+    SIZE_T Length;
+} SEGMENTED_BUFFER, *PSEGMENTED_BUFFER;
+
+//
+// Get a segment's data
+//
+
+#define SEGMENT_DATA(Segment) ((PBYTE)((Segment) + 1))
+
+//
+// Append data to a buffer
+//
+
+BOOLEAN
+BufferAppend(
+    IN OUT PSEGMENTED_BUFFER Buffer,
+    IN PCVOID Data,
+    IN SIZE_T Length
+    );
+
+//
+// Copy a buffer into contiguous, NUL terminated arena memory
+//
+
+PCHAR
+BufferFlatten(
+    IN PSEGMENTED_BUFFER Buffer,
+    IN OUT PARENA Arena
+    );
+
+//
+// Free a buffer's segments
+//
+
+VOID
+BufferFree(
+    IN OUT PSEGMENTED_BUFFER Buffer
+    );
@@ -0,0 +1,277 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    capture.c
+
+Abstract:
+
+    This module implements capturing API requests, at the root or under a
+    team's prefix. Each one is a line of JSON with when it arrived in
+    microseconds since the epoch, its method, path, query and idempotency
+    key header, which is what the replay tool reads. Requests are
+    buffered and written once a second, so capturing doesn't cost a write
+    per request on the loop thread.
+
+    Queries have names and numbers in them, so capture files should be
+    treated like the journal, and are only readable by their owner. OAuth
+    responses carry an authorization code, so they're never captured.
+
+--*/
+
+#include "server.h"
+
+PCHAR CapturePath;
+
+static FILE* CaptureFile;
+static UINT64 LastFlush;
+static BOOLEAN Dirty;
+
+BOOLEAN
+CaptureOpen(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine opens the capture file to add to, if capture_path is set.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The file was opened, or there isn't one.
+
+    FALSE - The file couldn't be opened.
+
+--*/
+{
+    if ( !CapturePath )
+    {
+        return TRUE;
+    }
+
+    CaptureFile = fopen(
+        CapturePath,
+        "ab"
+        );
+    if ( !CaptureFile )
+    {
+        LOG("Failed to open capture file %s: %s (errno %d)\n", CapturePath, ERRNO_STRING());
+        return FALSE;
+    }
+
+#ifndef _WIN32
+    fchmod(
+        fileno(CaptureFile),
+        0600
+        );
+#endif
+
+    setvbuf(
+        CaptureFile,
+        NULL,
+        _IOFBF,
+        CAPTURE_BUFFER_SIZE
+        );
+    LastFlush = mg_millis();
+    LOG("Capturing API requests to %s\n", CapturePath);
+    return TRUE;
+}
+
+VOID
+CaptureRecord(
+    IN struct mg_http_message* HttpMessage
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a request to the capture file, if it's for the API
+    at the root or under a prefix and isn't an OAuth response.
+
+Arguments:
+
+    HttpMessage - The request.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR Output[JSON_WRITER_BUFFER_SIZE];
+    JSON_WRITER Writer;
+    struct timespec Now;
+    struct mg_str* Key;
+
+    // Teams' submissions are under their prefix, like the router matches
+    if ( !CaptureFile || !mg_strstr(
+                             HttpMessage->uri,
+                             mg_str("/api/")
+                             ) ||
+         mg_http_match_uri(
+             HttpMessage,
+             MAKE_ENDPOINT(OAUTH_ENDPOINT)
+             ) )
+    {
+        return;
+    }
+
+    timespec_get(
+        &Now,
+        TIME_UTC
+        );
+
+    // Streamed into the file's buffer, so nothing is cut off
+    JsonWriterInitialize(
+        &Writer,
+        Output,
+        ARRAY_SIZE(Output),
+        JsonSinkFile,
+        CaptureFile
+        );
+    JsonWritef(
+        &Writer,
+        "{\"time\":%" PRIu64 ",\"method\":",
+        (UINT64)Now.tv_sec * 1000000 + (UINT64)Now.tv_nsec / 1000
+        );
+    JsonWriteStringLength(
+        &Writer,
+        HttpMessage->method.ptr,
+        HttpMessage->method.len
+        );
+    JsonWriteRaw(
+        &Writer,
+        ",\"uri\":",
+        7
+        );
+    JsonWriteStringLength(
+        &Writer,
+        HttpMessage->uri.ptr,
+        HttpMessage->uri.len
+        );
+    JsonWriteRaw(
+        &Writer,
+        ",\"query\":",
+        9
+        );
+    JsonWriteStringLength(
+        &Writer,
+        HttpMessage->query.ptr ? HttpMessage->query.ptr : "",
+        HttpMessage->query.len
+        );
+
+    // Retries can carry their key in a header instead of the query
+    Key = mg_http_get_header(
+        HttpMessage,
+        "Idempotency-Key"
+        );
+    if ( Key )
+    {
+        JsonWriteRaw(
+            &Writer,
+            ",\"idempotency_key\":",
+            19
+            );
+        JsonWriteStringLength(
+            &Writer,
+            Key->ptr,
+            Key->len
+            );
+    }
+    JsonWriteRaw(
+        &Writer,
+        "}\n",
+        2
+        );
+    JsonWriterFlush(&Writer);
+    Dirty = TRUE;
+}
+
+VOID
+CapturePoll(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine writes out captured requests every
+    CAPTURE_FLUSH_INTERVAL milliseconds, if there are any.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT64 Now;
+
+    Now = mg_millis();
+    if ( CaptureFile && Dirty && Now - LastFlush >= CAPTURE_FLUSH_INTERVAL )
+    {
+        fflush(CaptureFile);
+        LastFlush = Now;
+        Dirty = FALSE;
+    }
+}
+
+UINT64
+CaptureGetNextFlush(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets when CapturePoll next has requests to write out.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The mg_millis time of the next flush, or 0 if nothing is waiting.
+
+--*/
+{
+    return CaptureFile && Dirty ? LastFlush + CAPTURE_FLUSH_INTERVAL : 0;
+}
+
+VOID
+CaptureClose(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine writes out captured requests and closes the capture file.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( CaptureFile )
+    {
+        fclose(CaptureFile);
+        CaptureFile = NULL;
+    }
+}
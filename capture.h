@@ -0,0 +1,81 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    capture.h
+
+Abstract:
+
+    This module contains definitions for capturing API requests to a file
+    they can be replayed from.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Milliseconds captured requests can sit in memory before being written
+//
+
+#define CAPTURE_FLUSH_INTERVAL 1000
+
+//
+// Bytes buffered before captured requests are written regardless
+//
+
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+//
+// File requests are captured to, or NULL to not capture them
+//
+
+extern PCHAR CapturePath;
+
+//
+// Open the capture file, if there is one
+//
+
+BOOLEAN
+CaptureOpen(
+    VOID
+    );
+
+//
+// Capture a request, if it's for the API
+//
+
+VOID
+CaptureRecord(
+    IN struct mg_http_message* HttpMessage
+    );
+
+//
+// Write out captured requests once they've waited long enough
+//
+
+VOID
+CapturePoll(
+    VOID
+    );
+
+//
+// Get when captured requests are next written out, or 0 if none are waiting
+//
+
+UINT64
+CaptureGetNextFlush(
+    VOID
+    );
+
+//
+// Write out captured requests and close the capture file
+//
+
+VOID
+CaptureClose(
+    VOID
+    );
@@ -0,0 +1,78 @@
+# Generates a C file with each of ASSETS (relative to SOURCE_DIR, separated
+# by commas) as constant arrays, with a SHA-256 and a gzipped copy, for
+# assets.c to serve. Run with cmake -P.
+
+string(REPLACE "," ";" ASSETS "${ASSETS}")
+get_filename_component(WORK_DIR "${OUTPUT}" DIRECTORY)
+
+set(CONTENT_TYPE_html "text/html; charset=utf-8")
+set(CONTENT_TYPE_css "text/css; charset=utf-8")
+set(CONTENT_TYPE_js "text/javascript; charset=utf-8")
+set(CONTENT_TYPE_json "application/json")
+set(CONTENT_TYPE_svg "image/svg+xml")
+set(CONTENT_TYPE_png "image/png")
+set(CONTENT_TYPE_ico "image/x-icon")
+
+# Formats a file's bytes as a C initializer
+function(format_bytes FILE VARIABLE)
+    file(READ "${FILE}" HEX HEX)
+    string(REGEX REPLACE "(................................)" "\\1\n    " HEX "${HEX}")
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," BYTES "${HEX}")
+    set(${VARIABLE} "${BYTES}" PARENT_SCOPE)
+endfunction()
+
+set(ARRAYS "")
+set(ENTRIES "")
+set(INDEX 0)
+foreach(ASSET IN LISTS ASSETS)
+    set(FILE "${SOURCE_DIR}/${ASSET}")
+    file(SIZE "${FILE}" SIZE)
+    file(SHA256 "${FILE}" HASH)
+    format_bytes("${FILE}" BYTES)
+
+    get_filename_component(EXTENSION "${ASSET}" LAST_EXT)
+    string(SUBSTRING "${EXTENSION}" 1 -1 EXTENSION)
+    if (DEFINED CONTENT_TYPE_${EXTENSION})
+        set(TYPE "${CONTENT_TYPE_${EXTENSION}}")
+    else()
+        set(TYPE "application/octet-stream")
+    endif()
+
+    # A raw archive of one file is just the file compressed
+    set(GZIP_FILE "${WORK_DIR}/asset${INDEX}.gz")
+    file(ARCHIVE_CREATE
+         OUTPUT "${GZIP_FILE}"
+         PATHS "${FILE}"
+         FORMAT raw
+         COMPRESSION GZip
+         COMPRESSION_LEVEL 9)
+    file(SIZE "${GZIP_FILE}" GZIP_SIZE)
+
+    string(APPEND ARRAYS "static const UINT8 Asset${INDEX}[] = {\n    ${BYTES}0\n};\n\n")
+    if (GZIP_SIZE LESS SIZE)
+        format_bytes("${GZIP_FILE}" GZIP_BYTES)
+        string(APPEND ARRAYS "static const UINT8 Asset${INDEX}Gzip[] = {\n    ${GZIP_BYTES}0\n};\n\n")
+        set(GZIP "Asset${INDEX}Gzip, ${GZIP_SIZE}, \"\\\"${HASH}-gz\\\"\"")
+    else()
+        set(GZIP "NULL, 0, NULL")
+    endif()
+    file(REMOVE "${GZIP_FILE}")
+
+    string(APPEND ENTRIES "    {\"/${ASSET}\", \"${TYPE}\", \"\\\"${HASH}\\\"\", Asset${INDEX}, ${SIZE}, ${GZIP}},\n")
+    math(EXPR INDEX "${INDEX} + 1")
+endforeach()
+
+file(WRITE "${OUTPUT}.tmp"
+"// Generated by cmake/EmbedAssets.cmake, do not edit
+
+#include \"server.h\"
+
+${ARRAYS}const ASSET Assets[] = {
+${ENTRIES}};
+
+const UINT32 AssetCount = ARRAY_SIZE(Assets);
+")
+
+# Only touch the output if it changed, so it isn't rebuilt for nothing
+file(COPY_FILE "${OUTPUT}.tmp" "${OUTPUT}" ONLY_IF_DIFFERENT)
+file(REMOVE "${OUTPUT}.tmp")
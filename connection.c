@@ -0,0 +1,411 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    connection.c
+
+Abstract:
+
+    This module implements connection management. Every accepted
+    connection gets a CONNECTION_STATE that records when it was last active.
+    A repeating timer closes connections that have been idle longer than the
+    keep-alive timeout, and new connections over the cap either evict the
+    longest idle connection or are turned away, so file descriptors and TLS
+    contexts stay bounded.
+
+--*/
+
+#include "server.h"
+
+UINT32 KeepAliveTimeout = DEFAULT_KEEP_ALIVE_TIMEOUT;
+UINT32 MaxConnections = DEFAULT_MAX_CONNECTIONS;
+UINT32 SweepInterval = DEFAULT_SWEEP_INTERVAL;
+UINT32 DrainTimeout = DEFAULT_DRAIN_TIMEOUT;
+
+static UINT32 OpenConnections;
+static UINT64 AcceptedConnections;
+static UINT64 RejectedConnections;
+static UINT64 EvictedConnections;
+static UINT64 SweptConnections;
+
+static BOOLEAN
+IsConnectionIdle(
+    IN struct mg_connection* Connection,
+    IN PCONNECTION_STATE State
+    )
+/*++
+
+Routine Description:
+
+    This routine checks if a connection is waiting for a request.
+
+Arguments:
+
+    Connection - The connection.
+
+    State - The connection's state.
+
+Return Value:
+
+    TRUE - The connection has nothing in flight.
+
+    FALSE - The connection is busy or closing.
+
+--*/
+{
+    return !Connection->is_closing && !Connection->is_draining &&
+           !Connection->recv.len && !Connection->send.len &&
+           !State->Exporting;
+}
+
+static BOOLEAN
+EvictIdleConnection(
+    IN struct mg_mgr* Manager
+    )
+/*++
+
+Routine Description:
+
+    This routine closes the connection that has been idle the longest.
+
+Arguments:
+
+    Manager - The manager.
+
+Return Value:
+
+    TRUE - A connection was closed.
+
+    FALSE - No connections are idle.
+
+--*/
+{
+    struct mg_connection* Connection;
+    struct mg_connection* Oldest;
+    PCONNECTION_STATE State;
+    UINT64 OldestActivity;
+
+    Oldest = NULL;
+    OldestActivity = UINT64_MAX;
+    for ( Connection = Manager->conns; Connection; Connection = Connection->next )
+    {
+        State = GET_CONNECTION_STATE(Connection);
+        if ( State && IsConnectionIdle(
+                          Connection,
+                          State
+                          ) &&
+             State->LastActivity < OldestActivity )
+        {
+            Oldest = Connection;
+            OldestActivity = State->LastActivity;
+        }
+    }
+
+    if ( !Oldest )
+    {
+        return FALSE;
+    }
+
+    Oldest->is_closing = 1;
+    EvictedConnections++;
+    return TRUE;
+}
+
+BOOLEAN
+ConnectionAccept(
+    IN struct mg_connection* Connection
+    )
+/*++
+
+Routine Description:
+
+    This routine sets up state for a newly accepted connection. If the
+    maximum number of connections is open, the longest idle connection is
+    closed to make room, and if none are idle the new one is rejected.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    TRUE - The connection was accepted.
+
+    FALSE - The connection should be closed.
+
+--*/
+{
+    PCONNECTION_STATE State;
+
+    if ( OpenConnections >= MaxConnections &&
+         !EvictIdleConnection(Connection->mgr) )
+    {
+        LOG("Rejecting connection, %u of %u open and none idle\n", OpenConnections, MaxConnections);
+        RejectedConnections++;
+        return FALSE;
+    }
+
+    State = calloc(
+        1,
+        sizeof(CONNECTION_STATE)
+        );
+    if ( !State )
+    {
+        LOG("Failed to allocate connection state: %s (errno %d)\n", ERRNO_STRING());
+        RejectedConnections++;
+        return FALSE;
+    }
+
+    State->LastActivity = mg_millis();
+    State->IdleTimeout = KeepAliveTimeout;
+    Connection->fn_data = State;
+    OpenConnections++;
+    AcceptedConnections++;
+    return TRUE;
+}
+
+VOID
+ConnectionClose(
+    IN struct mg_connection* Connection
+    )
+/*++
+
+Routine Description:
+
+    This routine frees a connection's state.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PCONNECTION_STATE State = GET_CONNECTION_STATE(Connection);
+
+    if ( State )
+    {
+        free(State);
+        Connection->fn_data = NULL;
+        OpenConnections--;
+    }
+}
+
+VOID
+ConnectionTouch(
+    IN struct mg_connection* Connection
+    )
+/*++
+
+Routine Description:
+
+    This routine notes activity on a connection so it isn't swept.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PCONNECTION_STATE State = GET_CONNECTION_STATE(Connection);
+
+    if ( State )
+    {
+        State->LastActivity = mg_millis();
+    }
+}
+
+static VOID
+SweepConnections(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine closes connections that have been idle for longer than the
+    keep-alive timeout. Busy connections are left alone, exports in
+    particular can go quiet while a slow client catches up.
+
+Arguments:
+
+    Parameter - The manager.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct mg_mgr* Manager = Parameter;
+    struct mg_connection* Connection;
+    PCONNECTION_STATE State;
+    UINT64 Now;
+
+    WatchdogHandlerBegin(
+        "sweep",
+        -1
+        );
+
+    Now = mg_millis();
+    for ( Connection = Manager->conns; Connection; Connection = Connection->next )
+    {
+        State = GET_CONNECTION_STATE(Connection);
+        if ( State && IsConnectionIdle(
+                          Connection,
+                          State
+                          ) &&
+             Now - State->LastActivity > State->IdleTimeout )
+        {
+            Connection->is_closing = 1;
+            SweptConnections++;
+        }
+    }
+
+    WatchdogHandlerEnd();
+}
+
+VOID
+ConnectionStartSweeper(
+    IN struct mg_mgr* Manager
+    )
+/*++
+
+Routine Description:
+
+    This routine starts the timer that sweeps idle connections.
+
+Arguments:
+
+    Manager - The manager.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LOG("Closing connections idle for %ums, checking every %ums, at most %u open\n", KeepAliveTimeout, SweepInterval, MaxConnections);
+    mg_timer_add(
+        Manager,
+        SweepInterval,
+        MG_TIMER_REPEAT,
+        SweepConnections,
+        Manager
+        );
+}
+
+VOID
+ConnectionGetMetrics(
+    IN struct mg_mgr* Manager,
+    OUT PCONNECTION_METRICS Metrics
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the connection counters.
+
+Arguments:
+
+    Manager - The manager, used to count idle connections.
+
+    Metrics - Receives the counters.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct mg_connection* Connection;
+    PCONNECTION_STATE State;
+
+    Metrics->Open = OpenConnections;
+    Metrics->Idle = 0;
+    Metrics->Max = MaxConnections;
+    Metrics->Accepted = AcceptedConnections;
+    Metrics->Rejected = RejectedConnections;
+    Metrics->Evicted = EvictedConnections;
+    Metrics->Swept = SweptConnections;
+
+    for ( Connection = Manager->conns; Connection; Connection = Connection->next )
+    {
+        State = GET_CONNECTION_STATE(Connection);
+        if ( State && IsConnectionIdle(
+                          Connection,
+                          State
+                          ) )
+        {
+            Metrics->Idle++;
+        }
+    }
+}
+
+UINT32
+ConnectionDrain(
+    IN struct mg_mgr* Manager
+    )
+/*++
+
+Routine Description:
+
+    This routine closes the listeners and any connection that has nothing
+    in flight and hasn't been active for a moment. It's called repeatedly
+    while shutting down, so busy connections are closed once they finish
+    their current request. Listeners that were handed to a new server stay
+    open in it, this only closes this server's copy.
+
+Arguments:
+
+    Manager - The manager.
+
+Return Value:
+
+    The number of connections still open.
+
+--*/
+{
+    struct mg_connection* Connection;
+    PCONNECTION_STATE State;
+    UINT32 Open;
+    UINT64 Now;
+
+    Open = 0;
+    Now = mg_millis();
+    for ( Connection = Manager->conns; Connection; Connection = Connection->next )
+    {
+        if ( Connection->is_listening )
+        {
+            Connection->is_closing = 1;
+            continue;
+        }
+
+        State = GET_CONNECTION_STATE(Connection);
+        if ( !State )
+        {
+            continue;
+        }
+
+        if ( IsConnectionIdle(
+                 Connection,
+                 State
+                 ) &&
+             Now - State->LastActivity >= DRAIN_IDLE_GRACE )
+        {
+            Connection->is_closing = 1;
+        }
+        Open++;
+    }
+
+    return Open;
+}
@@ -0,0 +1,167 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    connection.h
+
+Abstract:
+
+    This module contains definitions for connection management, which
+    tracks accepted connections, caps how many can be open and closes idle
+    ones.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Default time a connection can go without activity before it's closed
+//
+
+#define DEFAULT_KEEP_ALIVE_TIMEOUT 30000
+
+//
+// Default maximum number of open connections
+//
+
+#define DEFAULT_MAX_CONNECTIONS 256
+
+//
+// Default time between idle connection sweeps
+//
+
+#define DEFAULT_SWEEP_INTERVAL 5000
+
+//
+// Default time to drain for on shutdown before giving up
+//
+
+#define DEFAULT_DRAIN_TIMEOUT 10000
+
+//
+// Time a connection has to be idle for before draining closes it, so
+// requests on connections that were just accepted aren't cut off
+//
+
+#define DRAIN_IDLE_GRACE 1000
+
+//
+// State for accepted connections, stored in their fn_data
+//
+
+typedef struct _CONNECTION_STATE
+{
+    UINT64 LastActivity;
+    UINT32 IdleTimeout;
+    UINT32 Records;
+    UINT64 HandshakeStart;
+    BOOLEAN Exporting;
+    UINT64 ExportNext;
+    UINT64 ExportEnd;
+} CONNECTION_STATE, *PCONNECTION_STATE;
+
+//
+// Get the state of a connection, NULL for listeners and connections that
+// haven't been accepted yet
+//
+
+#define GET_CONNECTION_STATE(Connection) \
+    ((Connection)->is_accepted && (Connection)->fn_data != (Connection)->mgr ? (PCONNECTION_STATE)(Connection)->fn_data : NULL)
+
+//
+// Connection counters
+//
+
+typedef struct _CONNECTION_METRICS
+{
+    UINT32 Open;
+    UINT32 Idle;
+    UINT32 Max;
+    UINT64 Accepted;
+    UINT64 Rejected;
+    UINT64 Evicted;
+    UINT64 Swept;
+} CONNECTION_METRICS, *PCONNECTION_METRICS;
+
+//
+// Milliseconds a connection can be idle
+//
+
+extern UINT32 KeepAliveTimeout;
+
+//
+// Maximum number of open connections
+//
+
+extern UINT32 MaxConnections;
+
+//
+// Milliseconds between idle connection sweeps
+//
+
+extern UINT32 SweepInterval;
+
+//
+// Milliseconds to drain for on shutdown
+//
+
+extern UINT32 DrainTimeout;
+
+//
+// Set up state for a newly accepted connection
+//
+
+BOOLEAN
+ConnectionAccept(
+    IN struct mg_connection* Connection
+    );
+
+//
+// Free a connection's state
+//
+
+VOID
+ConnectionClose(
+    IN struct mg_connection* Connection
+    );
+
+//
+// Note activity on a connection
+//
+
+VOID
+ConnectionTouch(
+    IN struct mg_connection* Connection
+    );
+
+//
+// Start the idle connection sweeper
+//
+
+VOID
+ConnectionStartSweeper(
+    IN struct mg_mgr* Manager
+    );
+
+//
+// Get connection counters
+//
+
+VOID
+ConnectionGetMetrics(
+    IN struct mg_mgr* Manager,
+    OUT PCONNECTION_METRICS Metrics
+    );
+
+//
+// Stop accepting and close idle connections, for shutting down
+//
+
+UINT32
+ConnectionDrain(
+    IN struct mg_mgr* Manager
+    );
@@ -0,0 +1,761 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    delivery.c
+
+Abstract:
+
+    This module implements the routes that send submissions to spreadsheets.
+    Each route has a rule picking the submissions it takes, and its own
+    queue, batch controller and delivery thread, so one spreadsheet running
+    out of quota or responding slowly doesn't hold up the others.
+
+    The main thread adds to the back of a route's ring buffer, and its
+    delivery thread sends from the front in batches picked by the batch
+    controller. Submissions only leave the queue once Google has accepted
+    them, so failed requests are retried with the same rows. Failures that
+    retrying can't fix, like a 400 or 403, are retried a row at a time
+    instead, and rows that still fail alone are logged and dropped, so one
+    bad row can't hold up the rest of the queue. They're still in the
+    journal.
+
+--*/
+
+#include "server.h"
+
+PCHAR DeliveryRange = DELIVERY_RANGE;
+UINT32 DeliveryQuota = BATCH_DEFAULT_QUOTA;
+
+//
+// A queued submission
+//
+
+typedef struct _DELIVERY_ITEM
+{
+    ATTENDANCE_RECORD Record;
+    UINT64 Queued;
+} DELIVERY_ITEM, *PDELIVERY_ITEM;
+
+//
+// A route. The rule fields are NULL to match anything, and don't change
+// once the delivery threads start. Everything after them is protected by
+// the route's lock.
+//
+
+struct _DELIVERY_ROUTE
+{
+    PCCHAR Name;
+    PCCHAR Event;
+    PCCHAR Team;
+    PCCHAR Prefix;
+    PCCHAR Spreadsheet;
+    PCCHAR Range;
+    UINT32 Quota;
+
+    MUTEX Lock;
+    CONDITION Condition;
+    BATCH_CONTROLLER Controller;
+    PDELIVERY_ITEM Items;
+    UINT32 Capacity;
+    UINT32 Head;
+    UINT32 Count;
+    UINT32 InFlight;
+    UINT32 Isolating;
+    UINT64 Dropped;
+};
+
+static PDELIVERY_ROUTE Routes[DELIVERY_MAX_ROUTES];
+static UINT32 RouteCount;
+
+static BOOLEAN
+IsPermanentFailure(
+    IN INT Status
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether a failed append would fail the same way if
+    it were sent again. Client errors are, except for timeouts, throttling
+    and an expired token, which the next refresh replaces.
+
+Arguments:
+
+    Status - The HTTP status, or 0 if there wasn't a response.
+
+Return Value:
+
+    TRUE - Sending the same rows again won't help.
+
+    FALSE - The request can be retried.
+
+--*/
+{
+    return Status >= 400 && Status < 500 &&
+           Status != 401 && Status != 408 && Status != 429;
+}
+
+static PCHAR
+FormatBatch(
+    IN PDELIVERY_ROUTE Route,
+    IN OUT PARENA Arena,
+    IN UINT32 BatchCount
+    )
+/*++
+
+Routine Description:
+
+    This routine formats the first submissions in a route's queue as a
+    ValueRange with a timestamp, number and name in each row. The route's
+    lock must be held. The body is written straight into arena memory big
+    enough for the longest rows, so once the arena has grown to fit a full
+    batch, formatting one doesn't allocate.
+
+Arguments:
+
+    Route - The route.
+
+    Arena - The arena to put the body in.
+
+    BatchCount - The number of submissions to include.
+
+Return Value:
+
+    The body, or NULL if memory couldn't be allocated.
+
+--*/
+{
+    CHAR Stamp[32];
+    JSON_WRITER Writer;
+    PCATTENDANCE_RECORD Record;
+    time_t Timestamp;
+    struct tm Time;
+    SIZE_T Size;
+    PCHAR Body;
+    UINT32 i;
+
+    Size = (SIZE_T)BatchCount * DELIVERY_ROW_SIZE + 16;
+    Body = ArenaAlloc(
+        Arena,
+        Size
+        );
+    if ( !Body )
+    {
+        return NULL;
+    }
+
+    JsonWriterInitialize(
+        &Writer,
+        Body,
+        Size,
+        NULL,
+        NULL
+        );
+    JsonWriteRaw(
+        &Writer,
+        "{\"values\":[",
+        11
+        );
+    for ( i = 0; i < BatchCount; i++ )
+    {
+        Record = &Route->Items[(Route->Head + i) % Route->Capacity].Record;
+        Timestamp = (time_t)Record->Timestamp;
+        LOCALTIME(
+            &Timestamp,
+            &Time
+            );
+        strftime(
+            Stamp,
+            ARRAY_SIZE(Stamp),
+            "%Y-%m-%d %H:%M:%S",
+            &Time
+            );
+
+        JsonWritef(
+            &Writer,
+            "%s[\"%s\",\"%09u\",",
+            i ? "," : "",
+            Stamp,
+            Record->Number
+            );
+        JsonWriteString(
+            &Writer,
+            Record->Name
+            );
+        JsonWriteRaw(
+            &Writer,
+            "]",
+            1
+            );
+    }
+    JsonWriteRaw(
+        &Writer,
+        "]}",
+        2
+        );
+
+    return Writer.Error ? NULL : Body;
+}
+
+static VOID
+DeliveryThread(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine sends batches from the front of a route's queue for as long
+    as the server runs, sleeping whenever the controller says to wait.
+
+Arguments:
+
+    Parameter - The route.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PDELIVERY_ROUTE Route = Parameter;
+    ARENA Arena = {0};
+    CHAR ThreadName[TRACE_THREAD_NAME_SIZE];
+    CHAR Name[128];
+    JSON_WRITER Writer;
+    PCATTENDANCE_RECORD Record;
+    PCHAR Body;
+    UINT64 Oldest;
+    UINT64 Start;
+    UINT64 End;
+    UINT64 TraceStart;
+    UINT32 BatchCount;
+    UINT32 Wait;
+    INT Status;
+
+    snprintf(
+        ThreadName,
+        ARRAY_SIZE(ThreadName),
+        "delivery %s",
+        Route->Name
+        );
+    TraceSetThreadName(ThreadName);
+
+    // Names too long to fit are left out of traces
+    JsonWriterInitialize(
+        &Writer,
+        Name,
+        ARRAY_SIZE(Name),
+        NULL,
+        NULL
+        );
+    JsonWriteString(
+        &Writer,
+        Route->Name
+        );
+    if ( Writer.Error )
+    {
+        strcpy(
+            Name,
+            "null"
+            );
+    }
+
+    MutexLock(&Route->Lock);
+    while ( TRUE )
+    {
+        BatchCount = BatchControllerPoll(
+            &Route->Controller,
+            mg_millis(),
+            Route->Count,
+            Route->Count ? Route->Items[Route->Head].Queued : 0,
+            &Wait
+            );
+        if ( !BatchCount )
+        {
+            ConditionWait(
+                &Route->Condition,
+                &Route->Lock,
+                Wait
+                );
+            continue;
+        }
+
+        // Rows from a batch that failed for good are sent one at a time,
+        // to find the ones that can't be written
+        if ( Route->Isolating )
+        {
+            BatchCount = 1;
+        }
+
+        // Only this thread removes items, so the front of the queue stays
+        // put, but the array can move when it grows
+        Body = FormatBatch(
+            Route,
+            &Arena,
+            BatchCount
+            );
+        Route->InFlight = BatchCount;
+        Oldest = Route->Items[Route->Head].Queued;
+        MutexUnlock(&Route->Lock);
+
+        TraceStart = TraceNow();
+        Start = mg_millis();
+        Status = 0;
+        if ( Body )
+        {
+            SheetsAppendValues(
+                Route->Spreadsheet,
+                Route->Range,
+                Body,
+                &Status
+                );
+        }
+        End = mg_millis();
+        ArenaReset(&Arena);
+        TraceSpan(
+            "delivery",
+            "batch",
+            TraceStart,
+            TraceNow(),
+            "{\"route\":%s,\"rows\":%u,\"status\":%d,\"queued_ms\":%" PRIu64 "}",
+            Name,
+            BatchCount,
+            Status,
+            Start - Oldest
+            );
+
+        MutexLock(&Route->Lock);
+        BatchControllerComplete(
+            &Route->Controller,
+            End,
+            BatchCount,
+            (UINT32)(End - Start),
+            Status
+            );
+        if ( Status >= 200 && Status < 300 )
+        {
+            Route->Head = (Route->Head + BatchCount) % Route->Capacity;
+            Route->Count -= BatchCount;
+            Route->Isolating -= MIN(Route->Isolating, BatchCount);
+            LOG("Delivered %u submissions to %s in %" PRIu64 "ms, %u left\n", BatchCount, Route->Name, End - Start, Route->Count);
+        }
+        else if ( (!Body || IsPermanentFailure(Status)) && BatchCount > 1 )
+        {
+            LOG("Sending %u submissions to %s one at a time after HTTP %d\n", BatchCount, Route->Name, Status);
+            Route->Isolating = BatchCount;
+        }
+        else if ( !Body || IsPermanentFailure(Status) )
+        {
+            Record = &Route->Items[Route->Head].Record;
+            LOG("Dropping %s (%09u) at %" PRId64 " for %s after HTTP %d, it's only in the journal\n", Record->Name, Record->Number, Record->Timestamp, Route->Name, Status);
+            Route->Head = (Route->Head + 1) % Route->Capacity;
+            Route->Count--;
+            Route->Isolating -= MIN(Route->Isolating, 1);
+            Route->Dropped++;
+        }
+        Route->InFlight = 0;
+    }
+}
+
+BOOLEAN
+DeliveryAddRoute(
+    IN PCCHAR Name,
+    IN PCCHAR Event OPTIONAL,
+    IN PCCHAR Team OPTIONAL,
+    IN PCCHAR Prefix OPTIONAL,
+    IN PCCHAR Spreadsheet,
+    IN PCCHAR Range OPTIONAL,
+    IN UINT32 Quota
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a route. A submission goes to the first route whose
+    rule it matches, and to the default route if it doesn't match any. The
+    strings aren't copied, so they have to outlive the server.
+
+Arguments:
+
+    Name - The route's name, for logs and metrics.
+
+    Event - The event a submission has to be for, or NULL for any event.
+
+    Team - The team a submission has to be for, or NULL for any team.
+
+    Prefix - What the request path has to start with, or NULL for any path.
+
+    Spreadsheet - The spreadsheet ID to append to.
+
+    Range - The range to append to, or NULL for the default range.
+
+    Quota - Write requests allowed per minute, or 0 for the default quota.
+
+Return Value:
+
+    TRUE - The route was added.
+
+    FALSE - There are too many routes, or memory couldn't be allocated.
+
+--*/
+{
+    PDELIVERY_ROUTE Route;
+
+    if ( RouteCount >= DELIVERY_MAX_ROUTES )
+    {
+        LOG("Too many routes, can't add %s\n", Name);
+        return FALSE;
+    }
+
+    Route = calloc(
+        1,
+        sizeof(DELIVERY_ROUTE)
+        );
+    if ( !Route )
+    {
+        LOG("Failed to allocate route %s: %s (errno %d)\n", Name, ERRNO_STRING());
+        return FALSE;
+    }
+
+    Route->Name = Name;
+    Route->Event = Event;
+    Route->Team = Team;
+    Route->Prefix = Prefix;
+    Route->Spreadsheet = Spreadsheet;
+    Route->Range = Range ? Range : DeliveryRange;
+    Route->Quota = Quota ? Quota : DeliveryQuota;
+    Route->Lock = (MUTEX)MUTEX_INITIALIZER;
+    Route->Condition = (CONDITION)CONDITION_INITIALIZER;
+    BatchControllerInitialize(
+        &Route->Controller,
+        Route->Quota,
+        mg_millis()
+        );
+
+    Routes[RouteCount++] = Route;
+    return TRUE;
+}
+
+BOOLEAN
+DeliveryStart(
+    IN PCCHAR Spreadsheet
+    )
+/*++
+
+Routine Description:
+
+    This routine adds the default route, which takes everything the
+    configured routes don't, and starts a delivery thread for each route.
+
+Arguments:
+
+    Spreadsheet - The default route's spreadsheet ID.
+
+Return Value:
+
+    TRUE - The threads were started.
+
+    FALSE - A thread couldn't be started.
+
+--*/
+{
+    PDELIVERY_ROUTE Route;
+    UINT32 i;
+
+    if ( !DeliveryAddRoute(
+             "default",
+             NULL,
+             NULL,
+             NULL,
+             Spreadsheet,
+             NULL,
+             0
+             ) )
+    {
+        return FALSE;
+    }
+
+    for ( i = 0; i < RouteCount; i++ )
+    {
+        Route = Routes[i];
+        LOG("Route %s appends to %s in %s, %u writes per minute\n", Route->Name, Route->Range, Route->Spreadsheet, Route->Quota);
+        if ( !ThreadStart(
+                 DeliveryThread,
+                 Route
+                 ) )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+PDELIVERY_ROUTE
+DeliveryFindRoute(
+    IN PCCHAR Event OPTIONAL,
+    IN PCCHAR Team OPTIONAL,
+    IN PCCHAR Path,
+    IN SIZE_T PathLength
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the first route whose rule matches a submission. A
+    rule matches when every field it sets matches.
+
+Arguments:
+
+    Event - The event the submission is for, or NULL if it didn't say.
+
+    Team - The team the submission is for, or NULL if it didn't say.
+
+    Path - The request path, which doesn't have to be terminated.
+
+    PathLength - The length of the path.
+
+Return Value:
+
+    The route, which is the default route if no other matches. NULL if the
+    routes haven't been started.
+
+--*/
+{
+    PDELIVERY_ROUTE Route;
+    UINT32 i;
+
+    for ( i = 0; i < RouteCount; i++ )
+    {
+        Route = Routes[i];
+        if ( Route->Event && (!Event || strcmp(Route->Event, Event) != 0) )
+        {
+            continue;
+        }
+        if ( Route->Team && (!Team || strcmp(Route->Team, Team) != 0) )
+        {
+            continue;
+        }
+        if ( Route->Prefix &&
+             (strlen(Route->Prefix) > PathLength ||
+              strncmp(Route->Prefix, Path, strlen(Route->Prefix)) != 0) )
+        {
+            continue;
+        }
+
+        return Route;
+    }
+
+    return NULL;
+}
+
+BOOLEAN
+DeliveryEnqueue(
+    IN PDELIVERY_ROUTE Route,
+    IN PCATTENDANCE_RECORD Record
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a submission to the back of a route's queue and wakes
+    its delivery thread.
+
+Arguments:
+
+    Route - The route.
+
+    Record - The submission.
+
+Return Value:
+
+    TRUE - The submission was queued.
+
+    FALSE - Memory couldn't be allocated.
+
+--*/
+{
+    PDELIVERY_ITEM NewItems;
+    PDELIVERY_ITEM Item;
+    UINT32 NewCapacity;
+    UINT32 i;
+    BOOLEAN Queued;
+
+    Queued = FALSE;
+    MutexLock(&Route->Lock);
+
+    if ( Route->Count == Route->Capacity )
+    {
+        NewCapacity = Route->Capacity ? Route->Capacity * 2 : 64;
+        NewItems = malloc(NewCapacity * sizeof(DELIVERY_ITEM));
+        if ( !NewItems )
+        {
+            LOG("Failed to grow delivery queue for %s: %s (errno %d)\n", Route->Name, ERRNO_STRING());
+            goto Done;
+        }
+
+        // Unwrap the ring so the front is at the start again
+        for ( i = 0; i < Route->Count; i++ )
+        {
+            NewItems[i] = Route->Items[(Route->Head + i) % Route->Capacity];
+        }
+        free(Route->Items);
+        Route->Items = NewItems;
+        Route->Capacity = NewCapacity;
+        Route->Head = 0;
+    }
+
+    Item = &Route->Items[(Route->Head + Route->Count) % Route->Capacity];
+    Item->Record = *Record;
+    Item->Queued = mg_millis();
+    Route->Count++;
+    BatchControllerArrival(
+        &Route->Controller,
+        Item->Queued
+        );
+    ConditionSignal(&Route->Condition);
+    Queued = TRUE;
+
+Done:
+    MutexUnlock(&Route->Lock);
+    return Queued;
+}
+
+UINT32
+DeliveryGetRouteCount(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the number of routes.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of routes.
+
+--*/
+{
+    return RouteCount;
+}
+
+VOID
+DeliveryGetState(
+    IN UINT32 Index,
+    OUT PDELIVERY_STATE State
+    )
+/*++
+
+Routine Description:
+
+    This routine copies a route's queue counts and controller state.
+
+Arguments:
+
+    Index - The index of the route, in the order they're checked.
+
+    State - Receives the state.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PDELIVERY_ROUTE Route;
+    UINT64 Now;
+
+    Route = Routes[Index];
+    State->Name = Route->Name;
+    State->Spreadsheet = Route->Spreadsheet;
+    State->Range = Route->Range;
+
+    Now = mg_millis();
+    MutexLock(&Route->Lock);
+    State->Controller = Route->Controller;
+    State->Queued = Route->Count;
+    State->InFlight = Route->InFlight;
+    State->Dropped = Route->Dropped;
+    State->OldestAge = Route->Count && Now > Route->Items[Route->Head].Queued ? Now - Route->Items[Route->Head].Queued : 0;
+    MutexUnlock(&Route->Lock);
+}
+
+VOID
+DeliveryDrain(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine makes every route send what it has queued without waiting
+    for batches to fill. Quotas and backoffs still apply.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PDELIVERY_ROUTE Route;
+    UINT32 i;
+
+    for ( i = 0; i < RouteCount; i++ )
+    {
+        Route = Routes[i];
+        MutexLock(&Route->Lock);
+        Route->Controller.Flush = TRUE;
+        ConditionSignal(&Route->Condition);
+        MutexUnlock(&Route->Lock);
+    }
+}
+
+UINT32
+DeliveryGetPending(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine counts the submissions that haven't been written yet,
+    including ones in requests that haven't finished.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of submissions.
+
+--*/
+{
+    PDELIVERY_ROUTE Route;
+    UINT32 Pending;
+    UINT32 i;
+
+    Pending = 0;
+    for ( i = 0; i < RouteCount; i++ )
+    {
+        Route = Routes[i];
+        MutexLock(&Route->Lock);
+        Pending += Route->Count;
+        MutexUnlock(&Route->Lock);
+    }
+
+    return Pending;
+}
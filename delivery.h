@@ -0,0 +1,156 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    delivery.h
+
+Abstract:
+
+    This module contains definitions for the routes that send submissions to
+    spreadsheets, each with its own queue of submissions waiting to be
+    written.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+#include "batching.h"
+#include "journal.h"
+
+//
+// Default range submissions are appended to
+//
+
+#define DELIVERY_RANGE "Sheet1!A:C"
+
+//
+// Most routes, including the default one
+//
+
+#define DELIVERY_MAX_ROUTES 32
+
+//
+// Most bytes a row of a batch can take, with every byte of the name escaped
+//
+
+#define DELIVERY_ROW_SIZE (ROSTER_NAME_SIZE * 6 + 64)
+
+//
+// Range submissions are appended to when a route doesn't set one
+//
+
+extern PCHAR DeliveryRange;
+
+//
+// Write requests allowed per minute when a route doesn't set it
+//
+
+extern UINT32 DeliveryQuota;
+
+//
+// A route, with its queue and delivery thread
+//
+
+typedef struct _DELIVERY_ROUTE DELIVERY_ROUTE, *PDELIVERY_ROUTE;
+
+//
+// Snapshot of a route's queue and its controller
+//
+
+typedef struct _DELIVERY_STATE
+{
+    PCCHAR Name;
+    PCCHAR Spreadsheet;
+    PCCHAR Range;
+    BATCH_CONTROLLER Controller;
+    UINT32 Queued;
+    UINT32 InFlight;
+    UINT64 OldestAge;
+    UINT64 Dropped;
+} DELIVERY_STATE, *PDELIVERY_STATE;
+
+//
+// Add a route, checked in the order they're added
+//
+
+BOOLEAN
+DeliveryAddRoute(
+    IN PCCHAR Name,
+    IN PCCHAR Event OPTIONAL,
+    IN PCCHAR Team OPTIONAL,
+    IN PCCHAR Prefix OPTIONAL,
+    IN PCCHAR Spreadsheet,
+    IN PCCHAR Range OPTIONAL,
+    IN UINT32 Quota
+    );
+
+//
+// Add the default route and start a delivery thread for each route
+//
+
+BOOLEAN
+DeliveryStart(
+    IN PCCHAR Spreadsheet
+    );
+
+//
+// Find the route for a submission
+//
+
+PDELIVERY_ROUTE
+DeliveryFindRoute(
+    IN PCCHAR Event OPTIONAL,
+    IN PCCHAR Team OPTIONAL,
+    IN PCCHAR Path,
+    IN SIZE_T PathLength
+    );
+
+//
+// Queue a submission to be written to a route's spreadsheet
+//
+
+BOOLEAN
+DeliveryEnqueue(
+    IN PDELIVERY_ROUTE Route,
+    IN PCATTENDANCE_RECORD Record
+    );
+
+//
+// Get the number of routes
+//
+
+UINT32
+DeliveryGetRouteCount(
+    VOID
+    );
+
+//
+// Get a snapshot of a route's queue and its controller
+//
+
+VOID
+DeliveryGetState(
+    IN UINT32 Index,
+    OUT PDELIVERY_STATE State
+    );
+
+//
+// Send everything that's queued as soon as the controllers allow
+//
+
+VOID
+DeliveryDrain(
+    VOID
+    );
+
+//
+// Get the number of submissions that haven't been written yet
+//
+
+UINT32
+DeliveryGetPending(
+    VOID
+    );
@@ -0,0 +1,532 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    executor.c
+
+Abstract:
+
+    This module implements the task executor. Tasks go into one queue that
+    any thread can add to and every worker takes from, and workers sleep on
+    a condition while it's empty. When a task with a completion finishes,
+    it's put on a list for the loop, which is woken up through a mongoose
+    pipe and runs the completions on its own thread, where they can touch
+    connections.
+
+    Blocking work is submitted here instead of starting a thread for it,
+    so the number of threads stays fixed no matter how much there is.
+
+--*/
+
+#include "server.h"
+
+//
+// A queued or finished task
+//
+
+typedef struct _TASK
+{
+    struct _TASK* Next;
+    PTASK_ROUTINE Routine;
+    PTASK_COMPLETION Completion;
+    PVOID Context;
+} TASK, *PTASK;
+
+UINT32 ExecutorWorkers = DEFAULT_EXECUTOR_WORKERS;
+
+// The queue, a ring that grows
+static MUTEX QueueLock = MUTEX_INITIALIZER;
+static CONDITION QueueCondition = CONDITION_INITIALIZER;
+static PTASK* Queue;
+static UINT32 QueueCapacity;
+static UINT32 QueueHead;
+static UINT32 QueueCount;
+static BOOLEAN Stopping;
+
+// The workers, joined when the executor stops
+static THREAD Workers[EXECUTOR_MAX_WORKERS];
+static UINT32 WorkerCount;
+
+// Finished tasks waiting for the loop to run their completions
+static MUTEX CompletionLock = MUTEX_INITIALIZER;
+static PTASK CompletedHead;
+static PTASK CompletedTail;
+static INT WakeupPipe = -1;
+
+static VOID
+PostCompletion(
+    IN PTASK Task
+    )
+/*++
+
+Routine Description:
+
+    This routine puts a task on the list for the loop to run its completion.
+    Only the first task on an empty list wakes the loop, since the loop
+    takes the whole list at once.
+
+Arguments:
+
+    Task - The task.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    BOOLEAN Wake;
+
+    MutexLock(&CompletionLock);
+    Task->Next = NULL;
+    Wake = !CompletedHead;
+    if ( CompletedTail )
+    {
+        CompletedTail->Next = Task;
+    }
+    else
+    {
+        CompletedHead = Task;
+    }
+    CompletedTail = Task;
+    MutexUnlock(&CompletionLock);
+
+    if ( Wake )
+    {
+        ExecutorWake();
+    }
+}
+
+static VOID
+WorkerThread(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine runs tasks from the front of the queue until the executor
+    stops and the queue is empty.
+
+Arguments:
+
+    Parameter - The worker's number, for traces.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR ThreadName[TRACE_THREAD_NAME_SIZE];
+    PTASK Task;
+    UINT64 Start;
+
+    snprintf(
+        ThreadName,
+        ARRAY_SIZE(ThreadName),
+        "worker %u",
+        (UINT32)(SIZE_T)Parameter
+        );
+    TraceSetThreadName(ThreadName);
+
+    while ( TRUE )
+    {
+        MutexLock(&QueueLock);
+        while ( !QueueCount && !Stopping )
+        {
+            ConditionWait(
+                &QueueCondition,
+                &QueueLock,
+                WAIT_FOREVER
+                );
+        }
+        if ( !QueueCount )
+        {
+            MutexUnlock(&QueueLock);
+            break;
+        }
+        Task = Queue[QueueHead];
+        QueueHead = (QueueHead + 1) % QueueCapacity;
+        QueueCount--;
+
+        // Pass the wakeup on in case more than one task was queued
+        if ( QueueCount )
+        {
+            ConditionSignal(&QueueCondition);
+        }
+        MutexUnlock(&QueueLock);
+
+        Start = TraceNow();
+        Task->Routine(Task->Context);
+        TraceSpan(
+            "executor",
+            "task",
+            Start,
+            TraceNow(),
+            NULL
+            );
+
+        // Tasks without completions still change state the loop checks,
+        // like the access token, so it's woken to look
+        if ( Task->Completion )
+        {
+            PostCompletion(Task);
+        }
+        else
+        {
+            free(Task);
+            ExecutorWake();
+        }
+    }
+}
+
+static VOID
+RunCompletions(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine runs the completions of finished tasks, in the order they
+    finished, on the loop thread.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PTASK Task;
+    PTASK Next;
+
+    MutexLock(&CompletionLock);
+    Task = CompletedHead;
+    CompletedHead = NULL;
+    CompletedTail = NULL;
+    MutexUnlock(&CompletionLock);
+
+    for ( ; Task; Task = Next )
+    {
+        Next = Task->Next;
+        Task->Completion(Task->Context);
+        free(Task);
+    }
+}
+
+static VOID
+HandleWakeup(
+    IN struct mg_connection* Connection,
+    IN INT Event,
+    IN PVOID EventData,
+    IN PVOID Data
+    )
+/*++
+
+Routine Description:
+
+    This routine runs the completions of finished tasks, in the order they
+    finished, when a worker wakes the loop.
+
+Arguments:
+
+    Connection - The read end of the wakeup pipe.
+
+    Event - The event.
+
+    EventData - Not used.
+
+    Data - Not used.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    (EventData);
+    (Data);
+
+    if ( Event != MG_EV_READ )
+    {
+        return;
+    }
+
+    WatchdogHandlerBegin(
+        "executor",
+        Event
+        );
+
+    Connection->recv.len = 0;
+    RunCompletions();
+
+    WatchdogHandlerEnd();
+}
+
+BOOLEAN
+ExecutorStart(
+    IN struct mg_mgr* Manager
+    )
+/*++
+
+Routine Description:
+
+    This routine creates the wakeup pipe and starts the workers.
+
+Arguments:
+
+    Manager - The manager whose loop runs completions.
+
+Return Value:
+
+    TRUE - The executor was started.
+
+    FALSE - The pipe or the workers couldn't be created.
+
+--*/
+{
+    UINT32 i;
+
+    WakeupPipe = mg_mkpipe(
+        Manager,
+        HandleWakeup,
+        NULL,
+        false
+        );
+    if ( WakeupPipe < 0 )
+    {
+        LOG("Failed to create the executor's wakeup pipe\n");
+        return FALSE;
+    }
+
+    ExecutorWorkers = CLAMP(ExecutorWorkers, 1, EXECUTOR_MAX_WORKERS);
+    for ( i = 0; i < ExecutorWorkers; i++ )
+    {
+        if ( !ThreadCreate(
+                 WorkerThread,
+                 (PVOID)(SIZE_T)i,
+                 &Workers[WorkerCount]
+                 ) )
+        {
+            return FALSE;
+        }
+        WorkerCount++;
+    }
+
+    LOG("Started %u workers\n", ExecutorWorkers);
+    return TRUE;
+}
+
+VOID
+ExecutorStop(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine lets the workers finish the tasks already queued, joins
+    them, then runs the completions that are left. Tasks submitted from
+    now on are refused. It's called on the loop thread once the loop has
+    stopped, before anything the tasks use is freed.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 i;
+
+    MutexLock(&QueueLock);
+    Stopping = TRUE;
+    ConditionBroadcast(&QueueCondition);
+    MutexUnlock(&QueueLock);
+
+    for ( i = 0; i < WorkerCount; i++ )
+    {
+        ThreadJoin(Workers[i]);
+    }
+    WorkerCount = 0;
+
+    RunCompletions();
+
+    free(Queue);
+    Queue = NULL;
+    QueueCapacity = 0;
+    QueueHead = 0;
+}
+
+VOID
+ExecutorWake(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine wakes the loop if it's waiting in poll, so it checks its
+    deadlines and state again. It only writes to a socket, so it's safe to
+    call from any thread and from signal handlers.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( WakeupPipe >= 0 )
+    {
+        send(
+            WakeupPipe,
+            "",
+            1,
+            0
+            );
+    }
+}
+
+BOOLEAN
+ExecutorSubmit(
+    IN PTASK_ROUTINE Routine,
+    IN PTASK_COMPLETION Completion OPTIONAL,
+    IN PVOID Context OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine queues a task for the next free worker. Tasks can be
+    queued before the executor starts, and run once it does.
+
+Arguments:
+
+    Routine - Called on a worker thread with the context.
+
+    Completion - Called on the loop thread with the context once the
+                 routine returns, or NULL.
+
+    Context - Passed to the routine and the completion.
+
+Return Value:
+
+    TRUE - The task was queued.
+
+    FALSE - Memory couldn't be allocated or the executor has stopped, and
+            the task won't run.
+
+--*/
+{
+    PTASK Task;
+    PTASK* NewQueue;
+    UINT32 NewCapacity;
+    UINT32 i;
+
+    Task = malloc(sizeof(TASK));
+    if ( !Task )
+    {
+        LOG("Failed to allocate task: %s (errno %d)\n", ERRNO_STRING());
+        return FALSE;
+    }
+    Task->Next = NULL;
+    Task->Routine = Routine;
+    Task->Completion = Completion;
+    Task->Context = Context;
+
+    MutexLock(&QueueLock);
+    if ( Stopping )
+    {
+        MutexUnlock(&QueueLock);
+        free(Task);
+        return FALSE;
+    }
+
+    if ( QueueCount == QueueCapacity )
+    {
+        NewCapacity = QueueCapacity ? QueueCapacity * 2 : EXECUTOR_INITIAL_CAPACITY;
+        NewQueue = calloc(
+            NewCapacity,
+            sizeof(PTASK)
+            );
+        if ( !NewQueue )
+        {
+            MutexUnlock(&QueueLock);
+            LOG("Failed to grow task queue: %s (errno %d)\n", ERRNO_STRING());
+            free(Task);
+            return FALSE;
+        }
+
+        for ( i = 0; i < QueueCount; i++ )
+        {
+            NewQueue[i] = Queue[(QueueHead + i) % QueueCapacity];
+        }
+        free(Queue);
+        Queue = NewQueue;
+        QueueHead = 0;
+        QueueCapacity = NewCapacity;
+    }
+
+    Queue[(QueueHead + QueueCount) % QueueCapacity] = Task;
+    QueueCount++;
+    ConditionSignal(&QueueCondition);
+    MutexUnlock(&QueueLock);
+
+    return TRUE;
+}
+
+BOOLEAN
+ExecutorPost(
+    IN PTASK_COMPLETION Completion,
+    IN PVOID Context OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine runs a completion on the loop thread, for threads outside
+    the pool that have something to report.
+
+Arguments:
+
+    Completion - Called on the loop thread with the context.
+
+    Context - Passed to the completion.
+
+Return Value:
+
+    TRUE - The completion was queued.
+
+    FALSE - Memory couldn't be allocated, and the completion won't run.
+
+--*/
+{
+    PTASK Task;
+
+    Task = malloc(sizeof(TASK));
+    if ( !Task )
+    {
+        LOG("Failed to allocate completion: %s (errno %d)\n", ERRNO_STRING());
+        return FALSE;
+    }
+    Task->Routine = NULL;
+    Task->Completion = Completion;
+    Task->Context = Context;
+
+    PostCompletion(Task);
+    return TRUE;
+}
@@ -0,0 +1,107 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    executor.h
+
+Abstract:
+
+    This module contains definitions for the task executor, a fixed pool of
+    worker threads for blocking work, with completions run on the event
+    loop.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Default number of worker threads
+//
+
+#define DEFAULT_EXECUTOR_WORKERS 4
+
+//
+// Maximum number of worker threads
+//
+
+#define EXECUTOR_MAX_WORKERS 64
+
+//
+// Initial size of the task queue, which grows as needed
+//
+
+#define EXECUTOR_INITIAL_CAPACITY 64
+
+//
+// Work done on a worker thread
+//
+
+typedef VOID (*PTASK_ROUTINE)(
+    IN PVOID Context
+    );
+
+//
+// Called on the loop thread once a task's routine has returned
+//
+
+typedef VOID (*PTASK_COMPLETION)(
+    IN PVOID Context
+    );
+
+//
+// Number of worker threads
+//
+
+extern UINT32 ExecutorWorkers;
+
+//
+// Start the workers and the loop's wakeup pipe
+//
+
+BOOLEAN
+ExecutorStart(
+    IN struct mg_mgr* Manager
+    );
+
+//
+// Finish the queued tasks and join the workers, once the loop has stopped
+//
+
+VOID
+ExecutorStop(
+    VOID
+    );
+
+//
+// Wake the loop, from any thread or a signal handler
+//
+
+VOID
+ExecutorWake(
+    VOID
+    );
+
+//
+// Queue a task, from any thread
+//
+
+BOOLEAN
+ExecutorSubmit(
+    IN PTASK_ROUTINE Routine,
+    IN PTASK_COMPLETION Completion OPTIONAL,
+    IN PVOID Context OPTIONAL
+    );
+
+//
+// Run a completion on the loop thread, from any thread
+//
+
+BOOLEAN
+ExecutorPost(
+    IN PTASK_COMPLETION Completion,
+    IN PVOID Context OPTIONAL
+    );
@@ -0,0 +1,1122 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    fuzzy.c
+
+Abstract:
+
+    This module implements fuzzy name matching. Each folded roster name is
+    split into trigrams, padded with a space at each end, and the trigrams
+    are hashed into buckets listing the names they appear in. A name within
+    a few edits of another still shares most of its trigrams with it, so
+    only names sharing enough buckets with a query are compared with it.
+
+    Candidates are compared by optimal string alignment distance, which is
+    edit distance with swapped neighbours counting as one edit, computed
+    with Hyyrö's bit-vector algorithm. Each character of a candidate
+    updates the whole column for the query in a handful of word
+    operations, which is why queries are cut to 64 characters.
+
+    The index is built and swapped in the same way as the suggestion index.
+
+--*/
+
+#include "server.h"
+
+typedef struct _FUZZY_NAME
+{
+    UINT32 Number;
+    UINT32 Offset;
+    UINT32 Length;
+} FUZZY_NAME, *PFUZZY_NAME;
+
+typedef struct _FUZZY_INDEX
+{
+    PFUZZY_NAME Names;
+    UINT32 NameCount;
+
+    // Where each bucket's names start in the postings
+    PUINT32 Offsets;
+    PUINT32 Postings;
+
+    // Shared buckets for each name, the names with any, and those names
+    // with the most first, while querying
+    PUINT16 Counts;
+    PUINT32 Touched;
+    PUINT32 Ranked;
+
+    PCHAR Pool;
+} FUZZY_INDEX, *PFUZZY_INDEX;
+
+typedef struct _FUZZY_QUERY
+{
+    // The positions of each character in the query
+    UINT64 Masks[256];
+    UINT32 Buckets[FUZZY_PATTERN_SIZE];
+    UINT32 BucketCount;
+    UINT32 Length;
+    UINT32 MaxDistance;
+} FUZZY_QUERY, *PFUZZY_QUERY;
+typedef const FUZZY_QUERY* PCFUZZY_QUERY;
+
+typedef struct _FUZZY_BUILD
+{
+    PROSTER_MEMBER Members;
+    UINT32 Count;
+    PFUZZY_INDEX Index;
+} FUZZY_BUILD, *PFUZZY_BUILD;
+
+// Only touched on the loop thread
+static PFUZZY_INDEX Index;
+static BOOLEAN Building;
+static BOOLEAN RebuildPending;
+
+static UINT32
+HashTrigram(
+    IN PCCHAR Trigram
+    )
+/*++
+
+Routine Description:
+
+    This routine hashes three characters into a bucket.
+
+Arguments:
+
+    Trigram - The characters.
+
+Return Value:
+
+    The bucket.
+
+--*/
+{
+    UINT32 Value;
+
+    Value = (UINT32)(UCHAR)Trigram[0] |
+            (UINT32)(UCHAR)Trigram[1] << 8 |
+            (UINT32)(UCHAR)Trigram[2] << 16;
+    return (Value * 2654435761u) >> (32 - FUZZY_BUCKET_BITS);
+}
+
+static VOID
+FreeIndex(
+    IN PFUZZY_INDEX Index OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine frees an index.
+
+Arguments:
+
+    Index - The index.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( Index )
+    {
+        free(Index->Names);
+        free(Index->Offsets);
+        free(Index->Postings);
+        free(Index->Counts);
+        free(Index->Touched);
+        free(Index->Ranked);
+        free(Index->Pool);
+        free(Index);
+    }
+}
+
+static PFUZZY_INDEX
+BuildIndex(
+    IN PCROSTER_MEMBER Members,
+    IN UINT32 Count
+    )
+/*++
+
+Routine Description:
+
+    This routine folds a list of members' names and indexes their trigrams.
+    The first pass counts the names in each bucket and the second fills
+    them in, so the postings are one array in bucket order. A trigram
+    that's in a name more than once is only listed once.
+
+Arguments:
+
+    Members - The members.
+
+    Count - The number of members.
+
+Return Value:
+
+    The index, or NULL if it couldn't be allocated.
+
+--*/
+{
+    CHAR Padded[ROSTER_NAME_SIZE + 2];
+    PFUZZY_INDEX NewIndex;
+    PFUZZY_NAME Name;
+    PUINT32 Last;
+    PUINT32 Next;
+    SIZE_T PoolSize;
+    SIZE_T Offset;
+    UINT32 Bucket;
+    UINT32 Pass;
+    UINT32 i;
+    UINT32 j;
+
+    Last = malloc(FUZZY_BUCKET_COUNT * sizeof(UINT32));
+    Next = malloc(FUZZY_BUCKET_COUNT * sizeof(UINT32));
+    NewIndex = calloc(
+        1,
+        sizeof(FUZZY_INDEX)
+        );
+    if ( !Last || !Next || !NewIndex )
+    {
+        goto Failed;
+    }
+
+    // Folding never makes a name longer, but needs a byte to spare
+    PoolSize = 1;
+    for ( i = 0; i < Count; i++ )
+    {
+        PoolSize += strlen(Members[i].Name) + 1;
+    }
+
+    NewIndex->Names = malloc(MAX(Count, 1) * sizeof(FUZZY_NAME));
+    NewIndex->Offsets = calloc(
+        FUZZY_BUCKET_COUNT + 1,
+        sizeof(UINT32)
+        );
+    NewIndex->Counts = calloc(
+        MAX(Count, 1),
+        sizeof(UINT16)
+        );
+    NewIndex->Touched = malloc(MAX(Count, 1) * sizeof(UINT32));
+    NewIndex->Ranked = malloc(MAX(Count, 1) * sizeof(UINT32));
+    NewIndex->Pool = malloc(MAX(PoolSize, 1));
+    if ( !NewIndex->Names || !NewIndex->Offsets || !NewIndex->Counts ||
+         !NewIndex->Touched || !NewIndex->Ranked || !NewIndex->Pool )
+    {
+        goto Failed;
+    }
+
+    Offset = 0;
+    for ( i = 0; i < Count; i++ )
+    {
+        Name = &NewIndex->Names[NewIndex->NameCount];
+        Name->Number = Members[i].Number;
+        Name->Offset = (UINT32)Offset;
+        Name->Length = (UINT32)FoldName(
+            Members[i].Name,
+            NewIndex->Pool + Offset,
+            PoolSize - Offset
+            );
+        if ( Name->Length && NewIndex->Pool[Offset + Name->Length - 1] == ' ' )
+        {
+            Name->Length--;
+        }
+        if ( Name->Length )
+        {
+            Offset += Name->Length + 1;
+            NewIndex->NameCount++;
+        }
+    }
+
+    for ( Pass = 0; Pass < 2; Pass++ )
+    {
+        memset(
+            Last,
+            0xFF,
+            FUZZY_BUCKET_COUNT * sizeof(UINT32)
+            );
+
+        for ( i = 0; i < NewIndex->NameCount; i++ )
+        {
+            Name = &NewIndex->Names[i];
+            Padded[0] = ' ';
+            memcpy(
+                Padded + 1,
+                NewIndex->Pool + Name->Offset,
+                Name->Length
+                );
+            Padded[Name->Length + 1] = ' ';
+
+            for ( j = 0; j < Name->Length; j++ )
+            {
+                Bucket = HashTrigram(Padded + j);
+                if ( Last[Bucket] == i )
+                {
+                    continue;
+                }
+                Last[Bucket] = i;
+
+                if ( Pass == 0 )
+                {
+                    NewIndex->Offsets[Bucket + 1]++;
+                }
+                else
+                {
+                    NewIndex->Postings[Next[Bucket]++] = i;
+                }
+            }
+        }
+
+        if ( Pass == 0 )
+        {
+            for ( j = 0; j < FUZZY_BUCKET_COUNT; j++ )
+            {
+                NewIndex->Offsets[j + 1] += NewIndex->Offsets[j];
+                Next[j] = NewIndex->Offsets[j];
+            }
+
+            NewIndex->Postings = malloc(MAX(NewIndex->Offsets[FUZZY_BUCKET_COUNT], 1) * sizeof(UINT32));
+            if ( !NewIndex->Postings )
+            {
+                goto Failed;
+            }
+        }
+    }
+
+    free(Last);
+    free(Next);
+    return NewIndex;
+
+Failed:
+    LOG("Failed to allocate fuzzy name index: %s (errno %d)\n", ERRNO_STRING());
+    free(Last);
+    free(Next);
+    FreeIndex(NewIndex);
+    return NULL;
+}
+
+static BOOLEAN
+PrepareQuery(
+    IN PCCHAR Name,
+    OUT PFUZZY_QUERY Query
+    )
+/*++
+
+Routine Description:
+
+    This routine folds a name to be matched, and finds the positions of
+    each character in it and the buckets of its trigrams. Names are
+    allowed a quarter as many edits as they have characters, plus one, up
+    to FUZZY_MAX_DISTANCE.
+
+Arguments:
+
+    Name - The name.
+
+    Query - Receives the query.
+
+Return Value:
+
+    TRUE - The query was prepared.
+
+    FALSE - The name was empty.
+
+--*/
+{
+    CHAR Padded[ROSTER_NAME_SIZE + 2];
+    UINT32 Bucket;
+    UINT32 Length;
+    UINT32 i;
+    UINT32 j;
+
+    Length = (UINT32)FoldName(
+        Name,
+        Padded + 1,
+        ROSTER_NAME_SIZE
+        );
+    if ( Length && Padded[Length] == ' ' )
+    {
+        Length--;
+    }
+    Length = MIN(Length, FUZZY_PATTERN_SIZE);
+    if ( !Length )
+    {
+        return FALSE;
+    }
+    Padded[0] = ' ';
+    Padded[Length + 1] = ' ';
+
+    memset(
+        Query->Masks,
+        0,
+        sizeof(Query->Masks)
+        );
+    Query->BucketCount = 0;
+    for ( i = 0; i < Length; i++ )
+    {
+        Query->Masks[(UCHAR)Padded[i + 1]] |= 1ull << i;
+
+        Bucket = HashTrigram(Padded + i);
+        for ( j = 0; j < Query->BucketCount && Query->Buckets[j] != Bucket; j++ )
+        {
+        }
+        if ( j == Query->BucketCount )
+        {
+            Query->Buckets[Query->BucketCount++] = Bucket;
+        }
+    }
+
+    Query->Length = Length;
+    Query->MaxDistance = MIN(Length / 4 + 1, FUZZY_MAX_DISTANCE);
+    return TRUE;
+}
+
+static UINT32
+Distance(
+    IN PCFUZZY_QUERY Query,
+    IN PCCHAR Text,
+    IN UINT32 Length
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the optimal string alignment distance between a
+    query and a name. The bits of the vectors are the rows of the current
+    column of the distance matrix, with VP and VN holding where the
+    distance goes up or down a row, and the bottom row's distance is
+    tracked as the columns go by.
+
+Arguments:
+
+    Query - The query.
+
+    Text - The folded name.
+
+    Length - The length of the name.
+
+Return Value:
+
+    The distance.
+
+--*/
+{
+    UINT64 Bottom;
+    UINT64 VP;
+    UINT64 VN;
+    UINT64 D0;
+    UINT64 HP;
+    UINT64 HN;
+    UINT64 Match;
+    UINT64 LastMatch;
+    UINT64 Transposed;
+    UINT32 Score;
+    UINT32 i;
+
+    Bottom = 1ull << (Query->Length - 1);
+    VP = ~0ull;
+    VN = 0;
+    D0 = 0;
+    LastMatch = 0;
+    Score = Query->Length;
+
+    for ( i = 0; i < Length; i++ )
+    {
+        Match = Query->Masks[(UCHAR)Text[i]];
+        Transposed = (((~D0) & Match) << 1) & LastMatch;
+        D0 = (((Match & VP) + VP) ^ VP) | Match | VN | Transposed;
+        HP = VN | ~(D0 | VP);
+        HN = D0 & VP;
+
+        Score += (HP & Bottom) != 0;
+        Score -= (HN & Bottom) != 0;
+
+        HP = (HP << 1) | 1;
+        HN = HN << 1;
+        VP = HN | ~(D0 | HP);
+        VN = HP & D0;
+        LastMatch = Match;
+    }
+
+    return Score;
+}
+
+static BOOLEAN
+FindInIndex(
+    IN PFUZZY_INDEX Index,
+    IN PCFUZZY_QUERY Query,
+    OUT PUINT32 Best,
+    OUT PUINT32 BestDistance
+    )
+/*++
+
+Routine Description:
+
+    This routine counts the buckets each name shares with a query, and
+    compares the query with names in order of how many they share. Every
+    edit changes at most four trigrams, so a name within some distance of
+    the query shares all but four of its buckets per edit. Once the names
+    left share too few to be closer than the best so far, the search
+    stops. Ties go to the name sharing more buckets.
+
+Arguments:
+
+    Index - The index.
+
+    Query - The query.
+
+    Best - Receives the position of the closest name in the index.
+
+    BestDistance - Receives its distance from the query.
+
+Return Value:
+
+    TRUE - A name was close enough.
+
+    FALSE - No name was.
+
+--*/
+{
+    UINT32 Starts[FUZZY_PATTERN_SIZE + 1] = {0};
+    PFUZZY_NAME Name;
+    UINT32 TouchedCount;
+    UINT32 MinShared;
+    UINT32 Shared;
+    UINT32 Bucket;
+    UINT32 Current;
+    UINT32 Total;
+    UINT32 i;
+    UINT32 j;
+
+    TouchedCount = 0;
+    for ( i = 0; i < Query->BucketCount; i++ )
+    {
+        Bucket = Query->Buckets[i];
+        for ( j = Index->Offsets[Bucket]; j < Index->Offsets[Bucket + 1]; j++ )
+        {
+            if ( Index->Counts[Index->Postings[j]]++ == 0 )
+            {
+                Index->Touched[TouchedCount++] = Index->Postings[j];
+            }
+        }
+    }
+
+    // Sort the names by shared buckets, most first
+    for ( i = 0; i < TouchedCount; i++ )
+    {
+        Starts[Index->Counts[Index->Touched[i]]]++;
+    }
+    Total = 0;
+    for ( i = Query->BucketCount + 1; i-- > 0; )
+    {
+        Current = Starts[i];
+        Starts[i] = Total;
+        Total += Current;
+    }
+    for ( i = 0; i < TouchedCount; i++ )
+    {
+        Index->Ranked[Starts[Index->Counts[Index->Touched[i]]]++] = Index->Touched[i];
+    }
+
+    MinShared = Query->BucketCount > 4 * Query->MaxDistance ? Query->BucketCount - 4 * Query->MaxDistance : 1;
+    *Best = UINT32_MAX;
+    *BestDistance = Query->MaxDistance + 1;
+    for ( i = 0; i < TouchedCount && *BestDistance; i++ )
+    {
+        Shared = Index->Counts[Index->Ranked[i]];
+        if ( Shared < MinShared )
+        {
+            break;
+        }
+
+        Name = &Index->Names[Index->Ranked[i]];
+        if ( Name->Length + Query->MaxDistance < Query->Length ||
+             Name->Length > Query->Length + Query->MaxDistance )
+        {
+            continue;
+        }
+
+        Current = Distance(
+            Query,
+            Index->Pool + Name->Offset,
+            Name->Length
+            );
+        if ( Current < *BestDistance )
+        {
+            *Best = Index->Ranked[i];
+            *BestDistance = Current;
+
+            // Anything closer has at most one edit fewer
+            if ( Current && Query->BucketCount > 4 * (Current - 1) )
+            {
+                MinShared = MAX(MinShared, Query->BucketCount - 4 * (Current - 1));
+            }
+        }
+    }
+
+    for ( i = 0; i < TouchedCount; i++ )
+    {
+        Index->Counts[Index->Touched[i]] = 0;
+    }
+
+    return *BestDistance <= Query->MaxDistance;
+}
+
+static BOOLEAN
+ScanIndex(
+    IN PFUZZY_INDEX Index,
+    IN PCFUZZY_QUERY Query,
+    OUT PUINT32 Best,
+    OUT PUINT32 BestDistance
+    )
+/*++
+
+Routine Description:
+
+    This routine compares a query with every name, for the benchmark to
+    measure the trigram filter against.
+
+Arguments:
+
+    Index - The index.
+
+    Query - The query.
+
+    Best - Receives the position of the closest name in the index.
+
+    BestDistance - Receives its distance from the query.
+
+Return Value:
+
+    TRUE - A name was close enough.
+
+    FALSE - No name was.
+
+--*/
+{
+    PFUZZY_NAME Name;
+    UINT32 Current;
+    UINT32 i;
+
+    *BestDistance = Query->MaxDistance + 1;
+    for ( i = 0; i < Index->NameCount; i++ )
+    {
+        Name = &Index->Names[i];
+        if ( Name->Length + Query->MaxDistance < Query->Length ||
+             Name->Length > Query->Length + Query->MaxDistance )
+        {
+            continue;
+        }
+
+        Current = Distance(
+            Query,
+            Index->Pool + Name->Offset,
+            Name->Length
+            );
+        if ( Current < *BestDistance )
+        {
+            *Best = i;
+            *BestDistance = Current;
+        }
+    }
+
+    return *BestDistance <= Query->MaxDistance;
+}
+
+static VOID
+BuildTask(
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    This routine builds an index from a copy of the roster, on a worker.
+
+Arguments:
+
+    Context - The FUZZY_BUILD.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PFUZZY_BUILD Build = Context;
+
+    Build->Index = BuildIndex(
+        Build->Members,
+        Build->Count
+        );
+    free(Build->Members);
+    Build->Members = NULL;
+}
+
+static VOID
+BuildCompletion(
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    This routine swaps in a finished index, and starts another build if the
+    roster changed while this one was running.
+
+Arguments:
+
+    Context - The FUZZY_BUILD.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PFUZZY_BUILD Build = Context;
+
+    if ( Build->Index )
+    {
+        LOG("Built fuzzy name index of %u members and %u trigrams\n", Build->Index->NameCount, Build->Index->Offsets[FUZZY_BUCKET_COUNT]);
+        FreeIndex(Index);
+        Index = Build->Index;
+    }
+    free(Build);
+
+    Building = FALSE;
+    if ( RebuildPending )
+    {
+        RebuildPending = FALSE;
+        FuzzyRebuild();
+    }
+}
+
+VOID
+FuzzyRebuild(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine copies the roster and builds a new index from it on a
+    worker. The old index is used until the new one is ready, and a rebuild
+    asked for during a build runs once it's done.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PFUZZY_BUILD Build;
+    UINT32 i;
+
+    if ( Building )
+    {
+        RebuildPending = TRUE;
+        return;
+    }
+
+    Build = calloc(
+        1,
+        sizeof(FUZZY_BUILD)
+        );
+    if ( !Build )
+    {
+        LOG("Failed to allocate fuzzy name index build: %s (errno %d)\n", ERRNO_STRING());
+        return;
+    }
+
+    Build->Count = RosterGetMemberCount();
+    Build->Members = malloc(MAX(Build->Count, 1) * sizeof(ROSTER_MEMBER));
+    if ( !Build->Members )
+    {
+        LOG("Failed to copy roster for fuzzy name index: %s (errno %d)\n", ERRNO_STRING());
+        free(Build);
+        return;
+    }
+    for ( i = 0; i < Build->Count; i++ )
+    {
+        Build->Members[i] = *RosterGetMember(i);
+    }
+
+    if ( !ExecutorSubmit(
+             BuildTask,
+             BuildCompletion,
+             Build
+             ) )
+    {
+        free(Build->Members);
+        free(Build);
+        return;
+    }
+    Building = TRUE;
+}
+
+BOOLEAN
+FuzzyFind(
+    IN PCCHAR Name,
+    OUT PUINT32 Number,
+    OUT PUINT32 Distance
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the member whose name is the fewest edits from a
+    name, if any are close enough to it.
+
+Arguments:
+
+    Name - The name.
+
+    Number - Receives the member's number.
+
+    Distance - Receives the number of edits, which is 0 if the name
+               matches apart from case and spacing.
+
+Return Value:
+
+    TRUE - A member was found.
+
+    FALSE - No member's name was close, or the index isn't built yet.
+
+--*/
+{
+    FUZZY_QUERY Query;
+    UINT32 Best;
+
+    if ( !Index || !PrepareQuery(
+                        Name,
+                        &Query
+                        ) )
+    {
+        return FALSE;
+    }
+
+    if ( !FindInIndex(
+             Index,
+             &Query,
+             &Best,
+             Distance
+             ) )
+    {
+        return FALSE;
+    }
+
+    *Number = Index->Names[Best].Number;
+    return TRUE;
+}
+
+static UINT32
+Random(
+    IN OUT PUINT32 State
+    )
+/*++
+
+Routine Description:
+
+    This routine makes a pseudo-random number, so the benchmark's names are
+    the same every run.
+
+Arguments:
+
+    State - The generator's state, which must not be 0.
+
+Return Value:
+
+    The number.
+
+--*/
+{
+    *State ^= *State << 13;
+    *State ^= *State >> 17;
+    *State ^= *State << 5;
+    return *State;
+}
+
+static VOID
+MakeTypo(
+    IN PCCHAR Name,
+    OUT PCHAR Typo,
+    IN OUT PUINT32 State
+    )
+/*++
+
+Routine Description:
+
+    This routine copies a name with one mistake in it: two letters swapped,
+    one left out, one wrong, or an extra one.
+
+Arguments:
+
+    Name - The name.
+
+    Typo - Receives the misspelled name, with room for ROSTER_NAME_SIZE
+           bytes.
+
+    State - The random number generator.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    SIZE_T Length;
+    SIZE_T Position;
+    CHAR Swap;
+
+    Length = strlen(Name);
+    strcpy(
+        Typo,
+        Name
+        );
+    if ( Length < 2 || Length + 2 >= ROSTER_NAME_SIZE )
+    {
+        return;
+    }
+
+    Position = Random(State) % (Length - 1);
+    switch ( Random(State) % 4 )
+    {
+    case 0:
+        Swap = Typo[Position];
+        Typo[Position] = Typo[Position + 1];
+        Typo[Position + 1] = Swap;
+        break;
+    case 1:
+        memmove(
+            Typo + Position,
+            Typo + Position + 1,
+            Length - Position
+            );
+        break;
+    case 2:
+        Typo[Position] = (CHAR)('a' + Random(State) % 26);
+        break;
+    default:
+        memmove(
+            Typo + Position + 1,
+            Typo + Position,
+            Length - Position + 1
+            );
+        Typo[Position] = (CHAR)('a' + Random(State) % 26);
+        break;
+    }
+}
+
+INT
+FuzzyBenchmark(
+    IN UINT32 MaxCount
+    )
+/*++
+
+Routine Description:
+
+    This routine makes up rosters of 100 members, ten times that and so on
+    up to a number, and times matching names with a typo in them against
+    each with the index and by comparing every name. It prints the time to
+    build the index, the time per query, and how many typos were matched to
+    the member they were made from.
+
+Arguments:
+
+    MaxCount - The most members to make up.
+
+Return Value:
+
+    0 - The benchmark ran.
+
+    ENOMEM - Memory couldn't be allocated.
+
+--*/
+{
+    static PCCHAR Syllables[] = {
+        "al", "an", "ar", "be", "bo", "ca", "da", "de", "el", "en", "fa",
+        "ga", "ha", "is", "ja", "ka", "ki", "la", "le", "li", "lo", "ma",
+        "mi", "na", "ni", "no", "ol", "ra", "ri", "ro", "sa", "se", "sh",
+        "ta", "th", "to", "va", "vi", "wa", "ya", "za", "zo"
+    };
+    PROSTER_MEMBER Members;
+    PFUZZY_INDEX Benchmark;
+    PCHAR Typos;
+    PUINT32 Expected;
+    FUZZY_QUERY Query;
+    UINT64 Start;
+    UINT64 BuildTime;
+    UINT64 IndexTime;
+    UINT64 ScanTime;
+    UINT32 IndexFound;
+    UINT32 ScanFound;
+    UINT32 Best;
+    UINT32 BestDistance;
+    UINT32 Count;
+    UINT32 State;
+    UINT32 i;
+
+    MaxCount = MAX(MaxCount, 1);
+    Members = calloc(
+        MaxCount,
+        sizeof(ROSTER_MEMBER)
+        );
+    Typos = malloc(FUZZY_BENCHMARK_QUERIES * ROSTER_NAME_SIZE);
+    Expected = malloc(FUZZY_BENCHMARK_QUERIES * sizeof(UINT32));
+    if ( !Members || !Typos || !Expected )
+    {
+        free(Members);
+        free(Typos);
+        free(Expected);
+        return ENOMEM;
+    }
+
+    State = 865;
+    for ( i = 0; i < MaxCount; i++ )
+    {
+        Members[i].Number = 100000000 + i;
+        snprintf(
+            Members[i].Name,
+            ROSTER_NAME_SIZE,
+            "%s%s %s%s%s",
+            Syllables[Random(&State) % ARRAY_SIZE(Syllables)],
+            Syllables[Random(&State) % ARRAY_SIZE(Syllables)],
+            Syllables[Random(&State) % ARRAY_SIZE(Syllables)],
+            Syllables[Random(&State) % ARRAY_SIZE(Syllables)],
+            Syllables[Random(&State) % ARRAY_SIZE(Syllables)]
+            );
+        Members[i].Name[0] = (CHAR)toupper((UCHAR)Members[i].Name[0]);
+    }
+
+    printf(
+        "%u queries with one typo each\n",
+        FUZZY_BENCHMARK_QUERIES
+        );
+    printf(
+        "%-8s %10s %12s %12s %10s %10s\n",
+        "members",
+        "build ms",
+        "index us/q",
+        "scan us/q",
+        "index hit",
+        "scan hit"
+        );
+
+    for ( Count = MIN(100, MaxCount); ; Count = MIN(Count * 10, MaxCount) )
+    {
+        Start = TraceNow();
+        Benchmark = BuildIndex(
+            Members,
+            Count
+            );
+        BuildTime = TraceNow() - Start;
+        if ( !Benchmark )
+        {
+            break;
+        }
+
+        for ( i = 0; i < FUZZY_BENCHMARK_QUERIES; i++ )
+        {
+            Expected[i] = Random(&State) % Count;
+            MakeTypo(
+                Members[Expected[i]].Name,
+                Typos + i * ROSTER_NAME_SIZE,
+                &State
+                );
+        }
+
+        IndexFound = 0;
+        Start = TraceNow();
+        for ( i = 0; i < FUZZY_BENCHMARK_QUERIES; i++ )
+        {
+            if ( PrepareQuery(
+                     Typos + i * ROSTER_NAME_SIZE,
+                     &Query
+                     ) &&
+                 FindInIndex(
+                     Benchmark,
+                     &Query,
+                     &Best,
+                     &BestDistance
+                     ) )
+            {
+                IndexFound += Benchmark->Names[Best].Number == Members[Expected[i]].Number;
+            }
+        }
+        IndexTime = MAX(TraceNow() - Start, 1);
+
+        ScanFound = 0;
+        Start = TraceNow();
+        for ( i = 0; i < FUZZY_BENCHMARK_QUERIES; i++ )
+        {
+            if ( PrepareQuery(
+                     Typos + i * ROSTER_NAME_SIZE,
+                     &Query
+                     ) &&
+                 ScanIndex(
+                     Benchmark,
+                     &Query,
+                     &Best,
+                     &BestDistance
+                     ) )
+            {
+                ScanFound += Benchmark->Names[Best].Number == Members[Expected[i]].Number;
+            }
+        }
+        ScanTime = MAX(TraceNow() - Start, 1);
+
+        printf(
+            "%-8u %10.1f %12.2f %12.2f %9.1f%% %9.1f%%\n",
+            Count,
+            BuildTime / 1000.0,
+            (DOUBLE)IndexTime / FUZZY_BENCHMARK_QUERIES,
+            (DOUBLE)ScanTime / FUZZY_BENCHMARK_QUERIES,
+            IndexFound * 100.0 / FUZZY_BENCHMARK_QUERIES,
+            ScanFound * 100.0 / FUZZY_BENCHMARK_QUERIES
+            );
+
+        FreeIndex(Benchmark);
+        if ( Count == MaxCount )
+        {
+            break;
+        }
+    }
+
+    free(Members);
+    free(Typos);
+    free(Expected);
+    return 0;
+}
+
+VOID
+FuzzyFree(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the index. The executor has stopped by now, so no
+    build is still running.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FreeIndex(Index);
+    Index = NULL;
+}
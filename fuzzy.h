@@ -0,0 +1,81 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    fuzzy.h
+
+Abstract:
+
+    This module contains definitions for fuzzy name matching, which finds
+    the roster member a misspelled name most likely belongs to.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Buckets trigrams are hashed into
+//
+
+#define FUZZY_BUCKET_BITS 12
+#define FUZZY_BUCKET_COUNT (1 << FUZZY_BUCKET_BITS)
+
+//
+// Longest name that's compared, which is the number of bits in a word
+//
+
+#define FUZZY_PATTERN_SIZE 64
+
+//
+// Most edits a match can be from a name, which is less for short names
+//
+
+#define FUZZY_MAX_DISTANCE 4
+
+//
+// Queries timed for each roster size by the benchmark
+//
+
+#define FUZZY_BENCHMARK_QUERIES 2000
+
+//
+// Rebuild the index from the roster on a worker, from the loop thread
+//
+
+VOID
+FuzzyRebuild(
+    VOID
+    );
+
+//
+// Find the member with the closest name to a name, from the loop thread
+//
+
+BOOLEAN
+FuzzyFind(
+    IN PCCHAR Name,
+    OUT PUINT32 Number,
+    OUT PUINT32 Distance
+    );
+
+//
+// Time matching against rosters of up to a number of members
+//
+
+INT
+FuzzyBenchmark(
+    IN UINT32 MaxCount
+    );
+
+//
+// Free the index
+//
+
+VOID
+FuzzyFree(
+    VOID
+    );
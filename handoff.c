@@ -0,0 +1,677 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    handoff.c
+
+Abstract:
+
+    This module implements listener handoffs between server processes. A
+    running server listens on a Unix domain socket, and a new server that
+    connects to it is sent the listening sockets with SCM_RIGHTS. The new
+    server swaps them into its own mongoose listeners and acknowledges, and
+    the old one stops accepting, releases the journal and drains. The new
+    server waits for the journal before reading it, so the two never append
+    to it at once. The listening sockets are never closed in between, so
+    connections that arrive during a restart wait in the backlog instead of
+    being refused.
+
+    Descriptors can't be passed this way on Windows, so there handoffs are
+    disabled and restarts work as before.
+
+--*/
+
+#include "server.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+#endif
+
+//
+// A listener taken over from the old server
+//
+
+typedef struct _INHERITED_LISTENER
+{
+    CHAR Role;
+    INT Descriptor;
+} INHERITED_LISTENER, *PINHERITED_LISTENER;
+
+PCHAR HandoffPath;
+
+static INHERITED_LISTENER Inherited[HANDOFF_MAX_LISTENERS];
+static UINT32 InheritedCount;
+static struct mg_connection* Listeners[HANDOFF_MAX_LISTENERS];
+static CHAR ListenerRoles[HANDOFF_MAX_LISTENERS];
+static UINT32 ListenerCount;
+
+#ifndef _WIN32
+static INT HandoffSocket = -1;
+
+static BOOLEAN
+GetHandoffAddress(
+    OUT struct sockaddr_un* Address
+    )
+/*++
+
+Routine Description:
+
+    This routine makes the address of the handoff socket.
+
+Arguments:
+
+    Address - Receives the address.
+
+Return Value:
+
+    TRUE - The address was made.
+
+    FALSE - The path is too long for a Unix domain socket.
+
+--*/
+{
+    memset(
+        Address,
+        0,
+        sizeof(struct sockaddr_un)
+        );
+    Address->sun_family = AF_UNIX;
+    if ( strlen(HandoffPath) >= sizeof(Address->sun_path) )
+    {
+        LOG("Handoff socket path %s is too long\n", HandoffPath);
+        return FALSE;
+    }
+    strcpy(
+        Address->sun_path,
+        HandoffPath
+        );
+
+    return TRUE;
+}
+
+static VOID
+SetReceiveTimeout(
+    IN INT Socket,
+    IN UINT32 Timeout
+    )
+/*++
+
+Routine Description:
+
+    This routine limits how long reads on a socket block for.
+
+Arguments:
+
+    Socket - The socket.
+
+    Timeout - The limit, in milliseconds.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct timeval Time;
+
+    Time.tv_sec = Timeout / 1000;
+    Time.tv_usec = Timeout % 1000 * 1000;
+    setsockopt(
+        Socket,
+        SOL_SOCKET,
+        SO_RCVTIMEO,
+        &Time,
+        sizeof(Time)
+        );
+}
+
+static VOID
+CloseUnclaimed(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine closes sockets that were taken over but never registered,
+    like the scanner listener when the new configuration turns scanners
+    off.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 i;
+
+    for ( i = 0; i < InheritedCount; i++ )
+    {
+        if ( Inherited[i].Descriptor >= 0 )
+        {
+            LOG("Closing unused listener %c taken over from the old server\n", Inherited[i].Role);
+            close(Inherited[i].Descriptor);
+            Inherited[i].Descriptor = -1;
+        }
+    }
+}
+#endif
+
+BOOLEAN
+HandoffReceive(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine asks the server running on the handoff socket for its
+    listeners. If nothing is listening there, this is the only server, and
+    it listens as usual.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - Listeners were taken over.
+
+    FALSE - There's no server to take them from, or the handoff failed.
+
+--*/
+{
+#ifdef _WIN32
+    if ( HandoffPath )
+    {
+        LOG("Listener handoffs aren't supported on Windows\n");
+    }
+    return FALSE;
+#else
+    struct sockaddr_un Address;
+    struct msghdr Message = {0};
+    struct iovec Vector;
+    struct cmsghdr* Control;
+    CHAR Roles[HANDOFF_MAX_LISTENERS];
+    CHAR ControlBuffer[CMSG_SPACE(sizeof(INT) * HANDOFF_MAX_LISTENERS)];
+    INT Descriptors[HANDOFF_MAX_LISTENERS];
+    SSIZE_T Received;
+    UINT32 DescriptorCount;
+    UINT32 i;
+    INT Socket;
+    CHAR Ack;
+
+    if ( !HandoffPath || !GetHandoffAddress(&Address) )
+    {
+        return FALSE;
+    }
+
+    Socket = socket(
+        AF_UNIX,
+        SOCK_STREAM,
+        0
+        );
+    if ( Socket < 0 )
+    {
+        LOG("Failed to create handoff socket: %s (errno %d)\n", ERRNO_STRING());
+        return FALSE;
+    }
+
+    if ( connect(
+             Socket,
+             (struct sockaddr*)&Address,
+             sizeof(Address)
+             ) < 0 )
+    {
+        close(Socket);
+        return FALSE;
+    }
+
+    LOG("Taking over listeners from the server on %s\n", HandoffPath);
+    SetReceiveTimeout(
+        Socket,
+        HANDOFF_ACK_TIMEOUT
+        );
+
+    Vector.iov_base = Roles;
+    Vector.iov_len = sizeof(Roles);
+    Message.msg_iov = &Vector;
+    Message.msg_iovlen = 1;
+    Message.msg_control = ControlBuffer;
+    Message.msg_controllen = sizeof(ControlBuffer);
+    Received = recvmsg(
+        Socket,
+        &Message,
+        0
+        );
+    Control = Received > 0 ? CMSG_FIRSTHDR(&Message) : NULL;
+    if ( !Control || Control->cmsg_level != SOL_SOCKET || Control->cmsg_type != SCM_RIGHTS )
+    {
+        LOG("Failed to receive listeners: %s (errno %d)\n", ERRNO_STRING());
+        close(Socket);
+        return FALSE;
+    }
+
+    DescriptorCount = (UINT32)((Control->cmsg_len - CMSG_LEN(0)) / sizeof(INT));
+    memcpy(
+        Descriptors,
+        CMSG_DATA(Control),
+        DescriptorCount * sizeof(INT)
+        );
+    for ( i = 0; i < DescriptorCount; i++ )
+    {
+        if ( i < (UINT32)Received )
+        {
+            Inherited[InheritedCount].Role = Roles[i];
+            Inherited[InheritedCount].Descriptor = Descriptors[i];
+            InheritedCount++;
+        }
+        else
+        {
+            close(Descriptors[i]);
+        }
+    }
+
+    // Once this is sent the old server stops accepting, so the listeners
+    // are this server's now
+    Ack = 'A';
+    send(
+        Socket,
+        &Ack,
+        1,
+        0
+        );
+    close(Socket);
+
+    LOG("Took over %u listeners\n", InheritedCount);
+    return InheritedCount > 0;
+#endif
+}
+
+BOOLEAN
+HandoffHasListener(
+    IN CHAR Role
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether a listener was taken over, in which case
+    the listener for it should be opened on any port, since the real one is
+    still bound.
+
+Arguments:
+
+    Role - The listener's role.
+
+Return Value:
+
+    TRUE - There's a socket for the role that hasn't been registered yet.
+
+    FALSE - There isn't.
+
+--*/
+{
+    UINT32 i;
+
+    for ( i = 0; i < InheritedCount; i++ )
+    {
+        if ( Inherited[i].Role == Role && Inherited[i].Descriptor >= 0 )
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+VOID
+HandoffRegister(
+    IN struct mg_connection* Listener,
+    IN CHAR Role
+    )
+/*++
+
+Routine Description:
+
+    This routine registers a listener so it's handed to the next server. If
+    a socket for the same role was taken over, it replaces the listener's
+    own, which mongoose only ever uses to accept on, so the listener keeps
+    its handlers and protocol. With epoll, closing the old socket takes it
+    out of the set, so the new one is added in its place.
+
+Arguments:
+
+    Listener - The listener.
+
+    Role - The listener's role.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#if MG_ENABLE_EPOLL
+    struct epoll_event Event = {0};
+#endif
+    UINT32 i;
+
+    if ( ListenerCount < HANDOFF_MAX_LISTENERS )
+    {
+        Listeners[ListenerCount] = Listener;
+        ListenerRoles[ListenerCount] = Role;
+        ListenerCount++;
+    }
+
+#ifndef _WIN32
+    for ( i = 0; i < InheritedCount; i++ )
+    {
+        if ( Inherited[i].Role == Role && Inherited[i].Descriptor >= 0 )
+        {
+            close((INT)(SIZE_T)Listener->fd);
+            Listener->fd = (PVOID)(SIZE_T)Inherited[i].Descriptor;
+            fcntl(
+                Inherited[i].Descriptor,
+                F_SETFL,
+                fcntl(Inherited[i].Descriptor, F_GETFL, 0) | O_NONBLOCK
+                );
+            fcntl(
+                Inherited[i].Descriptor,
+                F_SETFD,
+                FD_CLOEXEC
+                );
+#if MG_ENABLE_EPOLL
+            Event.events = EPOLLIN | EPOLLERR | EPOLLHUP;
+            Event.data.ptr = Listener;
+            epoll_ctl(
+                Listener->mgr->epoll_fd,
+                EPOLL_CTL_ADD,
+                Inherited[i].Descriptor,
+                &Event
+                );
+#endif
+            Inherited[i].Descriptor = -1;
+            break;
+        }
+    }
+#else
+    (i);
+#endif
+}
+
+BOOLEAN
+HandoffListen(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine starts listening for new servers on the handoff socket,
+    replacing the old server's socket file if there was one.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - Handoffs are being accepted, or they're disabled.
+
+    FALSE - The handoff socket couldn't be opened.
+
+--*/
+{
+#ifdef _WIN32
+    return TRUE;
+#else
+    struct sockaddr_un Address;
+
+    // Every listener has been registered by now
+    CloseUnclaimed();
+
+    if ( !HandoffPath )
+    {
+        return TRUE;
+    }
+
+    if ( !GetHandoffAddress(&Address) )
+    {
+        return FALSE;
+    }
+
+    HandoffSocket = socket(
+        AF_UNIX,
+        SOCK_STREAM,
+        0
+        );
+    if ( HandoffSocket < 0 )
+    {
+        LOG("Failed to create handoff socket: %s (errno %d)\n", ERRNO_STRING());
+        return FALSE;
+    }
+
+    unlink(HandoffPath);
+    if ( bind(
+             HandoffSocket,
+             (struct sockaddr*)&Address,
+             sizeof(Address)
+             ) < 0 ||
+         listen(
+             HandoffSocket,
+             1
+             ) < 0 )
+    {
+        LOG("Failed to listen on %s: %s (errno %d)\n", HandoffPath, ERRNO_STRING());
+        close(HandoffSocket);
+        HandoffSocket = -1;
+        return FALSE;
+    }
+
+    fcntl(
+        HandoffSocket,
+        F_SETFL,
+        O_NONBLOCK
+        );
+    fcntl(
+        HandoffSocket,
+        F_SETFD,
+        FD_CLOEXEC
+        );
+
+    LOG("Accepting listener handoffs on %s\n", HandoffPath);
+    return TRUE;
+#endif
+}
+
+BOOLEAN
+HandoffIsListening(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether a new server could connect to hand off to,
+    so the loop knows to keep checking while it's idle.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The handoff socket is open.
+
+    FALSE - Handoffs are disabled.
+
+--*/
+{
+#ifdef _WIN32
+    return FALSE;
+#else
+    return HandoffSocket >= 0;
+#endif
+}
+
+BOOLEAN
+HandoffPoll(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine sends the listeners to a new server, if one has connected
+    to the handoff socket, and waits for it to acknowledge them. It's called
+    from the loop, and only blocks once a new server has connected.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The listeners were handed off, and this server should drain.
+
+    FALSE - No new server connected, or the handoff failed.
+
+--*/
+{
+#ifdef _WIN32
+    return FALSE;
+#else
+    struct msghdr Message = {0};
+    struct iovec Vector;
+    struct cmsghdr* Control;
+    CHAR Roles[HANDOFF_MAX_LISTENERS];
+    CHAR ControlBuffer[CMSG_SPACE(sizeof(INT) * HANDOFF_MAX_LISTENERS)] = {0};
+    INT Descriptors[HANDOFF_MAX_LISTENERS];
+    UINT32 Count;
+    UINT32 i;
+    INT Client;
+    CHAR Ack;
+
+    if ( HandoffSocket < 0 )
+    {
+        return FALSE;
+    }
+
+    Client = accept(
+        HandoffSocket,
+        NULL,
+        NULL
+        );
+    if ( Client < 0 )
+    {
+        return FALSE;
+    }
+
+    Count = 0;
+    for ( i = 0; i < ListenerCount; i++ )
+    {
+        if ( !Listeners[i]->is_closing )
+        {
+            Roles[Count] = ListenerRoles[i];
+            Descriptors[Count] = (INT)(SIZE_T)Listeners[i]->fd;
+            Count++;
+        }
+    }
+
+    if ( !Count )
+    {
+        close(Client);
+        return FALSE;
+    }
+
+    Vector.iov_base = Roles;
+    Vector.iov_len = Count;
+    Message.msg_iov = &Vector;
+    Message.msg_iovlen = 1;
+    Message.msg_control = ControlBuffer;
+    Message.msg_controllen = CMSG_SPACE(sizeof(INT) * Count);
+    Control = CMSG_FIRSTHDR(&Message);
+    Control->cmsg_level = SOL_SOCKET;
+    Control->cmsg_type = SCM_RIGHTS;
+    Control->cmsg_len = CMSG_LEN(sizeof(INT) * Count);
+    memcpy(
+        CMSG_DATA(Control),
+        Descriptors,
+        sizeof(INT) * Count
+        );
+
+    LOG("Handing %u listeners to a new server\n", Count);
+    SetReceiveTimeout(
+        Client,
+        HANDOFF_ACK_TIMEOUT
+        );
+    if ( sendmsg(
+             Client,
+             &Message,
+             0
+             ) < 0 ||
+         recv(
+             Client,
+             &Ack,
+             1,
+             0
+             ) != 1 )
+    {
+        LOG("Handoff failed, still serving: %s (errno %d)\n", ERRNO_STRING());
+        close(Client);
+        return FALSE;
+    }
+    close(Client);
+
+    // The new server owns the socket file now
+    close(HandoffSocket);
+    HandoffSocket = -1;
+    return TRUE;
+#endif
+}
+
+VOID
+HandoffClose(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine stops accepting handoffs, and closes any sockets that were
+    taken over but never registered. The socket file is only removed if it
+    wasn't handed to a new server along with the listeners.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifndef _WIN32
+    if ( HandoffSocket >= 0 )
+    {
+        close(HandoffSocket);
+        unlink(HandoffPath);
+        HandoffSocket = -1;
+    }
+
+    CloseUnclaimed();
+#endif
+}
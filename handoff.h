@@ -0,0 +1,123 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    handoff.h
+
+Abstract:
+
+    This module contains definitions for handing listening sockets to a new
+    server process over a Unix domain socket, so restarts don't refuse any
+    connections.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Maximum number of listeners that can be handed off
+//
+
+#define HANDOFF_MAX_LISTENERS 4
+
+//
+// Milliseconds to wait for the new process to acknowledge the handoff
+//
+
+#define HANDOFF_ACK_TIMEOUT 5000
+
+//
+// Milliseconds to wait for the old server to release the journal once it
+// has handed over its listeners
+//
+
+#define HANDOFF_JOURNAL_TIMEOUT 10000
+
+//
+// Milliseconds an idle loop waits before checking for a new server again
+//
+
+#define HANDOFF_POLL_INTERVAL 1000
+
+//
+// Listener roles, sent with the descriptors so each one ends up with the
+// right handler
+//
+
+#define HANDOFF_ROLE_HTTP 'H'
+#define HANDOFF_ROLE_SCANNER 'S'
+
+//
+// Path of the handoff socket, or NULL to disable handoffs
+//
+
+extern PCHAR HandoffPath;
+
+//
+// Take over the listeners of a running server, if there is one
+//
+
+BOOLEAN
+HandoffReceive(
+    VOID
+    );
+
+//
+// Check whether a listener was taken over from the old server
+//
+
+BOOLEAN
+HandoffHasListener(
+    IN CHAR Role
+    );
+
+//
+// Register a listener to be handed off, swapping in the old server's
+// socket if one was taken over
+//
+
+VOID
+HandoffRegister(
+    IN struct mg_connection* Listener,
+    IN CHAR Role
+    );
+
+//
+// Start accepting handoff requests from new servers
+//
+
+BOOLEAN
+HandoffListen(
+    VOID
+    );
+
+//
+// Check whether this server accepts handoffs
+//
+
+BOOLEAN
+HandoffIsListening(
+    VOID
+    );
+
+//
+// Hand the listeners to a new server if one is asking for them
+//
+
+BOOLEAN
+HandoffPoll(
+    VOID
+    );
+
+//
+// Stop accepting handoff requests and close unclaimed sockets
+//
+
+VOID
+HandoffClose(
+    VOID
+    );
@@ -0,0 +1,483 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    history.c
+
+Abstract:
+
+    This module implements paging through the journal in time order. A
+    cursor holds the key of the last record on a page and where that
+    record was in time order. The next page starts right after it, so no
+    page costs more than the records on it, however deep it is. The
+    position is only a hint, since imports can shift records around, and
+    the key is looked up again when the hint doesn't match it.
+
+    Pages are formatted straight into the connection's send buffer as one
+    chunk, without building the JSON anywhere else first.
+
+--*/
+
+#include "server.h"
+
+//
+// Room reserved for one record, with an escaped name
+//
+
+#define HISTORY_RECORD_SIZE (ROSTER_NAME_SIZE * 6 + 128)
+
+//
+// A chunk's size is written as a fixed number of hex digits, since it's
+// only known once the chunk has been written
+//
+
+#define HISTORY_CHUNK_DIGITS 8
+
+static PCHAR
+Reserve(
+    IN struct mg_connection* Connection,
+    IN SIZE_T Size
+    )
+/*++
+
+Routine Description:
+
+    This routine makes room at the end of a connection's send buffer.
+
+Arguments:
+
+    Connection - The connection.
+
+    Size - The number of bytes needed.
+
+Return Value:
+
+    Where to write, or NULL if the buffer couldn't grow.
+
+--*/
+{
+    if ( Connection->send.len + Size > Connection->send.size &&
+         !mg_iobuf_resize(
+             &Connection->send,
+             MAX(Connection->send.len + Size, Connection->send.size * 2)
+             ) )
+    {
+        LOG("Failed to grow send buffer for history\n");
+        return NULL;
+    }
+
+    return (PCHAR)Connection->send.buf + Connection->send.len;
+}
+
+static BOOLEAN
+ParseCursor(
+    IN PCCHAR Cursor,
+    OUT PJOURNAL_KEY Key,
+    OUT PUINT64 Position
+    )
+/*++
+
+Routine Description:
+
+    This routine decodes a cursor into a key and a position hint.
+
+Arguments:
+
+    Cursor - The cursor.
+
+    Key - Receives the key of the last record on the previous page.
+
+    Position - Receives where that record was in time order.
+
+Return Value:
+
+    TRUE - The cursor was valid.
+
+    FALSE - The cursor wasn't made by this server.
+
+--*/
+{
+    UINT64 Timestamp;
+
+    if ( strlen(Cursor) != HISTORY_CURSOR_SIZE - 1 ||
+         strspn(Cursor, "0123456789abcdef") != HISTORY_CURSOR_SIZE - 1 ||
+         sscanf(
+             Cursor,
+             "%16" SCNx64 "%16" SCNx64 "%16" SCNx64,
+             &Timestamp,
+             &Key->Index,
+             Position
+             ) != 3 )
+    {
+        return FALSE;
+    }
+
+    Key->Timestamp = (INT64)Timestamp;
+    return TRUE;
+}
+
+static INT64
+FindStart(
+    IN PCCHAR Cursor OPTIONAL,
+    IN BOOLEAN Ascending,
+    OUT PBOOLEAN Valid
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the position in time order a page starts at.
+
+Arguments:
+
+    Cursor - The cursor from the previous page, or NULL for the first.
+
+    Ascending - Whether pages go forward in time.
+
+    Valid - Receives whether the cursor was valid.
+
+Return Value:
+
+    The position, which is out of range when there's nothing left.
+
+--*/
+{
+    JOURNAL_KEY Key;
+    JOURNAL_KEY Found;
+    UINT64 Position;
+    BOOLEAN Exact;
+
+    *Valid = TRUE;
+    if ( !Cursor )
+    {
+        return Ascending ? 0 : (INT64)JournalGetOrderedCount() - 1;
+    }
+
+    if ( !ParseCursor(
+             Cursor,
+             &Key,
+             &Position
+             ) )
+    {
+        *Valid = FALSE;
+        return -1;
+    }
+
+    // The hint is right unless records were added before it
+    Exact = JournalGetOrderedKey(
+        Position,
+        &Found
+        ) && Found.Timestamp == Key.Timestamp && Found.Index == Key.Index;
+    if ( !Exact )
+    {
+        Position = JournalFindKey(&Key);
+        Exact = JournalGetOrderedKey(
+            Position,
+            &Found
+            ) && Found.Timestamp == Key.Timestamp && Found.Index == Key.Index;
+    }
+
+    if ( Ascending )
+    {
+        return (INT64)Position + Exact;
+    }
+    return (INT64)Position - 1;
+}
+
+static SIZE_T
+FormatRecord(
+    IN PCATTENDANCE_RECORD Record,
+    IN BOOLEAN First,
+    OUT PCHAR Buffer
+    )
+/*++
+
+Routine Description:
+
+    This routine formats a record as JSON.
+
+Arguments:
+
+    Record - The record.
+
+    First - Whether it's the first on the page, which has no comma.
+
+    Buffer - Receives the JSON, with room for HISTORY_RECORD_SIZE bytes.
+
+Return Value:
+
+    The length of the JSON.
+
+--*/
+{
+    JSON_WRITER Writer;
+
+    JsonWriterInitialize(
+        &Writer,
+        Buffer,
+        HISTORY_RECORD_SIZE,
+        NULL,
+        NULL
+        );
+    JsonWritef(
+        &Writer,
+        "%s{\"time\":%" PRId64 ",\"number\":%u,\"name\":",
+        First ? "" : ",",
+        Record->Timestamp,
+        Record->Number
+        );
+    JsonWriteString(
+        &Writer,
+        Record->Name
+        );
+    JsonWritef(
+        &Writer,
+        ",\"action\":\"%s\"}",
+        Record->Flags & JOURNAL_FLAG_CHECK_OUT ? "out" : "in"
+        );
+
+    return Writer.Length;
+}
+
+BOOLEAN
+HistoryWriteJson(
+    IN struct mg_connection* Connection,
+    IN PCCHAR Cursor OPTIONAL,
+    IN UINT32 Limit,
+    IN BOOLEAN Ascending
+    )
+/*++
+
+Routine Description:
+
+    This routine writes a page of records, newest or oldest first, and the
+    cursor for the next page as a chunked response. Records that aren't
+    durable yet are left for a later page going forward, and skipped going
+    back. Runs of records that are next to each other in the journal are
+    read together.
+
+Arguments:
+
+    Connection - The connection to write to.
+
+    Cursor - The cursor from the previous page, or NULL for the first.
+
+    Limit - The most records to write.
+
+    Ascending - Whether to go forward in time.
+
+Return Value:
+
+    TRUE - The page was written.
+
+    FALSE - The cursor was invalid, and nothing was written.
+
+--*/
+{
+    ATTENDANCE_RECORD Records[HISTORY_READ_BATCH];
+    JOURNAL_KEY Keys[HISTORY_READ_BATCH];
+    INT64 Positions[HISTORY_READ_BATCH];
+    CHAR Size[HISTORY_CHUNK_DIGITS + 1];
+    JOURNAL_KEY Last = {0};
+    PCHAR Output;
+    SIZE_T ChunkStart;
+    INT64 Position;
+    INT64 LastPosition;
+    INT64 Count;
+    INT64 Step;
+    UINT32 Written;
+    UINT32 Run;
+    UINT32 i;
+    BOOLEAN Valid;
+    BOOLEAN Stopped;
+
+    Position = FindStart(
+        Cursor,
+        Ascending,
+        &Valid
+        );
+    if ( !Valid )
+    {
+        return FALSE;
+    }
+
+    Limit = CLAMP(Limit, 1, HISTORY_MAX_LIMIT);
+    Count = (INT64)JournalGetOrderedCount();
+    Step = Ascending ? 1 : -1;
+
+    mg_printf(
+        Connection,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        );
+
+    // The chunk size is filled in at the end
+    ChunkStart = Connection->send.len;
+    Output = Reserve(
+        Connection,
+        HISTORY_CHUNK_DIGITS + 16
+        );
+    if ( !Output )
+    {
+        Connection->is_closing = 1;
+        return TRUE;
+    }
+    memcpy(
+        Output,
+        "00000000\r\n{\"records\":[",
+        HISTORY_CHUNK_DIGITS + 14
+        );
+    Connection->send.len += HISTORY_CHUNK_DIGITS + 14;
+
+    Written = 0;
+    LastPosition = -1;
+    Stopped = FALSE;
+    while ( Written < Limit && !Stopped )
+    {
+        // Collect keys until one isn't next to the last in the journal
+        Run = 0;
+        while ( Run < ARRAY_SIZE(Keys) && Written + Run < Limit &&
+                Position >= 0 && Position < Count )
+        {
+            if ( !JournalGetOrderedKey(
+                     (UINT64)Position,
+                     &Keys[Run]
+                     ) )
+            {
+                if ( Ascending )
+                {
+                    Stopped = TRUE;
+                    break;
+                }
+                Position += Step;
+                continue;
+            }
+
+            if ( Run && Keys[Run].Index != Keys[Run - 1].Index + Step )
+            {
+                break;
+            }
+
+            Positions[Run++] = Position;
+            Position += Step;
+        }
+
+        if ( !Run )
+        {
+            break;
+        }
+
+        if ( JournalRead(
+                 Ascending ? Keys[0].Index : Keys[Run - 1].Index,
+                 Records,
+                 Run
+                 ) != Run )
+        {
+            Stopped = TRUE;
+            break;
+        }
+
+        for ( i = 0; i < Run; i++ )
+        {
+            Output = Reserve(
+                Connection,
+                HISTORY_RECORD_SIZE
+                );
+            if ( !Output )
+            {
+                Connection->is_closing = 1;
+                return TRUE;
+            }
+
+            Connection->send.len += FormatRecord(
+                &Records[Ascending ? i : Run - 1 - i],
+                !Written,
+                Output
+                );
+            Last = Keys[i];
+            LastPosition = Positions[i];
+            Written++;
+        }
+    }
+
+    Output = Reserve(
+        Connection,
+        HISTORY_CURSOR_SIZE + 32
+        );
+    if ( !Output )
+    {
+        Connection->is_closing = 1;
+        return TRUE;
+    }
+
+    // A page that stopped early resumes where it stopped, which is where
+    // the last one did if nothing was written. Before the first page,
+    // that's a key sorting before or after every record.
+    if ( Stopped && !Written )
+    {
+        if ( Cursor )
+        {
+            Connection->send.len += snprintf(
+                Output,
+                HISTORY_CURSOR_SIZE + 32,
+                "],\"next\":\"%s\"}\n",
+                Cursor
+                );
+        }
+        else
+        {
+            Connection->send.len += snprintf(
+                Output,
+                HISTORY_CURSOR_SIZE + 32,
+                "],\"next\":\"%016" PRIx64 "%016" PRIx64 "%016" PRIx64 "\"}\n",
+                Ascending ? (UINT64)INT64_MIN : (UINT64)INT64_MAX,
+                Ascending ? 0 : UINT64_MAX,
+                UINT64_MAX
+                );
+        }
+    }
+
+    // Otherwise a full page might have more after it, and a short one is
+    // the end
+    else if ( Stopped || (Written == Limit && Position >= 0 && Position < Count) )
+    {
+        Connection->send.len += snprintf(
+            Output,
+            HISTORY_CURSOR_SIZE + 32,
+            "],\"next\":\"%016" PRIx64 "%016" PRIx64 "%016" PRIx64 "\"}\n",
+            (UINT64)Last.Timestamp,
+            Last.Index,
+            (UINT64)LastPosition
+            );
+    }
+    else
+    {
+        Connection->send.len += snprintf(
+            Output,
+            HISTORY_CURSOR_SIZE + 32,
+            "],\"next\":null}\n"
+            );
+    }
+
+    snprintf(
+        Size,
+        ARRAY_SIZE(Size),
+        "%08zx",
+        Connection->send.len - ChunkStart - HISTORY_CHUNK_DIGITS - 2
+        );
+    memcpy(
+        Connection->send.buf + ChunkStart,
+        Size,
+        HISTORY_CHUNK_DIGITS
+        );
+
+    mg_printf(
+        Connection,
+        "\r\n0\r\n\r\n"
+        );
+    return TRUE;
+}
@@ -0,0 +1,49 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    history.h
+
+Abstract:
+
+    This module contains definitions for paging through the journal in time
+    order with cursors.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Records per page by default, and at most
+//
+
+#define DEFAULT_HISTORY_LIMIT 50
+#define HISTORY_MAX_LIMIT 1000
+
+//
+// Size of a cursor, with its terminator
+//
+
+#define HISTORY_CURSOR_SIZE 49
+
+//
+// Records read from the journal at once
+//
+
+#define HISTORY_READ_BATCH 64
+
+//
+// Write a page of records after a cursor as a response
+//
+
+BOOLEAN
+HistoryWriteJson(
+    IN struct mg_connection* Connection,
+    IN PCCHAR Cursor OPTIONAL,
+    IN UINT32 Limit,
+    IN BOOLEAN Ascending
+    );
@@ -0,0 +1,596 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    idempotency.c
+
+Abstract:
+
+    This module implements idempotency keys. A client sends a key it made
+    up with a submission, and the response is stored under it, so a retry
+    of a submission whose response never arrived gets the same response
+    back instead of being recorded again. Keys are forgotten once they
+    expire, and the least recently used key is dropped to make room for a
+    new one.
+
+    Every entry is allocated up front with room for the key and response,
+    so the cache never uses more than IdempotencyMaxKeys entries' worth of
+    memory. Entries are found through a hash table with chains, and kept
+    in use order on a list, so lookups, stores and evictions all take
+    constant time. Only the loop thread uses the cache.
+
+--*/
+
+#include "server.h"
+
+//
+// No entry, for links
+//
+
+#define IDEMPOTENCY_NONE UINT32_MAX
+
+//
+// A key and the response to the request it came with. Entries not in use
+// are linked through Chain.
+//
+
+typedef struct _IDEMPOTENCY_ENTRY
+{
+    UINT64 KeyHash;
+    UINT64 Fingerprint;
+    UINT64 Expires;
+    UINT32 Chain;
+    UINT32 Newer;
+    UINT32 Older;
+    UINT16 Status;
+    UINT16 Length;
+    CHAR Key[IDEMPOTENCY_KEY_SIZE];
+    CHAR Response[IDEMPOTENCY_RESPONSE_SIZE];
+} IDEMPOTENCY_ENTRY, *PIDEMPOTENCY_ENTRY;
+
+UINT32 IdempotencyMaxKeys = DEFAULT_IDEMPOTENCY_KEYS;
+UINT32 IdempotencyTtl = DEFAULT_IDEMPOTENCY_TTL;
+
+static PIDEMPOTENCY_ENTRY Entries;
+static PUINT32 Buckets;
+static UINT32 BucketMask;
+static UINT32 FreeEntries;
+static UINT32 Newest;
+static UINT32 Oldest;
+static IDEMPOTENCY_METRICS Counters;
+
+static UINT64
+HashBytes(
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine hashes bytes with 64-bit FNV-1a.
+
+Arguments:
+
+    Data - The bytes.
+
+    Length - The number of bytes.
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    UINT64 Hash;
+    SIZE_T i;
+
+    Hash = 0xCBF29CE484222325;
+    for ( i = 0; i < Length; i++ )
+    {
+        Hash ^= (UCHAR)Data[i];
+        Hash *= 0x100000001B3;
+    }
+
+    return Hash;
+}
+
+static UINT32
+FindEntry(
+    IN PCCHAR Key,
+    IN UINT64 KeyHash
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the entry for a key.
+
+Arguments:
+
+    Key - The key.
+
+    KeyHash - The key's hash.
+
+Return Value:
+
+    The entry's index, or IDEMPOTENCY_NONE if the key isn't stored.
+
+--*/
+{
+    UINT32 Index;
+
+    for ( Index = Buckets[KeyHash & BucketMask]; Index != IDEMPOTENCY_NONE; Index = Entries[Index].Chain )
+    {
+        if ( Entries[Index].KeyHash == KeyHash && strcmp(Entries[Index].Key, Key) == 0 )
+        {
+            return Index;
+        }
+    }
+
+    return IDEMPOTENCY_NONE;
+}
+
+static VOID
+UnlinkUse(
+    IN UINT32 Index
+    )
+/*++
+
+Routine Description:
+
+    This routine takes an entry off the use order list.
+
+Arguments:
+
+    Index - The entry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PIDEMPOTENCY_ENTRY Entry = &Entries[Index];
+
+    if ( Entry->Newer != IDEMPOTENCY_NONE )
+    {
+        Entries[Entry->Newer].Older = Entry->Older;
+    }
+    else
+    {
+        Newest = Entry->Older;
+    }
+
+    if ( Entry->Older != IDEMPOTENCY_NONE )
+    {
+        Entries[Entry->Older].Newer = Entry->Newer;
+    }
+    else
+    {
+        Oldest = Entry->Newer;
+    }
+}
+
+static VOID
+MakeNewest(
+    IN UINT32 Index
+    )
+/*++
+
+Routine Description:
+
+    This routine puts an entry at the front of the use order list. It must
+    not be on the list already.
+
+Arguments:
+
+    Index - The entry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Entries[Index].Newer = IDEMPOTENCY_NONE;
+    Entries[Index].Older = Newest;
+    if ( Newest != IDEMPOTENCY_NONE )
+    {
+        Entries[Newest].Newer = Index;
+    }
+    else
+    {
+        Oldest = Index;
+    }
+    Newest = Index;
+}
+
+static VOID
+RemoveEntry(
+    IN UINT32 Index
+    )
+/*++
+
+Routine Description:
+
+    This routine forgets an entry and puts it back on the free list.
+
+Arguments:
+
+    Index - The entry.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PUINT32 Link;
+
+    Link = &Buckets[Entries[Index].KeyHash & BucketMask];
+    while ( *Link != Index )
+    {
+        Link = &Entries[*Link].Chain;
+    }
+    *Link = Entries[Index].Chain;
+
+    UnlinkUse(Index);
+    Entries[Index].Chain = FreeEntries;
+    FreeEntries = Index;
+    Counters.Keys--;
+}
+
+BOOLEAN
+IdempotencyInitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine allocates every entry the cache can hold, and a bucket for
+    each, rounded up to a power of two.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The cache was allocated, or idempotency keys are disabled.
+
+    FALSE - Memory couldn't be allocated.
+
+--*/
+{
+    UINT32 BucketCount;
+    UINT32 i;
+
+    Newest = IDEMPOTENCY_NONE;
+    Oldest = IDEMPOTENCY_NONE;
+    FreeEntries = IDEMPOTENCY_NONE;
+    if ( !IdempotencyMaxKeys )
+    {
+        LOG("Idempotency keys disabled\n");
+        return TRUE;
+    }
+
+    IdempotencyMaxKeys = MIN(IdempotencyMaxKeys, 1u << 24);
+    for ( BucketCount = 1; BucketCount < IdempotencyMaxKeys; BucketCount *= 2 )
+    {
+    }
+
+    Entries = malloc(IdempotencyMaxKeys * sizeof(IDEMPOTENCY_ENTRY));
+    Buckets = malloc(BucketCount * sizeof(UINT32));
+    if ( !Entries || !Buckets )
+    {
+        LOG("Failed to allocate %u idempotency keys: %s (errno %d)\n", IdempotencyMaxKeys, ERRNO_STRING());
+        free(Entries);
+        free(Buckets);
+        Entries = NULL;
+        Buckets = NULL;
+        return FALSE;
+    }
+
+    BucketMask = BucketCount - 1;
+    memset(
+        Buckets,
+        0xFF,
+        BucketCount * sizeof(UINT32)
+        );
+    for ( i = IdempotencyMaxKeys; i > 0; i-- )
+    {
+        Entries[i - 1].Chain = FreeEntries;
+        FreeEntries = i - 1;
+    }
+
+    Counters.Max = IdempotencyMaxKeys;
+    LOG("Remembering up to %u idempotency keys for %ums\n", IdempotencyMaxKeys, IdempotencyTtl);
+    return TRUE;
+}
+
+BOOLEAN
+IdempotencyIsValidKey(
+    IN PCCHAR Key
+    )
+/*++
+
+Routine Description:
+
+    This routine checks that a key is printable ASCII without spaces, and
+    not empty or too long.
+
+Arguments:
+
+    Key - The key.
+
+Return Value:
+
+    TRUE - The key can be used.
+
+    FALSE - The key is malformed.
+
+--*/
+{
+    SIZE_T Length;
+
+    for ( Length = 0; Key[Length]; Length++ )
+    {
+        if ( (UCHAR)Key[Length] <= ' ' || (UCHAR)Key[Length] > '~' )
+        {
+            return FALSE;
+        }
+    }
+
+    return Length > 0 && Length < IDEMPOTENCY_KEY_SIZE;
+}
+
+IDEMPOTENCY_RESULT
+IdempotencyLookup(
+    IN PCCHAR Key,
+    IN PCCHAR Request,
+    IN SIZE_T RequestLength,
+    OUT PUINT32 Status,
+    OUT PCCHAR* Response,
+    OUT PSIZE_T ResponseLength
+    )
+/*++
+
+Routine Description:
+
+    This routine looks up the response stored under a key. An expired key
+    is forgotten and treated as new. The key has to have come with the same
+    request, so a client reusing a key by mistake gets an error instead of
+    someone else's response.
+
+Arguments:
+
+    Key - The key.
+
+    Request - The parts of the request that affect its response.
+
+    RequestLength - The length of the request.
+
+    Status - Receives the stored response's status.
+
+    Response - Receives the stored response, which is valid until the next
+               store.
+
+    ResponseLength - Receives the length of the stored response.
+
+Return Value:
+
+    What was found.
+
+--*/
+{
+    PIDEMPOTENCY_ENTRY Entry;
+    UINT64 KeyHash;
+    UINT32 Index;
+
+    if ( !Entries )
+    {
+        return IdempotencyResultNew;
+    }
+
+    KeyHash = HashBytes(
+        Key,
+        strlen(Key)
+        );
+    Index = FindEntry(
+        Key,
+        KeyHash
+        );
+    if ( Index == IDEMPOTENCY_NONE )
+    {
+        return IdempotencyResultNew;
+    }
+
+    Entry = &Entries[Index];
+    if ( mg_millis() >= Entry->Expires )
+    {
+        RemoveEntry(Index);
+        Counters.Expired++;
+        return IdempotencyResultNew;
+    }
+
+    if ( Entry->Fingerprint != HashBytes(
+                                   Request,
+                                   RequestLength
+                                   ) )
+    {
+        Counters.Conflicts++;
+        return IdempotencyResultConflict;
+    }
+
+    UnlinkUse(Index);
+    MakeNewest(Index);
+    Counters.Replays++;
+
+    *Status = Entry->Status;
+    *Response = Entry->Response;
+    *ResponseLength = Entry->Length;
+    return IdempotencyResultReplay;
+}
+
+VOID
+IdempotencyStore(
+    IN PCCHAR Key,
+    IN PCCHAR Request,
+    IN SIZE_T RequestLength,
+    IN UINT32 Status,
+    IN PCCHAR Response,
+    IN SIZE_T ResponseLength
+    )
+/*++
+
+Routine Description:
+
+    This routine stores the response to a request under its key, replacing
+    whatever was stored under it before. If the cache is full, the least
+    recently used key is forgotten to make room.
+
+Arguments:
+
+    Key - The key, which must be valid.
+
+    Request - The parts of the request that affect its response.
+
+    RequestLength - The length of the request.
+
+    Status - The response's status.
+
+    Response - The response.
+
+    ResponseLength - The length of the response.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PIDEMPOTENCY_ENTRY Entry;
+    UINT64 KeyHash;
+    UINT64 Now;
+    UINT32 Index;
+
+    if ( !Entries )
+    {
+        return;
+    }
+
+    if ( ResponseLength >= IDEMPOTENCY_RESPONSE_SIZE )
+    {
+        LOG("Not storing %zu byte response for idempotency key %s\n", ResponseLength, Key);
+        return;
+    }
+
+    Now = mg_millis();
+    KeyHash = HashBytes(
+        Key,
+        strlen(Key)
+        );
+    Index = FindEntry(
+        Key,
+        KeyHash
+        );
+    if ( Index != IDEMPOTENCY_NONE )
+    {
+        RemoveEntry(Index);
+    }
+
+    if ( FreeEntries == IDEMPOTENCY_NONE )
+    {
+        if ( Now >= Entries[Oldest].Expires )
+        {
+            Counters.Expired++;
+        }
+        else
+        {
+            Counters.Evicted++;
+        }
+        RemoveEntry(Oldest);
+    }
+
+    Index = FreeEntries;
+    Entry = &Entries[Index];
+    FreeEntries = Entry->Chain;
+
+    Entry->KeyHash = KeyHash;
+    Entry->Fingerprint = HashBytes(
+        Request,
+        RequestLength
+        );
+    Entry->Expires = Now + IdempotencyTtl;
+    Entry->Status = (UINT16)Status;
+    Entry->Length = (UINT16)ResponseLength;
+    strcpy(
+        Entry->Key,
+        Key
+        );
+    memcpy(
+        Entry->Response,
+        Response,
+        ResponseLength
+        );
+    Entry->Response[ResponseLength] = 0;
+
+    Entry->Chain = Buckets[KeyHash & BucketMask];
+    Buckets[KeyHash & BucketMask] = Index;
+    MakeNewest(Index);
+    Counters.Keys++;
+}
+
+VOID
+IdempotencyGetMetrics(
+    OUT PIDEMPOTENCY_METRICS Metrics
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the number of keys stored and what's happened to
+    them.
+
+Arguments:
+
+    Metrics - Receives the counters.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    *Metrics = Counters;
+}
+
+VOID
+IdempotencyFree(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the cache.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    free(Entries);
+    free(Buckets);
+    Entries = NULL;
+    Buckets = NULL;
+}
@@ -0,0 +1,145 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    idempotency.h
+
+Abstract:
+
+    This module contains definitions for idempotency keys, which let a
+    client retry a submission without it being recorded twice.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Default most keys remembered at once, each taking about 600 bytes
+//
+
+#define DEFAULT_IDEMPOTENCY_KEYS 4096
+
+//
+// Default milliseconds a key is remembered for
+//
+
+#define DEFAULT_IDEMPOTENCY_TTL 3600000
+
+//
+// Longest key, including the NUL terminator
+//
+
+#define IDEMPOTENCY_KEY_SIZE 65
+
+//
+// Largest response that can be stored, including the NUL terminator
+//
+
+#define IDEMPOTENCY_RESPONSE_SIZE 512
+
+//
+// What a lookup found: a key that should be handled as a new request, one
+// whose stored response should be replayed, or one that was used for a
+// different request
+//
+
+typedef enum _IDEMPOTENCY_RESULT
+{
+    IdempotencyResultNew,
+    IdempotencyResultReplay,
+    IdempotencyResultConflict
+} IDEMPOTENCY_RESULT;
+
+//
+// Counters for metrics
+//
+
+typedef struct _IDEMPOTENCY_METRICS
+{
+    UINT32 Keys;
+    UINT32 Max;
+    UINT64 Replays;
+    UINT64 Conflicts;
+    UINT64 Evicted;
+    UINT64 Expired;
+} IDEMPOTENCY_METRICS, *PIDEMPOTENCY_METRICS;
+
+//
+// Most keys remembered at once, 0 to disable idempotency keys
+//
+
+extern UINT32 IdempotencyMaxKeys;
+
+//
+// Milliseconds a key is remembered for
+//
+
+extern UINT32 IdempotencyTtl;
+
+//
+// Allocate the cache
+//
+
+BOOLEAN
+IdempotencyInitialize(
+    VOID
+    );
+
+//
+// Check whether a key is well formed
+//
+
+BOOLEAN
+IdempotencyIsValidKey(
+    IN PCCHAR Key
+    );
+
+//
+// Look up the stored response for a key, from the loop thread
+//
+
+IDEMPOTENCY_RESULT
+IdempotencyLookup(
+    IN PCCHAR Key,
+    IN PCCHAR Request,
+    IN SIZE_T RequestLength,
+    OUT PUINT32 Status,
+    OUT PCCHAR* Response,
+    OUT PSIZE_T ResponseLength
+    );
+
+//
+// Store the response to a request with a key, from the loop thread
+//
+
+VOID
+IdempotencyStore(
+    IN PCCHAR Key,
+    IN PCCHAR Request,
+    IN SIZE_T RequestLength,
+    IN UINT32 Status,
+    IN PCCHAR Response,
+    IN SIZE_T ResponseLength
+    );
+
+//
+// Get the counters
+//
+
+VOID
+IdempotencyGetMetrics(
+    OUT PIDEMPOTENCY_METRICS Metrics
+    );
+
+//
+// Free the cache
+//
+
+VOID
+IdempotencyFree(
+    VOID
+    );
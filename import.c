@@ -0,0 +1,968 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    import.c
+
+Abstract:
+
+    This module implements importing attendance from CSV files, for moving
+    past seasons into the journal. Files use the export format,
+
+        YYYY-MM-DD HH:MM:SS,number,"name",in|out
+
+    with the name and whether it's a check-out optional. The file is mapped
+    into memory, and commas, newlines and quotes are found 64 bytes at a
+    time, with SSE2 where it's available and 64-bit words elsewhere, so the
+    parser only looks at the bytes that matter.
+
+--*/
+
+#include "server.h"
+
+#ifdef _WIN32
+#include <memoryapi.h>
+#include <fileapi.h>
+#include <handleapi.h>
+#include <profileapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IMPORT_SSE2
+#endif
+
+//
+// Bytes scanned at a time
+//
+
+#define SCAN_BLOCK_SIZE 64
+
+//
+// A file mapped into memory
+//
+
+typedef struct _MAPPED_FILE
+{
+    PCBYTE Data;
+    SIZE_T Size;
+#ifdef _WIN32
+    HANDLE File;
+    HANDLE Mapping;
+#endif
+} MAPPED_FILE, *PMAPPED_FILE;
+
+//
+// Finds commas, newlines and quotes in order
+//
+
+typedef struct _CSV_SCANNER
+{
+    PCBYTE Data;
+    SIZE_T Size;
+    SIZE_T Block;
+    UINT64 Mask;
+} CSV_SCANNER, *PCSV_SCANNER;
+
+//
+// A field in a row, which still has doubled quotes in it if it was quoted
+//
+
+typedef struct _CSV_FIELD
+{
+    PCCHAR Data;
+    SIZE_T Length;
+    BOOLEAN Quoted;
+} CSV_FIELD, *PCSV_FIELD;
+
+//
+// Fields in a row: timestamp, number, name, in or out
+//
+
+#define CSV_FIELD_COUNT 4
+
+//
+// The last hour converted to a timestamp, since mktime is slow and rows
+// are usually in order
+//
+
+typedef struct _HOUR_CACHE
+{
+    UINT32 Key;
+    time_t Timestamp;
+} HOUR_CACHE, *PHOUR_CACHE;
+
+static BOOLEAN
+MapFile(
+    IN PCCHAR Path,
+    OUT PMAPPED_FILE File
+    )
+/*++
+
+Routine Description:
+
+    This routine maps a file into memory for reading.
+
+Arguments:
+
+    Path - The path to the file.
+
+    File - Receives the mapping.
+
+Return Value:
+
+    TRUE - The file was mapped.
+
+    FALSE - The file couldn't be opened or mapped.
+
+--*/
+{
+#ifdef _WIN32
+    LARGE_INTEGER Size;
+
+    memset(
+        File,
+        0,
+        sizeof(MAPPED_FILE)
+        );
+    File->File = CreateFileA(
+        Path,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL
+        );
+    if ( File->File == INVALID_HANDLE_VALUE || !GetFileSizeEx(File->File, &Size) )
+    {
+        LOG("Failed to open %s: error %lu\n", Path, GetLastError());
+        return FALSE;
+    }
+
+    File->Size = (SIZE_T)Size.QuadPart;
+    if ( !File->Size )
+    {
+        return TRUE;
+    }
+
+    File->Mapping = CreateFileMappingA(
+        File->File,
+        NULL,
+        PAGE_READONLY,
+        0,
+        0,
+        NULL
+        );
+    File->Data = File->Mapping ? MapViewOfFile(
+                                     File->Mapping,
+                                     FILE_MAP_READ,
+                                     0,
+                                     0,
+                                     0
+                                     ) : NULL;
+    if ( !File->Data )
+    {
+        LOG("Failed to map %s: error %lu\n", Path, GetLastError());
+        return FALSE;
+    }
+#else
+    struct stat Stat;
+    PVOID Data;
+    INT Descriptor;
+
+    memset(
+        File,
+        0,
+        sizeof(MAPPED_FILE)
+        );
+    Descriptor = open(
+        Path,
+        O_RDONLY
+        );
+    if ( Descriptor < 0 || fstat(Descriptor, &Stat) != 0 )
+    {
+        LOG("Failed to open %s: %s (errno %d)\n", Path, ERRNO_STRING());
+        if ( Descriptor >= 0 )
+        {
+            close(Descriptor);
+        }
+        return FALSE;
+    }
+
+    File->Size = (SIZE_T)Stat.st_size;
+    if ( !File->Size )
+    {
+        close(Descriptor);
+        return TRUE;
+    }
+
+    Data = mmap(
+        NULL,
+        File->Size,
+        PROT_READ,
+        MAP_PRIVATE,
+        Descriptor,
+        0
+        );
+    close(Descriptor);
+    if ( Data == MAP_FAILED )
+    {
+        LOG("Failed to map %s: %s (errno %d)\n", Path, ERRNO_STRING());
+        return FALSE;
+    }
+
+    madvise(
+        Data,
+        File->Size,
+        MADV_SEQUENTIAL
+        );
+    File->Data = Data;
+#endif
+
+    return TRUE;
+}
+
+static VOID
+UnmapFile(
+    IN OUT PMAPPED_FILE File
+    )
+/*++
+
+Routine Description:
+
+    This routine unmaps a file.
+
+Arguments:
+
+    File - The mapping.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    if ( File->Data )
+    {
+        UnmapViewOfFile(File->Data);
+    }
+    if ( File->Mapping )
+    {
+        CloseHandle(File->Mapping);
+    }
+    if ( File->File && File->File != INVALID_HANDLE_VALUE )
+    {
+        CloseHandle(File->File);
+    }
+#else
+    if ( File->Data )
+    {
+        munmap(
+            (PVOID)File->Data,
+            File->Size
+            );
+    }
+#endif
+
+    memset(
+        File,
+        0,
+        sizeof(MAPPED_FILE)
+        );
+}
+
+static DOUBLE
+GetSeconds(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine reads a high resolution monotonic clock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Seconds from an arbitrary point.
+
+--*/
+{
+#ifdef _WIN32
+    LARGE_INTEGER Counter;
+    LARGE_INTEGER Frequency;
+
+    QueryPerformanceCounter(&Counter);
+    QueryPerformanceFrequency(&Frequency);
+    return (DOUBLE)Counter.QuadPart / Frequency.QuadPart;
+#else
+    struct timespec Time;
+
+    clock_gettime(
+        CLOCK_MONOTONIC,
+        &Time
+        );
+    return Time.tv_sec + Time.tv_nsec / 1e9;
+#endif
+}
+
+#ifndef IMPORT_SSE2
+static UINT64
+MatchBytes(
+    IN UINT64 Word,
+    IN BYTE Byte
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the bytes in a word that are equal to a byte.
+
+Arguments:
+
+    Word - Eight bytes, loaded little endian.
+
+    Byte - The byte to look for.
+
+Return Value:
+
+    The high bit of each matching byte set, and nothing else.
+
+--*/
+{
+    const UINT64 Low = 0x7F7F7F7F7F7F7F7FULL;
+    UINT64 Difference;
+
+    Difference = Word ^ (0x0101010101010101ULL * Byte);
+    return ~(((Difference & Low) + Low) | Difference | Low);
+}
+#endif
+
+static UINT64
+ScanBlock(
+    IN PCBYTE Block
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the commas, newlines and quotes in a block.
+
+Arguments:
+
+    Block - SCAN_BLOCK_SIZE bytes.
+
+Return Value:
+
+    A mask with bit i set if byte i is a comma, newline or quote.
+
+--*/
+{
+    UINT64 Mask;
+    UINT32 i;
+#ifdef IMPORT_SSE2
+    __m128i Comma = _mm_set1_epi8(',');
+    __m128i Newline = _mm_set1_epi8('\n');
+    __m128i Quote = _mm_set1_epi8('"');
+    __m128i Chunk;
+    __m128i Match;
+
+    Mask = 0;
+    for ( i = 0; i < SCAN_BLOCK_SIZE; i += 16 )
+    {
+        Chunk = _mm_loadu_si128((const __m128i*)(Block + i));
+        Match = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi8(Chunk, Comma),
+                _mm_cmpeq_epi8(Chunk, Newline)
+                ),
+            _mm_cmpeq_epi8(Chunk, Quote)
+            );
+        Mask |= (UINT64)(UINT32)_mm_movemask_epi8(Match) << i;
+    }
+#else
+    UINT64 Word;
+    UINT64 Match;
+    UINT32 j;
+
+    Mask = 0;
+    for ( i = 0; i < SCAN_BLOCK_SIZE; i += 8 )
+    {
+        Word = 0;
+        for ( j = 0; j < 8; j++ )
+        {
+            Word |= (UINT64)Block[i + j] << (j * 8);
+        }
+
+        // Gather the high bit of each byte into the low 8 bits
+        Match = MatchBytes(Word, ',') | MatchBytes(Word, '\n') | MatchBytes(Word, '"');
+        Mask |= ((Match >> 7) * 0x0102040810204080ULL >> 56) << i;
+    }
+#endif
+
+    return Mask;
+}
+
+static VOID
+LoadBlock(
+    IN OUT PCSV_SCANNER Scanner
+    )
+/*++
+
+Routine Description:
+
+    This routine scans the block the scanner is at. The last block is
+    copied into a padded buffer, so the scan doesn't read past the file.
+
+Arguments:
+
+    Scanner - The scanner.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    BYTE Tail[SCAN_BLOCK_SIZE] = {0};
+
+    if ( Scanner->Block + SCAN_BLOCK_SIZE <= Scanner->Size )
+    {
+        Scanner->Mask = ScanBlock(Scanner->Data + Scanner->Block);
+    }
+    else
+    {
+        memcpy(
+            Tail,
+            Scanner->Data + Scanner->Block,
+            Scanner->Size - Scanner->Block
+            );
+        Scanner->Mask = ScanBlock(Tail);
+    }
+}
+
+static SIZE_T
+NextStructural(
+    IN OUT PCSV_SCANNER Scanner
+    )
+/*++
+
+Routine Description:
+
+    This routine finds the next comma, newline or quote.
+
+Arguments:
+
+    Scanner - The scanner.
+
+Return Value:
+
+    The offset of the character, or the size of the file if there are no
+    more.
+
+--*/
+{
+    SIZE_T Offset;
+
+    while ( !Scanner->Mask )
+    {
+        Scanner->Block += SCAN_BLOCK_SIZE;
+        if ( Scanner->Block >= Scanner->Size )
+        {
+            return Scanner->Size;
+        }
+        LoadBlock(Scanner);
+    }
+
+    Offset = Scanner->Block + CTZ64(Scanner->Mask);
+    Scanner->Mask &= Scanner->Mask - 1;
+    return Offset;
+}
+
+static BOOLEAN
+NextRow(
+    IN OUT PCSV_SCANNER Scanner,
+    IN OUT PSIZE_T Offset,
+    OUT PCSV_FIELD Fields,
+    OUT PUINT32 FieldCount
+    )
+/*++
+
+Routine Description:
+
+    This routine splits the next row into fields. Fields past
+    CSV_FIELD_COUNT are ignored.
+
+Arguments:
+
+    Scanner - The scanner, positioned at the start of the row.
+
+    Offset - The offset of the row, which receives the offset of the next.
+
+    Fields - Receives CSV_FIELD_COUNT fields.
+
+    FieldCount - Receives the number of fields in the row.
+
+Return Value:
+
+    TRUE - A row was read.
+
+    FALSE - There are no more rows.
+
+--*/
+{
+    PCCHAR Data = (PCCHAR)Scanner->Data;
+    SIZE_T FieldStart;
+    SIZE_T Position;
+    UINT32 Count;
+
+    if ( *Offset >= Scanner->Size )
+    {
+        return FALSE;
+    }
+
+    memset(
+        Fields,
+        0,
+        CSV_FIELD_COUNT * sizeof(CSV_FIELD)
+        );
+    Count = 0;
+    FieldStart = *Offset;
+
+    while ( TRUE )
+    {
+        Position = NextStructural(Scanner);
+
+        // A quote opening a field hides everything up to the quote closing
+        // it, and doubled quotes inside are part of the field
+        if ( Position < Scanner->Size && Data[Position] == '"' && Position == FieldStart )
+        {
+            while ( TRUE )
+            {
+                Position = NextStructural(Scanner);
+                if ( Position >= Scanner->Size )
+                {
+                    break;
+                }
+                if ( Data[Position] != '"' )
+                {
+                    continue;
+                }
+                if ( Position + 1 < Scanner->Size && Data[Position + 1] == '"' )
+                {
+                    NextStructural(Scanner);
+                    continue;
+                }
+                break;
+            }
+
+            if ( Count < CSV_FIELD_COUNT )
+            {
+                Fields[Count].Data = Data + FieldStart + 1;
+                Fields[Count].Length = Position - FieldStart - 1;
+                Fields[Count].Quoted = TRUE;
+            }
+
+            // Anything between the closing quote and the delimiter is dropped
+            do
+            {
+                Position = NextStructural(Scanner);
+            } while ( Position < Scanner->Size && Data[Position] == '"' );
+        }
+        else
+        {
+            while ( Position < Scanner->Size && Data[Position] == '"' )
+            {
+                Position = NextStructural(Scanner);
+            }
+
+            if ( Count < CSV_FIELD_COUNT )
+            {
+                Fields[Count].Data = Data + FieldStart;
+                Fields[Count].Length = Position - FieldStart;
+                if ( Fields[Count].Length && Position < Scanner->Size && Data[Position] == '\n' &&
+                     Fields[Count].Data[Fields[Count].Length - 1] == '\r' )
+                {
+                    Fields[Count].Length--;
+                }
+            }
+        }
+
+        Count++;
+        if ( Position >= Scanner->Size || Data[Position] == '\n' )
+        {
+            break;
+        }
+        FieldStart = Position + 1;
+    }
+
+    *Offset = Position + 1;
+    *FieldCount = Count;
+    return TRUE;
+}
+
+static BOOLEAN
+ParseDigits(
+    IN PCCHAR Data,
+    IN UINT32 Count,
+    OUT PUINT32 Value
+    )
+/*++
+
+Routine Description:
+
+    This routine parses a fixed number of decimal digits.
+
+Arguments:
+
+    Data - The digits.
+
+    Count - The number of digits.
+
+    Value - Receives the value.
+
+Return Value:
+
+    TRUE - The digits were parsed.
+
+    FALSE - Something other than a digit was found.
+
+--*/
+{
+    UINT32 i;
+
+    *Value = 0;
+    for ( i = 0; i < Count; i++ )
+    {
+        if ( Data[i] < '0' || Data[i] > '9' )
+        {
+            return FALSE;
+        }
+        *Value = *Value * 10 + (Data[i] - '0');
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN
+ParseTimestamp(
+    IN PCSV_FIELD Field,
+    IN OUT PHOUR_CACHE Cache,
+    OUT PINT64 Timestamp
+    )
+/*++
+
+Routine Description:
+
+    This routine parses a local "YYYY-MM-DD HH:MM:SS" timestamp.
+
+Arguments:
+
+    Field - The field.
+
+    Cache - The last hour that was converted.
+
+    Timestamp - Receives the Unix timestamp.
+
+Return Value:
+
+    TRUE - The timestamp was parsed.
+
+    FALSE - The timestamp is malformed.
+
+--*/
+{
+    PCCHAR Data = Field->Data;
+    struct tm Time = {0};
+    UINT32 Year;
+    UINT32 Month;
+    UINT32 Day;
+    UINT32 Hour;
+    UINT32 Minute;
+    UINT32 Second;
+    UINT32 Key;
+
+    if ( Field->Length != 19 || Data[4] != '-' || Data[7] != '-' ||
+         Data[10] != ' ' || Data[13] != ':' || Data[16] != ':' ||
+         !ParseDigits(Data, 4, &Year) || !ParseDigits(Data + 5, 2, &Month) ||
+         !ParseDigits(Data + 8, 2, &Day) || !ParseDigits(Data + 11, 2, &Hour) ||
+         !ParseDigits(Data + 14, 2, &Minute) || !ParseDigits(Data + 17, 2, &Second) ||
+         Year < 1970 || Month < 1 || Month > 12 || Day < 1 || Day > 31 ||
+         Hour > 23 || Minute > 59 || Second > 60 )
+    {
+        return FALSE;
+    }
+
+    // Converting whole hours keeps daylight saving changes right
+    Key = ((Year * 13 + Month) * 32 + Day) * 24 + Hour;
+    if ( Cache->Key != Key )
+    {
+        Time.tm_year = Year - 1900;
+        Time.tm_mon = Month - 1;
+        Time.tm_mday = Day;
+        Time.tm_hour = Hour;
+        Time.tm_isdst = -1;
+        Cache->Timestamp = mktime(&Time);
+        Cache->Key = Key;
+    }
+
+    *Timestamp = (INT64)Cache->Timestamp + Minute * 60 + Second;
+    return TRUE;
+}
+
+static VOID
+CopyName(
+    IN PCSV_FIELD Field,
+    OUT PCHAR Name,
+    IN SIZE_T NameSize
+    )
+/*++
+
+Routine Description:
+
+    This routine copies a name field, undoubling quotes if it was quoted.
+
+Arguments:
+
+    Field - The field.
+
+    Name - Receives the name, truncated if it's too long.
+
+    NameSize - The size of the name buffer.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    SIZE_T Length;
+    SIZE_T i;
+
+    Length = 0;
+    for ( i = 0; i < Field->Length && Length + 1 < NameSize; i++ )
+    {
+        Name[Length++] = Field->Data[i];
+        if ( Field->Quoted && Field->Data[i] == '"' )
+        {
+            i++;
+        }
+    }
+    Name[Length] = 0;
+}
+
+BOOLEAN
+ImportCsv(
+    IN PCCHAR Path
+    )
+/*++
+
+Routine Description:
+
+    This routine imports a CSV file into the journal. Rows with a malformed
+    timestamp or number, or a number that isn't in the roster, are skipped
+    and counted. If there's no roster, any number is accepted. A first row
+    that doesn't start with a digit is taken to be a header.
+
+Arguments:
+
+    Path - The path to the CSV file.
+
+Return Value:
+
+    TRUE - The file was imported, possibly with rows skipped.
+
+    FALSE - The file couldn't be read, or the journal couldn't be written.
+
+--*/
+{
+    CSV_FIELD Fields[CSV_FIELD_COUNT];
+    CSV_SCANNER Scanner = {0};
+    MAPPED_FILE File;
+    HOUR_CACHE Cache = {0};
+    PATTENDANCE_RECORD Batch;
+    PATTENDANCE_RECORD Record;
+    PCROSTER_MEMBER Member;
+    PCCHAR Reason;
+    BOOLEAN CheckRoster;
+    BOOLEAN Written;
+    SIZE_T Offset;
+    DOUBLE Start;
+    DOUBLE Elapsed;
+    UINT64 Line;
+    UINT64 Imported;
+    UINT64 Rejected;
+    UINT32 BatchCount;
+    UINT32 FieldCount;
+    UINT32 Id;
+
+    if ( !MapFile(
+             Path,
+             &File
+             ) )
+    {
+        return FALSE;
+    }
+
+    Batch = malloc(IMPORT_BATCH_SIZE * sizeof(ATTENDANCE_RECORD));
+    if ( !Batch )
+    {
+        LOG("Failed to allocate import batch: %s (errno %d)\n", ERRNO_STRING());
+        UnmapFile(&File);
+        return FALSE;
+    }
+
+    CheckRoster = RosterGetMemberCount() > 0;
+    if ( !CheckRoster )
+    {
+        LOG("No roster loaded, member numbers won't be checked\n");
+    }
+
+    LOG("Importing %s (%zu bytes)\n", Path, File.Size);
+    Start = GetSeconds();
+
+    Scanner.Data = File.Data;
+    Scanner.Size = File.Size;
+    if ( File.Size )
+    {
+        LoadBlock(&Scanner);
+    }
+
+    Written = TRUE;
+    Id = ROSTER_INVALID_ID;
+    Offset = 0;
+    Line = 0;
+    Imported = 0;
+    Rejected = 0;
+    BatchCount = 0;
+    while ( Written && NextRow(
+                           &Scanner,
+                           &Offset,
+                           Fields,
+                           &FieldCount
+                           ) )
+    {
+        Line++;
+        if ( FieldCount == 1 && !Fields[0].Length )
+        {
+            continue;
+        }
+        if ( Line == 1 && (!Fields[0].Length || Fields[0].Data[0] < '0' || Fields[0].Data[0] > '9') )
+        {
+            continue;
+        }
+
+        Record = &Batch[BatchCount];
+        memset(
+            Record,
+            0,
+            sizeof(ATTENDANCE_RECORD)
+            );
+        Record->Flags = JOURNAL_FLAG_IMPORTED;
+
+        Reason = NULL;
+        if ( FieldCount < 2 )
+        {
+            Reason = "missing number";
+        }
+        else if ( !ParseTimestamp(
+                      &Fields[0],
+                      &Cache,
+                      &Record->Timestamp
+                      ) )
+        {
+            Reason = "malformed timestamp";
+        }
+        else if ( !Fields[1].Length || Fields[1].Length > 9 ||
+                  !ParseDigits(
+                      Fields[1].Data,
+                      (UINT32)Fields[1].Length,
+                      &Record->Number
+                      ) )
+        {
+            Reason = "malformed number";
+        }
+        else if ( CheckRoster &&
+                  (Id = RosterFindMember(Record->Number)) == ROSTER_INVALID_ID )
+        {
+            Reason = "number not in roster";
+        }
+
+        if ( Reason )
+        {
+            if ( Rejected < IMPORT_MAX_REJECT_LOGS )
+            {
+                LOG("Skipping line %" PRIu64 ": %s\n", Line, Reason);
+            }
+            Rejected++;
+            continue;
+        }
+
+        if ( FieldCount > 3 && Fields[3].Length == 3 && memcmp(Fields[3].Data, "out", 3) == 0 )
+        {
+            Record->Flags |= JOURNAL_FLAG_CHECK_OUT;
+        }
+
+        if ( FieldCount > 2 && Fields[2].Length )
+        {
+            CopyName(
+                &Fields[2],
+                Record->Name,
+                ARRAY_SIZE(Record->Name)
+                );
+        }
+        else if ( CheckRoster )
+        {
+            Member = RosterGetMember(Id);
+            strncpy(
+                Record->Name,
+                Member->Name,
+                ARRAY_SIZE(Record->Name) - 1
+                );
+        }
+
+        Imported++;
+        if ( ++BatchCount == IMPORT_BATCH_SIZE )
+        {
+            Written = JournalAppendRecords(
+                Batch,
+                BatchCount
+                );
+            BatchCount = 0;
+        }
+    }
+
+    if ( Written && BatchCount )
+    {
+        Written = JournalAppendRecords(
+            Batch,
+            BatchCount
+            );
+    }
+    Elapsed = GetSeconds() - Start;
+
+    if ( Rejected > IMPORT_MAX_REJECT_LOGS )
+    {
+        LOG("%" PRIu64 " more lines skipped\n", Rejected - IMPORT_MAX_REJECT_LOGS);
+    }
+    LOG("Imported %" PRIu64 " rows and skipped %" PRIu64 " in %.3fs, %.0f rows/s, %.1f MB/s\n",
+        Imported,
+        Rejected,
+        Elapsed,
+        Elapsed > 0 ? (Imported + Rejected) / Elapsed : 0.0,
+        Elapsed > 0 ? File.Size / Elapsed / (1024 * 1024) : 0.0);
+
+    free(Batch);
+    UnmapFile(&File);
+    return Written;
+}
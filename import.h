@@ -0,0 +1,39 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    import.h
+
+Abstract:
+
+    This module contains definitions for importing attendance from CSV
+    files into the journal.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Records written to the journal at once
+//
+
+#define IMPORT_BATCH_SIZE 4096
+
+//
+// Rejected rows that are logged individually before only being counted
+//
+
+#define IMPORT_MAX_REJECT_LOGS 20
+
+//
+// Import a CSV file in the export format into the journal
+//
+
+BOOLEAN
+ImportCsv(
+    IN PCCHAR Path
+    );
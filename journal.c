@@ -0,0 +1,783 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    journal.c
+
+Abstract:
+
+    This module implements the attendance journal. It's an append-only file
+    of fixed size records, so any record can be read without scanning the
+    ones before it.
+
+    Appends go through a storage writer, so they return without waiting
+    for the disk, and records only become visible to readers once they're
+    durable. The stream is only used for reading.
+
+    Only one process writes the journal at a time. The writer holds an
+    exclusive lock on it, and a server taking over from another waits for
+    the old one to release it, so the two never write at the same offsets.
+
+    The keys of every record are also kept sorted by time, since imports
+    append old records after new ones. Records almost always arrive in
+    order, so keys are appended and only sorted when something out of
+    order has been added since the last lookup.
+
+--*/
+
+#include "server.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define FSEEK64 _fseeki64
+#define FTELL64 _ftelli64
+#define FTRUNCATE(File, Size) _chsize_s(_fileno(File), Size)
+#else
+#define FSEEK64 fseeko
+#define FTELL64 ftello
+#define FTRUNCATE(File, Size) ftruncate(fileno(File), Size)
+#include <fcntl.h>
+#include <sys/file.h>
+#endif
+
+PCHAR JournalPath;
+STORAGE_BACKEND JournalBackend = StorageBackendAuto;
+
+static FILE* JournalFile;
+static PSTORAGE_WRITER JournalWriter;
+#ifndef _WIN32
+static INT LockDescriptor = -1;
+#endif
+static UINT64 RecordCount;
+static UINT64 DurableCount;
+static BOOLEAN WriteFailed;
+static BOOLEAN Released;
+
+// Keys in time order, one per appended record
+static PJOURNAL_KEY Order;
+static UINT64 OrderCapacity;
+static BOOLEAN OrderSorted = TRUE;
+
+static INT
+CompareKeys(
+    IN PCVOID First,
+    IN PCVOID Second
+    )
+/*++
+
+Routine Description:
+
+    This routine compares two keys by time, then by journal position.
+
+Arguments:
+
+    First - The first key.
+
+    Second - The second key.
+
+Return Value:
+
+    Less than, equal to or greater than 0 as First is before, the same as
+    or after Second.
+
+--*/
+{
+    PCJOURNAL_KEY A = First;
+    PCJOURNAL_KEY B = Second;
+
+    if ( A->Timestamp != B->Timestamp )
+    {
+        return A->Timestamp < B->Timestamp ? -1 : 1;
+    }
+    return A->Index < B->Index ? -1 : A->Index > B->Index;
+}
+
+static BOOLEAN
+AddKeys(
+    IN PCATTENDANCE_RECORD Records,
+    IN UINT64 Index,
+    IN UINT32 Count
+    )
+/*++
+
+Routine Description:
+
+    This routine adds the keys of records to the end of the time order,
+    noting whether that put it out of order.
+
+Arguments:
+
+    Records - The records.
+
+    Index - The journal position of the first record.
+
+    Count - The number of records.
+
+Return Value:
+
+    TRUE - The keys were added.
+
+    FALSE - Memory couldn't be allocated.
+
+--*/
+{
+    PJOURNAL_KEY NewOrder;
+    PJOURNAL_KEY Key;
+    UINT64 NewCapacity;
+    UINT32 i;
+
+    if ( Index + Count > OrderCapacity )
+    {
+        NewCapacity = MAX(OrderCapacity, 1024);
+        while ( NewCapacity < Index + Count )
+        {
+            NewCapacity *= 2;
+        }
+
+        NewOrder = realloc(
+            Order,
+            NewCapacity * sizeof(JOURNAL_KEY)
+            );
+        if ( !NewOrder )
+        {
+            LOG("Failed to grow journal time index: %s (errno %d)\n", ERRNO_STRING());
+            return FALSE;
+        }
+        Order = NewOrder;
+        OrderCapacity = NewCapacity;
+    }
+
+    for ( i = 0; i < Count; i++ )
+    {
+        Key = &Order[Index + i];
+        Key->Timestamp = Records[i].Timestamp;
+        Key->Index = Index + i;
+        if ( Index + i && Key->Timestamp < Key[-1].Timestamp )
+        {
+            OrderSorted = FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static VOID
+SortKeys(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine puts the time order back in order after records were
+    added out of order.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( OrderSorted )
+    {
+        return;
+    }
+
+    qsort(
+        Order,
+        RecordCount,
+        sizeof(JOURNAL_KEY),
+        CompareKeys
+        );
+    OrderSorted = TRUE;
+}
+
+static VOID
+HandleDurable(
+    IN UINT64 Durable,
+    IN BOOLEAN Failed
+    )
+/*++
+
+Routine Description:
+
+    This routine makes records visible to readers once they're durable.
+
+Arguments:
+
+    Durable - The number of bytes of the journal that are durable.
+
+    Failed - Whether a write failed.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    DurableCount = Durable / sizeof(ATTENDANCE_RECORD);
+    if ( Failed && !WriteFailed )
+    {
+        LOG("Journal writes failed, %" PRIu64 " records weren't saved\n", RecordCount - DurableCount);
+        WriteFailed = TRUE;
+    }
+}
+
+static BOOLEAN
+LockJournal(
+    IN PCCHAR Path,
+    IN UINT32 Wait
+    )
+/*++
+
+Routine Description:
+
+    This routine takes the exclusive lock on the journal. The lock is on
+    its own descriptor, so it can be released without closing the stream
+    readers use. Locks can't be taken this way on Windows, where handoffs
+    are disabled anyway.
+
+Arguments:
+
+    Path - The path to the journal.
+
+    Wait - Milliseconds to wait for another process to release it.
+
+Return Value:
+
+    TRUE - The lock was taken.
+
+    FALSE - Another process has the journal, or it couldn't be locked.
+
+--*/
+{
+#ifdef _WIN32
+    return TRUE;
+#else
+    UINT64 Deadline;
+
+    LockDescriptor = open(
+        Path,
+        O_RDONLY | O_CLOEXEC
+        );
+    if ( LockDescriptor < 0 )
+    {
+        LOG("Failed to open journal \"%s\" to lock it: %s (errno %d)\n", Path, ERRNO_STRING());
+        return FALSE;
+    }
+
+    Deadline = mg_millis() + Wait;
+    while ( flock(
+                LockDescriptor,
+                LOCK_EX | LOCK_NB
+                ) < 0 )
+    {
+        if ( errno != EWOULDBLOCK || mg_millis() >= Deadline )
+        {
+            LOG("Journal \"%s\" is in use by another process: %s (errno %d)\n", Path, ERRNO_STRING());
+            close(LockDescriptor);
+            LockDescriptor = -1;
+            return FALSE;
+        }
+        usleep(JOURNAL_LOCK_INTERVAL * 1000);
+    }
+
+    return TRUE;
+#endif
+}
+
+BOOLEAN
+JournalOpen(
+    IN PCCHAR Path,
+    IN PJOURNAL_RECORD_CALLBACK Callback OPTIONAL,
+    IN UINT32 LockWait
+    )
+/*++
+
+Routine Description:
+
+    This routine opens and locks the journal, creating it if it doesn't
+    exist, and replays the records already in it.
+
+Arguments:
+
+    Path - The path to the journal.
+
+    Callback - Called for each existing record.
+
+    LockWait - Milliseconds to wait for another process to release the
+               journal, 0 to fail right away.
+
+Return Value:
+
+    TRUE - The journal was opened.
+
+    FALSE - The journal couldn't be opened, or another process has it.
+
+--*/
+{
+    ATTENDANCE_RECORD Records[64];
+    UINT64 Size;
+    UINT64 Index;
+    UINT32 Count;
+    UINT32 i;
+
+    LOG("Opening journal %s\n", Path);
+    JournalFile = fopen(
+        Path,
+        "a+b"
+        );
+    if ( !JournalFile )
+    {
+        LOG("Failed to open journal \"%s\": %s (errno %d)\n", Path, ERRNO_STRING());
+        return FALSE;
+    }
+
+    // The size is only final once nothing else can append
+    if ( !LockJournal(
+             Path,
+             LockWait
+             ) )
+    {
+        JournalClose();
+        return FALSE;
+    }
+
+    FSEEK64(
+        JournalFile,
+        0,
+        SEEK_END
+        );
+    Size = FTELL64(JournalFile);
+    RecordCount = Size / sizeof(ATTENDANCE_RECORD);
+
+    // A crash in the middle of a write leaves part of a record at the end
+    if ( Size % sizeof(ATTENDANCE_RECORD) )
+    {
+        LOG("Discarding %" PRIu64 " bytes of partial record at end of journal\n", Size % sizeof(ATTENDANCE_RECORD));
+        fflush(JournalFile);
+        if ( FTRUNCATE(
+                 JournalFile,
+                 RecordCount * sizeof(ATTENDANCE_RECORD)
+                 ) != 0 )
+        {
+            LOG("Failed to truncate journal: %s (errno %d)\n", ERRNO_STRING());
+            JournalClose();
+            return FALSE;
+        }
+    }
+
+    // Reads below stop at the durable count, which is everything so far
+    DurableCount = RecordCount;
+    for ( Index = 0; Index < RecordCount; Index += Count )
+    {
+        Count = JournalRead(
+            Index,
+            Records,
+            ARRAY_SIZE(Records)
+            );
+        if ( !Count || !AddKeys(
+                           Records,
+                           Index,
+                           Count
+                           ) )
+        {
+            JournalClose();
+            return FALSE;
+        }
+
+        for ( i = 0; Callback && i < Count; i++ )
+        {
+            Callback(&Records[i]);
+        }
+    }
+
+    JournalWriter = StorageOpen(
+        Path,
+        RecordCount * sizeof(ATTENDANCE_RECORD),
+        JournalBackend,
+        HandleDurable
+        );
+    if ( !JournalWriter )
+    {
+        JournalClose();
+        return FALSE;
+    }
+
+    LOG("Journal has %" PRIu64 " records\n", RecordCount);
+    return TRUE;
+}
+
+BOOLEAN
+JournalAppend(
+    IN PCATTENDANCE_RECORD Record
+    )
+/*++
+
+Routine Description:
+
+    This routine appends a record to the journal.
+
+Arguments:
+
+    Record - The record to append.
+
+Return Value:
+
+    TRUE - The record was written.
+
+    FALSE - The record couldn't be written.
+
+--*/
+{
+    return JournalAppendRecords(
+        Record,
+        1
+        );
+}
+
+BOOLEAN
+JournalAppendRecords(
+    IN PCATTENDANCE_RECORD Records,
+    IN UINT32 Count
+    )
+/*++
+
+Routine Description:
+
+    This routine queues records to be appended to the journal. They're
+    written and synced in the background, and readers see them once they
+    are durable.
+
+Arguments:
+
+    Records - The records to append.
+
+    Count - The number of records.
+
+Return Value:
+
+    TRUE - The records were queued.
+
+    FALSE - The records couldn't be queued, or an earlier write failed.
+
+--*/
+{
+    if ( !JournalIsWritable() || !AddKeys(
+                               Records,
+                               RecordCount,
+                               Count
+                               ) )
+    {
+        return FALSE;
+    }
+
+    if ( !StorageAppend(
+             JournalWriter,
+             Records,
+             Count * sizeof(ATTENDANCE_RECORD)
+             ) )
+    {
+        LOG("Failed to append to journal\n");
+        return FALSE;
+    }
+
+    RecordCount += Count;
+    return TRUE;
+}
+
+UINT64
+JournalGetRecordCount(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the number of durable records in the journal.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of records.
+
+--*/
+{
+    return DurableCount;
+}
+
+UINT32
+JournalRead(
+    IN UINT64 Index,
+    OUT PATTENDANCE_RECORD Records,
+    IN UINT32 Count
+    )
+/*++
+
+Routine Description:
+
+    This routine reads consecutive records from the journal.
+
+Arguments:
+
+    Index - The index of the first record.
+
+    Records - Receives the records.
+
+    Count - The maximum number of records to read.
+
+Return Value:
+
+    The number of records read.
+
+--*/
+{
+    if ( !JournalFile || Index >= DurableCount )
+    {
+        return 0;
+    }
+
+    Count = (UINT32)MIN(Count, DurableCount - Index);
+    if ( FSEEK64(
+             JournalFile,
+             Index * sizeof(ATTENDANCE_RECORD),
+             SEEK_SET
+             ) != 0 )
+    {
+        LOG("Failed to seek to journal record %" PRIu64 ": %s (errno %d)\n", Index, ERRNO_STRING());
+        return 0;
+    }
+
+    return (UINT32)fread(
+        Records,
+        sizeof(ATTENDANCE_RECORD),
+        Count,
+        JournalFile
+        );
+}
+
+UINT64
+JournalGetOrderedCount(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the number of records in time order, which includes
+    records that aren't durable yet.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of records.
+
+--*/
+{
+    return RecordCount;
+}
+
+BOOLEAN
+JournalGetOrderedKey(
+    IN UINT64 Position,
+    OUT PJOURNAL_KEY Key
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the key of a record by its position in time order.
+
+Arguments:
+
+    Position - The position.
+
+    Key - Receives the key.
+
+Return Value:
+
+    TRUE - The key was found.
+
+    FALSE - The position is past the end, or the record isn't durable yet
+            and can't be read.
+
+--*/
+{
+    if ( Position >= RecordCount )
+    {
+        return FALSE;
+    }
+
+    SortKeys();
+    *Key = Order[Position];
+    return Key->Index < DurableCount;
+}
+
+UINT64
+JournalFindKey(
+    IN PCJOURNAL_KEY Key
+    )
+/*++
+
+Routine Description:
+
+    This routine finds where a key falls in time order with a binary
+    search.
+
+Arguments:
+
+    Key - The key.
+
+Return Value:
+
+    The position of the first record at or after the key, or the number of
+    records if there isn't one.
+
+--*/
+{
+    UINT64 Low;
+    UINT64 High;
+    UINT64 Middle;
+
+    SortKeys();
+
+    Low = 0;
+    High = RecordCount;
+    while ( Low < High )
+    {
+        Middle = Low + (High - Low) / 2;
+        if ( CompareKeys(
+                 &Order[Middle],
+                 Key
+                 ) < 0 )
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+
+    return Low;
+}
+
+BOOLEAN
+JournalIsWritable(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether records can still be appended, which they
+    can't once the journal has been released to another server.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - Appends are accepted.
+
+    FALSE - The journal is closed or released.
+
+--*/
+{
+    return JournalWriter && !Released;
+}
+
+VOID
+JournalRelease(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine writes what's left and unlocks the journal, so another
+    server can take over appending to it. The journal can still be read,
+    but appends fail from now on. The writer is only freed by
+    JournalClose, since completions it already posted still run on the
+    loop while it drains.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Released = TRUE;
+    if ( JournalWriter && !StorageFlush(JournalWriter) )
+    {
+        LOG("Releasing the journal with records that weren't written\n");
+    }
+
+#ifndef _WIN32
+    if ( LockDescriptor >= 0 )
+    {
+        close(LockDescriptor);
+        LockDescriptor = -1;
+    }
+#endif
+}
+
+VOID
+JournalClose(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine writes what's left and closes the journal. The loop has
+    to have stopped first, since completions the writer posted that
+    haven't run yet never will.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    JournalRelease();
+
+    if ( JournalWriter )
+    {
+        StorageClose(JournalWriter);
+        JournalWriter = NULL;
+    }
+    Released = FALSE;
+
+    if ( JournalFile )
+    {
+        fclose(JournalFile);
+        JournalFile = NULL;
+    }
+
+    free(Order);
+    Order = NULL;
+    OrderCapacity = 0;
+    OrderSorted = TRUE;
+}
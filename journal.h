@@ -0,0 +1,192 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    journal.h
+
+Abstract:
+
+    This module contains definitions for the attendance journal, the local
+    on-disk copy of every accepted submission.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+#include "roster.h"
+#include "storage.h"
+
+//
+// Default journal file
+//
+
+#define JOURNAL_FILE "attendance.journal"
+
+//
+// Milliseconds between attempts to lock a journal another process has
+//
+
+#define JOURNAL_LOCK_INTERVAL 10
+
+//
+// Record flags
+//
+
+#define JOURNAL_FLAG_IMPORTED 0x1
+#define JOURNAL_FLAG_CHECK_OUT 0x2
+
+//
+// A journal record. Records are fixed size so they can be found by index.
+//
+
+typedef struct _ATTENDANCE_RECORD
+{
+    INT64 Timestamp;
+    UINT32 Number;
+    UINT32 Flags;
+    CHAR Name[ROSTER_NAME_SIZE];
+} ATTENDANCE_RECORD, *PATTENDANCE_RECORD;
+
+typedef const ATTENDANCE_RECORD* PCATTENDANCE_RECORD;
+
+//
+// A record's place in time order. Records with the same timestamp are in
+// the order they were written.
+//
+
+typedef struct _JOURNAL_KEY
+{
+    INT64 Timestamp;
+    UINT64 Index;
+} JOURNAL_KEY, *PJOURNAL_KEY;
+
+typedef const JOURNAL_KEY* PCJOURNAL_KEY;
+
+//
+// Called for each record when the journal is opened
+//
+
+typedef VOID (*PJOURNAL_RECORD_CALLBACK)(
+    IN PCATTENDANCE_RECORD Record
+    );
+
+//
+// Path to the journal
+//
+
+extern PCHAR JournalPath;
+
+//
+// How the journal is written
+//
+
+extern STORAGE_BACKEND JournalBackend;
+
+//
+// Open and lock the journal, calling Callback for each existing record
+//
+
+BOOLEAN
+JournalOpen(
+    IN PCCHAR Path,
+    IN PJOURNAL_RECORD_CALLBACK Callback OPTIONAL,
+    IN UINT32 LockWait
+    );
+
+//
+// Append a record to the journal
+//
+
+BOOLEAN
+JournalAppend(
+    IN PCATTENDANCE_RECORD Record
+    );
+
+//
+// Append records to the journal at once
+//
+
+BOOLEAN
+JournalAppendRecords(
+    IN PCATTENDANCE_RECORD Records,
+    IN UINT32 Count
+    );
+
+//
+// Get the number of records in the journal
+//
+
+UINT64
+JournalGetRecordCount(
+    VOID
+    );
+
+//
+// Read records starting at an index
+//
+
+UINT32
+JournalRead(
+    IN UINT64 Index,
+    OUT PATTENDANCE_RECORD Records,
+    IN UINT32 Count
+    );
+
+//
+// Get the number of records in time order, including ones that aren't
+// durable yet
+//
+
+UINT64
+JournalGetOrderedCount(
+    VOID
+    );
+
+//
+// Get the key of the record at a position in time order
+//
+
+BOOLEAN
+JournalGetOrderedKey(
+    IN UINT64 Position,
+    OUT PJOURNAL_KEY Key
+    );
+
+//
+// Find the position in time order of the first record at or after a key
+//
+
+UINT64
+JournalFindKey(
+    IN PCJOURNAL_KEY Key
+    );
+
+//
+// Check whether records can still be appended
+//
+
+BOOLEAN
+JournalIsWritable(
+    VOID
+    );
+
+//
+// Finish writing and unlock the journal for another server
+//
+
+VOID
+JournalRelease(
+    VOID
+    );
+
+//
+// Close the journal
+//
+
+VOID
+JournalClose(
+    VOID
+    );
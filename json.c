@@ -0,0 +1,1274 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    json.c
+
+Abstract:
+
+    This module implements the incremental JSON tokenizer. It's a byte at a
+    time state machine, so a document can be fed in whatever pieces it
+    arrives in and every byte is looked at once. Only the token being read
+    is buffered.
+
+    It also implements the JSON writer, which formats and escapes straight
+    into a buffer the caller owns, usually on the stack, and hands it to a
+    sink each time it fills up, so outgoing JSON never needs an allocation
+    or more than one copy. The caller writes the structure itself, the same
+    way it would with printf, and the writer takes care of escaping strings.
+
+--*/
+
+#include "server.h"
+
+VOID
+JsonTokenizerInitialize(
+    OUT PJSON_TOKENIZER Tokenizer,
+    IN PJSON_TOKEN_CALLBACK Callback,
+    IN PVOID Context OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine sets up a tokenizer.
+
+Arguments:
+
+    Tokenizer - The tokenizer.
+
+    Callback - Called for each token.
+
+    Context - Passed to the callback.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    memset(
+        Tokenizer,
+        0,
+        sizeof(JSON_TOKENIZER)
+        );
+    Tokenizer->Callback = Callback;
+    Tokenizer->Context = Context;
+    Tokenizer->State = JsonStateValue;
+}
+
+static VOID
+AppendToken(
+    IN OUT PJSON_TOKENIZER Tokenizer,
+    IN CHAR Character
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a character to the current token. A token that
+    doesn't fit is an error, since passing on part of it would look like
+    the whole value.
+
+Arguments:
+
+    Tokenizer - The tokenizer.
+
+    Character - The character.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( Tokenizer->TokenLength >= JSON_MAX_TOKEN )
+    {
+        if ( !Tokenizer->Error )
+        {
+            LOG("JSON string or number longer than %d bytes\n", JSON_MAX_TOKEN);
+            Tokenizer->Error = TRUE;
+        }
+        return;
+    }
+
+    Tokenizer->Token[Tokenizer->TokenLength++] = Character;
+}
+
+static VOID
+AppendCodePoint(
+    IN OUT PJSON_TOKENIZER Tokenizer,
+    IN UINT32 CodePoint
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a code point to the current token as UTF-8.
+
+Arguments:
+
+    Tokenizer - The tokenizer.
+
+    CodePoint - The code point.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( CodePoint < 0x80 )
+    {
+        AppendToken(Tokenizer, (CHAR)CodePoint);
+    }
+    else if ( CodePoint < 0x800 )
+    {
+        AppendToken(Tokenizer, (CHAR)(0xC0 | CodePoint >> 6));
+        AppendToken(Tokenizer, (CHAR)(0x80 | (CodePoint & 0x3F)));
+    }
+    else if ( CodePoint < 0x10000 )
+    {
+        AppendToken(Tokenizer, (CHAR)(0xE0 | CodePoint >> 12));
+        AppendToken(Tokenizer, (CHAR)(0x80 | (CodePoint >> 6 & 0x3F)));
+        AppendToken(Tokenizer, (CHAR)(0x80 | (CodePoint & 0x3F)));
+    }
+    else
+    {
+        AppendToken(Tokenizer, (CHAR)(0xF0 | CodePoint >> 18));
+        AppendToken(Tokenizer, (CHAR)(0x80 | (CodePoint >> 12 & 0x3F)));
+        AppendToken(Tokenizer, (CHAR)(0x80 | (CodePoint >> 6 & 0x3F)));
+        AppendToken(Tokenizer, (CHAR)(0x80 | (CodePoint & 0x3F)));
+    }
+}
+
+static BOOLEAN
+EmitToken(
+    IN OUT PJSON_TOKENIZER Tokenizer,
+    IN JSON_TOKEN_TYPE Type
+    )
+/*++
+
+Routine Description:
+
+    This routine passes a token to the callback.
+
+Arguments:
+
+    Tokenizer - The tokenizer.
+
+    Type - The type of the token. The value is the current token for
+           strings, keys, numbers and literals.
+
+Return Value:
+
+    TRUE - Tokenizing should continue.
+
+    FALSE - The callback stopped tokenizing.
+
+--*/
+{
+    Tokenizer->Token[Tokenizer->TokenLength] = 0;
+    if ( !Tokenizer->Callback(
+             Tokenizer->Context,
+             Type,
+             Tokenizer->Token,
+             Tokenizer->TokenLength,
+             Tokenizer->Depth
+             ) )
+    {
+        Tokenizer->Error = TRUE;
+        return FALSE;
+    }
+
+    Tokenizer->TokenLength = 0;
+    return TRUE;
+}
+
+static BOOLEAN
+EmitLiteral(
+    IN OUT PJSON_TOKENIZER Tokenizer
+    )
+/*++
+
+Routine Description:
+
+    This routine emits the number or literal that was just read.
+
+Arguments:
+
+    Tokenizer - The tokenizer.
+
+Return Value:
+
+    TRUE - Tokenizing should continue.
+
+    FALSE - The literal is invalid or the callback stopped tokenizing.
+
+--*/
+{
+    JSON_TOKEN_TYPE Type;
+
+    Tokenizer->Token[Tokenizer->TokenLength] = 0;
+    if ( Tokenizer->State == JsonStateNumber )
+    {
+        Type = JsonTokenNumber;
+    }
+    else if ( strcmp(Tokenizer->Token, "true") == 0 )
+    {
+        Type = JsonTokenTrue;
+    }
+    else if ( strcmp(Tokenizer->Token, "false") == 0 )
+    {
+        Type = JsonTokenFalse;
+    }
+    else if ( strcmp(Tokenizer->Token, "null") == 0 )
+    {
+        Type = JsonTokenNull;
+    }
+    else
+    {
+        LOG("Invalid JSON literal %s\n", Tokenizer->Token);
+        Tokenizer->Error = TRUE;
+        return FALSE;
+    }
+
+    Tokenizer->State = JsonStateValue;
+    return EmitToken(
+        Tokenizer,
+        Type
+        );
+}
+
+static BOOLEAN
+HandleStructure(
+    IN OUT PJSON_TOKENIZER Tokenizer,
+    IN CHAR Character
+    )
+/*++
+
+Routine Description:
+
+    This routine handles a character outside of a string, number or
+    literal.
+
+Arguments:
+
+    Tokenizer - The tokenizer.
+
+    Character - The character.
+
+Return Value:
+
+    TRUE - Tokenizing should continue.
+
+    FALSE - The document is invalid or the callback stopped tokenizing.
+
+--*/
+{
+    BOOLEAN IsObject;
+
+    switch ( Character )
+    {
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+        return TRUE;
+    case '{':
+    case '[':
+        if ( Tokenizer->Depth >= JSON_MAX_DEPTH )
+        {
+            LOG("JSON nested deeper than %d\n", JSON_MAX_DEPTH);
+            Tokenizer->Error = TRUE;
+            return FALSE;
+        }
+        IsObject = Character == '{';
+        if ( !EmitToken(
+                 Tokenizer,
+                 IsObject ? JsonTokenObjectStart : JsonTokenArrayStart
+                 ) )
+        {
+            return FALSE;
+        }
+        Tokenizer->InObject[Tokenizer->Depth++] = IsObject;
+        Tokenizer->ExpectKey = IsObject;
+        return TRUE;
+    case '}':
+    case ']':
+        IsObject = Character == '}';
+        if ( !Tokenizer->Depth || Tokenizer->InObject[Tokenizer->Depth - 1] != IsObject )
+        {
+            LOG("Unbalanced '%c' in JSON\n", Character);
+            Tokenizer->Error = TRUE;
+            return FALSE;
+        }
+        Tokenizer->Depth--;
+        Tokenizer->ExpectKey = FALSE;
+        return EmitToken(
+            Tokenizer,
+            IsObject ? JsonTokenObjectEnd : JsonTokenArrayEnd
+            );
+    case ':':
+        Tokenizer->ExpectKey = FALSE;
+        return TRUE;
+    case ',':
+        Tokenizer->ExpectKey = Tokenizer->Depth && Tokenizer->InObject[Tokenizer->Depth - 1];
+        return TRUE;
+    case '"':
+        Tokenizer->State = JsonStateString;
+        Tokenizer->TokenLength = 0;
+        return TRUE;
+    default:
+        Tokenizer->TokenLength = 0;
+        AppendToken(
+            Tokenizer,
+            Character
+            );
+        if ( Character == '-' || (Character >= '0' && Character <= '9') )
+        {
+            Tokenizer->State = JsonStateNumber;
+        }
+        else if ( Character >= 'a' && Character <= 'z' )
+        {
+            Tokenizer->State = JsonStateLiteral;
+        }
+        else
+        {
+            LOG("Unexpected '%c' in JSON\n", Character);
+            Tokenizer->Error = TRUE;
+            return FALSE;
+        }
+        return TRUE;
+    }
+}
+
+BOOLEAN
+JsonTokenizerFeed(
+    IN OUT PJSON_TOKENIZER Tokenizer,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine tokenizes the next part of a document. Tokens split across
+    calls are put back together.
+
+Arguments:
+
+    Tokenizer - The tokenizer.
+
+    Data - The next part of the document.
+
+    Length - The length of the data.
+
+Return Value:
+
+    TRUE - Tokenizing can continue.
+
+    FALSE - The document is invalid or the callback stopped tokenizing.
+
+--*/
+{
+    SIZE_T i;
+    CHAR Character;
+    UINT32 Digit;
+
+    for ( i = 0; i < Length && !Tokenizer->Error; i++ )
+    {
+        Character = Data[i];
+        switch ( Tokenizer->State )
+        {
+        case JsonStateValue:
+            HandleStructure(
+                Tokenizer,
+                Character
+                );
+            break;
+        case JsonStateString:
+            if ( Character == '"' )
+            {
+                Tokenizer->State = JsonStateValue;
+                EmitToken(
+                    Tokenizer,
+                    Tokenizer->ExpectKey ? JsonTokenKey : JsonTokenString
+                    );
+            }
+            else if ( Character == '\\' )
+            {
+                Tokenizer->State = JsonStateEscape;
+            }
+            else
+            {
+                AppendToken(
+                    Tokenizer,
+                    Character
+                    );
+            }
+            break;
+        case JsonStateEscape:
+            Tokenizer->State = JsonStateString;
+            switch ( Character )
+            {
+            case 'b':
+                AppendToken(Tokenizer, '\b');
+                break;
+            case 'f':
+                AppendToken(Tokenizer, '\f');
+                break;
+            case 'n':
+                AppendToken(Tokenizer, '\n');
+                break;
+            case 'r':
+                AppendToken(Tokenizer, '\r');
+                break;
+            case 't':
+                AppendToken(Tokenizer, '\t');
+                break;
+            case 'u':
+                Tokenizer->State = JsonStateUnicode;
+                Tokenizer->Unicode = 0;
+                Tokenizer->UnicodeDigits = 0;
+                break;
+            default:
+                AppendToken(Tokenizer, Character);
+                break;
+            }
+            break;
+        case JsonStateUnicode:
+            if ( Character >= '0' && Character <= '9' )
+            {
+                Digit = Character - '0';
+            }
+            else if ( (Character | 0x20) >= 'a' && (Character | 0x20) <= 'f' )
+            {
+                Digit = (Character | 0x20) - 'a' + 10;
+            }
+            else
+            {
+                LOG("Invalid \\u escape in JSON\n");
+                Tokenizer->Error = TRUE;
+                break;
+            }
+
+            Tokenizer->Unicode = Tokenizer->Unicode << 4 | Digit;
+            if ( ++Tokenizer->UnicodeDigits < 4 )
+            {
+                break;
+            }
+
+            Tokenizer->State = JsonStateString;
+            if ( Tokenizer->Unicode >= 0xD800 && Tokenizer->Unicode < 0xDC00 )
+            {
+                Tokenizer->HighSurrogate = Tokenizer->Unicode;
+            }
+            else if ( Tokenizer->Unicode >= 0xDC00 && Tokenizer->Unicode < 0xE000 && Tokenizer->HighSurrogate )
+            {
+                AppendCodePoint(
+                    Tokenizer,
+                    0x10000 + ((Tokenizer->HighSurrogate - 0xD800) << 10) + (Tokenizer->Unicode - 0xDC00)
+                    );
+                Tokenizer->HighSurrogate = 0;
+            }
+            else
+            {
+                AppendCodePoint(
+                    Tokenizer,
+                    Tokenizer->Unicode
+                    );
+                Tokenizer->HighSurrogate = 0;
+            }
+            break;
+        case JsonStateNumber:
+        case JsonStateLiteral:
+            if ( (Character >= '0' && Character <= '9') || (Character >= 'a' && Character <= 'z') ||
+                 Character == '-' || Character == '+' || Character == '.' || Character == 'E' )
+            {
+                AppendToken(
+                    Tokenizer,
+                    Character
+                    );
+            }
+            else if ( EmitLiteral(Tokenizer) )
+            {
+                HandleStructure(
+                    Tokenizer,
+                    Character
+                    );
+            }
+            break;
+        }
+    }
+
+    return !Tokenizer->Error;
+}
+
+static BOOLEAN
+MakeRoom(
+    IN OUT PJSON_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    This routine empties a full writer's buffer into its sink. A writer
+    without a sink fails instead.
+
+Arguments:
+
+    Writer - The writer.
+
+Return Value:
+
+    TRUE - The buffer was emptied.
+
+    FALSE - The writer failed.
+
+--*/
+{
+    if ( !Writer->Sink || !JsonWriterFlush(Writer) )
+    {
+        Writer->Error = TRUE;
+    }
+
+    return !Writer->Error;
+}
+
+VOID
+JsonWriterInitialize(
+    OUT PJSON_WRITER Writer,
+    OUT PCHAR Buffer,
+    IN SIZE_T Size,
+    IN PJSON_WRITER_SINK Sink OPTIONAL,
+    IN PVOID Context OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine sets up a writer.
+
+Arguments:
+
+    Writer - The writer.
+
+    Buffer - The buffer to write into.
+
+    Size - The size of the buffer, including the NUL terminator.
+
+    Sink - Takes the buffer's contents when it fills up or is flushed, or
+           NULL if everything has to fit in the buffer.
+
+    Context - Passed to the sink.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Writer->Buffer = Buffer;
+    Writer->Size = Size;
+    Writer->Length = 0;
+    Writer->Sink = Sink;
+    Writer->Context = Context;
+    Writer->Error = Size < 2;
+    if ( Size )
+    {
+        Buffer[0] = 0;
+    }
+}
+
+VOID
+JsonWriteRaw(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine writes text without escaping it.
+
+Arguments:
+
+    Writer - The writer.
+
+    Data - The text.
+
+    Length - The length of the text.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    SIZE_T Copied;
+
+    while ( Length && !Writer->Error )
+    {
+        if ( Writer->Length + 1 >= Writer->Size && !MakeRoom(Writer) )
+        {
+            break;
+        }
+
+        Copied = MIN(Length, Writer->Size - 1 - Writer->Length);
+        memcpy(
+            Writer->Buffer + Writer->Length,
+            Data,
+            Copied
+            );
+        Writer->Length += Copied;
+        Writer->Buffer[Writer->Length] = 0;
+        Data += Copied;
+        Length -= Copied;
+    }
+}
+
+VOID
+JsonWritef(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR Format,
+    ...
+    )
+/*++
+
+Routine Description:
+
+    This routine formats text into the writer without escaping it. It's
+    formatted in place, and again after emptying the buffer if it didn't
+    fit. Text longer than the whole buffer fails the writer.
+
+Arguments:
+
+    Writer - The writer.
+
+    Format - The printf format.
+
+    ... - The format's arguments.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    va_list Arguments;
+    INT Length;
+
+    if ( Writer->Error )
+    {
+        return;
+    }
+
+    va_start(
+        Arguments,
+        Format
+        );
+    Length = vsnprintf(
+        Writer->Buffer + Writer->Length,
+        Writer->Size - Writer->Length,
+        Format,
+        Arguments
+        );
+    va_end(Arguments);
+
+    if ( Length >= 0 && (SIZE_T)Length >= Writer->Size - Writer->Length )
+    {
+        Writer->Buffer[Writer->Length] = 0;
+        if ( !MakeRoom(Writer) )
+        {
+            return;
+        }
+
+        va_start(
+            Arguments,
+            Format
+            );
+        Length = vsnprintf(
+            Writer->Buffer,
+            Writer->Size,
+            Format,
+            Arguments
+            );
+        va_end(Arguments);
+        if ( Length >= 0 && (SIZE_T)Length >= Writer->Size )
+        {
+            Writer->Buffer[0] = 0;
+            Writer->Error = TRUE;
+            return;
+        }
+    }
+
+    if ( Length < 0 )
+    {
+        Writer->Buffer[Writer->Length] = 0;
+        Writer->Error = TRUE;
+        return;
+    }
+    Writer->Length += Length;
+}
+
+static SIZE_T
+GetSequenceLength(
+    IN PCUCHAR String,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine checks that a string starts with a well formed UTF-8
+    sequence, which rules out overlong forms, surrogates and code points
+    past U+10FFFF.
+
+Arguments:
+
+    String - The string, which starts with a byte of 0x80 or more.
+
+    Length - The length of the string.
+
+Return Value:
+
+    The length of the sequence, or 0 if it isn't well formed.
+
+--*/
+{
+    UCHAR Low;
+    UCHAR High;
+    SIZE_T Needed;
+    SIZE_T i;
+
+    Low = 0x80;
+    High = 0xBF;
+    if ( String[0] >= 0xC2 && String[0] <= 0xDF )
+    {
+        Needed = 2;
+    }
+    else if ( String[0] >= 0xE0 && String[0] <= 0xEF )
+    {
+        Needed = 3;
+        Low = String[0] == 0xE0 ? 0xA0 : 0x80;
+        High = String[0] == 0xED ? 0x9F : 0xBF;
+    }
+    else if ( String[0] >= 0xF0 && String[0] <= 0xF4 )
+    {
+        Needed = 4;
+        Low = String[0] == 0xF0 ? 0x90 : 0x80;
+        High = String[0] == 0xF4 ? 0x8F : 0xBF;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if ( Length < Needed || String[1] < Low || String[1] > High )
+    {
+        return 0;
+    }
+    for ( i = 2; i < Needed; i++ )
+    {
+        if ( (String[i] & 0xC0) != 0x80 )
+        {
+            return 0;
+        }
+    }
+
+    return Needed;
+}
+
+VOID
+JsonWriteStringLength(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR String,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine writes a string as a JSON string literal, quotes included.
+    Runs of characters that don't need escaping are copied at once. Control
+    characters are escaped, and bytes that aren't part of well formed UTF-8
+    become U+FFFD, so the output is valid JSON whatever the input was.
+
+Arguments:
+
+    Writer - The writer.
+
+    String - The string, which doesn't need to be NUL terminated.
+
+    Length - The length of the string.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    static const CHAR Hex[] = "0123456789abcdef";
+    PCUCHAR Next = (PCUCHAR)String;
+    PCUCHAR End = Next + Length;
+    PCUCHAR Run;
+    CHAR Escape[6];
+    SIZE_T Sequence;
+    UCHAR c;
+
+    JsonWriteRaw(
+        Writer,
+        "\"",
+        1
+        );
+    while ( Next < End && !Writer->Error )
+    {
+        Run = Next;
+        while ( Next < End && *Next >= 0x20 && *Next < 0x80 && *Next != '"' && *Next != '\\' )
+        {
+            Next++;
+        }
+        if ( Next > Run )
+        {
+            JsonWriteRaw(
+                Writer,
+                (PCCHAR)Run,
+                Next - Run
+                );
+        }
+        if ( Next == End )
+        {
+            break;
+        }
+
+        c = *Next;
+        if ( c >= 0x80 )
+        {
+            Sequence = GetSequenceLength(
+                Next,
+                End - Next
+                );
+            if ( Sequence )
+            {
+                JsonWriteRaw(
+                    Writer,
+                    (PCCHAR)Next,
+                    Sequence
+                    );
+                Next += Sequence;
+            }
+            else
+            {
+                JsonWriteRaw(
+                    Writer,
+                    "\\ufffd",
+                    6
+                    );
+                Next++;
+            }
+            continue;
+        }
+
+        Escape[0] = '\\';
+        switch ( c )
+        {
+        case '"':
+        case '\\':
+            Escape[1] = c;
+            break;
+        case '\b':
+            Escape[1] = 'b';
+            break;
+        case '\f':
+            Escape[1] = 'f';
+            break;
+        case '\n':
+            Escape[1] = 'n';
+            break;
+        case '\r':
+            Escape[1] = 'r';
+            break;
+        case '\t':
+            Escape[1] = 't';
+            break;
+        default:
+            Escape[1] = 'u';
+            Escape[2] = '0';
+            Escape[3] = '0';
+            Escape[4] = Hex[c >> 4];
+            Escape[5] = Hex[c & 0xF];
+            break;
+        }
+        JsonWriteRaw(
+            Writer,
+            Escape,
+            Escape[1] == 'u' ? 6 : 2
+            );
+        Next++;
+    }
+    JsonWriteRaw(
+        Writer,
+        "\"",
+        1
+        );
+}
+
+VOID
+JsonWriteString(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR String
+    )
+/*++
+
+Routine Description:
+
+    This routine writes a NUL terminated string as a JSON string literal.
+
+Arguments:
+
+    Writer - The writer.
+
+    String - The string.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    JsonWriteStringLength(
+        Writer,
+        String,
+        strlen(String)
+        );
+}
+
+BOOLEAN
+JsonWriterFlush(
+    IN OUT PJSON_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    This routine hands what's in the buffer to the sink and empties it. A
+    writer without a sink keeps its output in the buffer.
+
+Arguments:
+
+    Writer - The writer.
+
+Return Value:
+
+    TRUE - Everything written so far was taken.
+
+    FALSE - The writer failed.
+
+--*/
+{
+    if ( Writer->Sink && Writer->Length && !Writer->Error )
+    {
+        Writer->Error = !Writer->Sink(
+                            Writer->Context,
+                            Writer->Buffer,
+                            Writer->Length
+                            );
+        Writer->Length = 0;
+        Writer->Buffer[0] = 0;
+    }
+
+    return !Writer->Error;
+}
+
+BOOLEAN
+JsonSinkChunk(
+    IN PVOID Context,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine sends output as a chunk of a chunked response. A writer
+    never flushes an empty buffer, so it can't end the response by accident.
+
+Arguments:
+
+    Context - The connection.
+
+    Data - The output.
+
+    Length - The length of the output.
+
+Return Value:
+
+    TRUE.
+
+--*/
+{
+    mg_http_write_chunk(
+        Context,
+        Data,
+        Length
+        );
+    return TRUE;
+}
+
+BOOLEAN
+JsonSinkFile(
+    IN PVOID Context,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine writes output to a FILE.
+
+Arguments:
+
+    Context - The FILE.
+
+    Data - The output.
+
+    Length - The length of the output.
+
+Return Value:
+
+    TRUE - The output was written.
+
+    FALSE - The write failed.
+
+--*/
+{
+    return fwrite(
+               Data,
+               1,
+               Length,
+               Context
+               ) == Length;
+}
+
+// Allocations cJSON made while it was being benchmarked
+static UINT64 BenchmarkAllocations;
+
+static PVOID
+CountingMalloc(
+    IN SIZE_T Size
+    )
+/*++
+
+Routine Description:
+
+    This routine counts an allocation by cJSON and makes it with malloc.
+
+Arguments:
+
+    Size - The size of the allocation.
+
+Return Value:
+
+    The memory, or NULL if it couldn't be allocated.
+
+--*/
+{
+    BenchmarkAllocations++;
+    return malloc(Size);
+}
+
+INT
+JsonBenchmark(
+    IN UINT32 Iterations
+    )
+/*++
+
+Routine Description:
+
+    This routine builds the same values:append body, JSON_BENCHMARK_ROWS
+    rows of a timestamp, number and name, with cJSON and with the writer a
+    number of times, and prints the time and allocations per body. Some of
+    the names need escaping, and the two bodies are checked to be the same.
+
+Arguments:
+
+    Iterations - The number of bodies to build each way.
+
+Return Value:
+
+    0 - The benchmark ran.
+
+    ENOMEM - Memory couldn't be allocated.
+
+--*/
+{
+    static PCCHAR Names[] = {
+        "Ada Lovelace", "Grace \"Amazing\" Hopper", "Zoë Núñez",
+        "Back\\Slash", "Tab\tSeparated", "Ōkubo Toshimichi", "李小龍",
+        "Line\nBreak"
+    };
+    cJSON_Hooks Hooks = {
+        CountingMalloc,
+        free
+    };
+    CHAR Timestamp[32];
+    CHAR Number[16];
+    JSON_WRITER Writer;
+    cJSON* Root;
+    cJSON* Values;
+    cJSON* Row;
+    PCHAR Printed;
+    PCHAR Buffer;
+    SIZE_T Size;
+    UINT64 Start;
+    UINT64 CjsonTime;
+    UINT64 WriterTime;
+    UINT32 Iteration;
+    UINT32 i;
+    BOOLEAN Same;
+
+    Iterations = MAX(Iterations, 1);
+    Size = JSON_BENCHMARK_ROWS * (ROSTER_NAME_SIZE * 6 + 64) + 16;
+    Buffer = malloc(Size);
+    if ( !Buffer )
+    {
+        return ENOMEM;
+    }
+    cJSON_InitHooks(&Hooks);
+
+    Printed = NULL;
+    Start = TraceNow();
+    for ( Iteration = 0; Iteration < Iterations; Iteration++ )
+    {
+        cJSON_free(Printed);
+        Root = cJSON_CreateObject();
+        Values = cJSON_AddArrayToObject(
+            Root,
+            "values"
+            );
+        for ( i = 0; i < JSON_BENCHMARK_ROWS; i++ )
+        {
+            snprintf(
+                Timestamp,
+                ARRAY_SIZE(Timestamp),
+                "2022-10-%02u 18:%02u:%02u",
+                i % 28 + 1,
+                i / 60 % 60,
+                i % 60
+                );
+            snprintf(
+                Number,
+                ARRAY_SIZE(Number),
+                "%09u",
+                100000000 + i
+                );
+            Row = cJSON_CreateArray();
+            cJSON_AddItemToArray(
+                Row,
+                cJSON_CreateString(Timestamp)
+                );
+            cJSON_AddItemToArray(
+                Row,
+                cJSON_CreateString(Number)
+                );
+            cJSON_AddItemToArray(
+                Row,
+                cJSON_CreateString(Names[i % ARRAY_SIZE(Names)])
+                );
+            cJSON_AddItemToArray(
+                Values,
+                Row
+                );
+        }
+        Printed = cJSON_PrintUnformatted(Root);
+        cJSON_Delete(Root);
+    }
+    CjsonTime = TraceNow() - Start;
+    cJSON_InitHooks(NULL);
+
+    Start = TraceNow();
+    for ( Iteration = 0; Iteration < Iterations; Iteration++ )
+    {
+        JsonWriterInitialize(
+            &Writer,
+            Buffer,
+            Size,
+            NULL,
+            NULL
+            );
+        JsonWriteRaw(
+            &Writer,
+            "{\"values\":[",
+            11
+            );
+        for ( i = 0; i < JSON_BENCHMARK_ROWS; i++ )
+        {
+            JsonWritef(
+                &Writer,
+                "%s[\"2022-10-%02u 18:%02u:%02u\",\"%09u\",",
+                i ? "," : "",
+                i % 28 + 1,
+                i / 60 % 60,
+                i % 60,
+                100000000 + i
+                );
+            JsonWriteString(
+                &Writer,
+                Names[i % ARRAY_SIZE(Names)]
+                );
+            JsonWriteRaw(
+                &Writer,
+                "]",
+                1
+                );
+        }
+        JsonWriteRaw(
+            &Writer,
+            "]}",
+            2
+            );
+    }
+    WriterTime = TraceNow() - Start;
+
+    Same = Printed && !Writer.Error && strcmp(Printed, Buffer) == 0;
+    printf(
+        "%u bodies of %u rows, %zu bytes each\n",
+        Iterations,
+        JSON_BENCHMARK_ROWS,
+        Writer.Length
+        );
+    printf(
+        "%-8s %12s %12s %12s\n",
+        "",
+        "us/body",
+        "MB/s",
+        "allocs/body"
+        );
+    printf(
+        "%-8s %12.1f %12.1f %12.1f\n",
+        "cJSON",
+        (DOUBLE)CjsonTime / Iterations,
+        CjsonTime ? (DOUBLE)Writer.Length * Iterations / CjsonTime : 0.0,
+        (DOUBLE)BenchmarkAllocations / Iterations
+        );
+    printf(
+        "%-8s %12.1f %12.1f %12.1f\n",
+        "writer",
+        (DOUBLE)WriterTime / Iterations,
+        WriterTime ? (DOUBLE)Writer.Length * Iterations / WriterTime : 0.0,
+        0.0
+        );
+    printf(
+        "Output %s\n",
+        Same ? "matches" : "differs"
+        );
+
+    free(Printed);
+    free(Buffer);
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    json.h
+
+Abstract:
+
+    This module contains definitions for the incremental JSON tokenizer,
+    which turns JSON into a stream of tokens as it arrives, without needing
+    the whole document in memory, and the streaming JSON writer, which
+    does the opposite for outgoing JSON.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Maximum nesting depth
+//
+
+#define JSON_MAX_DEPTH 32
+
+//
+// Maximum length of a string, number or literal. Longer ones make the
+// document invalid.
+//
+
+#define JSON_MAX_TOKEN 1024
+
+//
+// Token types
+//
+
+typedef enum _JSON_TOKEN_TYPE
+{
+    JsonTokenObjectStart,
+    JsonTokenObjectEnd,
+    JsonTokenArrayStart,
+    JsonTokenArrayEnd,
+    JsonTokenKey,
+    JsonTokenString,
+    JsonTokenNumber,
+    JsonTokenTrue,
+    JsonTokenFalse,
+    JsonTokenNull
+} JSON_TOKEN_TYPE;
+
+//
+// Called for each token. Depth is the number of containers around the
+// token, so a container's start and end have the same depth. Returning
+// FALSE stops tokenizing.
+//
+
+typedef BOOLEAN (*PJSON_TOKEN_CALLBACK)(
+    IN PVOID Context,
+    IN JSON_TOKEN_TYPE Type,
+    IN PCCHAR Value,
+    IN SIZE_T Length,
+    IN UINT32 Depth
+    );
+
+//
+// Tokenizer states
+//
+
+typedef enum _JSON_STATE
+{
+    JsonStateValue,
+    JsonStateString,
+    JsonStateEscape,
+    JsonStateUnicode,
+    JsonStateNumber,
+    JsonStateLiteral
+} JSON_STATE;
+
+//
+// Tokenizer
+//
+
+typedef struct _JSON_TOKENIZER
+{
+    PJSON_TOKEN_CALLBACK Callback;
+    PVOID Context;
+    JSON_STATE State;
+    UINT32 Depth;
+    BOOLEAN InObject[JSON_MAX_DEPTH];
+    BOOLEAN ExpectKey;
+    BOOLEAN Error;
+    UINT32 Unicode;
+    UINT32 HighSurrogate;
+    UINT8 UnicodeDigits;
+    SIZE_T TokenLength;
+    CHAR Token[JSON_MAX_TOKEN + 1];
+} JSON_TOKENIZER, *PJSON_TOKENIZER;
+
+//
+// Set up a tokenizer
+//
+
+VOID
+JsonTokenizerInitialize(
+    OUT PJSON_TOKENIZER Tokenizer,
+    IN PJSON_TOKEN_CALLBACK Callback,
+    IN PVOID Context OPTIONAL
+    );
+
+//
+// Tokenize the next part of a document
+//
+
+BOOLEAN
+JsonTokenizerFeed(
+    IN OUT PJSON_TOKENIZER Tokenizer,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    );
+
+//
+// Size of the buffer writers that stream their output usually get
+//
+
+#define JSON_WRITER_BUFFER_SIZE 4096
+
+//
+// Rows in each body the benchmark builds
+//
+
+#define JSON_BENCHMARK_ROWS 500
+
+//
+// Takes a writer's buffered output when it fills up or is flushed.
+// Returning FALSE stops writing.
+//
+
+typedef BOOLEAN (*PJSON_WRITER_SINK)(
+    IN PVOID Context,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    );
+
+//
+// Writer. The buffer is the caller's, and is always NUL terminated.
+//
+
+typedef struct _JSON_WRITER
+{
+    PCHAR Buffer;
+    SIZE_T Size;
+    SIZE_T Length;
+    PJSON_WRITER_SINK Sink;
+    PVOID Context;
+    BOOLEAN Error;
+} JSON_WRITER, *PJSON_WRITER;
+
+//
+// Set up a writer, which fails once its buffer is full if it has no sink
+//
+
+VOID
+JsonWriterInitialize(
+    OUT PJSON_WRITER Writer,
+    OUT PCHAR Buffer,
+    IN SIZE_T Size,
+    IN PJSON_WRITER_SINK Sink OPTIONAL,
+    IN PVOID Context OPTIONAL
+    );
+
+//
+// Write text as it is
+//
+
+VOID
+JsonWriteRaw(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    );
+
+//
+// Write formatted text as it is
+//
+
+VOID
+JsonWritef(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR Format,
+    ...
+    );
+
+//
+// Write a string as a JSON string literal
+//
+
+VOID
+JsonWriteString(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR String
+    );
+
+//
+// Write part of a string as a JSON string literal
+//
+
+VOID
+JsonWriteStringLength(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR String,
+    IN SIZE_T Length
+    );
+
+//
+// Hand what's buffered to the sink
+//
+
+BOOLEAN
+JsonWriterFlush(
+    IN OUT PJSON_WRITER Writer
+    );
+
+//
+// Sink that sends output as chunks of a chunked response on a connection
+//
+
+BOOLEAN
+JsonSinkChunk(
+    IN PVOID Context,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    );
+
+//
+// Sink that writes output to a FILE
+//
+
+BOOLEAN
+JsonSinkFile(
+    IN PVOID Context,
+    IN PCCHAR Data,
+    IN SIZE_T Length
+    );
+
+//
+// Compare building Sheets bodies with the writer and with cJSON
+//
+
+INT
+JsonBenchmark(
+    IN UINT32 Iterations
+    );
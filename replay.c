@@ -0,0 +1,530 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    replay.c
+
+Abstract:
+
+    This module implements replaying a capture file against a server. Each
+    request is sent when it arrived in the capture, relative to the first,
+    divided by the speed, so the gaps between requests are kept but
+    shortened. At max speed requests are sent as fast as connections free
+    up. Requests captured with an Idempotency-Key header are sent with it
+    again, so retries are replayed as retries.
+
+    Latency is measured from when a request was due rather than when it was
+    sent, so a server falling behind shows up as latency instead of as the
+    replay slowing down to match it. Each request gets its own connection,
+    like the browsers and scanners at an event.
+
+--*/
+
+#include "server.h"
+
+typedef struct _REPLAY_REQUEST
+{
+    UINT64 Time;
+    PCHAR Target;
+    CHAR Method[16];
+    CHAR IdempotencyKey[IDEMPOTENCY_KEY_SIZE];
+} REPLAY_REQUEST, *PREPLAY_REQUEST;
+
+//
+// A request that's been sent
+//
+
+typedef struct _REPLAY_SENT
+{
+    UINT32 Request;
+    UINT64 Due;
+    BOOLEAN Answered;
+} REPLAY_SENT, *PREPLAY_SENT;
+
+static PREPLAY_REQUEST Requests;
+static UINT32 RequestCount;
+static PCCHAR ReplayUrl;
+static PUINT64 Latencies;
+static UINT32 LatencyCount;
+static UINT32 InFlight;
+static UINT32 Completed;
+static UINT32 Failed;
+static UINT32 StatusCounts[6];
+
+static BOOLEAN
+LoadCapture(
+    IN PCCHAR Path
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the requests in a capture file. Lines that aren't a
+    captured request are skipped.
+
+Arguments:
+
+    Path - The capture file.
+
+Return Value:
+
+    TRUE - The requests were read.
+
+    FALSE - The file couldn't be read, or had no requests in it.
+
+--*/
+{
+    CHAR Line[REPLAY_LINE_SIZE];
+    PREPLAY_REQUEST NewRequests;
+    PREPLAY_REQUEST Request;
+    cJSON* Root;
+    cJSON* Time;
+    cJSON* Method;
+    cJSON* Uri;
+    cJSON* Query;
+    cJSON* Key;
+    FILE* File;
+    SIZE_T Length;
+    UINT32 Capacity;
+
+    File = fopen(
+        Path,
+        "rb"
+        );
+    if ( !File )
+    {
+        LOG("Failed to open capture file %s: %s (errno %d)\n", Path, ERRNO_STRING());
+        return FALSE;
+    }
+
+    Capacity = 0;
+    while ( fgets(
+                Line,
+                ARRAY_SIZE(Line),
+                File
+                ) )
+    {
+        Root = cJSON_Parse(Line);
+        Time = cJSON_GetObjectItem(
+            Root,
+            "time"
+            );
+        Method = cJSON_GetObjectItem(
+            Root,
+            "method"
+            );
+        Uri = cJSON_GetObjectItem(
+            Root,
+            "uri"
+            );
+        Query = cJSON_GetObjectItem(
+            Root,
+            "query"
+            );
+        Key = cJSON_GetObjectItem(
+            Root,
+            "idempotency_key"
+            );
+        if ( !cJSON_IsNumber(Time) || !cJSON_IsString(Uri) )
+        {
+            cJSON_Delete(Root);
+            continue;
+        }
+
+        if ( RequestCount == Capacity )
+        {
+            Capacity = Capacity ? Capacity * 2 : 1024;
+            NewRequests = realloc(
+                Requests,
+                Capacity * sizeof(REPLAY_REQUEST)
+                );
+            if ( !NewRequests )
+            {
+                LOG("Failed to allocate %u requests: %s (errno %d)\n", Capacity, ERRNO_STRING());
+                cJSON_Delete(Root);
+                break;
+            }
+            Requests = NewRequests;
+        }
+
+        Request = &Requests[RequestCount];
+        Request->Time = (UINT64)Time->valuedouble;
+        snprintf(
+            Request->Method,
+            ARRAY_SIZE(Request->Method),
+            "%s",
+            cJSON_IsString(Method) ? Method->valuestring : "GET"
+            );
+
+        // Only keys that fit on one header line are sent again
+        Request->IdempotencyKey[0] = 0;
+        if ( cJSON_IsString(Key) &&
+             strlen(Key->valuestring) < ARRAY_SIZE(Request->IdempotencyKey) &&
+             !Key->valuestring[strcspn(Key->valuestring, "\r\n")] )
+        {
+            strcpy(
+                Request->IdempotencyKey,
+                Key->valuestring
+                );
+        }
+
+        Length = strlen(Uri->valuestring) + 2 +
+                 (cJSON_IsString(Query) ? strlen(Query->valuestring) : 0);
+        Request->Target = malloc(Length);
+        if ( Request->Target )
+        {
+            snprintf(
+                Request->Target,
+                Length,
+                "%s%s%s",
+                Uri->valuestring,
+                cJSON_IsString(Query) && Query->valuestring[0] ? "?" : "",
+                cJSON_IsString(Query) ? Query->valuestring : ""
+                );
+            RequestCount++;
+        }
+        cJSON_Delete(Root);
+    }
+    fclose(File);
+
+    if ( !RequestCount )
+    {
+        LOG("No requests in capture file %s\n", Path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static VOID
+HandleReplayEvent(
+    IN struct mg_connection* Connection,
+    IN INT Event,
+    IN PVOID EventData,
+    IN PVOID Data
+    )
+/*++
+
+Routine Description:
+
+    This routine sends a request once its connection is open, and records
+    how long the response took.
+
+Arguments:
+
+    Connection - The connection.
+
+    Event - The event.
+
+    EventData - Data for the event.
+
+    Data - The REPLAY_SENT for the request.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PREPLAY_SENT Sent = Data;
+    PREPLAY_REQUEST Request = &Requests[Sent->Request];
+    struct mg_str Host;
+    INT Status;
+
+    if ( Event == MG_EV_CONNECT )
+    {
+        Host = mg_url_host(ReplayUrl);
+        if ( mg_url_is_ssl(ReplayUrl) )
+        {
+            // Certificates aren't checked, since test servers use their own
+            struct mg_tls_opts TlsOptions = {
+                .srvname = Host
+            };
+
+            mg_tls_init(
+                Connection,
+                &TlsOptions
+                );
+        }
+
+        mg_printf(
+            Connection,
+            "%s %s HTTP/1.1\r\n"
+            "Host: %.*s\r\n"
+            "%s%s%s"
+            "Connection: close\r\n"
+            "\r\n",
+            Request->Method,
+            Request->Target,
+            (INT)Host.len,
+            Host.ptr,
+            Request->IdempotencyKey[0] ? "Idempotency-Key: " : "",
+            Request->IdempotencyKey,
+            Request->IdempotencyKey[0] ? "\r\n" : ""
+            );
+    }
+    else if ( Event == MG_EV_HTTP_MSG )
+    {
+        Latencies[LatencyCount++] = TraceNow() - Sent->Due;
+        Sent->Answered = TRUE;
+
+        Status = mg_http_status((struct mg_http_message*)EventData);
+        StatusCounts[CLAMP(Status / 100, 0, 5)]++;
+        Connection->is_closing = 1;
+    }
+    else if ( Event == MG_EV_POLL )
+    {
+        if ( TraceNow() - Sent->Due > REPLAY_TIMEOUT * 1000ull )
+        {
+            Connection->is_closing = 1;
+        }
+    }
+    else if ( Event == MG_EV_CLOSE )
+    {
+        if ( !Sent->Answered )
+        {
+            Failed++;
+        }
+        Completed++;
+        InFlight--;
+        free(Sent);
+    }
+}
+
+static INT
+CompareLatencies(
+    IN PCVOID First,
+    IN PCVOID Second
+    )
+/*++
+
+Routine Description:
+
+    This routine compares two latencies.
+
+Arguments:
+
+    First - The first latency.
+
+    Second - The second latency.
+
+Return Value:
+
+    Less than, equal to or greater than 0 as First is less than, equal to
+    or greater than Second.
+
+--*/
+{
+    UINT64 Left = *(const UINT64*)First;
+    UINT64 Right = *(const UINT64*)Second;
+
+    return (Left > Right) - (Left < Right);
+}
+
+static DOUBLE
+Percentile(
+    IN DOUBLE Fraction
+    )
+/*++
+
+Routine Description:
+
+    This routine finds a percentile of the sorted latencies.
+
+Arguments:
+
+    Fraction - The percentile, from 0 to 1.
+
+Return Value:
+
+    The latency, in milliseconds.
+
+--*/
+{
+    UINT32 Position;
+
+    if ( !LatencyCount )
+    {
+        return 0;
+    }
+
+    Position = (UINT32)(Fraction * (LatencyCount - 1) + 0.5);
+    return Latencies[Position] / 1000.0;
+}
+
+INT
+ReplayRun(
+    IN PCCHAR Path,
+    IN PCCHAR Url,
+    IN PCCHAR Speed
+    )
+/*++
+
+Routine Description:
+
+    This routine replays a capture file against a server, keeping up to
+    REPLAY_MAX_IN_FLIGHT requests open at once, and prints how many
+    requests got each class of status and the latency percentiles.
+
+Arguments:
+
+    Path - The capture file.
+
+    Url - The server, like https://localhost:443.
+
+    Speed - How many times faster than captured to send requests, with an
+            optional x after it, or max to send them as fast as possible.
+
+Return Value:
+
+    0 - The capture was replayed.
+
+    EINVAL - The speed was invalid.
+
+    EIO - The capture couldn't be read.
+
+--*/
+{
+    struct mg_mgr Manager;
+    struct mg_connection* Connection;
+    PREPLAY_SENT Sent;
+    DOUBLE Factor;
+    UINT64 Start;
+    UINT64 Due;
+    UINT64 Now;
+    UINT64 Elapsed;
+    UINT32 Next;
+    UINT32 i;
+    INT Timeout;
+
+    if ( strcmp(Speed, "max") == 0 )
+    {
+        Factor = 0;
+    }
+    else
+    {
+        Factor = strtod(
+            Speed,
+            NULL
+            );
+        if ( Factor <= 0 )
+        {
+            LOG("Invalid replay speed %s, expected a number or max\n", Speed);
+            return EINVAL;
+        }
+    }
+
+    if ( !LoadCapture(Path) )
+    {
+        return EIO;
+    }
+    Latencies = malloc(RequestCount * sizeof(UINT64));
+    if ( !Latencies )
+    {
+        return ENOMEM;
+    }
+
+    LOG("Replaying %u requests from %s against %s at %s speed\n", RequestCount, Path, Url, Speed);
+    ReplayUrl = Url;
+    mg_mgr_init(&Manager);
+
+    Start = TraceNow();
+    Next = 0;
+    while ( Completed < RequestCount )
+    {
+        Now = TraceNow();
+        while ( Next < RequestCount && InFlight < REPLAY_MAX_IN_FLIGHT )
+        {
+            // Captures from more than one run can go back in time
+            Due = Now;
+            if ( Factor )
+            {
+                Due = Start + (UINT64)((DOUBLE)(MAX(Requests[Next].Time, Requests[0].Time) - Requests[0].Time) / Factor);
+                if ( Due > Now )
+                {
+                    break;
+                }
+            }
+
+            Sent = calloc(
+                1,
+                sizeof(REPLAY_SENT)
+                );
+            if ( !Sent )
+            {
+                break;
+            }
+            Sent->Request = Next++;
+            Sent->Due = Due;
+
+            Connection = mg_http_connect(
+                &Manager,
+                Url,
+                HandleReplayEvent,
+                Sent
+                );
+            if ( !Connection )
+            {
+                free(Sent);
+                Failed++;
+                Completed++;
+                continue;
+            }
+            InFlight++;
+        }
+
+        // Wake up in time for the next request
+        Timeout = 50;
+        if ( Factor && Next < RequestCount && InFlight < REPLAY_MAX_IN_FLIGHT )
+        {
+            Due = Start + (UINT64)((DOUBLE)(MAX(Requests[Next].Time, Requests[0].Time) - Requests[0].Time) / Factor);
+            Timeout = (INT)MIN(Due > Now ? (Due - Now) / 1000 : 0, 50);
+        }
+        mg_mgr_poll(
+            &Manager,
+            Timeout
+            );
+    }
+    Elapsed = MAX(TraceNow() - Start, 1);
+    mg_mgr_free(&Manager);
+
+    qsort(
+        Latencies,
+        LatencyCount,
+        sizeof(UINT64),
+        CompareLatencies
+        );
+
+    printf(
+        "%u requests in %.2fs (%.1f/s), %u failed\n",
+        RequestCount,
+        Elapsed / 1e6,
+        RequestCount * 1e6 / Elapsed,
+        Failed
+        );
+    printf(
+        "1xx %u, 2xx %u, 3xx %u, 4xx %u, 5xx %u\n",
+        StatusCounts[1],
+        StatusCounts[2],
+        StatusCounts[3],
+        StatusCounts[4],
+        StatusCounts[5]
+        );
+    printf(
+        "latency ms: p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+        Percentile(0.5),
+        Percentile(0.9),
+        Percentile(0.99),
+        Percentile(0.999),
+        Percentile(1)
+        );
+
+    for ( i = 0; i < RequestCount; i++ )
+    {
+        free(Requests[i].Target);
+    }
+    free(Requests);
+    free(Latencies);
+    return 0;
+}
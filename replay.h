@@ -0,0 +1,48 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    replay.h
+
+Abstract:
+
+    This module contains definitions for replaying captured requests
+    against a server.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Most requests waiting on responses at once
+//
+
+#define REPLAY_MAX_IN_FLIGHT 256
+
+//
+// Milliseconds a request gets before it's counted as failed
+//
+
+#define REPLAY_TIMEOUT 30000
+
+//
+// Longest line read from a capture file
+//
+
+#define REPLAY_LINE_SIZE 8192
+
+//
+// Replay a capture file against a server at a speed, like 1, 10x or max,
+// and print the latencies
+//
+
+INT
+ReplayRun(
+    IN PCCHAR Path,
+    IN PCCHAR Url,
+    IN PCCHAR Speed
+    );
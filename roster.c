@@ -0,0 +1,685 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    roster.c
+
+Abstract:
+
+    This module implements the team roster. Members are stored in an array
+    indexed by a dense ID, and an open addressing hash table maps member
+    numbers to those IDs.
+
+--*/
+
+#include "server.h"
+
+PCHAR RosterPath;
+PCHAR RosterRange;
+
+static PROSTER_MEMBER Members;
+static UINT32 MemberCount;
+static UINT32 MemberCapacity;
+
+//
+// Hash table slots hold a dense ID plus one, so zero means empty
+//
+
+static PUINT32 Slots;
+static UINT32 SlotCount;
+
+//
+// Members read by a sync, waiting for the main thread to apply them
+//
+
+typedef struct _ROSTER_SYNC
+{
+    PROSTER_MEMBER Members;
+    UINT32 Count;
+    UINT32 Capacity;
+    UINT32 Row;
+    UINT32 Number;
+} ROSTER_SYNC, *PROSTER_SYNC;
+
+static MUTEX SyncLock = MUTEX_INITIALIZER;
+static BOOLEAN SyncInProgress;
+static PROSTER_SYNC CompletedSync;
+static time_t NextSync;
+
+static UINT32
+HashNumber(
+    IN UINT32 Number
+    )
+/*++
+
+Routine Description:
+
+    This routine mixes the bits of a member number.
+
+Arguments:
+
+    Number - The member number.
+
+Return Value:
+
+    The hash of the number.
+
+--*/
+{
+    Number ^= Number >> 16;
+    Number *= 0x45D9F3B;
+    Number ^= Number >> 16;
+    return Number;
+}
+
+static BOOLEAN
+GrowSlots(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine doubles the size of the hash table and reinserts every member.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The table was resized.
+
+    FALSE - Memory couldn't be allocated.
+
+--*/
+{
+    PUINT32 NewSlots;
+    UINT32 NewSlotCount;
+    UINT32 Slot;
+    UINT32 i;
+
+    NewSlotCount = SlotCount ? SlotCount * 2 : 256;
+    NewSlots = calloc(
+        NewSlotCount,
+        sizeof(UINT32)
+        );
+    if ( !NewSlots )
+    {
+        LOG("Failed to allocate %u roster slots: %s (errno %d)\n", NewSlotCount, ERRNO_STRING());
+        return FALSE;
+    }
+
+    for ( i = 0; i < MemberCount; i++ )
+    {
+        Slot = HashNumber(Members[i].Number) & (NewSlotCount - 1);
+        while ( NewSlots[Slot] )
+        {
+            Slot = (Slot + 1) & (NewSlotCount - 1);
+        }
+        NewSlots[Slot] = i + 1;
+    }
+
+    free(Slots);
+    Slots = NewSlots;
+    SlotCount = NewSlotCount;
+    return TRUE;
+}
+
+UINT32
+RosterFindMember(
+    IN UINT32 Number
+    )
+/*++
+
+Routine Description:
+
+    This routine looks up the dense ID of a member.
+
+Arguments:
+
+    Number - The member number.
+
+Return Value:
+
+    The member's ID, or ROSTER_INVALID_ID if they aren't in the roster.
+
+--*/
+{
+    UINT32 Slot;
+
+    if ( !SlotCount )
+    {
+        return ROSTER_INVALID_ID;
+    }
+
+    Slot = HashNumber(Number) & (SlotCount - 1);
+    while ( Slots[Slot] )
+    {
+        if ( Members[Slots[Slot] - 1].Number == Number )
+        {
+            return Slots[Slot] - 1;
+        }
+        Slot = (Slot + 1) & (SlotCount - 1);
+    }
+
+    return ROSTER_INVALID_ID;
+}
+
+UINT32
+RosterInternMember(
+    IN UINT32 Number,
+    IN PCCHAR Name OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the dense ID of a member, adding them to the roster if
+    they aren't already in it.
+
+Arguments:
+
+    Number - The member number.
+
+    Name - The member's name, used if they're added.
+
+Return Value:
+
+    The member's ID, or ROSTER_INVALID_ID if they couldn't be added, or the
+    roster is full.
+
+--*/
+{
+    PROSTER_MEMBER NewMembers;
+    UINT32 NewCapacity;
+    UINT32 Id;
+    UINT32 Slot;
+
+    Id = RosterFindMember(Number);
+    if ( Id != ROSTER_INVALID_ID )
+    {
+        return Id;
+    }
+
+    if ( MemberCount >= ROSTER_MAX_MEMBERS )
+    {
+        LOG("Roster is full, not adding %u\n", Number);
+        return ROSTER_INVALID_ID;
+    }
+
+    if ( (MemberCount + 1) * 2 > SlotCount && !GrowSlots() )
+    {
+        return ROSTER_INVALID_ID;
+    }
+
+    if ( MemberCount >= MemberCapacity )
+    {
+        NewCapacity = MemberCapacity ? MemberCapacity * 2 : 64;
+        NewMembers = realloc(
+            Members,
+            NewCapacity * sizeof(ROSTER_MEMBER)
+            );
+        if ( !NewMembers )
+        {
+            LOG("Failed to allocate %u roster members: %s (errno %d)\n", NewCapacity, ERRNO_STRING());
+            return ROSTER_INVALID_ID;
+        }
+        Members = NewMembers;
+        MemberCapacity = NewCapacity;
+    }
+
+    Id = MemberCount++;
+    Members[Id].Number = Number;
+    Members[Id].Name[0] = 0;
+    if ( Name )
+    {
+        strncpy(
+            Members[Id].Name,
+            Name,
+            ARRAY_SIZE(Members[Id].Name) - 1
+            );
+        Members[Id].Name[ARRAY_SIZE(Members[Id].Name) - 1] = 0;
+    }
+
+    Slot = HashNumber(Number) & (SlotCount - 1);
+    while ( Slots[Slot] )
+    {
+        Slot = (Slot + 1) & (SlotCount - 1);
+    }
+    Slots[Slot] = Id + 1;
+
+    return Id;
+}
+
+PCROSTER_MEMBER
+RosterGetMember(
+    IN UINT32 Id
+    )
+/*++
+
+Routine Description:
+
+    This routine gets a member by their dense ID.
+
+Arguments:
+
+    Id - The member's ID.
+
+Return Value:
+
+    The member, or NULL if the ID is out of range.
+
+--*/
+{
+    return Id < MemberCount ? &Members[Id] : NULL;
+}
+
+UINT32
+RosterGetMemberCount(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the number of members in the roster.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of members, which is also one past the highest dense ID.
+
+--*/
+{
+    return MemberCount;
+}
+
+BOOLEAN
+RosterLoad(
+    IN PCCHAR Path
+    )
+/*++
+
+Routine Description:
+
+    This routine loads a roster CSV file. Each line is a member number
+    followed by a comma and the member's name. Lines that don't start with a
+    number, such as a header, are skipped.
+
+Arguments:
+
+    Path - The path to the roster file.
+
+Return Value:
+
+    TRUE - The roster was loaded.
+
+    FALSE - The roster couldn't be loaded.
+
+--*/
+{
+    FILE* RosterFile;
+    CHAR Line[256];
+    PCHAR Name;
+    PCHAR End;
+    UINT32 Number;
+    UINT32 Count;
+
+    LOG("Loading roster %s\n", Path);
+    RosterFile = fopen(
+        Path,
+        "r"
+        );
+    if ( !RosterFile )
+    {
+        LOG("Failed to open roster \"%s\": %s (errno %d)\n", Path, ERRNO_STRING());
+        return FALSE;
+    }
+
+    Count = 0;
+    while ( fgets(
+                Line,
+                ARRAY_SIZE(Line),
+                RosterFile
+                ) )
+    {
+        Number = strtoul(
+            Line,
+            &End,
+            10
+            );
+        if ( End == Line || *End != ',' )
+        {
+            continue;
+        }
+
+        Name = End + 1;
+        Name[strcspn(Name, "\r\n")] = 0;
+        if ( *Name == '"' )
+        {
+            Name++;
+            if ( strlen(Name) && Name[strlen(Name) - 1] == '"' )
+            {
+                Name[strlen(Name) - 1] = 0;
+            }
+        }
+
+        if ( RosterInternMember(
+                 Number,
+                 Name
+                 ) == ROSTER_INVALID_ID )
+        {
+            fclose(RosterFile);
+            return FALSE;
+        }
+        Count++;
+    }
+
+    fclose(RosterFile);
+    LOG("Loaded %u members from roster\n", Count);
+    return TRUE;
+}
+
+VOID
+RosterFree(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the roster.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    free(Slots);
+    free(Members);
+    Slots = NULL;
+    Members = NULL;
+    SlotCount = 0;
+    MemberCount = 0;
+    MemberCapacity = 0;
+}
+
+static BOOLEAN
+CollectMember(
+    IN PVOID Context,
+    IN UINT32 Row,
+    IN UINT32 Column,
+    IN PCCHAR Value,
+    IN SIZE_T Length
+    )
+/*++
+
+Routine Description:
+
+    This routine collects a member from the roster range. The first column
+    is the member number and the second is their name.
+
+Arguments:
+
+    Context - The ROSTER_SYNC.
+
+    Row - The row of the cell.
+
+    Column - The column of the cell.
+
+    Value - The cell's value.
+
+    Length - The length of the value.
+
+Return Value:
+
+    TRUE - Reading should continue.
+
+    FALSE - Memory couldn't be allocated.
+
+--*/
+{
+    PROSTER_SYNC Sync = Context;
+    PROSTER_MEMBER NewMembers;
+    UINT32 NewCapacity;
+
+    (Length);
+
+    if ( Column == 0 )
+    {
+        Sync->Row = Row;
+        Sync->Number = strtoul(
+            Value,
+            NULL,
+            10
+            );
+        return TRUE;
+    }
+
+    if ( Column != 1 || Sync->Row != Row || !Sync->Number )
+    {
+        return TRUE;
+    }
+
+    if ( Sync->Count >= Sync->Capacity )
+    {
+        NewCapacity = Sync->Capacity ? Sync->Capacity * 2 : 256;
+        NewMembers = realloc(
+            Sync->Members,
+            NewCapacity * sizeof(ROSTER_MEMBER)
+            );
+        if ( !NewMembers )
+        {
+            LOG("Failed to allocate %u synced members: %s (errno %d)\n", NewCapacity, ERRNO_STRING());
+            return FALSE;
+        }
+        Sync->Members = NewMembers;
+        Sync->Capacity = NewCapacity;
+    }
+
+    Sync->Members[Sync->Count].Number = Sync->Number;
+    strncpy(
+        Sync->Members[Sync->Count].Name,
+        Value,
+        ROSTER_NAME_SIZE - 1
+        );
+    Sync->Members[Sync->Count].Name[ROSTER_NAME_SIZE - 1] = 0;
+    Sync->Count++;
+    return TRUE;
+}
+
+static VOID
+RosterSyncTask(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the roster range and hands the members to the main
+    thread.
+
+Arguments:
+
+    Parameter - Not used.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PROSTER_SYNC Sync;
+    BOOLEAN Read;
+
+    (Parameter);
+
+    Sync = calloc(
+        1,
+        sizeof(ROSTER_SYNC)
+        );
+    Read = Sync && SheetsGetValues(
+                       SpreadsheetId,
+                       RosterRange,
+                       CollectMember,
+                       Sync
+                       );
+    if ( !Read && Sync )
+    {
+        free(Sync->Members);
+        free(Sync);
+        Sync = NULL;
+    }
+
+    MutexLock(&SyncLock);
+    CompletedSync = Sync;
+    NextSync = time(NULL) + (Read ? ROSTER_SYNC_INTERVAL : TOKEN_RETRY_DELAY);
+    SyncInProgress = FALSE;
+    MutexUnlock(&SyncLock);
+}
+
+time_t
+RosterGetNextSync(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets when RosterPollSync next has something to do. A sync
+    that's running or waiting on an access token wakes the loop when it's
+    done, so it has no deadline.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The time the next sync is due, or 0 if there's nothing to wait for.
+
+--*/
+{
+    CHAR AccessToken[256];
+    time_t Next;
+
+    if ( !RosterRange )
+    {
+        return 0;
+    }
+
+    MutexLock(&SyncLock);
+    Next = SyncInProgress ? 0 : MAX(NextSync, 1);
+    MutexUnlock(&SyncLock);
+
+    if ( Next && Next <= time(NULL) && !GetGoogleAccessToken(
+                                          AccessToken,
+                                          ARRAY_SIZE(AccessToken)
+                                          ) )
+    {
+        return 0;
+    }
+
+    return Next;
+}
+
+VOID
+RosterPollSync(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine applies a finished roster sync, and starts the next one
+    once it's due and there's an access token to read the sheet with.
+    Members in the sheet are added or renamed, and members only in the
+    local roster are kept.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR AccessToken[256];
+    PROSTER_SYNC Sync;
+    BOOLEAN Start;
+    UINT32 Id;
+    UINT32 i;
+
+    if ( !RosterRange )
+    {
+        return;
+    }
+
+    MutexLock(&SyncLock);
+    Sync = CompletedSync;
+    CompletedSync = NULL;
+    Start = !SyncInProgress && time(NULL) >= NextSync;
+    MutexUnlock(&SyncLock);
+
+    if ( Sync )
+    {
+        for ( i = 0; i < Sync->Count; i++ )
+        {
+            Id = RosterInternMember(
+                Sync->Members[i].Number,
+                Sync->Members[i].Name
+                );
+            if ( Id != ROSTER_INVALID_ID )
+            {
+                memcpy(
+                    Members[Id].Name,
+                    Sync->Members[i].Name,
+                    ROSTER_NAME_SIZE
+                    );
+            }
+        }
+
+        LOG("Synced %u members from %s\n", Sync->Count, RosterRange);
+        free(Sync->Members);
+        free(Sync);
+        SuggestRebuild();
+        FuzzyRebuild();
+    }
+
+    if ( !Start || !GetGoogleAccessToken(
+                        AccessToken,
+                        ARRAY_SIZE(AccessToken)
+                        ) )
+    {
+        return;
+    }
+
+    MutexLock(&SyncLock);
+    SyncInProgress = TRUE;
+    MutexUnlock(&SyncLock);
+
+    if ( !ExecutorSubmit(
+             RosterSyncTask,
+             NULL,
+             NULL
+             ) )
+    {
+        MutexLock(&SyncLock);
+        SyncInProgress = FALSE;
+        NextSync = time(NULL) + TOKEN_RETRY_DELAY;
+        MutexUnlock(&SyncLock);
+    }
+}
@@ -0,0 +1,149 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    roster.h
+
+Abstract:
+
+    This module contains definitions for the team roster, which maps
+    member numbers to dense member IDs.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Maximum length of a member's name, including the terminator
+//
+
+#define ROSTER_NAME_SIZE 128
+
+//
+// Member numbers are 9 digits
+//
+
+#define ROSTER_MIN_NUMBER 100000000
+#define ROSTER_MAX_NUMBER 999999999
+
+//
+// Most members the roster holds, so submissions can't grow it without
+// bound
+//
+
+#define ROSTER_MAX_MEMBERS 16384
+
+//
+// Returned when a member isn't in the roster
+//
+
+#define ROSTER_INVALID_ID UINT32_MAX
+
+//
+// A roster entry, the index of which is the member's dense ID
+//
+
+typedef struct _ROSTER_MEMBER
+{
+    UINT32 Number;
+    CHAR Name[ROSTER_NAME_SIZE];
+} ROSTER_MEMBER, *PROSTER_MEMBER;
+
+typedef const ROSTER_MEMBER* PCROSTER_MEMBER;
+
+//
+// Seconds between roster syncs from the spreadsheet
+//
+
+#define ROSTER_SYNC_INTERVAL 3600
+
+//
+// Path to the roster CSV file, NULL if there isn't one
+//
+
+extern PCHAR RosterPath;
+
+//
+// Spreadsheet range with member numbers and names to sync the roster from,
+// NULL if there isn't one
+//
+
+extern PCHAR RosterRange;
+
+//
+// Load the roster file
+//
+
+BOOLEAN
+RosterLoad(
+    IN PCCHAR Path
+    );
+
+//
+// Free the roster
+//
+
+VOID
+RosterFree(
+    VOID
+    );
+
+//
+// Get the dense ID of a member
+//
+
+UINT32
+RosterFindMember(
+    IN UINT32 Number
+    );
+
+//
+// Get the dense ID of a member, adding them if they aren't in the roster
+//
+
+UINT32
+RosterInternMember(
+    IN UINT32 Number,
+    IN PCCHAR Name OPTIONAL
+    );
+
+//
+// Get a member by dense ID
+//
+
+PCROSTER_MEMBER
+RosterGetMember(
+    IN UINT32 Id
+    );
+
+//
+// Get the number of members
+//
+
+UINT32
+RosterGetMemberCount(
+    VOID
+    );
+
+//
+// Get when the next roster sync is due, or 0 if the loop will be woken
+//
+
+time_t
+RosterGetNextSync(
+    VOID
+    );
+
+//
+// Start and apply roster syncs from the spreadsheet, called from the main
+// loop
+//
+
+VOID
+RosterPollSync(
+    VOID
+    );
@@ -0,0 +1,643 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    scanner.c
+
+Abstract:
+
+    This module implements the badge scanner listener. Scanners connect
+    over plain TCP and send records back to back, and every complete record
+    in the receive buffer is handled as soon as it arrives, with its ack
+    queued behind the ones before it. Records go through SubmitUser, the
+    same as send_user.
+
+--*/
+
+#include "server.h"
+
+UINT16 ScannerPort;
+UINT32 ScannerIdleTimeout = DEFAULT_SCANNER_IDLE_TIMEOUT;
+
+//
+// Reasons sent back for text records, indexed by SCANNER_RESULT
+//
+
+static PCCHAR ResultReasons[] = {
+    "",
+    "",
+    "Invalid name",
+    "Invalid number",
+    "Record too long",
+    ""
+};
+
+static BOOLEAN
+IsAccepted(
+    IN SCANNER_RESULT Result
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether a result means the record was recorded,
+    with or without a warning.
+
+Arguments:
+
+    Result - The result.
+
+Return Value:
+
+    TRUE - The record was recorded.
+
+    FALSE - The record was refused.
+
+--*/
+{
+    return Result == ScannerResultAccepted ||
+           Result == ScannerResultShortNumber ||
+           Result == ScannerResultNameWarning;
+}
+
+static SCANNER_RESULT
+SubmitRecord(
+    IN PCCHAR Name,
+    IN PCCHAR Number,
+    IN PCCHAR Event OPTIONAL,
+    IN PCCHAR Team OPTIONAL,
+    OUT PCCHAR* Warning
+    )
+/*++
+
+Routine Description:
+
+    This routine checks a scanned record and submits it. Numbers have to be
+    1 to 9 digits, since scanners can't show an error as readily as the web
+    page.
+
+Arguments:
+
+    Name - The name.
+
+    Number - The number.
+
+    Event - The event, or NULL.
+
+    Team - The team, or NULL.
+
+    Warning - Receives a warning about an accepted record, or NULL.
+
+Return Value:
+
+    The result to ack the record with.
+
+--*/
+{
+    SIZE_T Digits;
+
+    *Warning = NULL;
+
+    Digits = strspn(
+        Number,
+        "0123456789"
+        );
+    if ( !Digits || Digits > 9 || Number[Digits] )
+    {
+        return ScannerResultInvalidNumber;
+    }
+
+    if ( !SubmitUser(
+             Name,
+             Number,
+             Event,
+             Team,
+             FALSE,
+             "",
+             0,
+             Warning
+             ) )
+    {
+        return ScannerResultInvalidName;
+    }
+
+    // The only other warnings are about the name
+    if ( !*Warning )
+    {
+        return ScannerResultAccepted;
+    }
+    return strtoul(Number, NULL, 10) < ROSTER_MIN_NUMBER ? ScannerResultShortNumber : ScannerResultNameWarning;
+}
+
+static VOID
+SendTextAck(
+    IN struct mg_connection* Connection,
+    IN UINT32 Sequence,
+    IN SCANNER_RESULT Result,
+    IN PCCHAR Warning OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine queues the ack for a text record.
+
+Arguments:
+
+    Connection - The scanner's connection.
+
+    Sequence - The record's sequence number.
+
+    Result - The result.
+
+    Warning - The warning for an accepted record, or NULL.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( IsAccepted(Result) )
+    {
+        mg_printf(
+            Connection,
+            "OK %u%s%s\n",
+            Sequence,
+            Warning ? " " : "",
+            Warning ? Warning : ""
+            );
+    }
+    else
+    {
+        mg_printf(
+            Connection,
+            "ERR %u %s\n",
+            Sequence,
+            ResultReasons[Result]
+            );
+    }
+}
+
+static VOID
+SendBinaryAck(
+    IN struct mg_connection* Connection,
+    IN UINT32 Sequence,
+    IN SCANNER_RESULT Result
+    )
+/*++
+
+Routine Description:
+
+    This routine queues the ack for a binary record.
+
+Arguments:
+
+    Connection - The scanner's connection.
+
+    Sequence - The record's sequence number.
+
+    Result - The result.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    BYTE Ack[SCANNER_ACK_SIZE];
+
+    Ack[0] = IsAccepted(Result) ? SCANNER_ACK : SCANNER_NAK;
+    Ack[1] = (BYTE)(Sequence >> 24);
+    Ack[2] = (BYTE)(Sequence >> 16);
+    Ack[3] = (BYTE)(Sequence >> 8);
+    Ack[4] = (BYTE)Sequence;
+    Ack[5] = (BYTE)Result;
+    mg_send(
+        Connection,
+        Ack,
+        sizeof(Ack)
+        );
+}
+
+static SIZE_T
+HandleBinaryRecord(
+    IN struct mg_connection* Connection,
+    IN PCONNECTION_STATE State,
+    IN PCBYTE Data,
+    IN SIZE_T Available
+    )
+/*++
+
+Routine Description:
+
+    This routine handles a binary frame at the front of the receive buffer.
+
+Arguments:
+
+    Connection - The scanner's connection.
+
+    State - The connection's state.
+
+    Data - The frame.
+
+    Available - The number of bytes received.
+
+Return Value:
+
+    The size of the frame, or 0 if it hasn't all arrived yet.
+
+--*/
+{
+    CHAR Name[ROSTER_NAME_SIZE];
+    CHAR Number[16];
+    PCCHAR Warning;
+    SCANNER_RESULT Result;
+    SIZE_T Length;
+    SIZE_T NameLength;
+
+    if ( Available < SCANNER_FRAME_HEADER_SIZE )
+    {
+        return 0;
+    }
+
+    Length = (SIZE_T)Data[1] << 8 | Data[2];
+    if ( Length > SCANNER_MAX_RECORD )
+    {
+        SendBinaryAck(
+            Connection,
+            ++State->Records,
+            ScannerResultTooLong
+            );
+        Connection->is_draining = 1;
+        return 0;
+    }
+
+    if ( Available < SCANNER_FRAME_HEADER_SIZE + Length )
+    {
+        return 0;
+    }
+
+    Data += SCANNER_FRAME_HEADER_SIZE;
+    State->Records++;
+    if ( Length < 4 )
+    {
+        Result = ScannerResultInvalidNumber;
+    }
+    else
+    {
+        snprintf(
+            Number,
+            ARRAY_SIZE(Number),
+            "%u",
+            (UINT32)Data[0] << 24 | (UINT32)Data[1] << 16 | (UINT32)Data[2] << 8 | Data[3]
+            );
+
+        NameLength = MIN(Length - 4, ARRAY_SIZE(Name) - 1);
+        memcpy(
+            Name,
+            Data + 4,
+            NameLength
+            );
+        Name[NameLength] = 0;
+
+        Result = SubmitRecord(
+            Name,
+            Number,
+            NULL,
+            NULL,
+            &Warning
+            );
+    }
+
+    SendBinaryAck(
+        Connection,
+        State->Records,
+        Result
+        );
+    return SCANNER_FRAME_HEADER_SIZE + Length;
+}
+
+static SIZE_T
+HandleTextRecord(
+    IN struct mg_connection* Connection,
+    IN PCONNECTION_STATE State,
+    IN PCCHAR Data,
+    IN SIZE_T Available
+    )
+/*++
+
+Routine Description:
+
+    This routine handles a text line at the front of the receive buffer.
+
+Arguments:
+
+    Connection - The scanner's connection.
+
+    State - The connection's state.
+
+    Data - The line.
+
+    Available - The number of bytes received.
+
+Return Value:
+
+    The size of the line including its newline, or 0 if it hasn't all
+    arrived yet.
+
+--*/
+{
+    CHAR Line[SCANNER_MAX_RECORD + 1];
+    PCHAR Fields[4];
+    PCHAR Field;
+    PCCHAR Newline;
+    PCCHAR Warning;
+    SCANNER_RESULT Result;
+    SIZE_T Length;
+    UINT32 FieldCount;
+
+    Newline = memchr(
+        Data,
+        '\n',
+        MIN(Available, SCANNER_MAX_RECORD + 1)
+        );
+    if ( !Newline )
+    {
+        if ( Available > SCANNER_MAX_RECORD )
+        {
+            SendTextAck(
+                Connection,
+                ++State->Records,
+                ScannerResultTooLong,
+                NULL
+                );
+            Connection->is_draining = 1;
+        }
+        return 0;
+    }
+
+    Length = Newline - Data;
+    if ( Length && Data[Length - 1] == '\r' )
+    {
+        Length--;
+    }
+    if ( !Length )
+    {
+        return Newline - Data + 1;
+    }
+
+    memcpy(
+        Line,
+        Data,
+        Length
+        );
+    Line[Length] = 0;
+
+    // number,name[,event[,team]]
+    memset(
+        Fields,
+        0,
+        sizeof(Fields)
+        );
+    Field = Line;
+    for ( FieldCount = 0; Field && FieldCount < ARRAY_SIZE(Fields); FieldCount++ )
+    {
+        Fields[FieldCount] = Field;
+        Field = strchr(
+            Field,
+            ','
+            );
+        if ( Field )
+        {
+            *Field++ = 0;
+        }
+    }
+
+    State->Records++;
+    Result = SubmitRecord(
+        Fields[1] ? Fields[1] : "",
+        Fields[0],
+        Fields[2] && *Fields[2] ? Fields[2] : NULL,
+        Fields[3] && *Fields[3] ? Fields[3] : NULL,
+        &Warning
+        );
+    SendTextAck(
+        Connection,
+        State->Records,
+        Result,
+        Warning
+        );
+    return Newline - Data + 1;
+}
+
+static VOID
+HandleRecords(
+    IN struct mg_connection* Connection,
+    IN PCONNECTION_STATE State
+    )
+/*++
+
+Routine Description:
+
+    This routine handles every complete record in a connection's receive
+    buffer. If the scanner isn't reading its acks, it stops until they've
+    been sent.
+
+Arguments:
+
+    Connection - The scanner's connection.
+
+    State - The connection's state.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PCBYTE Data;
+    SIZE_T Offset;
+    SIZE_T Used;
+
+    // After a handoff the new server owns the journal, so the scanner gets
+    // the acks it's owed and is disconnected, and sends the rest again to
+    // the new server
+    if ( !JournalIsWritable() )
+    {
+        Connection->is_draining = 1;
+        return;
+    }
+
+    Offset = 0;
+    while ( Offset < Connection->recv.len &&
+            Connection->send.len < SCANNER_SEND_LIMIT &&
+            !Connection->is_draining && !Connection->is_closing )
+    {
+        Data = Connection->recv.buf + Offset;
+        if ( Data[0] == SCANNER_FRAME_START )
+        {
+            Used = HandleBinaryRecord(
+                Connection,
+                State,
+                Data,
+                Connection->recv.len - Offset
+                );
+        }
+        else
+        {
+            Used = HandleTextRecord(
+                Connection,
+                State,
+                (PCCHAR)Data,
+                Connection->recv.len - Offset
+                );
+        }
+
+        if ( !Used )
+        {
+            break;
+        }
+        Offset += Used;
+    }
+
+    mg_iobuf_del(
+        &Connection->recv,
+        0,
+        Offset
+        );
+}
+
+static VOID
+HandleScannerEvent(
+    IN struct mg_connection* Connection,
+    IN INT Event,
+    IN PVOID EventData,
+    IN PVOID Data
+    )
+/*++
+
+Routine Description:
+
+    This routine handles events on scanner connections.
+
+Arguments:
+
+    Connection - The connection.
+
+    Event - The event.
+
+    EventData - Not used.
+
+    Data - The manager for new connections, or the connection's state.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PCONNECTION_STATE State;
+
+    (EventData);
+    (Data);
+
+    WatchdogHandlerBegin(
+        "scanner",
+        Event
+        );
+
+    if ( Event == MG_EV_ACCEPT )
+    {
+        if ( !ConnectionAccept(Connection) )
+        {
+            Connection->is_closing = 1;
+            goto Done;
+        }
+
+        State = GET_CONNECTION_STATE(Connection);
+        State->IdleTimeout = ScannerIdleTimeout;
+    }
+    else if ( Event == MG_EV_CLOSE )
+    {
+        ConnectionClose(Connection);
+    }
+    else if ( Event == MG_EV_READ || Event == MG_EV_POLL || Event == MG_EV_WRITE )
+    {
+        State = GET_CONNECTION_STATE(Connection);
+        if ( Event != MG_EV_POLL )
+        {
+            ConnectionTouch(Connection);
+        }
+
+        // Polls pick up records left behind while acks were backed up
+        if ( State && Connection->recv.len )
+        {
+            HandleRecords(
+                Connection,
+                State
+                );
+        }
+    }
+
+Done:
+    WatchdogHandlerEnd();
+}
+
+BOOLEAN
+ScannerListen(
+    IN struct mg_mgr* Manager
+    )
+/*++
+
+Routine Description:
+
+    This routine starts listening for scanners on all interfaces, or takes
+    over the old server's listener during a restart. Scanner connections
+    count towards the connection cap, but have their own idle timeout,
+    since scanners can go a long time between scans.
+
+Arguments:
+
+    Manager - The manager.
+
+Return Value:
+
+    TRUE - The listener was started.
+
+    FALSE - The port couldn't be listened on.
+
+--*/
+{
+    struct mg_connection* Listener;
+    CHAR Url[64];
+
+    // The old server's socket is still bound to the port
+    snprintf(
+        Url,
+        ARRAY_SIZE(Url),
+        "tcp://0.0.0.0:%hu",
+        HandoffHasListener(HANDOFF_ROLE_SCANNER) ? 0 : ScannerPort
+        );
+
+    LOG("Listening for scanners on port :%hu\n", ScannerPort);
+    Listener = mg_listen(
+        Manager,
+        Url,
+        HandleScannerEvent,
+        Manager
+        );
+    if ( !Listener )
+    {
+        LOG("Failed to listen for scanners on %s\n", Url);
+        return FALSE;
+    }
+
+    HandoffRegister(
+        Listener,
+        HANDOFF_ROLE_SCANNER
+        );
+    return TRUE;
+}
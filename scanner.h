@@ -0,0 +1,108 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    scanner.h
+
+Abstract:
+
+    This module contains definitions for the badge scanner listener, a raw
+    TCP protocol for devices that can't easily speak HTTPS.
+
+    Each record is either a text line, or a binary frame that starts with
+    SCANNER_FRAME_START. Text lines look like
+
+        number,name[,event[,team]]\n
+
+    and get a line back, "OK <sequence>[ <warning>]" or
+    "ERR <sequence> <reason>". Binary frames are
+
+        SCANNER_FRAME_START, length (16 bits), number (32 bits), name
+
+    with big endian integers and a length covering the number and name, and
+    get back
+
+        SCANNER_ACK or SCANNER_NAK, sequence (32 bits), SCANNER_RESULT (8 bits)
+
+    Sequence numbers count the records on a connection from 1, so clients
+    can send many records before reading the acks. Empty lines are ignored
+    and can be used to keep a connection from going idle. Records that
+    weren't acked when the connection closes weren't recorded, and should
+    be sent again on a new connection.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Binary framing bytes
+//
+
+#define SCANNER_FRAME_START 0x02
+#define SCANNER_ACK 0x06
+#define SCANNER_NAK 0x15
+
+//
+// Size of a binary frame's header, and of a binary ack
+//
+
+#define SCANNER_FRAME_HEADER_SIZE 3
+#define SCANNER_ACK_SIZE 6
+
+//
+// Longest record, past which the connection is closed
+//
+
+#define SCANNER_MAX_RECORD 512
+
+//
+// Stop reading records while this many bytes of acks are waiting to be sent
+//
+
+#define SCANNER_SEND_LIMIT 4096
+
+//
+// Default time a scanner connection can be idle, in milliseconds
+//
+
+#define DEFAULT_SCANNER_IDLE_TIMEOUT 600000
+
+//
+// Result codes in acks. Short numbers and names that don't match the
+// roster are accepted with a warning.
+//
+
+typedef enum _SCANNER_RESULT
+{
+    ScannerResultAccepted,
+    ScannerResultShortNumber,
+    ScannerResultInvalidName,
+    ScannerResultInvalidNumber,
+    ScannerResultTooLong,
+    ScannerResultNameWarning
+} SCANNER_RESULT, *PSCANNER_RESULT;
+
+//
+// Port to listen for scanners on, 0 if disabled
+//
+
+extern UINT16 ScannerPort;
+
+//
+// Milliseconds a scanner connection can be idle
+//
+
+extern UINT32 ScannerIdleTimeout;
+
+//
+// Start listening for scanners
+//
+
+BOOLEAN
+ScannerListen(
+    IN struct mg_mgr* Manager
+    );
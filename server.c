@@ -15,13 +15,6 @@ Abstract:
 #include "server.h"
 #include "curl/easy.h"
 
-#define CURLWRITE_SIZE 2048
-typedef struct _CURL_BUFFER
-{
-    CHAR Data[CURLWRITE_SIZE];
-    SIZE_T Length;
-} CURL_BUFFER, *PCURL_BUFFER;
-
 CHAR Url[128];
 PCHAR SpreadsheetId;
 PCHAR GoogleOauth2ClientJson;
@@ -44,28 +37,107 @@ UINT64 TimeOfLastRefresh;
 UINT16 TimeUntilRefresh;
 BOOLEAN HaveGoogleAuthCode;
 
-VOID
-HandleEvent(
-    IN struct mg_connection* Connection,
-    IN INT Event,
-    IN PVOID EventData,
-    IN PVOID Data
+// Protects the authorization code, which the OAuth worker waits for until
+// it arrives or the server shuts down
+static MUTEX AuthCodeLock = MUTEX_INITIALIZER;
+static CONDITION AuthCodeCondition = CONDITION_INITIALIZER;
+static BOOLEAN AuthCodeCancelled;
+
+ARENA RequestArena;
+ARENA UpstreamArena;
+
+PCHAR TokenCachePath;
+MUTEX TokenLock = MUTEX_INITIALIZER;
+static BOOLEAN RefreshInProgress;
+static time_t NextTokenRefresh;
+
+static SIZE_T
+FormatCsvRecord(
+    IN PCATTENDANCE_RECORD Record,
+    OUT PCHAR Buffer,
+    IN SIZE_T BufferSize
     )
 /*++
 
 Routine Description:
 
-    This routine handles events from the server.
+    This routine formats a journal record as a CSV line. The name is always
+    quoted, with quotes in it doubled, and the last field says whether it's
+    a check-in or a check-out.
 
 Arguments:
 
-    Connection - The connection to the server.
+    Record - The record to format.
 
-    Event - The event.
+    Buffer - Receives the line. Must have room for at least
+             2 * ROSTER_NAME_SIZE + 64 characters.
 
-    EventData - Data for the event.
+    BufferSize - The size of the buffer.
+
+Return Value:
+
+    The length of the line.
+
+--*/
+{
+    time_t Timestamp;
+    struct tm Time;
+    SIZE_T Length;
+    PCCHAR Name;
+
+    Timestamp = (time_t)Record->Timestamp;
+    LOCALTIME(
+        &Timestamp,
+        &Time
+        );
+    Length = strftime(
+        Buffer,
+        BufferSize,
+        "%Y-%m-%d %H:%M:%S,",
+        &Time
+        );
+    Length += snprintf(
+        Buffer + Length,
+        BufferSize - Length,
+        "%09u,\"",
+        Record->Number
+        );
+
+    for ( Name = Record->Name; *Name && Name < Record->Name + ARRAY_SIZE(Record->Name) && Length + 8 < BufferSize; Name++ )
+    {
+        if ( *Name == '"' )
+        {
+            Buffer[Length++] = '"';
+        }
+        Buffer[Length++] = *Name;
+    }
+
+    Length += snprintf(
+        Buffer + Length,
+        BufferSize - Length,
+        "\",%s\n",
+        Record->Flags & JOURNAL_FLAG_CHECK_OUT ? "out" : "in"
+        );
+    return Length;
+}
 
-    Data - Data for the function, not used.
+static VOID
+ContinueExport(
+    IN struct mg_connection* Connection,
+    IN PCONNECTION_STATE State
+    )
+/*++
+
+Routine Description:
+
+    This routine sends the next part of a CSV export. Only EXPORT_SEND_LIMIT
+    bytes are buffered at once, the rest is sent as the client drains them.
+
+Arguments:
+
+    Connection - The connection doing the export.
+
+    State - The connection's state.
 
 Return Value:
 
@@ -73,218 +145,1639 @@ Return Value:
 
 --*/
 {
-    struct mg_http_serve_opts StaticOptions = {.root_dir = ROOT_DIR};
+    ATTENDANCE_RECORD Records[16];
+    CHAR Chunk[ARRAY_SIZE(Records) * (2 * ROSTER_NAME_SIZE + 64)];
+    SIZE_T Length;
+    UINT32 Count;
+    UINT32 i;
 
-    if ( Event == MG_EV_ACCEPT )
+    while ( State->ExportNext < State->ExportEnd &&
+            Connection->send.len < EXPORT_SEND_LIMIT )
     {
-        struct mg_tls_opts TlsOptions = {
-            .cert = TlsCertPath,
-            .certkey = TlsKeyPath
-        };
+        Count = JournalRead(
+            State->ExportNext,
+            Records,
+            (UINT32)MIN(ARRAY_SIZE(Records), State->ExportEnd - State->ExportNext)
+            );
+        if ( !Count )
+        {
+            // Closing without the last chunk tells the client it's truncated
+            LOG("Export stopped at record %" PRIu64 " of %" PRIu64 "\n", State->ExportNext, State->ExportEnd);
+            State->Exporting = FALSE;
+            Connection->is_draining = 1;
+            return;
+        }
 
-        mg_tls_init(
+        Length = 0;
+        for ( i = 0; i < Count; i++ )
+        {
+            Length += FormatCsvRecord(
+                &Records[i],
+                Chunk + Length,
+                ARRAY_SIZE(Chunk) - Length
+                );
+        }
+
+        mg_http_write_chunk(
             Connection,
-            &TlsOptions
+            Chunk,
+            Length
             );
+        State->ExportNext += Count;
     }
-    else if ( Event == MG_EV_HTTP_MSG )
+
+    if ( State->ExportNext >= State->ExportEnd )
     {
-        struct mg_http_message* HttpMessage = EventData;
-        struct mg_str* Host = mg_http_get_header(HttpMessage, "Host");
-        CHAR Query[1024];
-        struct mg_str QueryMgStr;
-        PCHAR p;
+        mg_http_write_chunk(
+            Connection,
+            "",
+            0
+            );
+        State->Exporting = FALSE;
+    }
+}
 
-        p = NULL;
-        if ( HttpMessage->query.ptr )
-        {
-            p = strstr(HttpMessage->query.ptr, " HTTP");
-            if ( p )
-            {
-                size_t Count = MIN(
-                        p - HttpMessage->query.ptr,
-                        ARRAY_SIZE(Query) - 1
-                        );
+static VOID
+HandleHttpMessage(
+    IN struct mg_connection* Connection,
+    IN struct mg_http_message* HttpMessage,
+    IN PCONNECTION_STATE State
+    )
+/*++
+
+Routine Description:
+
+    This routine handles an HTTP request. Anything it allocates from
+    RequestArena is released once it returns.
+
+Arguments:
+
+    Connection - The connection the request came in on.
+
+    HttpMessage - The request.
+
+    State - The connection's state.
+
+Return Value:
 
-                strncpy(
-                    Query,
-                    HttpMessage->query.ptr,
-                    Count
+    None.
+
+--*/
+{
+    struct mg_str* Host = mg_http_get_header(HttpMessage, "Host");
+    CHAR Query[1024];
+    struct mg_str QueryMgStr;
+    PCHAR p;
+
+    Query[0] = 0;
+    QueryMgStr.ptr = Query;
+    QueryMgStr.len = 0;
+
+    p = NULL;
+    if ( HttpMessage->query.ptr )
+    {
+        p = strstr(HttpMessage->query.ptr, " HTTP");
+        if ( p )
+        {
+            size_t Count = MIN(
+                    p - HttpMessage->query.ptr,
+                    ARRAY_SIZE(Query) - 1
                     );
-                Query[Count] = 0;
 
-                QueryMgStr.ptr = Query;
-                QueryMgStr.len = Count;
+            strncpy(
+                Query,
+                HttpMessage->query.ptr,
+                Count
+                );
+            Query[Count] = 0;
+
+            QueryMgStr.ptr = Query;
+            QueryMgStr.len = Count;
+        }
+    }
+
+    LOG("Serving host %s\n", Host->ptr);
+    if ( mg_http_match_uri(
+             HttpMessage,
+             MAKE_ENDPOINT(TEST_ENDPOINT)
+             ) )
+    {
+        mg_http_reply(
+            Connection,
+            200,
+            "Content-Type: text/plain\r\n",
+            "yes"
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  "#" MAKE_ENDPOINT(SEND_USER_ENDPOINT)
+                  ) )
+    {
+        CHAR Name[128];
+        CHAR Number[10];
+        CHAR Event[64];
+        CHAR Team[64];
+        CHAR Action[8];
+        CHAR Key[IDEMPOTENCY_KEY_SIZE];
+        CHAR Request[512];
+        CHAR Body[IDEMPOTENCY_RESPONSE_SIZE];
+        struct mg_str* KeyHeader;
+        IDEMPOTENCY_RESULT Result;
+        PCCHAR Response;
+        PCCHAR Warning;
+        SIZE_T ResponseLength;
+        UINT32 Status;
+        INT RequestLength;
+        INT BodyLength;
+        INT NameLen;
+        INT NumberLen;
+        INT KeyLen;
+        BOOLEAN KeyValid;
+
+        LOG("Handling send_user\n");
+
+        // Retries carry the key the first attempt was sent with
+        Key[0] = 0;
+        KeyValid = TRUE;
+        KeyHeader = mg_http_get_header(
+            HttpMessage,
+            "Idempotency-Key"
+            );
+        if ( KeyHeader && KeyHeader->len < ARRAY_SIZE(Key) )
+        {
+            memcpy(
+                Key,
+                KeyHeader->ptr,
+                KeyHeader->len
+                );
+            Key[KeyHeader->len] = 0;
+            KeyValid = IdempotencyIsValidKey(Key);
+        }
+        else if ( KeyHeader )
+        {
+            KeyValid = FALSE;
+        }
+        else
+        {
+            // Too long to decode is as bad as malformed
+            KeyLen = mg_http_get_var(
+                &QueryMgStr,
+                "idempotency_key",
+                Key,
+                ARRAY_SIZE(Key)
+                );
+            if ( KeyLen > 0 )
+            {
+                KeyValid = IdempotencyIsValidKey(Key);
+            }
+            else
+            {
+                KeyValid = KeyLen != -3;
+                Key[0] = 0;
             }
         }
 
-        LOG("Serving host %s\n", Host->ptr);
-        if ( mg_http_match_uri(
-                 HttpMessage,
-                 MAKE_ENDPOINT(TEST_ENDPOINT)
-                 ) )
+        if ( !KeyValid )
         {
             mg_http_reply(
                 Connection,
-                200,
+                400,
                 "Content-Type: text/plain\r\n",
-                "yes"
+                "Invalid idempotency key\n"
                 );
+            return;
         }
-        else if ( mg_http_match_uri(
-                      HttpMessage,
-                      MAKE_ENDPOINT(SEND_USER_ENDPOINT)
-                      ) )
-        {
-            CHAR Name[128];
-            CHAR Number[10];
-            PCCHAR Warning;
-            INT NameLen;
-            INT NumberLen;
 
-            LOG("Handling send_user\n");
-
-            NameLen = mg_http_get_var(
-                &QueryMgStr,
-                "name",
-                Name,
-                ARRAY_SIZE(Name)
-                );
-            if ( NameLen == -3 )
+        NameLen = mg_http_get_var(
+            &QueryMgStr,
+            "name",
+            Name,
+            ARRAY_SIZE(Name)
+            );
+        if ( NameLen == -3 )
 			{
 			    NameLen = strlen(Name);
-            }
+        }
 
-            NumberLen = mg_http_get_var(
-                &QueryMgStr,
-                "number",
-                Number,
-                ARRAY_SIZE(Number)
-                );
-            if ( NumberLen == -3 )
+        NumberLen = mg_http_get_var(
+            &QueryMgStr,
+            "number",
+            Number,
+            ARRAY_SIZE(Number)
+            );
+        if ( NumberLen == -3 )
 			{
 			    NumberLen = strlen(Number);
-            }
+        }
 
-            if ( NameLen > 0 && NumberLen > 0 )
+        if ( NameLen > 0 && NumberLen > 0 )
+        {
+            if ( mg_http_get_var(&QueryMgStr, "event", Event, ARRAY_SIZE(Event)) <= 0 )
+            {
+                Event[0] = 0;
+            }
+            if ( mg_http_get_var(&QueryMgStr, "team", Team, ARRAY_SIZE(Team)) <= 0 )
             {
-                LOG("Received name %s and number %s\n", Name, Number);
+                Team[0] = 0;
+            }
+            if ( mg_http_get_var(&QueryMgStr, "action", Action, ARRAY_SIZE(Action)) <= 0 )
+            {
+                Action[0] = 0;
+            }
 
-                // Warnings must start with a newline for frontend
-                if ( atoi(Number) < 100000000 )
-				{
-				    Warning = "\nNumber is invalid or less than 9 digits";
+            // A key can only be reused for the same submission
+            if ( Key[0] )
+            {
+                RequestLength = snprintf(
+                    Request,
+                    ARRAY_SIZE(Request),
+                    "%.*s\n%s\n%s\n%s\n%s\n%s",
+                    (INT)HttpMessage->uri.len,
+                    HttpMessage->uri.ptr,
+                    Name,
+                    Number,
+                    Event,
+                    Team,
+                    Action
+                    );
+                RequestLength = MIN(RequestLength, (INT)ARRAY_SIZE(Request) - 1);
+
+                Result = IdempotencyLookup(
+                    Key,
+                    Request,
+                    RequestLength,
+                    &Status,
+                    &Response,
+                    &ResponseLength
+                    );
+                if ( Result == IdempotencyResultReplay )
+                {
+                    LOG("Replaying response for idempotency key %s\n", Key);
+                    mg_http_reply(
+                        Connection,
+                        Status,
+                        "Content-Type: text/plain\r\nIdempotent-Replayed: true\r\n",
+                        "%.*s",
+                        (INT)ResponseLength,
+                        Response
+                        );
+                    return;
                 }
-                else
-				{
-                    Warning = "";
+                else if ( Result == IdempotencyResultConflict )
+                {
+                    LOG("Idempotency key %s reused for a different submission\n", Key);
+                    mg_http_reply(
+                        Connection,
+                        422,
+                        "Content-Type: text/plain\r\n",
+                        "Idempotency key was already used for a different submission\n"
+                        );
+                    return;
                 }
+            }
 
+            // After a handoff the new server owns the journal, and a retry
+            // on a new connection reaches it
+            if ( !JournalIsWritable() )
+            {
                 mg_http_reply(
                     Connection,
-                    200,
-                    "Content-Type: text/plain\r\n",
-                    "success\n%s\n%s%s",
+                    503,
+                    "Content-Type: text/plain\r\nConnection: close\r\nRetry-After: 1\r\n",
+                    "Server is restarting, try again\n"
+                    );
+                Connection->is_draining = 1;
+                return;
+            }
+
+            // Anything before /api picks a route, like a team's own page
+            if ( SubmitUser(
+                     Name,
+                     Number,
+                     Event[0] ? Event : NULL,
+                     Team[0] ? Team : NULL,
+                     strcmp(Action, "out") == 0,
+                     HttpMessage->uri.ptr,
+                     HttpMessage->uri.len,
+                     &Warning
+                     ) )
+            {
+                // Warnings must start with a newline for frontend
+                Status = 200;
+                BodyLength = snprintf(
+                    Body,
+                    ARRAY_SIZE(Body),
+                    "success\n%s\n%s%s%s",
                     Name,
                     Number,
-                    Warning
+                    Warning ? "\n" : "",
+                    Warning ? Warning : ""
                     );
             }
-            else if ( NameLen <= 0 && NumberLen > 0 )
+            else
             {
-                LOG("Invalid name (query %s)\n", p ? Query : "(none)");
-                mg_http_reply(
-                    Connection,
-                    400,
-                    "Content-Type: text/plain\r\n",
-                    "Invalid name (query %s)\n",
-                    p ? Query : "(none)"
+                // Name and number were checked above, so this is a check-out
+                // with no check-in to close, which wasn't recorded
+                Status = 409;
+                BodyLength = snprintf(
+                    Body,
+                    ARRAY_SIZE(Body),
+                    "%s\n",
+                    Warning ? Warning : "Submission was refused"
                     );
             }
-            else if ( NameLen > 0 && NumberLen <= 0 )
+            BodyLength = MIN(BodyLength, (INT)ARRAY_SIZE(Body) - 1);
+            mg_http_reply(
+                Connection,
+                Status,
+                "Content-Type: text/plain\r\n",
+                "%s",
+                Body
+                );
+
+            if ( Key[0] )
             {
-                LOG("Invalid number (query %s)\n", p ? Query : "(none)");
-                mg_http_reply(
-                    Connection,
-                    400,
-                    "Content-Type: text/plain\r\n",
-                    "Invalid number (query %s)\n",
-                    p ? Query : "(none)"
+                IdempotencyStore(
+                    Key,
+                    Request,
+                    RequestLength,
+                    Status,
+                    Body,
+                    BodyLength
                     );
             }
-            else if ( NameLen <= 0 && NumberLen <= 0 )
+        }
+        else if ( NameLen <= 0 && NumberLen > 0 )
+        {
+            LOG("Invalid name (query %s)\n", p ? Query : "(none)");
+            mg_http_reply(
+                Connection,
+                400,
+                "Content-Type: text/plain\r\n",
+                "Invalid name (query %s)\n",
+                p ? Query : "(none)"
+                );
+        }
+        else if ( NameLen > 0 && NumberLen <= 0 )
+        {
+            LOG("Invalid number (query %s)\n", p ? Query : "(none)");
+            mg_http_reply(
+                Connection,
+                400,
+                "Content-Type: text/plain\r\n",
+                "Invalid number (query %s)\n",
+                p ? Query : "(none)"
+                );
+        }
+        else if ( NameLen <= 0 && NumberLen <= 0 )
+        {
+            LOG("Invalid name and number (query %s)\n", p ? Query : "(none)");
+            mg_http_reply(
+                Connection,
+                400,
+                "Content-Type: text/plain\r\n",
+                "Invalid name and number (query %s)\n",
+                p ? Query : "(none)"
+                );
+        }
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(MEMBER_ATTENDANCE_ENDPOINT)
+                  ) )
+    {
+        CHAR Number[10];
+        CHAR Body[ROSTER_NAME_SIZE * 6 + 128];
+        JSON_WRITER Writer;
+        PCROSTER_MEMBER Member;
+        UINT32 MemberId;
+        UINT32 DaysPresent;
+        UINT32 MeetingDays;
+        UINT32 Percentage;
+
+        if ( mg_http_get_var(
+                 &QueryMgStr,
+                 "number",
+                 Number,
+                 ARRAY_SIZE(Number)
+                 ) <= 0 )
+        {
+            mg_http_reply(
+                Connection,
+                400,
+                "Content-Type: text/plain\r\n",
+                "Invalid number (query %s)\n",
+                Query
+                );
+            return;
+        }
+
+        MemberId = RosterFindMember(strtoul(Number, NULL, 10));
+        Member = RosterGetMember(MemberId);
+        if ( !Member )
+        {
+            mg_http_reply(
+                Connection,
+                404,
+                "Content-Type: text/plain\r\n",
+                "No member with number %s\n",
+                Number
+                );
+            return;
+        }
+
+        AttendanceGetMemberDays(
+            MemberId,
+            &DaysPresent,
+            &MeetingDays
+            );
+        Percentage = MeetingDays ? (UINT32)((UINT64)DaysPresent * 10000 / MeetingDays) : 0;
+
+        // The body always fits, since names are at most ROSTER_NAME_SIZE
+        JsonWriterInitialize(
+            &Writer,
+            Body,
+            ARRAY_SIZE(Body),
+            NULL,
+            NULL
+            );
+        JsonWritef(
+            &Writer,
+            "{\"number\":%u,\"name\":",
+            Member->Number
+            );
+        JsonWriteString(
+            &Writer,
+            Member->Name
+            );
+        JsonWritef(
+            &Writer,
+            ",\"days_present\":%u,\"meeting_days\":%u,\"percentage\":%u.%02u}\n",
+            DaysPresent,
+            MeetingDays,
+            Percentage / 100,
+            Percentage % 100
+            );
+
+        mg_http_reply(
+            Connection,
+            200,
+            "Content-Type: application/json\r\n",
+            "%s",
+            Body
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(MEETING_ATTENDANCE_ENDPOINT)
+                  ) )
+    {
+        CHAR DateString[16];
+        UINT32 Date;
+
+        if ( mg_http_get_var(
+                 &QueryMgStr,
+                 "date",
+                 DateString,
+                 ARRAY_SIZE(DateString)
+                 ) <= 0 )
+        {
+            Date = AttendanceGetDate(time(NULL));
+        }
+        else if ( !AttendanceParseDate(
+                      DateString,
+                      &Date
+                      ) )
+        {
+            mg_http_reply(
+                Connection,
+                400,
+                "Content-Type: text/plain\r\n",
+                "Invalid date %s, expected YYYY-MM-DD\n",
+                DateString
+                );
+            return;
+        }
+
+        mg_http_reply(
+            Connection,
+            200,
+            "Content-Type: application/json\r\n",
+            "{\"date\":\"%04u-%02u-%02u\",\"headcount\":%u,\"members\":%u}\n",
+            Date / 10000,
+            Date / 100 % 100,
+            Date % 100,
+            AttendanceGetHeadcount(Date),
+            RosterGetMemberCount()
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(PRESENT_ENDPOINT)
+                  ) )
+    {
+        CHAR Output[JSON_WRITER_BUFFER_SIZE];
+        JSON_WRITER Writer;
+        PCROSTER_MEMBER Member;
+        time_t Since;
+        UINT32 MemberId;
+        UINT32 i;
+
+        mg_printf(
+            Connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n"
+            );
+        JsonWriterInitialize(
+            &Writer,
+            Output,
+            ARRAY_SIZE(Output),
+            JsonSinkChunk,
+            Connection
+            );
+        JsonWritef(
+            &Writer,
+            "{\"now\":%" PRId64 ",\"count\":%u,\"members\":[",
+            (INT64)time(NULL),
+            SessionsGetPresentCount()
+            );
+        for ( i = 0; SessionsGetPresent(i, &MemberId, &Since); i++ )
+        {
+            Member = RosterGetMember(MemberId);
+            JsonWritef(
+                &Writer,
+                "%s{\"number\":%u,\"name\":",
+                i ? "," : "",
+                Member->Number
+                );
+            JsonWriteString(
+                &Writer,
+                Member->Name
+                );
+            JsonWritef(
+                &Writer,
+                ",\"since\":%" PRId64 "}",
+                (INT64)Since
+                );
+        }
+        JsonWriteRaw(
+            &Writer,
+            "]}\n",
+            3
+            );
+        JsonWriterFlush(&Writer);
+        mg_http_printf_chunk(
+            Connection,
+            ""
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(MEMBER_HOURS_ENDPOINT)
+                  ) )
+    {
+        CHAR DateString[16];
+        CHAR Number[10];
+        CHAR Output[JSON_WRITER_BUFFER_SIZE];
+        JSON_WRITER Writer;
+        PCROSTER_MEMBER Member;
+        SESSION_TOTAL Total;
+        time_t From;
+        time_t To;
+        UINT32 FromDate;
+        UINT32 ToDate;
+        UINT32 First;
+        UINT32 End;
+        UINT32 Written;
+        UINT32 i;
+
+        // Both days are included, and default to today
+        FromDate = AttendanceGetDate(time(NULL));
+        ToDate = FromDate;
+        if ( (mg_http_get_var(&QueryMgStr, "from", DateString, ARRAY_SIZE(DateString)) > 0 &&
+              !AttendanceParseDate(DateString, &FromDate)) ||
+             (mg_http_get_var(&QueryMgStr, "to", DateString, ARRAY_SIZE(DateString)) > 0 &&
+              !AttendanceParseDate(DateString, &ToDate)) ||
+             ToDate < FromDate )
+        {
+            mg_http_reply(
+                Connection,
+                400,
+                "Content-Type: text/plain\r\n",
+                "Invalid range (query %s), expected from and to as YYYY-MM-DD\n",
+                Query
+                );
+            return;
+        }
+        From = SessionsGetDayStart(FromDate);
+        To = SessionsGetDayStart(ToDate + 1);
+
+        // ?number= picks one member, otherwise it's everyone with any time
+        First = 0;
+        End = RosterGetMemberCount();
+        if ( mg_http_get_var(
+                 &QueryMgStr,
+                 "number",
+                 Number,
+                 ARRAY_SIZE(Number)
+                 ) > 0 )
+        {
+            First = RosterFindMember(strtoul(Number, NULL, 10));
+            if ( First == ROSTER_INVALID_ID )
             {
-                LOG("Invalid name and number (query %s)\n", p ? Query : "(none)");
                 mg_http_reply(
                     Connection,
-                    400,
+                    404,
                     "Content-Type: text/plain\r\n",
-                    "Invalid name and number (query %s)\n",
-                    p ? Query : "(none)"
+                    "No member with number %s\n",
+                    Number
                     );
+                return;
             }
+            End = First + 1;
         }
-        else if ( mg_http_match_uri(
-                    HttpMessage,
-                    MAKE_ENDPOINT(OAUTH_ENDPOINT)
-                    ) )
+
+        mg_printf(
+            Connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n"
+            );
+        JsonWriterInitialize(
+            &Writer,
+            Output,
+            ARRAY_SIZE(Output),
+            JsonSinkChunk,
+            Connection
+            );
+        JsonWritef(
+            &Writer,
+            "{\"from\":\"%04u-%02u-%02u\",\"to\":\"%04u-%02u-%02u\",\"members\":[",
+            FromDate / 10000,
+            FromDate / 100 % 100,
+            FromDate % 100,
+            ToDate / 10000,
+            ToDate / 100 % 100,
+            ToDate % 100
+            );
+
+        Written = 0;
+        for ( i = First; i < End; i++ )
         {
-            LOG("Received authentication response from Google\n");
+            SessionsGetTotal(
+                i,
+                From,
+                To,
+                &Total
+                );
+            if ( !Total.Sessions && End - First > 1 )
+            {
+                continue;
+            }
+
+            Member = RosterGetMember(i);
+            JsonWritef(
+                &Writer,
+                "%s{\"number\":%u,\"name\":",
+                Written ? "," : "",
+                Member->Number
+                );
+            JsonWriteString(
+                &Writer,
+                Member->Name
+                );
+            JsonWritef(
+                &Writer,
+                ",\"hours\":%.2f,\"seconds\":%" PRIu64 ",\"sessions\":%u}",
+                Total.Seconds / 3600.0,
+                Total.Seconds,
+                Total.Sessions
+                );
+            Written++;
+        }
+
+        JsonWriteRaw(
+            &Writer,
+            "]}\n",
+            3
+            );
+        JsonWriterFlush(&Writer);
+        mg_http_printf_chunk(
+            Connection,
+            ""
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(METRICS_ENDPOINT)
+                  ) )
+    {
+        CONNECTION_METRICS Metrics;
+        IDEMPOTENCY_METRICS Idempotency;
+
+        ConnectionGetMetrics(
+            Connection->mgr,
+            &Metrics
+            );
+        IdempotencyGetMetrics(&Idempotency);
+        mg_http_reply(
+            Connection,
+            200,
+            "Content-Type: application/json\r\n",
+            "{\"connections\":{\"open\":%u,\"idle\":%u,\"max\":%u,"
+            "\"accepted\":%" PRIu64 ",\"rejected\":%" PRIu64 ","
+            "\"evicted\":%" PRIu64 ",\"swept\":%" PRIu64 "},"
+            "\"idempotency\":{\"keys\":%u,\"max\":%u,"
+            "\"replays\":%" PRIu64 ",\"conflicts\":%" PRIu64 ","
+            "\"evicted\":%" PRIu64 ",\"expired\":%" PRIu64 "}}\n",
+            Metrics.Open,
+            Metrics.Idle,
+            Metrics.Max,
+            Metrics.Accepted,
+            Metrics.Rejected,
+            Metrics.Evicted,
+            Metrics.Swept,
+            Idempotency.Keys,
+            Idempotency.Max,
+            Idempotency.Replays,
+            Idempotency.Conflicts,
+            Idempotency.Evicted,
+            Idempotency.Expired
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(STATS_ENDPOINT)
+                  ) )
+    {
+        CHAR Hours[16];
+
+        mg_printf(
+            Connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n"
+            );
+        StatsWriteJson(
+            Connection,
+            mg_http_get_var(&QueryMgStr, "hours", Hours, ARRAY_SIZE(Hours)) > 0 ? strtoul(Hours, NULL, 10) : DEFAULT_STATS_HOURS
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(TRACE_ENDPOINT)
+                  ) )
+    {
+        CHAR Enabled[8];
+
+        // ?enabled=true|false turns recording on or off without a restart
+        if ( mg_http_get_var(
+                 &QueryMgStr,
+                 "enabled",
+                 Enabled,
+                 ARRAY_SIZE(Enabled)
+                 ) > 0 )
+        {
+            ATOMIC_STORE_BOOLEAN(
+                &TraceEnabled,
+                strcmp(Enabled, "false") && strcmp(Enabled, "0")
+                );
+            LOG("Tracing %s\n", ATOMIC_LOAD_BOOLEAN(&TraceEnabled) ? "enabled" : "disabled");
+        }
+
+        mg_printf(
+            Connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Content-Disposition: attachment; filename=\"trace.json\"\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n"
+            );
+        TraceWriteChromeJson(Connection);
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(WATCHDOG_ENDPOINT)
+                  ) )
+    {
+        mg_printf(
+            Connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n"
+            );
+        WatchdogWriteJson(Connection);
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(DELIVERY_ENDPOINT)
+                  ) )
+    {
+        DELIVERY_STATE Delivery;
+        CHAR Output[JSON_WRITER_BUFFER_SIZE];
+        JSON_WRITER Writer;
+        UINT64 Now;
+        UINT32 i;
+
+        mg_printf(
+            Connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n"
+            );
+
+        JsonWriterInitialize(
+            &Writer,
+            Output,
+            ARRAY_SIZE(Output),
+            JsonSinkChunk,
+            Connection
+            );
+        JsonWriteRaw(
+            &Writer,
+            "{\"routes\":[",
+            11
+            );
+
+        Now = mg_millis();
+        for ( i = 0; i < DeliveryGetRouteCount(); i++ )
+        {
+            DeliveryGetState(
+                i,
+                &Delivery
+                );
+            JsonWriteRaw(
+                &Writer,
+                i ? ",{\"name\":" : "{\"name\":",
+                i ? 9 : 8
+                );
+            JsonWriteString(
+                &Writer,
+                Delivery.Name
+                );
+            JsonWriteRaw(
+                &Writer,
+                ",\"spreadsheet\":",
+                15
+                );
+            JsonWriteString(
+                &Writer,
+                Delivery.Spreadsheet
+                );
+            JsonWriteRaw(
+                &Writer,
+                ",\"range\":",
+                9
+                );
+            JsonWriteString(
+                &Writer,
+                Delivery.Range
+                );
+            JsonWritef(
+                &Writer,
+                ",\"queued\":%u,\"in_flight\":%u,\"oldest_age_ms\":%" PRIu64 ","
+                "\"window_ms\":%u,\"batch_size\":%u,\"arrival_rate\":%.3f,"
+                "\"latency_ms\":%.0f,\"budget\":%.2f,\"penalty\":%.2f,"
+                "\"backoff_ms\":%" PRIu64 ",\"quota\":%u,\"requests\":%" PRIu64 ","
+                "\"delivered\":%" PRIu64 ",\"throttled\":%" PRIu64 ",\"failed\":%" PRIu64 ","
+                "\"dropped\":%" PRIu64 "}",
+                Delivery.Queued,
+                Delivery.InFlight,
+                Delivery.OldestAge,
+                Delivery.Controller.Window,
+                Delivery.Controller.BatchSize,
+                Delivery.Controller.ArrivalRate,
+                Delivery.Controller.Latency,
+                Delivery.Controller.Budget,
+                Delivery.Controller.Penalty,
+                Delivery.Controller.BackoffUntil > Now ? Delivery.Controller.BackoffUntil - Now : 0,
+                Delivery.Controller.Quota,
+                Delivery.Controller.Requests,
+                Delivery.Controller.Delivered,
+                Delivery.Controller.Throttled,
+                Delivery.Controller.Failed,
+                Delivery.Dropped
+                );
+        }
+
+        JsonWriteRaw(
+            &Writer,
+            "]}\n",
+            3
+            );
+        JsonWriterFlush(&Writer);
+        mg_http_printf_chunk(
+            Connection,
+            ""
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(SUGGEST_ENDPOINT)
+                  ) )
+    {
+        CHAR Prefix[SUGGEST_PREFIX_SIZE];
+        CHAR Limit[16];
+
+        if ( mg_http_get_var(&QueryMgStr, "prefix", Prefix, ARRAY_SIZE(Prefix)) < 0 )
+        {
+            Prefix[0] = 0;
+        }
+        SuggestWriteJson(
+            Connection,
+            Prefix,
+            mg_http_get_var(&QueryMgStr, "limit", Limit, ARRAY_SIZE(Limit)) > 0 ? strtoul(Limit, NULL, 10) : DEFAULT_SUGGEST_LIMIT
+            );
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(HISTORY_ENDPOINT)
+                  ) )
+    {
+        CHAR Cursor[HISTORY_CURSOR_SIZE + 1];
+        CHAR Limit[16];
+        CHAR Order[8];
+
+        // Newest first unless ?order=asc, and ?cursor= continues a page
+        if ( !HistoryWriteJson(
+                 Connection,
+                 mg_http_get_var(&QueryMgStr, "cursor", Cursor, ARRAY_SIZE(Cursor)) > 0 ? Cursor : NULL,
+                 mg_http_get_var(&QueryMgStr, "limit", Limit, ARRAY_SIZE(Limit)) > 0 ? strtoul(Limit, NULL, 10) : DEFAULT_HISTORY_LIMIT,
+                 mg_http_get_var(&QueryMgStr, "order", Order, ARRAY_SIZE(Order)) > 0 && strcmp(Order, "asc") == 0
+                 ) )
+        {
+            mg_http_reply(
+                Connection,
+                400,
+                "Content-Type: text/plain\r\n",
+                "Invalid cursor (query %s)\n",
+                Query
+                );
+        }
+    }
+    else if ( mg_http_match_uri(
+                  HttpMessage,
+                  MAKE_ENDPOINT(EXPORT_ENDPOINT)
+                  ) )
+    {
+        LOG("Exporting %" PRIu64 " records\n", JournalGetRecordCount());
+        mg_printf(
+            Connection,
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/csv\r\n"
+            "Content-Disposition: attachment; filename=\"attendance.csv\"\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "\r\n"
+            );
+        mg_http_printf_chunk(
+            Connection,
+            "timestamp,number,name,action\n"
+            );
+
+        State->Exporting = TRUE;
+        State->ExportNext = 0;
+        State->ExportEnd = JournalGetRecordCount();
+        ContinueExport(
+            Connection,
+            State
+            );
+    }
+    else if ( mg_http_match_uri(
+                HttpMessage,
+                MAKE_ENDPOINT(OAUTH_ENDPOINT)
+                ) )
+    {
+        LOG("Received authentication response from Google\n");
+
+        MutexLock(&AuthCodeLock);
+        if ( !HaveGoogleAuthCode )
+			{
+            mg_http_get_var(
+                &QueryMgStr,
+                "code",
+                GoogleAuthCode,
+                ARRAY_SIZE(GoogleAuthCode)
+                );
+            mg_http_get_var(
+                &QueryMgStr,
+                "state",
+                GoogleAuthState,
+                ARRAY_SIZE(GoogleAuthState)
+                );
+            HaveGoogleAuthCode = TRUE;
+            ConditionBroadcast(&AuthCodeCondition);
+        }
+        MutexUnlock(&AuthCodeLock);
+    }
+    else
+    {
+        AssetServe(
+            Connection,
+            HttpMessage
+            );
+    }
+}
+
+VOID
+HandleEvent(
+    IN struct mg_connection* Connection,
+    IN INT Event,
+    IN PVOID EventData,
+    IN PVOID Data
+    )
+/*++
+
+Routine Description:
+
+    This routine handles events from the server.
+
+Arguments:
+
+    Connection - The connection to the server.
+
+    Event - The event.
+
+    EventData - Data for the event.
+
+    Data - The manager for listeners, or the connection's state once it's
+           been accepted.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PCONNECTION_STATE State = GET_CONNECTION_STATE(Connection);
+
+    WatchdogHandlerBegin(
+        "http",
+        Event
+        );
+
+    if ( Event == MG_EV_ACCEPT )
+    {
+        struct mg_tls_opts TlsOptions = {
+            .cert = TlsCertPath,
+            .certkey = TlsKeyPath
+        };
+
+        if ( !ConnectionAccept(Connection) )
+        {
+            Connection->is_closing = 1;
+            goto Done;
+        }
+
+        mg_tls_init(
+            Connection,
+            &TlsOptions
+            );
+        GET_CONNECTION_STATE(Connection)->HandshakeStart = TraceNow();
+    }
+    else if ( Event == MG_EV_CLOSE )
+    {
+        ConnectionClose(Connection);
+    }
+    else if ( Event == MG_EV_READ )
+    {
+        ConnectionTouch(Connection);
+
+        // The handshake is done once mongoose stops feeding reads to it
+        if ( State && State->HandshakeStart && !Connection->is_tls_hs )
+        {
+            TraceSpan(
+                "tls",
+                "handshake",
+                State->HandshakeStart,
+                TraceNow(),
+                NULL
+                );
+            State->HandshakeStart = 0;
+        }
+    }
+    else if ( Event == MG_EV_POLL || Event == MG_EV_WRITE )
+    {
+        if ( Event == MG_EV_WRITE )
+        {
+            ConnectionTouch(Connection);
+        }
+
+        if ( State && State->Exporting )
+        {
+            ContinueExport(
+                Connection,
+                State
+                );
+        }
+    }
+    else if ( Event == MG_EV_HTTP_MSG )
+    {
+        struct mg_http_message* HttpMessage = EventData;
+        UINT64 Start;
+
+        WatchdogSetRoute(&HttpMessage->uri);
+        CaptureRecord(HttpMessage);
+        Start = TraceNow();
+        ArenaBegin(&RequestArena);
+        HandleHttpMessage(
+            Connection,
+            HttpMessage,
+            State
+            );
+        ArenaEnd(&RequestArena);
+
+        if ( ATOMIC_LOAD_BOOLEAN(&TraceEnabled) )
+        {
+            CHAR Uri[128];
+            JSON_WRITER Writer;
+
+            // Long URIs are cut off, which is plenty to tell them apart
+            JsonWriterInitialize(
+                &Writer,
+                Uri,
+                ARRAY_SIZE(Uri),
+                NULL,
+                NULL
+                );
+            JsonWriteStringLength(
+                &Writer,
+                HttpMessage->uri.ptr,
+                MIN(HttpMessage->uri.len, 96)
+                );
+            TraceSpan(
+                "http",
+                "request",
+                Start,
+                TraceNow(),
+                "{\"method\":\"%.*s\",\"uri\":%s,\"id\":%lu}",
+                (INT)MIN(HttpMessage->method.len, 8),
+                HttpMessage->method.ptr,
+                Writer.Error ? "null" : Uri,
+                Connection->id
+                );
+        }
+    }
+
+Done:
+    WatchdogHandlerEnd();
+}
+
+static INT LastSignal;
+static INT SignalCount;
+
+VOID
+HandleSignal(
+    IN INT Signal
+    )
+/*++
+
+Routine Description:
+
+    Saves signals so the server can exit cleanly. A second signal stops
+    draining. The loop is woken, since the signal may have been delivered
+    to another thread while it waits.
+
+Arguments:
+
+    Signal
+
+--*/
+{
+    LastSignal = Signal;
+    SignalCount++;
+    LOG("Received signal %d\n", LastSignal);
+    ExecutorWake();
+}
+
+static BOOLEAN SessionsReplayed;
+
+VOID
+IndexRecord(
+    IN PCATTENDANCE_RECORD Record
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a journal record to the in-memory indexes. Check-outs
+    only go in the session index, which is left for ReplaySessions while
+    the journal is being read. With a roster file, records for anyone not
+    in it are only counted in the stats. Otherwise members are added as
+    they check in, but only with valid numbers, so typos don't become
+    members.
+
+Arguments:
+
+    Record - The record.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 MemberId;
+    BOOLEAN CheckOut;
+
+    CheckOut = (Record->Flags & JOURNAL_FLAG_CHECK_OUT) != 0;
+    if ( !CheckOut )
+    {
+        StatsRecord((time_t)Record->Timestamp);
+    }
+
+    if ( RosterPath ||
+         Record->Number < ROSTER_MIN_NUMBER ||
+         Record->Number > ROSTER_MAX_NUMBER )
+    {
+        MemberId = RosterFindMember(Record->Number);
+    }
+    else
+    {
+        MemberId = RosterInternMember(
+            Record->Number,
+            Record->Name
+            );
+    }
+    if ( MemberId == ROSTER_INVALID_ID )
+    {
+        return;
+    }
+
+    // The journal isn't in time order, so sessions are rebuilt once it's
+    // been read
+    if ( SessionsReplayed )
+    {
+        SessionsRecord(
+            MemberId,
+            (time_t)Record->Timestamp,
+            CheckOut
+            );
+    }
+
+    if ( !CheckOut )
+    {
+        AttendanceRecord(
+            MemberId,
+            (time_t)Record->Timestamp
+            );
+    }
+}
+
+static VOID
+ReplaySessions(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine rebuilds the session index from the journal in time
+    order. Imports append old records after newer ones, and sessions only
+    take records in order, so replaying in the order records were written
+    would skip them.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ATTENDANCE_RECORD Record;
+    JOURNAL_KEY Key;
+    UINT64 Count;
+    UINT64 Position;
+    UINT32 MemberId;
+
+    Count = JournalGetOrderedCount();
+    for ( Position = 0; Position < Count; Position++ )
+    {
+        if ( !JournalGetOrderedKey(
+                 Position,
+                 &Key
+                 ) ||
+             !JournalRead(
+                 Key.Index,
+                 &Record,
+                 1
+                 ) )
+        {
+            continue;
+        }
+
+        MemberId = RosterFindMember(Record.Number);
+        if ( MemberId != ROSTER_INVALID_ID )
+        {
+            SessionsRecord(
+                MemberId,
+                (time_t)Record.Timestamp,
+                (Record.Flags & JOURNAL_FLAG_CHECK_OUT) != 0
+                );
+        }
+    }
+
+    SessionsReplayed = TRUE;
+}
+
+VOID
+RecordUser(
+    IN PCCHAR Name,
+    IN PCCHAR Number,
+    IN BOOLEAN CheckOut,
+    IN PDELIVERY_ROUTE Route OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine records an accepted submission in the journal and indexes,
+    and queues it on a route to be written to that route's spreadsheet.
+    Check-outs are only recorded locally, since the spreadsheet's rows are
+    arrivals.
+
+Arguments:
+
+    Name - The name that was submitted.
+
+    Number - The number that was submitted.
+
+    CheckOut - Whether it's a check-out.
+
+    Route - The route to send the submission to the spreadsheet on, or NULL
+            to only record it locally.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ATTENDANCE_RECORD Record = {0};
+    UINT32 MemberCount;
+
+    Record.Timestamp = time(NULL);
+    Record.Flags = CheckOut ? JOURNAL_FLAG_CHECK_OUT : 0;
+    Record.Number = strtoul(
+        Number,
+        NULL,
+        10
+        );
+    strncpy(
+        Record.Name,
+        Name,
+        ARRAY_SIZE(Record.Name) - 1
+        );
+
+    if ( !JournalAppend(&Record) )
+    {
+        LOG("Failed to journal %s (%s)\n", Name, Number);
+    }
+
+    MemberCount = RosterGetMemberCount();
+    IndexRecord(&Record);
+
+    // Someone new can be suggested and matched once they've checked in
+    if ( RosterGetMemberCount() != MemberCount )
+    {
+        SuggestRebuild();
+        FuzzyRebuild();
+    }
+
+    if ( Route && !CheckOut && !DeliveryEnqueue(
+                       Route,
+                       &Record
+                       ) )
+    {
+        LOG("Failed to queue %s (%s) for the spreadsheet\n", Name, Number);
+    }
+}
 
-            if ( !HaveGoogleAuthCode )
-			{
-                mg_http_get_var(
-                    &QueryMgStr,
-                    "code",
-                    GoogleAuthCode,
-                    ARRAY_SIZE(GoogleAuthCode)
-                    );
-                mg_http_get_var(
-                    &QueryMgStr,
-                    "state",
-                    GoogleAuthState,
-                    ARRAY_SIZE(GoogleAuthState)
-                    );
-                HaveGoogleAuthCode = TRUE;
-            }
-			else
-			{
+static PCCHAR
+CheckName(
+    IN PCCHAR Name,
+    IN UINT32 Number
+    )
+/*++
 
-			}
-        }
-        else
+Routine Description:
+
+    This routine checks a submitted name against the roster member with the
+    submitted number, and looks for the member it's closest to when it
+    doesn't match them, to catch typos in either.
+
+Arguments:
+
+    Name - The name that was submitted.
+
+    Number - The number that was submitted.
+
+Return Value:
+
+    A warning, which is only valid until the next call, or NULL if the name
+    matches the number or nobody is close to it.
+
+--*/
+{
+    static CHAR Warning[ROSTER_NAME_SIZE * 2 + 96];
+    CHAR Folded[ROSTER_NAME_SIZE];
+    CHAR MemberFolded[ROSTER_NAME_SIZE];
+    PCROSTER_MEMBER Member;
+    PCROSTER_MEMBER Match;
+    UINT32 MatchNumber;
+    UINT32 Distance;
+    UINT32 Id;
+
+    Id = RosterFindMember(Number);
+    Member = Id != ROSTER_INVALID_ID && RosterGetMember(Id)->Name[0] ? RosterGetMember(Id) : NULL;
+    FoldName(
+        Name,
+        Folded,
+        ARRAY_SIZE(Folded)
+        );
+    if ( Member )
+    {
+        FoldName(
+            Member->Name,
+            MemberFolded,
+            ARRAY_SIZE(MemberFolded)
+            );
+        if ( strcmp(Folded, MemberFolded) == 0 )
         {
-            LOG("Serving static content in " ROOT_DIR "/" STATIC_PAGE "\n");
-            mg_http_serve_file(
-                Connection,
-                HttpMessage,
-                STATIC_PAGE,
-                &StaticOptions
-                );
+            return NULL;
         }
     }
-}
 
-static INT LastSignal;
+    Match = NULL;
+    if ( FuzzyFind(
+             Name,
+             &MatchNumber,
+             &Distance
+             ) )
+    {
+        Id = RosterFindMember(MatchNumber);
+        Match = Id != ROSTER_INVALID_ID ? RosterGetMember(Id) : NULL;
+    }
 
-VOID
-HandleSignal(
-    IN INT Signal
+    if ( Match && Match == Member )
+    {
+        snprintf(
+            Warning,
+            ARRAY_SIZE(Warning),
+            "Name may be misspelled, this number is %s's",
+            Member->Name
+            );
+    }
+    else if ( Match && Member )
+    {
+        snprintf(
+            Warning,
+            ARRAY_SIZE(Warning),
+            "Name looks like %s (%u), but this number is %s's",
+            Match->Name,
+            Match->Number,
+            Member->Name
+            );
+    }
+    else if ( Match )
+    {
+        snprintf(
+            Warning,
+            ARRAY_SIZE(Warning),
+            "Number isn't on the roster, did you mean %s (%u)?",
+            Match->Name,
+            Match->Number
+            );
+    }
+    else if ( Member )
+    {
+        snprintf(
+            Warning,
+            ARRAY_SIZE(Warning),
+            "Name doesn't match %s, who has this number",
+            Member->Name
+            );
+    }
+    else
+    {
+        return NULL;
+    }
+
+    LOG("Name %s with number %u: %s\n", Name, Number, Warning);
+    return Warning;
+}
+
+BOOLEAN
+SubmitUser(
+    IN PCCHAR Name,
+    IN PCCHAR Number,
+    IN PCCHAR Event OPTIONAL,
+    IN PCCHAR Team OPTIONAL,
+    IN BOOLEAN CheckOut,
+    IN PCCHAR Path,
+    IN SIZE_T PathLength,
+    OUT PCCHAR* Warning
     )
 /*++
 
 Routine Description:
 
-    Saves signals so the server can exit cleanly.
+    This routine checks a submission and records it on the route it
+    matches. Every way of submitting goes through here, so they're all
+    validated the same way.
 
 Arguments:
 
-    Signal
+    Name - The name that was submitted.
+
+    Number - The number that was submitted.
+
+    Event - The event the submission is for, or NULL.
+
+    Team - The team the submission is for, or NULL.
+
+    CheckOut - Whether the member is checking out instead of in.
+
+    Path - The request path, for routes that match on it.
+
+    PathLength - The length of the path.
+
+    Warning - Receives a warning to show the user about an accepted
+              submission, or why one was refused, or NULL if there's
+              nothing wrong with it.
+
+Return Value:
+
+    TRUE - The submission was recorded.
+
+    FALSE - The name or number was empty, or it was a check-out without a
+            check-in to close, and nothing was recorded.
 
 --*/
 {
-    LastSignal = Signal;
-    LOG("Received signal %d\n", LastSignal);
+    UINT64 Start;
+
+    *Warning = NULL;
+    if ( !*Name || !*Number )
+    {
+        return FALSE;
+    }
+
+    Start = TraceNow();
+
+    LOG("Received name %s and number %s\n", Name, Number);
+    if ( atoi(Number) < ROSTER_MIN_NUMBER )
+    {
+        *Warning = "Number is invalid or less than 9 digits";
+    }
+    else if ( CheckOut && !SessionsGetOpen(
+                               RosterFindMember(strtoul(Number, NULL, 10)),
+                               NULL
+                               ) )
+    {
+        LOG("Refusing check-out of %s, who isn't checked in\n", Number);
+        *Warning = "Not checked in";
+        return FALSE;
+    }
+    else if ( !CheckOut )
+    {
+        *Warning = CheckName(
+            Name,
+            strtoul(Number, NULL, 10)
+            );
+    }
+
+    RecordUser(
+        Name,
+        Number,
+        CheckOut,
+        DeliveryFindRoute(
+            Event,
+            Team,
+            Path,
+            PathLength
+            )
+        );
+
+    TraceSpan(
+        "submit",
+        "submit",
+        Start,
+        TraceNow(),
+        "{\"warning\":%s,\"check_out\":%s}",
+        *Warning ? "true" : "false",
+        CheckOut ? "true" : "false"
+        );
+    return TRUE;
 }
 
 SIZE_T
@@ -298,7 +1791,9 @@ CurlWrite(
 
 Routine Description:
 
-    Writes curl'd data to a buffer (must be 1024 bytes).
+    Writes curl'd data to a segmented buffer, or feeds it straight to a JSON
+    tokenizer if the buffer has one, so responses of any size are handled
+    without truncating them or copying them again.
 
 Arguments:
 
@@ -308,43 +1803,46 @@ Arguments:
 
     Count - Number of elements.
 
-    Buffer - Buffer to write to. Must be at least 1024 bytes.
+    Buffer - CURL_BUFFER to write to.
 
 Return Value:
 
-    Returns the number of bytes written.
+    Returns the number of bytes written, anything else makes curl fail the
+    transfer.
 
 --*/
 {
     PCURL_BUFFER RealBuffer = Buffer;
-    SIZE_T AmountCopied;
+    SIZE_T Length;
 
     if ( !Buffer )
 	{
         return 0;
     }
 
-    LOG("Writing data for cURL\n");
-	if ( Size * Count > CURLWRITE_SIZE - RealBuffer->Length )
-	{
-        AmountCopied = CURLWRITE_SIZE - RealBuffer->Length;
-    }
-	else
-	{
-        AmountCopied = Size * Count;
+    Length = Size * Count;
+    if ( RealBuffer->Tokenizer )
+    {
+        if ( !JsonTokenizerFeed(
+                 RealBuffer->Tokenizer,
+                 Pointer,
+                 Length
+                 ) )
+        {
+            return 0;
+        }
     }
-    memcpy(
-        RealBuffer->Data + RealBuffer->Length,
-        Pointer,
-        AmountCopied
-        );
-    if ( Buffer && Size == sizeof(CHAR) && strnlen(Buffer, Size * Count) > 0 )
-	{
-	    LOG("Data:\n%s\n", (PCHAR)Buffer);
+    else if ( !BufferAppend(
+                  &RealBuffer->Data,
+                  Pointer,
+                  Length
+                  ) )
+    {
+        return 0;
     }
+
     HaveGoogleOauth2Token = TRUE;
-    RealBuffer->Length += AmountCopied;
-    return AmountCopied;
+    return Length;
 }
 
 BOOLEAN
@@ -382,10 +1880,13 @@ Return Value:
     UINT Error;
     CURL* Curl;
 	CURL_BUFFER Response = {0};
+    UINT64 Start;
     INT i;
     struct curl_slist* HttpHeader;
     cJSON* JsonResponseRoot;
     cJSON* JsonObject;
+    ARENA Arena = {0};
+    PCHAR ResponseText;
 
     (Parameter);
 
@@ -485,11 +1986,25 @@ Return Value:
         );
 
     LOG("Visit this URL to authenticate: %s\n", RequestUrl);
-	HaveGoogleAuthCode = FALSE;
-    while ( !HaveGoogleAuthCode )
-	{
-        ;
+
+    // The worker sleeps until the OAuth endpoint gets the code
+    MutexLock(&AuthCodeLock);
+    HaveGoogleAuthCode = FALSE;
+    while ( !HaveGoogleAuthCode && !AuthCodeCancelled )
+    {
+        ConditionWait(
+            &AuthCodeCondition,
+            &AuthCodeLock,
+            WAIT_FOREVER
+            );
     }
+    if ( !HaveGoogleAuthCode )
+    {
+        MutexUnlock(&AuthCodeLock);
+        LOG("Stopped waiting for the authorization code\n");
+        return FALSE;
+    }
+    MutexUnlock(&AuthCodeLock);
 
     HttpHeader = NULL;
     HttpHeader = curl_slist_append(
@@ -554,10 +2069,23 @@ Return Value:
         CURLOPT_WRITEFUNCTION,
         CurlWrite
         );
+    Start = TraceNow();
     curl_easy_perform(Curl);
+    TraceCurl(
+        "oauth.token",
+        Curl,
+        Start
+        );
     curl_easy_cleanup(Curl);
-    
-    JsonResponseRoot = cJSON_Parse(Response.Data);
+    curl_slist_free_all(HttpHeader);
+
+    ArenaBegin(&Arena);
+    ResponseText = BufferFlatten(
+        &Response.Data,
+        &Arena
+        );
+    BufferFree(&Response.Data);
+    JsonResponseRoot = cJSON_Parse(ResponseText);
     JsonObject = cJSON_GetObjectItem(
         JsonResponseRoot,
         "access_token"
@@ -581,14 +2109,366 @@ Return Value:
         TimeUntilRefresh = cJSON_GetNumberValue(JsonObject);
         TimeOfLastRefresh = time(NULL);
 
-        LOG("Set server.google_oauth2_token to \"%s\"", GoogleOauth2Token);
-        exit(0);
-	}
-	else
-	{
-		LOG("Failed to get tokens:\n%s\n", Response.Data);
-		exit(1);
+        LOG("Set server.google_oauth2_token to \"%s\"", GoogleOauth2Token);
+        ArenaEnd(&Arena);
+        ArenaFree(&Arena);
+        exit(0);
+	}
+	else
+	{
+		LOG("Failed to get tokens:\n%s\n", ResponseText ? ResponseText : "(out of memory)");
+		exit(1);
+    }
+}
+
+BOOLEAN
+GetGoogleAccessToken(
+    OUT PCHAR Buffer,
+    IN SIZE_T BufferSize
+    )
+/*++
+
+Routine Description:
+
+    This routine copies the current access token, which can be replaced by
+    the refresh thread at any time.
+
+Arguments:
+
+    Buffer - Receives the token.
+
+    BufferSize - The size of the buffer.
+
+Return Value:
+
+    TRUE - There is an access token.
+
+    FALSE - There isn't an access token yet.
+
+--*/
+{
+    MutexLock(&TokenLock);
+    strncpy(
+        Buffer,
+        GoogleOauth2AccessToken,
+        BufferSize - 1
+        );
+    Buffer[BufferSize - 1] = 0;
+    MutexUnlock(&TokenLock);
+
+    return Buffer[0] != 0;
+}
+
+BOOLEAN
+LoadTokenCache(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine loads the access token saved by the last run, if it's
+    still valid for long enough to be worth using.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The cached token was loaded.
+
+    FALSE - There's no usable cached token.
+
+--*/
+{
+    CHAR Buffer[1024];
+    FILE* CacheFile;
+    SIZE_T Length;
+    cJSON* CacheJson;
+    cJSON* JsonObject;
+    time_t ExpiresAt;
+    time_t Now;
+    BOOLEAN Loaded;
+
+    CacheFile = fopen(
+        TokenCachePath,
+        "rb"
+        );
+    if ( !CacheFile )
+    {
+        return FALSE;
+    }
+
+    Length = fread(
+        Buffer,
+        1,
+        ARRAY_SIZE(Buffer) - 1,
+        CacheFile
+        );
+    fclose(CacheFile);
+    Buffer[Length] = 0;
+
+    Loaded = FALSE;
+    ArenaBegin(&UpstreamArena);
+    CacheJson = cJSON_Parse(Buffer);
+    JsonObject = cJSON_GetObjectItem(
+        CacheJson,
+        "expires_at"
+        );
+    ExpiresAt = (time_t)cJSON_GetNumberValue(JsonObject);
+    JsonObject = cJSON_GetObjectItem(
+        CacheJson,
+        "access_token"
+        );
+    Now = time(NULL);
+    if ( cJSON_GetStringValue(JsonObject) && ExpiresAt - Now > TOKEN_REFRESH_MARGIN )
+    {
+        MutexLock(&TokenLock);
+        strncpy(
+            GoogleOauth2AccessToken,
+            cJSON_GetStringValue(JsonObject),
+            ARRAY_SIZE(GoogleOauth2AccessToken) - 1
+            );
+        TimeOfLastRefresh = Now;
+        TimeUntilRefresh = (UINT16)MIN(ExpiresAt - Now, UINT16_MAX);
+        NextTokenRefresh = ExpiresAt - TOKEN_REFRESH_MARGIN;
+        MutexUnlock(&TokenLock);
+
+        LOG("Using cached access token, valid for %llds\n", (long long)(ExpiresAt - Now));
+        Loaded = TRUE;
+    }
+    else
+    {
+        LOG("Cached access token in %s is missing or expired\n", TokenCachePath);
+    }
+    ArenaEnd(&UpstreamArena);
+
+    return Loaded;
+}
+
+BOOLEAN
+SaveTokenCache(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine saves the access token and its expiry time so the next run
+    can use it without waiting for Google. The file is written next to the
+    cache and renamed over it so a crash can't leave it half written.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The token was saved.
+
+    FALSE - The token couldn't be saved.
+
+--*/
+{
+    CHAR TempPath[512];
+    FILE* CacheFile;
+    BOOLEAN Written;
+
+    snprintf(
+        TempPath,
+        ARRAY_SIZE(TempPath),
+        "%s.tmp",
+        TokenCachePath
+        );
+    CacheFile = fopen(
+        TempPath,
+        "wb"
+        );
+    if ( !CacheFile )
+    {
+        LOG("Failed to open token cache \"%s\": %s (errno %d)\n", TempPath, ERRNO_STRING());
+        return FALSE;
+    }
+
+#ifndef _WIN32
+    // The access token is a credential
+    fchmod(
+        fileno(CacheFile),
+        0600
+        );
+#endif
+
+    MutexLock(&TokenLock);
+    Written = fprintf(
+        CacheFile,
+        "{\"access_token\":\"%s\",\"expires_at\":%lld}\n",
+        GoogleOauth2AccessToken,
+        (long long)(TimeOfLastRefresh + TimeUntilRefresh)
+        ) > 0;
+    MutexUnlock(&TokenLock);
+    Written = fclose(CacheFile) == 0 && Written;
+
+#ifdef _WIN32
+    remove(TokenCachePath);
+#endif
+    if ( !Written || rename(
+                         TempPath,
+                         TokenCachePath
+                         ) != 0 )
+    {
+        LOG("Failed to save token cache \"%s\": %s (errno %d)\n", TokenCachePath, ERRNO_STRING());
+        remove(TempPath);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static VOID
+AuthenticateTask(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine runs the interactive OAuth flow on a worker, since it
+    waits for the user to visit the authentication URL.
+
+Arguments:
+
+    Parameter - Not used.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( !AuthenticateGoogle(Parameter) )
+    {
+        LOG("Failed to authenticate with Google\n");
+    }
+}
+
+static VOID
+RefreshTokenTask(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine refreshes the access token off the main thread and
+    schedules the next refresh, or a retry if it failed.
+
+Arguments:
+
+    Parameter - Not used.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    BOOLEAN Refreshed;
+
+    (Parameter);
+
+    Refreshed = RefreshGoogleToken();
+
+    MutexLock(&TokenLock);
+    if ( Refreshed )
+    {
+        NextTokenRefresh = TimeOfLastRefresh + TimeUntilRefresh - TOKEN_REFRESH_MARGIN;
+    }
+    else
+    {
+        LOG("Retrying token refresh in %ds\n", TOKEN_RETRY_DELAY);
+        NextTokenRefresh = time(NULL) + TOKEN_RETRY_DELAY;
+    }
+    RefreshInProgress = FALSE;
+    MutexUnlock(&TokenLock);
+}
+
+VOID
+StartTokenRefresh(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine starts a refresh of the access token in the background if
+    it's due and one isn't already running.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    MutexLock(&TokenLock);
+    if ( RefreshInProgress || time(NULL) < NextTokenRefresh )
+    {
+        MutexUnlock(&TokenLock);
+        return;
+    }
+    RefreshInProgress = TRUE;
+    MutexUnlock(&TokenLock);
+
+    if ( !ExecutorSubmit(
+             RefreshTokenTask,
+             NULL,
+             NULL
+             ) )
+    {
+        MutexLock(&TokenLock);
+        NextTokenRefresh = time(NULL) + TOKEN_RETRY_DELAY;
+        RefreshInProgress = FALSE;
+        MutexUnlock(&TokenLock);
+    }
+}
+
+static time_t
+GetNextTokenRefresh(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets when StartTokenRefresh next has a refresh to start. A
+    refresh that's running wakes the loop when it's done, so it has no
+    deadline.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The time the next refresh is due, or 0 if there's nothing to wait for.
+
+--*/
+{
+    time_t Next;
+
+    if ( !strlen(GoogleOauth2Token) )
+    {
+        return 0;
     }
+
+    MutexLock(&TokenLock);
+    Next = RefreshInProgress ? 0 : MAX(NextTokenRefresh, 1);
+    MutexUnlock(&TokenLock);
+    return Next;
 }
 
 BOOLEAN
@@ -599,7 +2479,9 @@ RefreshGoogleToken(
 
 Routine Description:
 
-    Refreshes the Google access token using the refresh token.
+    Refreshes the Google access token using the refresh token. This runs
+    on the refresh thread started by StartTokenRefresh, which owns
+    UpstreamArena while it runs.
 
 Arguments:
 
@@ -613,21 +2495,19 @@ Return Value:
 
 --*/
 {
-    CHAR RequestBody[512];
+    PCHAR RequestBody;
 	struct curl_slist* HttpHeader;
 	CURL_BUFFER Response = {0};
     CURL* Curl;
+    UINT64 Start;
     cJSON* JsonResponseRoot;
     cJSON* JsonObject;
 
-    HttpHeader = NULL;
-    HttpHeader = curl_slist_append(
-        HttpHeader,
-        "Content-Type: application/x-www-form-urlencoded"
-        );
-    snprintf(
-        RequestBody,
-        ARRAY_SIZE(RequestBody),
+    // The request body and the parsed response are released all at once
+    ArenaBegin(&UpstreamArena);
+
+    RequestBody = ArenaPrintf(
+        &UpstreamArena,
         "client_id=%s&"
         "client_secret=%s&"
         "grant_type=refresh_token&"
@@ -636,6 +2516,16 @@ Return Value:
 		GoogleOauth2ClientSecret,
         GoogleOauth2Token
         );
+    if ( !RequestBody )
+    {
+        goto Error;
+    }
+
+    HttpHeader = NULL;
+    HttpHeader = curl_slist_append(
+        HttpHeader,
+        "Content-Type: application/x-www-form-urlencoded"
+        );
 
     LOG("Attempting to refresh access token\n");
 	LOG("Requesting token:\n%s\n", RequestBody);
@@ -681,28 +2571,40 @@ Return Value:
 		CURLOPT_WRITEFUNCTION,
 		CurlWrite
         );
+    Start = TraceNow();
 	curl_easy_perform(Curl);
+    TraceCurl(
+        "oauth.refresh",
+        Curl,
+        Start
+        );
 	curl_easy_cleanup(Curl);
+	curl_slist_free_all(HttpHeader);
 
-	JsonResponseRoot = cJSON_Parse(Response.Data);
+	JsonResponseRoot = cJSON_Parse(BufferFlatten(
+		&Response.Data,
+		&UpstreamArena
+		));
+	BufferFree(&Response.Data);
 	JsonObject = cJSON_GetObjectItem(
 		JsonResponseRoot,
 		"access_token"
         );
 	if (JsonObject)
 	{
+		MutexLock(&TokenLock);
 		strncpy(
 			GoogleOauth2AccessToken,
 			cJSON_GetStringValue(JsonObject),
 			ARRAY_SIZE(GoogleOauth2AccessToken) - 1
             );
-		GoogleOauth2Token = strdup(cJSON_GetStringValue(JsonObject));
 		JsonObject = cJSON_GetObjectItem(
 			JsonResponseRoot,
 			"expires_in"
             );
 		TimeUntilRefresh = cJSON_GetNumberValue(JsonObject);
 		TimeOfLastRefresh = time(NULL);
+		MutexUnlock(&TokenLock);
 	}
 	else
 	{
@@ -710,12 +2612,47 @@ Return Value:
 	}
 
     LOG("New access token is \"%s\"\n", GoogleOauth2AccessToken);
+    SaveTokenCache();
+    ArenaEnd(&UpstreamArena);
     return TRUE;
 Error:
     LOG("Failed to refresh access token\n");
+    ArenaEnd(&UpstreamArena);
     return FALSE;
 }
 
+static PCHAR
+GetOptionalString(
+	IN toml_table_t* Table,
+	IN PCCHAR Key
+	)
+/*++
+
+Routine Description:
+
+	This routine reads an optional string from a config table.
+
+Arguments:
+
+	Table - The table.
+
+	Key - The key.
+
+Return Value:
+
+	The string, or NULL if the key isn't there.
+
+--*/
+{
+	toml_datum_t TomlDatum;
+
+	TomlDatum = toml_string_in(
+		Table,
+		Key
+		);
+	return TomlDatum.ok ? TomlDatum.u.s : NULL;
+}
+
 BOOLEAN
 ParseConfiguration(
     VOID
@@ -744,6 +2681,11 @@ Return Value:
 	toml_table_t* Server;
 	char TomlErrorBuffer[128];
 	toml_datum_t TomlDatum;
+	toml_array_t* Routes;
+	toml_table_t* Route;
+	PCHAR RouteName;
+	PCHAR RouteSpreadsheet;
+	INT i;
 
 	Error = FALSE;
 
@@ -752,125 +2694,369 @@ Return Value:
 		CONFIG_FILE,
 		"r"
         );
-	if ( !ConfigFile )
+	if ( !ConfigFile )
+	{
+		LOG("Failed to open " CONFIG_FILE ": %s (errno %d)\n", ERRNO_STRING());
+		goto Cleanup;
+	}
+
+	Config = toml_parse_file(
+		ConfigFile,
+		TomlErrorBuffer,
+		ARRAY_SIZE(TomlErrorBuffer)
+        );
+	fclose(ConfigFile);
+
+	LOG("Parsing config\n");
+	Server = toml_table_in(
+		Config,
+		"server"
+        );
+	if ( !Server )
+	{
+		LOG("Config missing [server]: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+
+	TomlDatum = toml_string_in(
+		Server,
+		"spreadsheet_id"
+        );
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.spreadsheet_id: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	SpreadsheetId = TomlDatum.u.s;
+
+	TomlDatum = toml_string_in(
+		Server,
+		"google_oauth2_client"
+        );
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.google_oauth2_client: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	GoogleOauth2ClientJson = TomlDatum.u.s;
+
+	TomlDatum = toml_string_in(
+		Server,
+		"google_oauth2_token"
+        );
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.google_oauth2_token: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	GoogleOauth2Token = TomlDatum.u.s;
+
+	TomlDatum = toml_string_in(
+		Server,
+		"tls_cert_path"
+        );
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.tls_cert_path: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	TlsCertPath = TomlDatum.u.s;
+
+	TomlDatum = toml_string_in(
+		Server,
+		"tls_key_path"
+        );
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.tls_key_path: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	TlsKeyPath = TomlDatum.u.s;
+
+	TomlDatum = toml_int_in(
+		Server,
+		"port"
+        );
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.port: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	Port = TomlDatum.u.i;
+
+	TomlDatum = toml_int_in(
+		Server,
+		"poll_rate");
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.poll_rate: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	PollRate = TomlDatum.u.i;
+
+	TomlDatum = toml_string_in(
+		Server,
+		"email"
+        );
+	if ( !TomlDatum.ok )
+	{
+		LOG("Config missing server.email: %s\n", TomlErrorBuffer);
+		Error = TRUE;
+		goto Cleanup;
+	}
+	Email = TomlDatum.u.s;
+
+	TomlDatum = toml_string_in(
+		Server,
+		"token_cache_path"
+        );
+	TokenCachePath = TomlDatum.ok ? TomlDatum.u.s : TOKEN_CACHE_FILE;
+
+	TomlDatum = toml_int_in(
+		Server,
+		"keep_alive_timeout"
+        );
+	if ( TomlDatum.ok )
+	{
+		KeepAliveTimeout = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"max_connections"
+        );
+	if ( TomlDatum.ok )
+	{
+		MaxConnections = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"sweep_interval"
+        );
+	if ( TomlDatum.ok )
+	{
+		SweepInterval = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"idempotency_keys"
+        );
+	if ( TomlDatum.ok )
+	{
+		IdempotencyMaxKeys = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"idempotency_ttl"
+        );
+	if ( TomlDatum.ok )
 	{
-		LOG("Failed to open " CONFIG_FILE ": %s (errno %d)\n", ERRNO_STRING());
-		goto Cleanup;
+		IdempotencyTtl = TomlDatum.u.i;
 	}
 
-	Config = toml_parse_file(
-		ConfigFile,
-		TomlErrorBuffer,
-		ARRAY_SIZE(TomlErrorBuffer)
+	TomlDatum = toml_string_in(
+		Server,
+		"journal_path"
         );
-	fclose(ConfigFile);
+	JournalPath = TomlDatum.ok ? TomlDatum.u.s : JOURNAL_FILE;
 
-	LOG("Parsing config\n");
-	Server = toml_table_in(
-		Config,
-		"server"
+	TomlDatum = toml_string_in(
+		Server,
+		"roster_path"
         );
-	if ( !Server )
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing [server]: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		RosterPath = TomlDatum.u.s;
 	}
 
 	TomlDatum = toml_string_in(
 		Server,
-		"spreadsheet_id"
+		"roster_range"
         );
-	if ( !TomlDatum.ok )
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.spreadsheet_id: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		RosterRange = TomlDatum.u.s;
 	}
-	SpreadsheetId = TomlDatum.u.s;
 
 	TomlDatum = toml_string_in(
 		Server,
-		"google_oauth2_client"
+		"delivery_range"
         );
-	if ( !TomlDatum.ok )
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.google_oauth2_client: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		DeliveryRange = TomlDatum.u.s;
 	}
-	GoogleOauth2ClientJson = TomlDatum.u.s;
 
-	TomlDatum = toml_string_in(
+	TomlDatum = toml_int_in(
 		Server,
-		"google_oauth2_token"
+		"write_quota"
         );
-	if ( !TomlDatum.ok )
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.google_oauth2_token: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		DeliveryQuota = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"scanner_port"
+		);
+	if ( TomlDatum.ok )
+	{
+		ScannerPort = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"scanner_idle_timeout"
+		);
+	if ( TomlDatum.ok )
+	{
+		ScannerIdleTimeout = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_bool_in(
+		Server,
+		"trace"
+		);
+	if ( TomlDatum.ok )
+	{
+		TraceEnabled = TomlDatum.u.b;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"stall_threshold"
+		);
+	if ( TomlDatum.ok )
+	{
+		StallThreshold = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"worker_threads"
+		);
+	if ( TomlDatum.ok )
+	{
+		ExecutorWorkers = TomlDatum.u.i;
+	}
+
+	TomlDatum = toml_int_in(
+		Server,
+		"drain_timeout"
+		);
+	if ( TomlDatum.ok )
+	{
+		DrainTimeout = TomlDatum.u.i;
 	}
-	GoogleOauth2Token = TomlDatum.u.s;
 
 	TomlDatum = toml_string_in(
 		Server,
-		"tls_cert_path"
-        );
-	if ( !TomlDatum.ok )
+		"handoff_path"
+		);
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.tls_cert_path: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		HandoffPath = TomlDatum.u.s;
 	}
-	TlsCertPath = TomlDatum.u.s;
 
 	TomlDatum = toml_string_in(
 		Server,
-		"tls_key_path"
-        );
-	if ( !TomlDatum.ok )
+		"journal_backend"
+		);
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.tls_key_path: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		if ( !StorageParseBackend(
+				 TomlDatum.u.s,
+				 &JournalBackend
+				 ) )
+		{
+			Error = TRUE;
+			goto Cleanup;
+		}
 	}
-	TlsKeyPath = TomlDatum.u.s;
 
 	TomlDatum = toml_int_in(
 		Server,
-		"port"
-        );
-	if ( !TomlDatum.ok )
+		"session_close_hour"
+		);
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.port: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		SessionCloseHour = (UINT32)CLAMP(TomlDatum.u.i, 0, 24);
 	}
-	Port = TomlDatum.u.i;
 
-	TomlDatum = toml_int_in(
+	TomlDatum = toml_string_in(
 		Server,
-		"poll_rate");
-	if ( !TomlDatum.ok )
+		"asset_path"
+		);
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.poll_rate: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		AssetPath = TomlDatum.u.s;
 	}
-	PollRate = TomlDatum.u.i;
 
 	TomlDatum = toml_string_in(
 		Server,
-		"email"
-        );
-	if ( !TomlDatum.ok )
+		"capture_path"
+		);
+	if ( TomlDatum.ok )
 	{
-		LOG("Config missing server.email: %s\n", TomlErrorBuffer);
-		Error = TRUE;
-		goto Cleanup;
+		CapturePath = TomlDatum.u.s;
+	}
+
+	// [[route]] tables send matching submissions to their own spreadsheets
+	Routes = toml_array_in(
+		Config,
+		"route"
+		);
+	for ( i = 0; Routes && i < toml_array_nelem(Routes); i++ )
+	{
+		Route = toml_table_at(
+			Routes,
+			i
+			);
+		RouteName = GetOptionalString(
+			Route,
+			"name"
+			);
+		RouteSpreadsheet = GetOptionalString(
+			Route,
+			"spreadsheet_id"
+			);
+		if ( !RouteName || !RouteSpreadsheet )
+		{
+			LOG("Config route %d needs a name and spreadsheet_id\n", i);
+			Error = TRUE;
+			goto Cleanup;
+		}
+
+		TomlDatum = toml_int_in(
+			Route,
+			"write_quota"
+			);
+		if ( !DeliveryAddRoute(
+				 RouteName,
+				 GetOptionalString(Route, "event"),
+				 GetOptionalString(Route, "team"),
+				 GetOptionalString(Route, "prefix"),
+				 RouteSpreadsheet,
+				 GetOptionalString(Route, "range"),
+				 TomlDatum.ok ? (UINT32)TomlDatum.u.i : 0
+				 ) )
+		{
+			Error = TRUE;
+			goto Cleanup;
+		}
 	}
-	Email = TomlDatum.u.s;
 
 Cleanup:
 	if ( Config )
@@ -1015,6 +3201,88 @@ Cleanup:
     return !Error;
 }
 
+static INT
+GetLoopTimeout(
+    IN struct mg_mgr* Manager
+    )
+/*++
+
+Routine Description:
+
+    This routine gets how long the loop can wait in poll before something
+    it runs is due, which is the soonest of the mongoose timers and the
+    loop's own deadlines. Everything else that needs the loop wakes it,
+    either through a socket or the executor, so with epoll an idle loop
+    waits until then. Without it, an idle loop still wakes every PollRate
+    milliseconds, since select can't wait forever.
+
+Arguments:
+
+    Manager - The manager.
+
+Return Value:
+
+    The timeout in milliseconds, or -1 to wait until woken.
+
+--*/
+{
+    struct mg_timer* Timer;
+    UINT64 Now;
+    UINT64 Until;
+    INT64 Deadline;
+    time_t Wall;
+
+    Now = mg_millis();
+    Until = UINT64_MAX;
+
+    // Timers that haven't run yet are set up by the next poll
+    for ( Timer = Manager->timers; Timer; Timer = Timer->next )
+    {
+        Until = MIN(Until, Timer->expire ? Timer->expire : Now);
+    }
+
+    Deadline = CaptureGetNextFlush();
+    if ( Deadline )
+    {
+        Until = MIN(Until, (UINT64)Deadline);
+    }
+
+    if ( HandoffIsListening() )
+    {
+        Until = MIN(Until, Now + HANDOFF_POLL_INTERVAL);
+    }
+
+    // The rest are in seconds of wall time
+    Wall = time(NULL);
+    Deadline = SessionsGetNextClose();
+    if ( Deadline != INT64_MAX )
+    {
+        Until = MIN(Until, Now + MAX(Deadline - Wall, 0) * 1000);
+    }
+
+    Deadline = RosterGetNextSync();
+    if ( Deadline )
+    {
+        Until = MIN(Until, Now + MAX(Deadline - Wall, 0) * 1000);
+    }
+
+    Deadline = GetNextTokenRefresh();
+    if ( Deadline )
+    {
+        Until = MIN(Until, Now + MAX(Deadline - Wall, 0) * 1000);
+    }
+
+#if MG_ENABLE_EPOLL
+    if ( Until == UINT64_MAX )
+    {
+        return -1;
+    }
+    return (INT)MIN(Until > Now ? Until - Now : 0, INT32_MAX);
+#else
+    return (INT)MIN(Until > Now ? Until - Now : 0, (UINT64)PollRate);
+#endif
+}
+
 INT
 main(
     IN INT argc,
@@ -1041,9 +3309,55 @@ Return Value:
 --*/
 {
     struct mg_mgr Manager;
-    PVOID AuthenticationThread;
+    struct mg_connection* Listener;
+    PCCHAR ImportPath;
+    BOOLEAN TakenOver;
+    UINT64 Deadline;
+    UINT32 OpenConnections;
+    UINT32 Pending;
+    INT Signals;
+    INT Timeout;
+
+    if ( argc > 1 && strcmp(argv[1], "--simulate-batching") == 0 )
+    {
+        return BatchControllerSimulate();
+    }
+
+    // --benchmark-storage <file> compares the journal's backends
+    if ( argc > 2 && strcmp(argv[1], "--benchmark-storage") == 0 )
+    {
+        return StorageBenchmark(argv[2]);
+    }
+
+    // --benchmark-fuzzy [members] times name matching on made up rosters
+    if ( argc > 1 && strcmp(argv[1], "--benchmark-fuzzy") == 0 )
+    {
+        return FuzzyBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 10000);
+    }
+
+    // --benchmark-json [bodies] times building Sheets bodies with the JSON
+    // writer and with cJSON
+    if ( argc > 1 && strcmp(argv[1], "--benchmark-json") == 0 )
+    {
+        return JsonBenchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000);
+    }
+
+    // --replay <capture> <url> [speed] replays captured requests against a
+    // server, at the captured speed unless told otherwise
+    if ( argc > 3 && strcmp(argv[1], "--replay") == 0 )
+    {
+        return ReplayRun(argv[2], argv[3], argc > 4 ? argv[4] : "1");
+    }
+
+    // --import <file> loads a CSV into the journal and exits
+    ImportPath = NULL;
+    if ( argc > 2 && strcmp(argv[1], "--import") == 0 )
+    {
+        ImportPath = argv[2];
+    }
 
     LOG("Initializing\n");
+    ArenaInitializeJsonHooks();
     mg_mgr_init(&Manager);
     psa_crypto_init();
 
@@ -1055,8 +3369,9 @@ Return Value:
 	{
         goto Cleanup;
     }
+    TraceSetThreadName("main");
 
-    if ( !ParseOauth2ClientJson() )
+    if ( !ImportPath && !ParseOauth2ClientJson() )
 	{
         goto Cleanup;
     }
@@ -1068,75 +3383,198 @@ Return Value:
         Port
         );
 
+    if ( RosterPath && !RosterLoad(RosterPath) )
+    {
+        goto Cleanup;
+    }
+
+    // During a restart the old server's listeners are taken over, and ours
+    // are opened on any port just to have their sockets swapped out. The
+    // old server releases the journal once it stops accepting, and only
+    // then is it read, so nothing it wrote is missed or written over.
+    TakenOver = !ImportPath && HandoffReceive();
+
+    StatsInitialize();
+    if ( !JournalOpen(
+             JournalPath,
+             IndexRecord,
+             TakenOver ? HANDOFF_JOURNAL_TIMEOUT : 0
+             ) )
+    {
+        goto Cleanup;
+    }
+
+    if ( ImportPath )
+    {
+        errno = ImportCsv(ImportPath) ? 0 : EIO;
+        goto Cleanup;
+    }
+    ReplaySessions();
+
+    if ( !CaptureOpen() )
+    {
+        goto Cleanup;
+    }
+
+    if ( !IdempotencyInitialize() )
+    {
+        goto Cleanup;
+    }
+
     LOG("Using spreadsheet ID %s\n", SpreadsheetId);
 	if ( strlen(GoogleOauth2Token) )
 	{
 		LOG("Using OAuth2 token %s\n", GoogleOauth2Token);
-		if (!RefreshGoogleToken())
-		{
-			goto Cleanup;
-		}
+		LoadTokenCache();
 	}
     LOG("Using TLS certificate in %s\n", TlsCertPath);
     LOG("Using TLS private key in %s\n", TlsKeyPath);
+    if ( AssetPath )
+    {
+        LOG("Serving files from %s instead of the built in ones\n", AssetPath);
+    }
 
     LOG("Listening on port :%hu\n", Port);
-    mg_http_listen(
+    Listener = mg_http_listen(
         &Manager,
-        Url,
+        HandoffHasListener(HANDOFF_ROLE_HTTP) ? "localhost:0" : Url,
         HandleEvent,
         &Manager
         );
+    if ( !Listener )
+    {
+        LOG("Failed to listen on %s\n", Url);
+        goto Cleanup;
+    }
+    HandoffRegister(
+        Listener,
+        HANDOFF_ROLE_HTTP
+        );
+    ConnectionStartSweeper(&Manager);
 
-    if ( !strlen(GoogleOauth2AccessToken) )
+    if ( !ExecutorStart(&Manager) )
     {
-        LOG("Starting OAuth thread\n");
-        AuthenticationThread = NULL;
-#ifdef _WIN32
-        AuthenticationThread = CreateThread(
-            0,
-            0,
-            (LPTHREAD_START_ROUTINE)AuthenticateGoogle,
-            NULL,
-            0,
-            NULL
-            );
-#else
-        pthread_create(
-            &AuthenticationThread,
-            NULL,
-            AuthenticateGoogle,
-            NULL
-            );
-#endif
-        if ( !AuthenticationThread )
+        goto Cleanup;
+    }
+    SuggestRebuild();
+    FuzzyRebuild();
+
+    if ( ScannerPort && !ScannerListen(&Manager) )
+    {
+        goto Cleanup;
+    }
+
+    if ( !DeliveryStart(SpreadsheetId) )
+    {
+        goto Cleanup;
+    }
+
+    // The listener is already open, so requests are served while this runs
+    if ( strlen(GoogleOauth2Token) )
+    {
+        StartTokenRefresh();
+    }
+    else
+    {
+        LOG("Starting OAuth task\n");
+        if ( !ExecutorSubmit(
+                 AuthenticateTask,
+                 NULL,
+                 NULL
+                 ) )
         {
-            LOG("Failed to create thread\n");
             goto Cleanup;
         }
 	}
 
-    LOG("Polling every %dms\n", PollRate);
+    if ( !WatchdogStart() || !HandoffListen() )
+    {
+        goto Cleanup;
+    }
+
+#if MG_ENABLE_EPOLL
+    LOG("Polling with epoll, waiting until woken when idle\n");
+#else
+    LOG("Polling every %dms when idle\n", PollRate);
+#endif
     while (LastSignal == 0)
     {
+        Timeout = GetLoopTimeout(&Manager);
+        WatchdogLoopBegin(Timeout);
         mg_mgr_poll(
             &Manager,
-            PollRate
+            Timeout
             );
-        if ( strlen(GoogleOauth2AccessToken) &&
-             time(NULL) - TimeOfLastRefresh > TimeUntilRefresh )
+        if ( strlen(GoogleOauth2Token) )
 		{
-            if ( !RefreshGoogleToken() )
-			{
-                goto Cleanup;
-			}
+            StartTokenRefresh();
+        }
+        RosterPollSync();
+        SessionsPoll(time(NULL));
+        CapturePoll();
+        WatchdogLoopEnd();
+
+        if ( HandoffPoll() )
+        {
+            // The new server waits for the journal before reading it, and
+            // submissions that reach this one from now on are refused
+            JournalRelease();
+            break;
+        }
+    }
+
+    // Stop accepting, then let open requests finish and queued submissions
+    // get written before closing everything
+    LOG("Draining for up to %ums\n", DrainTimeout);
+    Signals = SignalCount;
+    Deadline = mg_millis() + DrainTimeout;
+    DeliveryDrain();
+    while ( TRUE )
+    {
+        OpenConnections = ConnectionDrain(&Manager);
+        Pending = DeliveryGetPending();
+        if ( !OpenConnections && !Pending )
+        {
+            LOG("Drained\n");
+            break;
+        }
+
+        if ( mg_millis() >= Deadline || SignalCount != Signals )
+        {
+            LOG("Stopped draining with %u connections open and %u submissions unsent\n", OpenConnections, Pending);
+            break;
         }
+
+        mg_mgr_poll(
+            &Manager,
+            PollRate
+            );
     }
 
     errno = 0;
 Cleanup:
     LOG("Shutting down\n");
 
+    HandoffClose();
+
+    // Tasks use the journal, the roster and the indexes freed below, and
+    // their completions can still touch connections. A worker waiting for
+    // an authorization code would never return, so it's woken first.
+    MutexLock(&AuthCodeLock);
+    AuthCodeCancelled = TRUE;
+    ConditionBroadcast(&AuthCodeCondition);
+    MutexUnlock(&AuthCodeLock);
+    ExecutorStop();
     mg_mgr_free(&Manager);
+    CaptureClose();
+    JournalClose();
+    IdempotencyFree();
+    AttendanceFree();
+    SessionsFree();
+    SuggestFree();
+    FuzzyFree();
+    RosterFree();
+    ArenaFree(&RequestArena);
+    ArenaFree(&UpstreamArena);
     return errno;
 }
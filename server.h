@@ -16,10 +16,13 @@ Abstract:
 
 #include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
 // Not windows.h because mongoose redefines things
@@ -27,11 +30,14 @@ Abstract:
 #include <windef.h>
 #include <WinBase.h>
 #include <processthreadsapi.h>
+#include <synchapi.h>
 
 #define strdup _strdup
+#include <intrin.h>
 #else
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #endif
 
 #include "cJSON.h"
@@ -44,6 +50,33 @@ Abstract:
 #undef snprintf
 
 #include "types.h"
+#include "arena.h"
+#include "assets.h"
+#include "thread.h"
+#include "buffer.h"
+#include "json.h"
+#include "sheets.h"
+#include "roster.h"
+#include "attendance.h"
+#include "sessions.h"
+#include "suggest.h"
+#include "fuzzy.h"
+#include "storage.h"
+#include "journal.h"
+#include "history.h"
+#include "idempotency.h"
+#include "connection.h"
+#include "batching.h"
+#include "capture.h"
+#include "delivery.h"
+#include "executor.h"
+#include "scanner.h"
+#include "import.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "handoff.h"
 
 //
 // Print a message
@@ -80,7 +113,47 @@ Abstract:
 // Clamp to range
 //
 
-#define CLAMP(Value, Min, Max) ((Value) < (Max) && (Value) > (Min) ? (Value) : (Value) > (Max) ? (Value) < (Min) ? (Min) : (Value) : (Max))
+#define CLAMP(Value, Min, Max) ((Value) < (Min) ? (Min) : (Value) > (Max) ? (Max) : (Value))
+
+//
+// Count the set bits in a 64-bit integer
+//
+
+#ifdef _MSC_VER
+#define POPCOUNT64(x) ((UINT32)__popcnt64(x))
+#else
+#define POPCOUNT64(x) ((UINT32)__builtin_popcountll(x))
+#endif
+
+//
+// Count the trailing zero bits in a nonzero 64-bit integer
+//
+
+#ifdef _MSC_VER
+#define CTZ64(x) ((UINT32)_tzcnt_u64(x))
+#else
+#define CTZ64(x) ((UINT32)__builtin_ctzll(x))
+#endif
+
+//
+// Convert a timestamp to local time, thread safe
+//
+
+#ifdef _WIN32
+#define LOCALTIME(Timestamp, Time) localtime_s(Time, Timestamp)
+#else
+#define LOCALTIME(Timestamp, Time) localtime_r(Timestamp, Time)
+#endif
+
+//
+// Thread local storage
+//
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
 
 //
 // Get the number of elements in an array
@@ -95,13 +168,25 @@ Abstract:
 #define CONFIG_FILE "config.toml"
 
 //
-// Root directory of files
+// Access token cache file
+//
+
+#define TOKEN_CACHE_FILE "token_cache.json"
+
+//
+// Seconds before the access token expires to refresh it
 //
 
-#define ROOT_DIR "."
+#define TOKEN_REFRESH_MARGIN 60
 
 //
-// Name of file to serve by default
+// Seconds to wait before retrying a failed refresh
+//
+
+#define TOKEN_RETRY_DELAY 30
+
+//
+// Name of file to serve for paths that aren't anything else
 //
 
 #define STATIC_PAGE "index.html"
@@ -130,12 +215,125 @@ Abstract:
 
 #define SEND_USER_ENDPOINT "send_user"
 
+//
+// Get a member's attendance percentage
+//
+
+#define MEMBER_ATTENDANCE_ENDPOINT "member_attendance"
+
+//
+// Get the headcount of a meeting
+//
+
+#define MEETING_ATTENDANCE_ENDPOINT "meeting_attendance"
+
+//
+// Get the members who are checked in
+//
+
+#define PRESENT_ENDPOINT "present"
+
+//
+// Get the hours members spent checked in over a range of days
+//
+
+#define MEMBER_HOURS_ENDPOINT "member_hours"
+
+//
+// Download the journal as CSV
+//
+
+#define EXPORT_ENDPOINT "export"
+
+//
+// Page through the journal in time order
+//
+
+#define HISTORY_ENDPOINT "history"
+
+//
+// Suggest members as their name is typed
+//
+
+#define SUGGEST_ENDPOINT "suggest"
+
+//
+// Stop filling a connection's send buffer past this many bytes, so exports
+// wait for slow clients instead of buffering the whole journal
+//
+
+#define EXPORT_SEND_LIMIT 16384
+
+//
+// Get server metrics
+//
+
+#define METRICS_ENDPOINT "metrics"
+
+//
+// Get the state of each route's spreadsheet write queue
+//
+
+#define DELIVERY_ENDPOINT "delivery"
+
+//
+// Dump recent spans as a Chrome trace
+//
+
+#define TRACE_ENDPOINT "trace"
+
+//
+// Get event loop timing histograms and recent stalls
+//
+
+#define WATCHDOG_ENDPOINT "watchdog"
+
+//
+// Get arrival counts per minute, hour and day
+//
+
+#define STATS_ENDPOINT "stats"
+
 //
 // Used for authentication
 //
 
 #define OAUTH_ENDPOINT "oauth_receive"
 
+//
+// Where CurlWrite puts a response
+//
+
+typedef struct _CURL_BUFFER
+{
+    SEGMENTED_BUFFER Data;
+    PJSON_TOKENIZER Tokenizer;
+} CURL_BUFFER, *PCURL_BUFFER;
+
+//
+// Scratch memory for the request being handled, released when it's done
+//
+
+extern ARENA RequestArena;
+
+//
+// Scratch memory for token refreshes
+//
+
+extern ARENA UpstreamArena;
+
+//
+// Path to the access token cache
+//
+
+extern PCHAR TokenCachePath;
+
+//
+// Protects the access token and its expiry time
+//
+
+extern MUTEX TokenLock;
+
 //
 // Google Sheets spreadsheet ID to send user input to
 //
@@ -230,15 +428,52 @@ HandleSignal(
     );
 
 //
-// Send user input to a spreadsheet
+// Add a journal record to the in-memory indexes
 //
 
 VOID
-SendUser(
+IndexRecord(
+    IN PCATTENDANCE_RECORD Record
+    );
+
+//
+// Record an accepted submission
+//
+
+VOID
+RecordUser(
     IN PCCHAR Name,
-    IN INT NameLen,
     IN PCCHAR Number,
-    IN INT NumberLen
+    IN BOOLEAN CheckOut,
+    IN PDELIVERY_ROUTE Route OPTIONAL
+    );
+
+//
+// Validate a submission and record it on the route it matches
+//
+
+BOOLEAN
+SubmitUser(
+    IN PCCHAR Name,
+    IN PCCHAR Number,
+    IN PCCHAR Event OPTIONAL,
+    IN PCCHAR Team OPTIONAL,
+    IN BOOLEAN CheckOut,
+    IN PCCHAR Path,
+    IN SIZE_T PathLength,
+    OUT PCCHAR* Warning
+    );
+
+//
+// curl write callback for CURL_BUFFERs
+//
+
+SIZE_T
+CurlWrite(
+    IN PVOID Pointer,
+    IN SIZE_T Size,
+    IN SIZE_T Count,
+    IN PVOID Buffer
     );
 
 //
@@ -250,6 +485,43 @@ AuthenticateGoogle(
     IN PVOID Parameter
     );
 
+//
+// Copy the current access token
+//
+
+BOOLEAN
+GetGoogleAccessToken(
+    OUT PCHAR Buffer,
+    IN SIZE_T BufferSize
+    );
+
+//
+// Load the cached access token
+//
+
+BOOLEAN
+LoadTokenCache(
+    VOID
+    );
+
+//
+// Save the access token to the cache
+//
+
+BOOLEAN
+SaveTokenCache(
+    VOID
+    );
+
+//
+// Refresh the access token in the background if it's due
+//
+
+VOID
+StartTokenRefresh(
+    VOID
+    );
+
 //
 // Refresh Google token
 //
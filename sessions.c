@@ -0,0 +1,658 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    sessions.c
+
+Abstract:
+
+    This module implements the session index. Each member has a slot for
+    the session they have open, if any, and a list of finished sessions
+    sorted by time, each carrying the total length of the ones before it.
+    Totals over a range are found with two binary searches and trimmed at
+    the ends, so they don't depend on how many sessions there have been.
+    Members who are in are also kept in a list, so who's in is answered
+    without looking at anyone who isn't.
+
+    Sessions nobody checked out of are closed at the close hour of the day
+    they started. Records have to arrive in time order, so the server
+    replays the journal through its time ordered keys.
+
+--*/
+
+#include "server.h"
+
+//
+// A member's sessions
+//
+
+typedef struct _MEMBER_SESSIONS
+{
+    PSESSION Sessions;
+    UINT32 Count;
+    UINT32 Capacity;
+    INT64 OpenSince;
+    INT64 CloseAt;
+    INT64 LastEvent;
+    UINT32 PresentIndex;
+} MEMBER_SESSIONS, *PMEMBER_SESSIONS;
+
+UINT32 SessionCloseHour = DEFAULT_SESSION_CLOSE_HOUR;
+
+static PMEMBER_SESSIONS Members;
+static UINT32 MemberCapacity;
+
+// Dense IDs of members with open sessions
+static PUINT32 Present;
+static UINT32 PresentCount;
+static UINT32 PresentCapacity;
+
+// The earliest close time of any open session
+static INT64 NextClose = INT64_MAX;
+
+static PMEMBER_SESSIONS
+GetMember(
+    IN UINT32 MemberId
+    )
+/*++
+
+Routine Description:
+
+    This routine gets a member's sessions, growing the table to fit them.
+
+Arguments:
+
+    MemberId - The member's dense ID.
+
+Return Value:
+
+    The member's sessions, or NULL if memory couldn't be allocated.
+
+--*/
+{
+    PMEMBER_SESSIONS NewMembers;
+    UINT32 NewCapacity;
+    UINT32 i;
+
+    if ( MemberId >= MemberCapacity )
+    {
+        NewCapacity = MAX(MemberCapacity, 64);
+        while ( NewCapacity <= MemberId )
+        {
+            NewCapacity *= 2;
+        }
+
+        NewMembers = realloc(
+            Members,
+            NewCapacity * sizeof(MEMBER_SESSIONS)
+            );
+        if ( !NewMembers )
+        {
+            LOG("Failed to grow session table to %u members: %s (errno %d)\n", NewCapacity, ERRNO_STRING());
+            return NULL;
+        }
+
+        memset(
+            NewMembers + MemberCapacity,
+            0,
+            (NewCapacity - MemberCapacity) * sizeof(MEMBER_SESSIONS)
+            );
+        for ( i = MemberCapacity; i < NewCapacity; i++ )
+        {
+            NewMembers[i].PresentIndex = UINT32_MAX;
+        }
+        Members = NewMembers;
+        MemberCapacity = NewCapacity;
+    }
+
+    return &Members[MemberId];
+}
+
+static INT64
+GetCloseTime(
+    IN INT64 Start
+    )
+/*++
+
+Routine Description:
+
+    This routine gets when a session is closed if nobody checks out, the
+    first close hour after it starts.
+
+Arguments:
+
+    Start - When the session started.
+
+Return Value:
+
+    The close time.
+
+--*/
+{
+    struct tm Time;
+    time_t Timestamp;
+    INT64 Close;
+
+    Timestamp = (time_t)Start;
+    LOCALTIME(
+        &Timestamp,
+        &Time
+        );
+    Time.tm_hour = SessionCloseHour;
+    Time.tm_min = 0;
+    Time.tm_sec = 0;
+    Time.tm_isdst = -1;
+    Close = mktime(&Time);
+
+    // Checked in after the close hour, so it's the next day's
+    if ( Close <= Start )
+    {
+        Time.tm_mday++;
+        Time.tm_hour = SessionCloseHour;
+        Time.tm_isdst = -1;
+        Close = mktime(&Time);
+    }
+
+    return Close;
+}
+
+static VOID
+CloseSession(
+    IN PMEMBER_SESSIONS Member,
+    IN INT64 End
+    )
+/*++
+
+Routine Description:
+
+    This routine finishes a member's open session and takes them off the
+    present list.
+
+Arguments:
+
+    Member - The member's sessions.
+
+    End - When the session ended.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSESSION NewSessions;
+    PSESSION Previous;
+    PSESSION Session;
+    UINT32 NewCapacity;
+    UINT32 Last;
+
+    if ( Member->Count >= Member->Capacity )
+    {
+        NewCapacity = Member->Capacity ? Member->Capacity * 2 : 8;
+        NewSessions = realloc(
+            Member->Sessions,
+            NewCapacity * sizeof(SESSION)
+            );
+        if ( NewSessions )
+        {
+            Member->Sessions = NewSessions;
+            Member->Capacity = NewCapacity;
+        }
+    }
+
+    if ( Member->Count < Member->Capacity )
+    {
+        Session = &Member->Sessions[Member->Count];
+        Previous = Member->Count ? Session - 1 : NULL;
+        Session->Start = Member->OpenSince;
+        Session->End = End;
+        Session->Before = Previous ? Previous->Before + (Previous->End - Previous->Start) : 0;
+        Member->Count++;
+    }
+    else
+    {
+        LOG("Failed to grow session list: %s (errno %d)\n", ERRNO_STRING());
+    }
+
+    // Swap the last present member into this one's place
+    Last = Present[--PresentCount];
+    Present[Member->PresentIndex] = Last;
+    Members[Last].PresentIndex = Member->PresentIndex;
+    Member->PresentIndex = UINT32_MAX;
+    Member->OpenSince = 0;
+}
+
+VOID
+SessionsPoll(
+    IN time_t Now
+    )
+/*++
+
+Routine Description:
+
+    This routine closes the sessions that are past their close time, at
+    their close time.
+
+Arguments:
+
+    Now - The current time, or the time of a record being replayed.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PMEMBER_SESSIONS Member;
+    UINT32 Closed;
+    UINT32 i;
+
+    if ( (INT64)Now < NextClose )
+    {
+        return;
+    }
+
+    // Going backwards, what's swapped into a closed slot was already seen
+    NextClose = INT64_MAX;
+    Closed = 0;
+    for ( i = PresentCount; i > 0; i-- )
+    {
+        Member = &Members[Present[i - 1]];
+        if ( Member->CloseAt <= (INT64)Now )
+        {
+            CloseSession(
+                Member,
+                Member->CloseAt
+                );
+            Closed++;
+        }
+        else
+        {
+            NextClose = MIN(NextClose, Member->CloseAt);
+        }
+    }
+
+    if ( Closed )
+    {
+        LOG("Closed %u sessions nobody checked out of\n", Closed);
+    }
+}
+
+INT64
+SessionsGetNextClose(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets when SessionsPoll next has a session to close.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The earliest close time of an open session, or INT64_MAX if none are
+    open.
+
+--*/
+{
+    return NextClose;
+}
+
+VOID
+SessionsRecord(
+    IN UINT32 MemberId,
+    IN time_t Timestamp,
+    IN BOOLEAN CheckOut
+    )
+/*++
+
+Routine Description:
+
+    This routine opens a session on a check-in and closes it on a check-out.
+    Checking in while in and checking out while out are ignored, and so are
+    records older than the member's last one.
+
+Arguments:
+
+    MemberId - The member's dense ID.
+
+    Timestamp - The time of the record.
+
+    CheckOut - Whether it's a check-out.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PMEMBER_SESSIONS Member;
+    PUINT32 NewPresent;
+    UINT32 NewCapacity;
+
+    SessionsPoll(Timestamp);
+
+    Member = GetMember(MemberId);
+    if ( !Member || (INT64)Timestamp < Member->LastEvent )
+    {
+        return;
+    }
+    Member->LastEvent = Timestamp;
+
+    if ( CheckOut )
+    {
+        if ( Member->OpenSince )
+        {
+            CloseSession(
+                Member,
+                Timestamp
+                );
+        }
+        return;
+    }
+
+    if ( Member->OpenSince )
+    {
+        return;
+    }
+
+    if ( PresentCount >= PresentCapacity )
+    {
+        NewCapacity = PresentCapacity ? PresentCapacity * 2 : 64;
+        NewPresent = realloc(
+            Present,
+            NewCapacity * sizeof(UINT32)
+            );
+        if ( !NewPresent )
+        {
+            LOG("Failed to grow present list: %s (errno %d)\n", ERRNO_STRING());
+            return;
+        }
+        Present = NewPresent;
+        PresentCapacity = NewCapacity;
+    }
+
+    Member->OpenSince = Timestamp;
+    Member->CloseAt = GetCloseTime(Timestamp);
+    Member->PresentIndex = PresentCount;
+    Present[PresentCount++] = MemberId;
+    NextClose = MIN(NextClose, Member->CloseAt);
+}
+
+BOOLEAN
+SessionsGetOpen(
+    IN UINT32 MemberId,
+    OUT time_t* Since OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine checks whether a member is in.
+
+Arguments:
+
+    MemberId - The member's dense ID.
+
+    Since - Receives when they checked in.
+
+Return Value:
+
+    TRUE - The member is in.
+
+    FALSE - The member is out.
+
+--*/
+{
+    if ( MemberId >= MemberCapacity || !Members[MemberId].OpenSince )
+    {
+        return FALSE;
+    }
+
+    if ( Since )
+    {
+        *Since = (time_t)Members[MemberId].OpenSince;
+    }
+    return TRUE;
+}
+
+UINT32
+SessionsGetPresentCount(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the number of members who are in.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The number of members.
+
+--*/
+{
+    return PresentCount;
+}
+
+BOOLEAN
+SessionsGetPresent(
+    IN UINT32 Index,
+    OUT PUINT32 MemberId,
+    OUT time_t* Since
+    )
+/*++
+
+Routine Description:
+
+    This routine gets a member who's in. The list isn't in any order.
+
+Arguments:
+
+    Index - The position in the present list.
+
+    MemberId - Receives the member's dense ID.
+
+    Since - Receives when they checked in.
+
+Return Value:
+
+    TRUE - The member was found.
+
+    FALSE - The index is past the end of the list.
+
+--*/
+{
+    if ( Index >= PresentCount )
+    {
+        return FALSE;
+    }
+
+    *MemberId = Present[Index];
+    *Since = (time_t)Members[*MemberId].OpenSince;
+    return TRUE;
+}
+
+VOID
+SessionsGetTotal(
+    IN UINT32 MemberId,
+    IN time_t From,
+    IN time_t To,
+    OUT PSESSION_TOTAL Total
+    )
+/*++
+
+Routine Description:
+
+    This routine adds up the time a member spent in between two times.
+    Sessions overlapping either end only count the part inside the range.
+
+Arguments:
+
+    MemberId - The member's dense ID.
+
+    From - The start of the range.
+
+    To - The end of the range.
+
+    Total - Receives the time and the number of sessions.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PMEMBER_SESSIONS Member;
+    PSESSION Sessions;
+    PSESSION First;
+    PSESSION Last;
+    UINT32 Low;
+    UINT32 High;
+    UINT32 Middle;
+    UINT32 Begin;
+    INT64 Start;
+    INT64 End;
+
+    memset(
+        Total,
+        0,
+        sizeof(SESSION_TOTAL)
+        );
+    if ( MemberId >= MemberCapacity )
+    {
+        return;
+    }
+    Member = &Members[MemberId];
+    Sessions = Member->Sessions;
+
+    // First session ending after the start of the range
+    Low = 0;
+    High = Member->Count;
+    while ( Low < High )
+    {
+        Middle = Low + (High - Low) / 2;
+        if ( Sessions[Middle].End <= (INT64)From )
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+    Begin = Low;
+
+    // First session starting at or after the end of the range
+    High = Member->Count;
+    while ( Low < High )
+    {
+        Middle = Low + (High - Low) / 2;
+        if ( Sessions[Middle].Start < (INT64)To )
+        {
+            Low = Middle + 1;
+        }
+        else
+        {
+            High = Middle;
+        }
+    }
+
+    if ( Begin < Low )
+    {
+        First = &Sessions[Begin];
+        Last = &Sessions[Low - 1];
+        Total->Seconds = Last->Before + (Last->End - Last->Start) - First->Before;
+        Total->Seconds -= MAX((INT64)From - First->Start, 0);
+        Total->Seconds -= MAX(Last->End - (INT64)To, 0);
+        Total->Sessions = Low - Begin;
+    }
+
+    if ( Member->OpenSince )
+    {
+        Start = MAX(Member->OpenSince, (INT64)From);
+        End = MIN((INT64)time(NULL), (INT64)To);
+        if ( End > Start )
+        {
+            Total->Seconds += End - Start;
+            Total->Sessions++;
+        }
+    }
+}
+
+time_t
+SessionsGetDayStart(
+    IN UINT32 Date
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the local midnight at the start of a date.
+
+Arguments:
+
+    Date - The date as YYYYMMDD.
+
+Return Value:
+
+    The timestamp.
+
+--*/
+{
+    struct tm Time = {0};
+
+    Time.tm_year = Date / 10000 - 1900;
+    Time.tm_mon = Date / 100 % 100 - 1;
+    Time.tm_mday = Date % 100;
+    Time.tm_isdst = -1;
+
+    return mktime(&Time);
+}
+
+VOID
+SessionsFree(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the session index.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 i;
+
+    for ( i = 0; i < MemberCapacity; i++ )
+    {
+        free(Members[i].Sessions);
+    }
+
+    free(Members);
+    Members = NULL;
+    MemberCapacity = 0;
+    free(Present);
+    Present = NULL;
+    PresentCount = 0;
+    PresentCapacity = 0;
+    NextClose = INT64_MAX;
+}
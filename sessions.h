@@ -0,0 +1,144 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    sessions.h
+
+Abstract:
+
+    This module contains definitions for the session index, which pairs
+    check-ins with check-outs to track who's in and how long members stay.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Default local hour sessions that were never checked out of are closed at
+//
+
+#define DEFAULT_SESSION_CLOSE_HOUR 24
+
+//
+// A finished session. Before is the total length of the member's sessions
+// before this one, so totals over a run of sessions take one subtraction.
+//
+
+typedef struct _SESSION
+{
+    INT64 Start;
+    INT64 End;
+    UINT64 Before;
+} SESSION, *PSESSION;
+
+//
+// Time a member spent in over a range
+//
+
+typedef struct _SESSION_TOTAL
+{
+    UINT64 Seconds;
+    UINT32 Sessions;
+} SESSION_TOTAL, *PSESSION_TOTAL;
+
+//
+// Local hour, from 0 to 24, open sessions are closed at on the day they
+// started
+//
+
+extern UINT32 SessionCloseHour;
+
+//
+// Check a member in or out
+//
+
+VOID
+SessionsRecord(
+    IN UINT32 MemberId,
+    IN time_t Timestamp,
+    IN BOOLEAN CheckOut
+    );
+
+//
+// Get the earliest close time of an open session
+//
+
+INT64
+SessionsGetNextClose(
+    VOID
+    );
+
+//
+// Close sessions that were left open past the close hour, called from the
+// main loop
+//
+
+VOID
+SessionsPoll(
+    IN time_t Now
+    );
+
+//
+// Get when a member checked in, if they're in
+//
+
+BOOLEAN
+SessionsGetOpen(
+    IN UINT32 MemberId,
+    OUT time_t* Since OPTIONAL
+    );
+
+//
+// Get the number of members who are in
+//
+
+UINT32
+SessionsGetPresentCount(
+    VOID
+    );
+
+//
+// Get a member who's in by their position in the present list
+//
+
+BOOLEAN
+SessionsGetPresent(
+    IN UINT32 Index,
+    OUT PUINT32 MemberId,
+    OUT time_t* Since
+    );
+
+//
+// Get the time a member spent in between two times, counting an open
+// session up to now
+//
+
+VOID
+SessionsGetTotal(
+    IN UINT32 MemberId,
+    IN time_t From,
+    IN time_t To,
+    OUT PSESSION_TOTAL Total
+    );
+
+//
+// Get the local midnight a YYYYMMDD date starts at
+//
+
+time_t
+SessionsGetDayStart(
+    IN UINT32 Date
+    );
+
+//
+// Free the index
+//
+
+VOID
+SessionsFree(
+    VOID
+    );
@@ -0,0 +1,404 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    sheets.c
+
+Abstract:
+
+    This module implements calls to the Google Sheets API. Responses are
+    tokenized as curl receives them, so ranges of any size can be read in
+    constant memory.
+
+--*/
+
+#include "server.h"
+
+//
+// State for picking cells out of a values:get response, which looks like
+// {"range": ..., "majorDimension": "ROWS", "values": [["a", "b"], ...]}
+//
+
+typedef struct _VALUES_READER
+{
+    PSHEETS_CELL_CALLBACK Callback;
+    PVOID Context;
+    BOOLEAN SawValuesKey;
+    BOOLEAN InValues;
+    UINT32 Row;
+    UINT32 Column;
+} VALUES_READER, *PVALUES_READER;
+
+static BOOLEAN
+ReadValuesToken(
+    IN PVOID Context,
+    IN JSON_TOKEN_TYPE Type,
+    IN PCCHAR Value,
+    IN SIZE_T Length,
+    IN UINT32 Depth
+    )
+/*++
+
+Routine Description:
+
+    This routine handles a token from a values:get response.
+
+Arguments:
+
+    Context - The VALUES_READER.
+
+    Type - The token type.
+
+    Value - The token's value.
+
+    Length - The length of the value.
+
+    Depth - The depth of the token.
+
+Return Value:
+
+    TRUE - Reading should continue.
+
+    FALSE - The cell callback stopped reading.
+
+--*/
+{
+    PVALUES_READER Reader = Context;
+
+    if ( Depth == 1 && Type == JsonTokenKey )
+    {
+        Reader->SawValuesKey = strcmp(Value, "values") == 0;
+    }
+    else if ( Depth == 1 && Type == JsonTokenArrayStart )
+    {
+        Reader->InValues = Reader->SawValuesKey;
+    }
+    else if ( Depth == 1 && Type == JsonTokenArrayEnd )
+    {
+        Reader->InValues = FALSE;
+    }
+    else if ( Reader->InValues && Depth == 2 && Type == JsonTokenArrayStart )
+    {
+        Reader->Column = 0;
+    }
+    else if ( Reader->InValues && Depth == 2 && Type == JsonTokenArrayEnd )
+    {
+        Reader->Row++;
+    }
+    else if ( Reader->InValues && Depth == 3 &&
+              (Type == JsonTokenString || Type == JsonTokenNumber) )
+    {
+        return Reader->Callback(
+            Reader->Context,
+            Reader->Row,
+            Reader->Column++,
+            Value,
+            Length
+            );
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+SheetsGetValues(
+    IN PCCHAR Spreadsheet,
+    IN PCCHAR Range,
+    IN PSHEETS_CELL_CALLBACK Callback,
+    IN PVOID Context OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the values in a range. Cells are passed to the
+    callback in row order as the response arrives. This blocks, so it
+    shouldn't be called on the main thread.
+
+Arguments:
+
+    Spreadsheet - The spreadsheet ID.
+
+    Range - The range, in A1 notation.
+
+    Callback - Called for each cell.
+
+    Context - Passed to the callback.
+
+Return Value:
+
+    TRUE - The range was read.
+
+    FALSE - The request failed.
+
+--*/
+{
+    CHAR AccessToken[256];
+    CHAR Header[300];
+    CHAR Url[512];
+    VALUES_READER Reader = {0};
+    JSON_TOKENIZER Tokenizer;
+    CURL_BUFFER Response = {0};
+    struct curl_slist* HttpHeader;
+    PCHAR EscapedRange;
+    CURL* Curl;
+    CURLcode Result;
+    UINT64 Start;
+    long Status;
+
+    if ( !GetGoogleAccessToken(
+             AccessToken,
+             ARRAY_SIZE(AccessToken)
+             ) )
+    {
+        LOG("Can't read %s yet, no access token\n", Range);
+        return FALSE;
+    }
+
+    Curl = curl_easy_init();
+    if ( !Curl )
+    {
+        return FALSE;
+    }
+
+    EscapedRange = curl_easy_escape(
+        Curl,
+        Range,
+        0
+        );
+    snprintf(
+        Url,
+        ARRAY_SIZE(Url),
+        SHEETS_API_URL "/%s/values/%s",
+        Spreadsheet,
+        EscapedRange ? EscapedRange : Range
+        );
+    curl_free(EscapedRange);
+
+    snprintf(
+        Header,
+        ARRAY_SIZE(Header),
+        "Authorization: Bearer %s",
+        AccessToken
+        );
+    HttpHeader = curl_slist_append(
+        NULL,
+        Header
+        );
+
+    Reader.Callback = Callback;
+    Reader.Context = Context;
+    JsonTokenizerInitialize(
+        &Tokenizer,
+        ReadValuesToken,
+        &Reader
+        );
+    Response.Tokenizer = &Tokenizer;
+
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_PROTOCOLS,
+        CURLPROTO_HTTPS
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_URL,
+        Url
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_HTTPHEADER,
+        HttpHeader
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_SSL_VERIFYPEER,
+        FALSE
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_WRITEDATA,
+        &Response
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_WRITEFUNCTION,
+        CurlWrite
+        );
+    Start = TraceNow();
+    Result = curl_easy_perform(Curl);
+    TraceCurl(
+        "sheets.get",
+        Curl,
+        Start
+        );
+    Status = 0;
+    curl_easy_getinfo(
+        Curl,
+        CURLINFO_RESPONSE_CODE,
+        &Status
+        );
+    curl_easy_cleanup(Curl);
+    curl_slist_free_all(HttpHeader);
+
+    if ( Result != CURLE_OK || Status != 200 )
+    {
+        LOG("Failed to read %s: %s, HTTP %ld\n", Range, curl_easy_strerror(Result), Status);
+        return FALSE;
+    }
+
+    LOG("Read %u rows from %s\n", Reader.Row, Range);
+    return TRUE;
+}
+
+BOOLEAN
+SheetsAppendValues(
+    IN PCCHAR Spreadsheet,
+    IN PCCHAR Range,
+    IN PCCHAR Body,
+    OUT PINT Status
+    )
+/*++
+
+Routine Description:
+
+    This routine appends rows after the table in a range. This blocks, so it
+    shouldn't be called on the main thread.
+
+Arguments:
+
+    Spreadsheet - The spreadsheet ID.
+
+    Range - The range, in A1 notation.
+
+    Body - A ValueRange, like {"values": [["a", "b"], ...]}.
+
+    Status - Receives the HTTP status, or 0 if there wasn't a response.
+
+Return Value:
+
+    TRUE - The rows were appended.
+
+    FALSE - The request failed.
+
+--*/
+{
+    CHAR AccessToken[256];
+    CHAR Header[300];
+    CHAR Url[512];
+    CURL_BUFFER Response = {0};
+    struct curl_slist* HttpHeader;
+    PCHAR EscapedRange;
+    CURL* Curl;
+    CURLcode Result;
+    UINT64 Start;
+    long ResponseCode;
+
+    *Status = 0;
+    if ( !GetGoogleAccessToken(
+             AccessToken,
+             ARRAY_SIZE(AccessToken)
+             ) )
+    {
+        LOG("Can't append to %s yet, no access token\n", Range);
+        return FALSE;
+    }
+
+    Curl = curl_easy_init();
+    if ( !Curl )
+    {
+        return FALSE;
+    }
+
+    EscapedRange = curl_easy_escape(
+        Curl,
+        Range,
+        0
+        );
+    snprintf(
+        Url,
+        ARRAY_SIZE(Url),
+        SHEETS_API_URL "/%s/values/%s:append?valueInputOption=USER_ENTERED&insertDataOption=INSERT_ROWS",
+        Spreadsheet,
+        EscapedRange ? EscapedRange : Range
+        );
+    curl_free(EscapedRange);
+
+    snprintf(
+        Header,
+        ARRAY_SIZE(Header),
+        "Authorization: Bearer %s",
+        AccessToken
+        );
+    HttpHeader = curl_slist_append(
+        NULL,
+        Header
+        );
+    HttpHeader = curl_slist_append(
+        HttpHeader,
+        "Content-Type: application/json"
+        );
+
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_PROTOCOLS,
+        CURLPROTO_HTTPS
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_URL,
+        Url
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_HTTPHEADER,
+        HttpHeader
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_POSTFIELDS,
+        Body
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_SSL_VERIFYPEER,
+        FALSE
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_WRITEDATA,
+        &Response
+        );
+    curl_easy_setopt(
+        Curl,
+        CURLOPT_WRITEFUNCTION,
+        CurlWrite
+        );
+    Start = TraceNow();
+    Result = curl_easy_perform(Curl);
+    TraceCurl(
+        "sheets.append",
+        Curl,
+        Start
+        );
+    ResponseCode = 0;
+    curl_easy_getinfo(
+        Curl,
+        CURLINFO_RESPONSE_CODE,
+        &ResponseCode
+        );
+    curl_easy_cleanup(Curl);
+    curl_slist_free_all(HttpHeader);
+    BufferFree(&Response.Data);
+
+    *Status = (INT)ResponseCode;
+    if ( Result != CURLE_OK || ResponseCode != 200 )
+    {
+        LOG("Failed to append to %s: %s, HTTP %ld\n", Range, curl_easy_strerror(Result), ResponseCode);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,59 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    sheets.h
+
+Abstract:
+
+    This module contains definitions for calls to the Google Sheets API.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Sheets API base URL
+//
+
+#define SHEETS_API_URL "https://sheets.googleapis.com/v4/spreadsheets"
+
+//
+// Called for each cell read from a range. Returning FALSE stops reading.
+//
+
+typedef BOOLEAN (*PSHEETS_CELL_CALLBACK)(
+    IN PVOID Context,
+    IN UINT32 Row,
+    IN UINT32 Column,
+    IN PCCHAR Value,
+    IN SIZE_T Length
+    );
+
+//
+// Read the values in a range, streaming them to a callback
+//
+
+BOOLEAN
+SheetsGetValues(
+    IN PCCHAR Spreadsheet,
+    IN PCCHAR Range,
+    IN PSHEETS_CELL_CALLBACK Callback,
+    IN PVOID Context OPTIONAL
+    );
+
+//
+// Append rows to the table in a range
+//
+
+BOOLEAN
+SheetsAppendValues(
+    IN PCCHAR Spreadsheet,
+    IN PCCHAR Range,
+    IN PCCHAR Body,
+    OUT PINT Status
+    );
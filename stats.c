@@ -0,0 +1,335 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    stats.c
+
+Abstract:
+
+    This module implements arrival statistics. Each resolution is a ring of
+    buckets indexed by time, and a bucket whose time has passed is reused
+    by the next arrival that lands on it, so memory never grows and old
+    counts age out on their own. Arrivals are counted at every resolution,
+    which makes the coarser rings a downsampled copy of the finer ones that
+    reaches further back.
+
+    Buckets are updated with compare-exchange instead of a lock, so
+    counting never waits on a reader. Dashboards poll this instead of the
+    spreadsheet.
+
+--*/
+
+#include "server.h"
+
+//
+// A ring of buckets at one resolution
+//
+
+typedef struct _STATS_LEVEL
+{
+    PCCHAR Name;
+    UINT32 Width;
+    UINT32 Count;
+    volatile UINT64* Buckets;
+} STATS_LEVEL, *PSTATS_LEVEL;
+
+static volatile UINT64 MinuteBuckets[STATS_MINUTE_BUCKETS];
+static volatile UINT64 HourBuckets[STATS_HOUR_BUCKETS];
+static volatile UINT64 DayBuckets[STATS_DAY_BUCKETS];
+
+static STATS_LEVEL Levels[] = {
+    {"minute", 60, STATS_MINUTE_BUCKETS, MinuteBuckets},
+    {"hour", 3600, STATS_HOUR_BUCKETS, HourBuckets},
+    {"day", 86400, STATS_DAY_BUCKETS, DayBuckets}
+};
+
+// Seconds to add to UTC for local time, so days start at local midnight
+static INT64 UtcOffset;
+
+VOID
+StatsInitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine works out the local time zone's offset from UTC, from the
+    local time of day now. It isn't updated for daylight saving time
+    changes, which only shift where hours and days start by an hour until
+    the next restart.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    struct tm Time;
+    time_t Now;
+
+    Now = time(NULL);
+    LOCALTIME(
+        &Now,
+        &Time
+        );
+
+    UtcOffset = Time.tm_hour * 3600 + Time.tm_min * 60 + Time.tm_sec - Now % 86400;
+    if ( UtcOffset > 14 * 3600 )
+    {
+        UtcOffset -= 86400;
+    }
+    else if ( UtcOffset < -12 * 3600 )
+    {
+        UtcOffset += 86400;
+    }
+}
+
+static UINT64
+GetEpoch(
+    IN PSTATS_LEVEL Level,
+    IN time_t Timestamp
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the number of the bucket a timestamp falls in at a
+    resolution. Numbers start at 1, so 0 is an empty bucket.
+
+Arguments:
+
+    Level - The resolution.
+
+    Timestamp - The timestamp.
+
+Return Value:
+
+    The bucket number, or 0 if the timestamp is before 1970.
+
+--*/
+{
+    INT64 Local = (INT64)Timestamp + UtcOffset;
+
+    return Local >= 0 ? (UINT64)Local / Level->Width + 1 : 0;
+}
+
+VOID
+StatsRecord(
+    IN time_t Timestamp
+    )
+/*++
+
+Routine Description:
+
+    This routine counts an arrival at each resolution. A bucket still
+    holding an older time is reset to this arrival, and an arrival older
+    than what its bucket holds, like one replayed from the journal, is too
+    old to be kept and is skipped.
+
+Arguments:
+
+    Timestamp - When the arrival was accepted.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSTATS_LEVEL Level;
+    volatile UINT64* Bucket;
+    UINT64 Epoch;
+    UINT64 Old;
+    UINT64 New;
+    UINT32 i;
+
+    for ( i = 0; i < ARRAY_SIZE(Levels); i++ )
+    {
+        Level = &Levels[i];
+        Epoch = GetEpoch(
+            Level,
+            Timestamp
+            );
+        if ( !Epoch )
+        {
+            return;
+        }
+
+        Bucket = &Level->Buckets[Epoch % Level->Count];
+        do
+        {
+            Old = ATOMIC_LOAD64(Bucket);
+            if ( Old >> STATS_COUNT_BITS > Epoch ||
+                 (Old >> STATS_COUNT_BITS == Epoch && (Old & STATS_COUNT_MASK) == STATS_COUNT_MASK) )
+            {
+                break;
+            }
+
+            New = Old >> STATS_COUNT_BITS == Epoch ? Old + 1 : Epoch << STATS_COUNT_BITS | 1;
+        } while ( !ATOMIC_COMPARE_EXCHANGE64(
+                      Bucket,
+                      Old,
+                      New
+                      ) );
+    }
+}
+
+static VOID
+WriteLevel(
+    IN OUT PJSON_WRITER Writer,
+    IN PSTATS_LEVEL Level,
+    IN time_t Now,
+    IN UINT32 Hours
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the buckets of one resolution covering the last
+    hours, oldest first, as a JSON object. Buckets holding an older time
+    are counted as empty.
+
+Arguments:
+
+    Writer - The writer.
+
+    Level - The resolution.
+
+    Now - The current time.
+
+    Hours - How far back to go, limited to what the ring holds.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT64 Last;
+    UINT64 First;
+    UINT64 Epoch;
+    UINT64 Value;
+    UINT64 Total;
+    UINT32 Count;
+    UINT32 Span;
+
+    Span = (UINT32)CLAMP((UINT64)Hours * 3600 / Level->Width, 1, Level->Count);
+    Last = GetEpoch(
+        Level,
+        Now
+        );
+    First = Last >= Span ? Last - Span + 1 : 1;
+
+    JsonWritef(
+        Writer,
+        "{\"resolution\":\"%s\",\"seconds\":%u,\"start\":%" PRId64 ",\"counts\":[",
+        Level->Name,
+        Level->Width,
+        (INT64)((First - 1) * Level->Width) - UtcOffset
+        );
+
+    Total = 0;
+    for ( Epoch = First; Epoch <= Last; Epoch++ )
+    {
+        Value = ATOMIC_LOAD64(&Level->Buckets[Epoch % Level->Count]);
+        Count = Value >> STATS_COUNT_BITS == Epoch ? (UINT32)(Value & STATS_COUNT_MASK) : 0;
+        Total += Count;
+
+        JsonWritef(
+            Writer,
+            "%s%u",
+            Epoch > First ? "," : "",
+            Count
+            );
+    }
+
+    JsonWritef(
+        Writer,
+        "],\"total\":%" PRIu64 "}",
+        Total
+        );
+}
+
+VOID
+StatsWriteJson(
+    IN struct mg_connection* Connection,
+    IN UINT32 Hours
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the arrivals in the last hours at each resolution
+    as chunks of a chunked response. Each resolution's counts start at its
+    start time and are its number of seconds apart, and resolutions that
+    don't reach back far enough return what they have.
+
+Arguments:
+
+    Connection - The connection to write to.
+
+    Hours - How far back to go.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR Output[JSON_WRITER_BUFFER_SIZE];
+    JSON_WRITER Writer;
+    time_t Now;
+    UINT32 i;
+
+    Now = time(NULL);
+    Hours = CLAMP(Hours, 1, STATS_MAX_HOURS);
+
+    JsonWriterInitialize(
+        &Writer,
+        Output,
+        ARRAY_SIZE(Output),
+        JsonSinkChunk,
+        Connection
+        );
+    JsonWritef(
+        &Writer,
+        "{\"now\":%" PRId64 ",\"hours\":%u,\"levels\":[",
+        (INT64)Now,
+        Hours
+        );
+    for ( i = 0; i < ARRAY_SIZE(Levels); i++ )
+    {
+        if ( i )
+        {
+            JsonWriteRaw(
+                &Writer,
+                ",",
+                1
+                );
+        }
+        WriteLevel(
+            &Writer,
+            &Levels[i],
+            Now,
+            Hours
+            );
+    }
+
+    JsonWriteRaw(
+        &Writer,
+        "]}\n",
+        3
+        );
+    JsonWriterFlush(&Writer);
+    mg_http_printf_chunk(
+        Connection,
+        ""
+        );
+}
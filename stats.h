@@ -0,0 +1,71 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    stats.h
+
+Abstract:
+
+    This module contains definitions for arrival statistics, counts of
+    accepted submissions per minute, hour and day kept in fixed rings.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Buckets kept at each resolution, a day of minutes, two weeks of hours and
+// a year of days
+//
+
+#define STATS_MINUTE_BUCKETS 1440
+#define STATS_HOUR_BUCKETS 336
+#define STATS_DAY_BUCKETS 366
+
+//
+// Each bucket is one word, with the bucket's time in the high bits and its
+// count in the low ones, so it can be reset and counted with one
+// compare-exchange
+//
+
+#define STATS_COUNT_BITS 24
+#define STATS_COUNT_MASK ((1ull << STATS_COUNT_BITS) - 1)
+
+//
+// Hours returned by default, and at most
+//
+
+#define DEFAULT_STATS_HOURS 24
+#define STATS_MAX_HOURS (STATS_DAY_BUCKETS * 24)
+
+//
+// Work out the local time zone, which days and hours are aligned to
+//
+
+VOID
+StatsInitialize(
+    VOID
+    );
+
+//
+// Count an arrival, from any thread
+//
+
+VOID
+StatsRecord(
+    IN time_t Timestamp
+    );
+
+//
+// Write the last hours of arrivals at each resolution as a chunked response
+//
+
+VOID
+StatsWriteJson(
+    IN struct mg_connection* Connection,
+    IN UINT32 Hours
+    );
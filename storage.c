@@ -0,0 +1,1278 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    storage.c
+
+Abstract:
+
+    This module implements asynchronous appends. Appends are copied into a
+    batch buffer and return right away, and a writer thread writes each
+    batch and syncs it, so the loop never waits on the disk. Everything
+    appended while a batch is being synced goes into the next one, which
+    makes one sync cover as many appends as arrived in the meantime.
+
+    On Linux, a batch's write and sync are submitted to io_uring together,
+    with the sync linked to the write, and the thread waits for both with
+    one system call. Where io_uring isn't available, or the kernel refuses
+    it, batches are written with pwrite and fdatasync instead.
+
+    Once a batch is durable, the writer's completion is run on the loop
+    thread through the executor.
+
+--*/
+
+#include "server.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define STORAGE_HAVE_URING 1
+#endif
+#endif
+#endif
+
+#ifdef STORAGE_HAVE_URING
+//
+// A minimal io_uring, set up with raw system calls
+//
+
+typedef struct _STORAGE_URING
+{
+    INT Descriptor;
+    PVOID SqRing;
+    SIZE_T SqRingSize;
+    PVOID CqRing;
+    SIZE_T CqRingSize;
+    struct io_uring_sqe* Sqes;
+    SIZE_T SqesSize;
+    PUINT32 SqTail;
+    PUINT32 SqMask;
+    PUINT32 SqArray;
+    PUINT32 CqHead;
+    PUINT32 CqTail;
+    PUINT32 CqMask;
+    struct io_uring_cqe* Cqes;
+} STORAGE_URING, *PSTORAGE_URING;
+#endif
+
+struct _STORAGE_WRITER
+{
+    STORAGE_BACKEND Backend;
+    INT Descriptor;
+    PSTORAGE_COMPLETION Completion;
+#ifdef STORAGE_HAVE_URING
+    STORAGE_URING Uring;
+#endif
+
+    //
+    // Everything after this is protected by the lock
+    //
+
+    MUTEX Lock;
+    CONDITION WorkCondition;
+    CONDITION DoneCondition;
+    PBYTE Pending;
+    SIZE_T PendingSize;
+    SIZE_T PendingCapacity;
+    UINT64 Appended;
+    UINT64 Durable;
+    UINT64 Batches;
+    UINT64 WriteTime;
+    BOOLEAN Failed;
+    BOOLEAN Posted;
+    BOOLEAN Stopping;
+    BOOLEAN Stopped;
+};
+
+static PCCHAR BackendNames[] = {
+    "auto",
+    "sync",
+    "io_uring"
+};
+
+BOOLEAN
+StorageParseBackend(
+    IN PCCHAR Name,
+    OUT PSTORAGE_BACKEND Backend
+    )
+/*++
+
+Routine Description:
+
+    This routine parses the name of a backend.
+
+Arguments:
+
+    Name - auto, sync or io_uring.
+
+    Backend - Receives the backend.
+
+Return Value:
+
+    TRUE - The name was valid.
+
+    FALSE - The name wasn't a backend.
+
+--*/
+{
+    UINT32 i;
+
+    for ( i = 0; i < ARRAY_SIZE(BackendNames); i++ )
+    {
+        if ( strcmp(Name, BackendNames[i]) == 0 )
+        {
+            *Backend = (STORAGE_BACKEND)i;
+            return TRUE;
+        }
+    }
+
+    LOG("Unknown storage backend %s\n", Name);
+    return FALSE;
+}
+
+static BOOLEAN
+SyncWrite(
+    IN PSTORAGE_WRITER Writer,
+    IN PCBYTE Data,
+    IN SIZE_T Size,
+    IN UINT64 Offset
+    )
+/*++
+
+Routine Description:
+
+    This routine writes data and waits for it to reach the disk with plain
+    system calls.
+
+Arguments:
+
+    Writer - The writer.
+
+    Data - The data.
+
+    Size - The size of the data.
+
+    Offset - Where to write it.
+
+Return Value:
+
+    TRUE - The data is durable.
+
+    FALSE - It couldn't be written.
+
+--*/
+{
+    SSIZE_T Written;
+
+    while ( Size )
+    {
+#ifdef _WIN32
+        // Opened for appending, so every write goes to the end
+        (Offset);
+        Written = _write(
+            Writer->Descriptor,
+            Data,
+            (UINT32)MIN(Size, INT32_MAX)
+            );
+#else
+        Written = pwrite(
+            Writer->Descriptor,
+            Data,
+            Size,
+            (off_t)Offset
+            );
+#endif
+        if ( Written < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            LOG("Failed to write: %s (errno %d)\n", ERRNO_STRING());
+            return FALSE;
+        }
+
+        Data += Written;
+        Size -= Written;
+        Offset += Written;
+    }
+
+#if defined(_WIN32)
+    if ( _commit(Writer->Descriptor) != 0 )
+#elif defined(__APPLE__)
+    if ( fsync(Writer->Descriptor) != 0 )
+#else
+    if ( fdatasync(Writer->Descriptor) != 0 )
+#endif
+    {
+        LOG("Failed to sync: %s (errno %d)\n", ERRNO_STRING());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+#ifdef STORAGE_HAVE_URING
+static BOOLEAN
+UringSetup(
+    OUT PSTORAGE_URING Uring
+    )
+/*++
+
+Routine Description:
+
+    This routine creates an io_uring and maps its queues.
+
+Arguments:
+
+    Uring - Receives the ring.
+
+Return Value:
+
+    TRUE - The ring was created.
+
+    FALSE - io_uring isn't available, or the ring couldn't be mapped.
+
+--*/
+{
+    struct io_uring_params Parameters = {0};
+
+    memset(
+        Uring,
+        0,
+        sizeof(STORAGE_URING)
+        );
+
+    Uring->Descriptor = (INT)syscall(
+        __NR_io_uring_setup,
+        STORAGE_URING_ENTRIES,
+        &Parameters
+        );
+    if ( Uring->Descriptor < 0 )
+    {
+        LOG("io_uring isn't available: %s (errno %d)\n", ERRNO_STRING());
+        return FALSE;
+    }
+
+    Uring->SqRingSize = Parameters.sq_off.array + Parameters.sq_entries * sizeof(UINT32);
+    Uring->CqRingSize = Parameters.cq_off.cqes + Parameters.cq_entries * sizeof(struct io_uring_cqe);
+    if ( Parameters.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        Uring->SqRingSize = MAX(Uring->SqRingSize, Uring->CqRingSize);
+        Uring->CqRingSize = Uring->SqRingSize;
+    }
+
+    Uring->SqRing = mmap(
+        NULL,
+        Uring->SqRingSize,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        Uring->Descriptor,
+        IORING_OFF_SQ_RING
+        );
+    if ( Uring->SqRing == MAP_FAILED )
+    {
+        goto Failed;
+    }
+
+    if ( Parameters.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        Uring->CqRing = Uring->SqRing;
+    }
+    else
+    {
+        Uring->CqRing = mmap(
+            NULL,
+            Uring->CqRingSize,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            Uring->Descriptor,
+            IORING_OFF_CQ_RING
+            );
+        if ( Uring->CqRing == MAP_FAILED )
+        {
+            Uring->CqRing = NULL;
+            goto Failed;
+        }
+    }
+
+    Uring->SqesSize = Parameters.sq_entries * sizeof(struct io_uring_sqe);
+    Uring->Sqes = mmap(
+        NULL,
+        Uring->SqesSize,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        Uring->Descriptor,
+        IORING_OFF_SQES
+        );
+    if ( Uring->Sqes == MAP_FAILED )
+    {
+        Uring->Sqes = NULL;
+        goto Failed;
+    }
+
+    Uring->SqTail = (PUINT32)((PBYTE)Uring->SqRing + Parameters.sq_off.tail);
+    Uring->SqMask = (PUINT32)((PBYTE)Uring->SqRing + Parameters.sq_off.ring_mask);
+    Uring->SqArray = (PUINT32)((PBYTE)Uring->SqRing + Parameters.sq_off.array);
+    Uring->CqHead = (PUINT32)((PBYTE)Uring->CqRing + Parameters.cq_off.head);
+    Uring->CqTail = (PUINT32)((PBYTE)Uring->CqRing + Parameters.cq_off.tail);
+    Uring->CqMask = (PUINT32)((PBYTE)Uring->CqRing + Parameters.cq_off.ring_mask);
+    Uring->Cqes = (struct io_uring_cqe*)((PBYTE)Uring->CqRing + Parameters.cq_off.cqes);
+    return TRUE;
+
+Failed:
+    LOG("Failed to map io_uring: %s (errno %d)\n", ERRNO_STRING());
+    if ( Uring->SqRing && Uring->SqRing != MAP_FAILED )
+    {
+        munmap(
+            Uring->SqRing,
+            Uring->SqRingSize
+            );
+    }
+    if ( Uring->CqRing && Uring->CqRing != Uring->SqRing )
+    {
+        munmap(
+            Uring->CqRing,
+            Uring->CqRingSize
+            );
+    }
+    close(Uring->Descriptor);
+    Uring->Descriptor = -1;
+    return FALSE;
+}
+
+static VOID
+UringFree(
+    IN PSTORAGE_URING Uring
+    )
+/*++
+
+Routine Description:
+
+    This routine unmaps and closes an io_uring.
+
+Arguments:
+
+    Uring - The ring.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    munmap(
+        Uring->Sqes,
+        Uring->SqesSize
+        );
+    if ( Uring->CqRing != Uring->SqRing )
+    {
+        munmap(
+            Uring->CqRing,
+            Uring->CqRingSize
+            );
+    }
+    munmap(
+        Uring->SqRing,
+        Uring->SqRingSize
+        );
+    close(Uring->Descriptor);
+}
+
+static UINT32
+UringReap(
+    IN PSTORAGE_URING Uring,
+    OUT PINT WriteResult,
+    OUT PINT SyncResult
+    )
+/*++
+
+Routine Description:
+
+    This routine takes every completion that's waiting in the ring.
+
+Arguments:
+
+    Uring - The ring.
+
+    WriteResult - Receives the write's result, if it completed.
+
+    SyncResult - Receives the sync's result, if it completed.
+
+Return Value:
+
+    The number of completions taken.
+
+--*/
+{
+    struct io_uring_cqe* Cqe;
+    UINT32 Head;
+    UINT32 Reaped;
+
+    Reaped = 0;
+    Head = *Uring->CqHead;
+    while ( Head != __atomic_load_n(Uring->CqTail, __ATOMIC_ACQUIRE) )
+    {
+        Cqe = &Uring->Cqes[Head & *Uring->CqMask];
+        if ( Cqe->user_data == 1 )
+        {
+            *WriteResult = Cqe->res;
+        }
+        else
+        {
+            *SyncResult = Cqe->res;
+        }
+        Head++;
+        Reaped++;
+    }
+    __atomic_store_n(
+        Uring->CqHead,
+        Head,
+        __ATOMIC_RELEASE
+        );
+
+    return Reaped;
+}
+
+static BOOLEAN
+UringWrite(
+    IN PSTORAGE_WRITER Writer,
+    IN PCBYTE Data,
+    IN SIZE_T Size,
+    IN UINT64 Offset
+    )
+/*++
+
+Routine Description:
+
+    This routine submits a write and a datasync linked to it, so the sync
+    only starts once the write is done, and waits for both. Only the writer
+    thread uses the ring, so nothing else touches the queues. A short write
+    breaks the link, and the rest is written with plain system calls.
+
+    The kernel can refuse to take more work for a moment with EAGAIN or
+    EBUSY, which is retried. If it still won't, or fails some other way,
+    entries it never took are withdrawn, the ones it did are waited for,
+    and the batch is written with plain system calls instead. Writing the
+    same bytes at the same offset again is harmless.
+
+Arguments:
+
+    Writer - The writer.
+
+    Data - The data.
+
+    Size - The size of the data.
+
+    Offset - Where to write it.
+
+Return Value:
+
+    TRUE - The data is durable.
+
+    FALSE - It couldn't be written.
+
+--*/
+{
+    PSTORAGE_URING Uring = &Writer->Uring;
+    struct io_uring_sqe* Sqe;
+    UINT32 Tail;
+    UINT32 Index;
+    UINT32 Submitted;
+    UINT32 Reaped;
+    UINT32 Retries;
+    INT WriteResult;
+    INT SyncResult;
+    INT Result;
+
+    Tail = *Uring->SqTail;
+
+    Index = Tail & *Uring->SqMask;
+    Sqe = &Uring->Sqes[Index];
+    memset(
+        Sqe,
+        0,
+        sizeof(struct io_uring_sqe)
+        );
+    Sqe->opcode = IORING_OP_WRITE;
+    Sqe->flags = IOSQE_IO_LINK;
+    Sqe->fd = Writer->Descriptor;
+    Sqe->addr = (UINT64)(SIZE_T)Data;
+    Sqe->len = (UINT32)Size;
+    Sqe->off = Offset;
+    Sqe->user_data = 1;
+    Uring->SqArray[Index] = Index;
+
+    Index = (Tail + 1) & *Uring->SqMask;
+    Sqe = &Uring->Sqes[Index];
+    memset(
+        Sqe,
+        0,
+        sizeof(struct io_uring_sqe)
+        );
+    Sqe->opcode = IORING_OP_FSYNC;
+    Sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    Sqe->fd = Writer->Descriptor;
+    Sqe->user_data = 2;
+    Uring->SqArray[Index] = Index;
+
+    __atomic_store_n(
+        Uring->SqTail,
+        Tail + 2,
+        __ATOMIC_RELEASE
+        );
+
+    // While entries are being submitted, io_uring_enter returns how many
+    // it took, and it only waits once all of them were taken
+    WriteResult = -ECANCELED;
+    SyncResult = -ECANCELED;
+    Submitted = 0;
+    Reaped = 0;
+    Retries = 0;
+    while ( Submitted < 2 || Reaped < 2 )
+    {
+        Result = (INT)syscall(
+            __NR_io_uring_enter,
+            Uring->Descriptor,
+            2 - Submitted,
+            2 - Reaped,
+            IORING_ENTER_GETEVENTS,
+            NULL,
+            0
+            );
+        if ( !Result && Submitted < 2 )
+        {
+            Result = -1;
+            errno = EAGAIN;
+        }
+
+        if ( Result < 0 && errno != EINTR )
+        {
+            if ( (errno != EAGAIN && errno != EBUSY) || ++Retries > STORAGE_URING_RETRIES )
+            {
+                break;
+            }
+
+            // Busy until completions are taken, so make room before waiting
+            if ( !UringReap(
+                     Uring,
+                     &WriteResult,
+                     &SyncResult
+                     ) )
+            {
+                usleep(STORAGE_URING_RETRY_DELAY * 1000);
+            }
+            continue;
+        }
+
+        if ( Result > 0 && Submitted < 2 )
+        {
+            Submitted += (UINT32)Result;
+        }
+
+        Reaped += UringReap(
+            Uring,
+            &WriteResult,
+            &SyncResult
+            );
+    }
+
+    if ( Submitted < 2 || Reaped < 2 )
+    {
+        LOG("io_uring_enter failed: %s (errno %d), writing this batch with the sync backend\n", ERRNO_STRING());
+
+        // Nothing past the tail is read again, and the kernel never took
+        // these
+        __atomic_store_n(
+            Uring->SqTail,
+            Tail + Submitted,
+            __ATOMIC_RELEASE
+            );
+
+        // What the kernel did take still points into this batch's buffer
+        while ( Reaped < Submitted )
+        {
+            Result = (INT)syscall(
+                __NR_io_uring_enter,
+                Uring->Descriptor,
+                0,
+                Submitted - Reaped,
+                IORING_ENTER_GETEVENTS,
+                NULL,
+                0
+                );
+            if ( Result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+            {
+                // The ring can't be trusted anymore
+                LOG("Failed to wait for io_uring: %s (errno %d), switching to the sync backend\n", ERRNO_STRING());
+                Writer->Backend = StorageBackendSync;
+                break;
+            }
+            Reaped += UringReap(
+                Uring,
+                &WriteResult,
+                &SyncResult
+                );
+        }
+
+        return SyncWrite(
+            Writer,
+            Data,
+            Size,
+            Offset
+            );
+    }
+
+    if ( WriteResult == -EINVAL )
+    {
+        // Kernels before 5.6 don't have IORING_OP_WRITE
+        LOG("io_uring can't write here, switching to the sync backend\n");
+        Writer->Backend = StorageBackendSync;
+        return SyncWrite(
+            Writer,
+            Data,
+            Size,
+            Offset
+            );
+    }
+
+    if ( WriteResult < 0 )
+    {
+        LOG("Failed to write: %s (errno %d)\n", strerror(-WriteResult), -WriteResult);
+        return FALSE;
+    }
+
+    if ( (SIZE_T)WriteResult < Size || SyncResult < 0 )
+    {
+        return SyncWrite(
+            Writer,
+            Data + WriteResult,
+            Size - WriteResult,
+            Offset + WriteResult
+            );
+    }
+
+    return TRUE;
+}
+#endif
+
+static VOID
+ReportCompletion(
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    This routine passes how much of the file is durable to the writer's
+    completion, on the loop thread.
+
+Arguments:
+
+    Context - The writer.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSTORAGE_WRITER Writer = Context;
+    UINT64 Durable;
+    BOOLEAN Failed;
+
+    MutexLock(&Writer->Lock);
+    Writer->Posted = FALSE;
+    Durable = Writer->Durable;
+    Failed = Writer->Failed;
+    MutexUnlock(&Writer->Lock);
+
+    Writer->Completion(
+        Durable,
+        Failed
+        );
+}
+
+static VOID
+WriterThread(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine writes batches until the writer is closed. The buffer
+    being written is swapped out of the writer, so appends go on while it's
+    on its way to the disk. After a failure nothing else is written, so the
+    file never has a gap in it.
+
+Arguments:
+
+    Parameter - The writer.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSTORAGE_WRITER Writer = Parameter;
+    PBYTE Writing;
+    SIZE_T WritingCapacity;
+    SIZE_T Size;
+    UINT64 Offset;
+    UINT64 Start;
+    BOOLEAN Written;
+
+    TraceSetThreadName("storage");
+    Writing = NULL;
+    WritingCapacity = 0;
+
+    MutexLock(&Writer->Lock);
+    while ( TRUE )
+    {
+        while ( !Writer->PendingSize && !Writer->Stopping )
+        {
+            ConditionWait(
+                &Writer->WorkCondition,
+                &Writer->Lock,
+                WAIT_FOREVER
+                );
+        }
+
+        if ( !Writer->PendingSize || Writer->Failed )
+        {
+            break;
+        }
+
+        // Swap buffers, so the next batch fills the one just written
+        {
+            PBYTE Buffer = Writing;
+            SIZE_T Capacity = WritingCapacity;
+
+            Writing = Writer->Pending;
+            WritingCapacity = Writer->PendingCapacity;
+            Writer->Pending = Buffer;
+            Writer->PendingCapacity = Capacity;
+        }
+        Size = Writer->PendingSize;
+        Offset = Writer->Appended - Size;
+        Writer->PendingSize = 0;
+        MutexUnlock(&Writer->Lock);
+
+        Start = TraceNow();
+#ifdef STORAGE_HAVE_URING
+        if ( Writer->Backend == StorageBackendUring )
+        {
+            Written = UringWrite(
+                Writer,
+                Writing,
+                Size,
+                Offset
+                );
+        }
+        else
+#endif
+        {
+            Written = SyncWrite(
+                Writer,
+                Writing,
+                Size,
+                Offset
+                );
+        }
+        TraceSpan(
+            "storage",
+            "batch",
+            Start,
+            TraceNow(),
+            "{\"bytes\":%zu}",
+            Size
+            );
+
+        MutexLock(&Writer->Lock);
+        Writer->Batches++;
+        Writer->WriteTime += TraceNow() - Start;
+        if ( Written )
+        {
+            Writer->Durable = Offset + Size;
+        }
+        else
+        {
+            Writer->Failed = TRUE;
+        }
+        ConditionBroadcast(&Writer->DoneCondition);
+
+        if ( Writer->Completion && !Writer->Posted )
+        {
+            Writer->Posted = ExecutorPost(
+                ReportCompletion,
+                Writer
+                );
+        }
+    }
+
+    Writer->Stopped = TRUE;
+    ConditionBroadcast(&Writer->DoneCondition);
+    MutexUnlock(&Writer->Lock);
+    free(Writing);
+}
+
+PSTORAGE_WRITER
+StorageOpen(
+    IN PCCHAR Path,
+    IN UINT64 Offset,
+    IN STORAGE_BACKEND Backend,
+    IN PSTORAGE_COMPLETION Completion OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine opens a file for appending and starts its writer thread.
+
+Arguments:
+
+    Path - The file, which has to exist.
+
+    Offset - The size of the file, where appends start.
+
+    Backend - How to write, where auto picks io_uring if it's available.
+
+    Completion - Called on the loop thread as appends become durable, or
+                 NULL.
+
+Return Value:
+
+    The writer, or NULL if the file couldn't be opened.
+
+--*/
+{
+    PSTORAGE_WRITER Writer;
+
+    Writer = calloc(
+        1,
+        sizeof(STORAGE_WRITER)
+        );
+    if ( !Writer )
+    {
+        LOG("Failed to allocate writer: %s (errno %d)\n", ERRNO_STRING());
+        return NULL;
+    }
+
+#ifdef _WIN32
+    Writer->Descriptor = _open(
+        Path,
+        _O_WRONLY | _O_APPEND | _O_BINARY
+        );
+#else
+    Writer->Descriptor = open(
+        Path,
+        O_WRONLY | O_CLOEXEC
+        );
+#endif
+    if ( Writer->Descriptor < 0 )
+    {
+        LOG("Failed to open %s for writing: %s (errno %d)\n", Path, ERRNO_STRING());
+        free(Writer);
+        return NULL;
+    }
+
+    Writer->Backend = StorageBackendSync;
+#ifdef STORAGE_HAVE_URING
+    if ( Backend != StorageBackendSync && UringSetup(&Writer->Uring) )
+    {
+        Writer->Backend = StorageBackendUring;
+    }
+#endif
+    if ( Backend == StorageBackendUring && Writer->Backend != StorageBackendUring )
+    {
+        LOG("io_uring isn't available, using the sync backend\n");
+    }
+
+    Writer->Completion = Completion;
+    Writer->Lock = (MUTEX)MUTEX_INITIALIZER;
+    Writer->WorkCondition = (CONDITION)CONDITION_INITIALIZER;
+    Writer->DoneCondition = (CONDITION)CONDITION_INITIALIZER;
+    Writer->Appended = Offset;
+    Writer->Durable = Offset;
+
+    if ( !ThreadStart(
+             WriterThread,
+             Writer
+             ) )
+    {
+#ifdef STORAGE_HAVE_URING
+        if ( Writer->Backend == StorageBackendUring )
+        {
+            UringFree(&Writer->Uring);
+        }
+#endif
+        close(Writer->Descriptor);
+        free(Writer);
+        return NULL;
+    }
+
+    LOG("Appending to %s with the %s backend\n", Path, BackendNames[Writer->Backend]);
+    return Writer;
+}
+
+BOOLEAN
+StorageAppend(
+    IN PSTORAGE_WRITER Writer,
+    IN PCVOID Data,
+    IN SIZE_T Size
+    )
+/*++
+
+Routine Description:
+
+    This routine copies data into the next batch and wakes the writer.
+
+Arguments:
+
+    Writer - The writer.
+
+    Data - The data.
+
+    Size - The size of the data.
+
+Return Value:
+
+    TRUE - The data will be written.
+
+    FALSE - An earlier write failed, or memory couldn't be allocated.
+
+--*/
+{
+    PBYTE NewPending;
+    SIZE_T NewCapacity;
+
+    MutexLock(&Writer->Lock);
+    if ( Writer->Failed || Writer->Stopping )
+    {
+        MutexUnlock(&Writer->Lock);
+        return FALSE;
+    }
+
+    if ( Writer->PendingSize + Size > Writer->PendingCapacity )
+    {
+        NewCapacity = MAX(Writer->PendingCapacity, STORAGE_INITIAL_BUFFER);
+        while ( NewCapacity < Writer->PendingSize + Size )
+        {
+            NewCapacity *= 2;
+        }
+
+        NewPending = realloc(
+            Writer->Pending,
+            NewCapacity
+            );
+        if ( !NewPending )
+        {
+            MutexUnlock(&Writer->Lock);
+            LOG("Failed to grow write batch: %s (errno %d)\n", ERRNO_STRING());
+            return FALSE;
+        }
+        Writer->Pending = NewPending;
+        Writer->PendingCapacity = NewCapacity;
+    }
+
+    memcpy(
+        Writer->Pending + Writer->PendingSize,
+        Data,
+        Size
+        );
+    Writer->PendingSize += Size;
+    Writer->Appended += Size;
+    ConditionSignal(&Writer->WorkCondition);
+    MutexUnlock(&Writer->Lock);
+
+    return TRUE;
+}
+
+BOOLEAN
+StorageFlush(
+    IN PSTORAGE_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    This routine waits for everything appended so far to be durable.
+
+Arguments:
+
+    Writer - The writer.
+
+Return Value:
+
+    TRUE - Everything is durable.
+
+    FALSE - A write failed.
+
+--*/
+{
+    UINT64 Target;
+    BOOLEAN Failed;
+
+    MutexLock(&Writer->Lock);
+    Target = Writer->Appended;
+    while ( Writer->Durable < Target && !Writer->Failed && !Writer->Stopped )
+    {
+        ConditionWait(
+            &Writer->DoneCondition,
+            &Writer->Lock,
+            WAIT_FOREVER
+            );
+    }
+    Failed = Writer->Durable < Target;
+    MutexUnlock(&Writer->Lock);
+
+    return !Failed;
+}
+
+PCCHAR
+StorageGetBackendName(
+    IN PSTORAGE_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the name of the backend a writer is using.
+
+Arguments:
+
+    Writer - The writer.
+
+Return Value:
+
+    The name.
+
+--*/
+{
+    return BackendNames[Writer->Backend];
+}
+
+VOID
+StorageClose(
+    IN PSTORAGE_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    This routine writes what's left, stops the writer thread and closes the
+    file. Completions that haven't run yet never will, so this is only
+    called once the loop has stopped.
+
+Arguments:
+
+    Writer - The writer.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    MutexLock(&Writer->Lock);
+    Writer->Stopping = TRUE;
+    ConditionSignal(&Writer->WorkCondition);
+    while ( !Writer->Stopped )
+    {
+        ConditionWait(
+            &Writer->DoneCondition,
+            &Writer->Lock,
+            WAIT_FOREVER
+            );
+    }
+    MutexUnlock(&Writer->Lock);
+
+    if ( Writer->Failed || Writer->Durable < Writer->Appended )
+    {
+        LOG("%" PRIu64 " bytes were never written\n", Writer->Appended - Writer->Durable);
+    }
+
+#ifdef STORAGE_HAVE_URING
+    if ( Writer->Backend == StorageBackendUring )
+    {
+        UringFree(&Writer->Uring);
+    }
+#endif
+    close(Writer->Descriptor);
+    free(Writer->Pending);
+    free(Writer);
+}
+
+static VOID
+BenchmarkBackend(
+    IN PCCHAR Path,
+    IN STORAGE_BACKEND Backend,
+    IN BOOLEAN FlushEach
+    )
+/*++
+
+Routine Description:
+
+    This routine appends records to an empty file with one backend and
+    prints how it did. Flushing after each append measures the latency of
+    a durable append, and flushing once at the end measures how well
+    appends are batched.
+
+Arguments:
+
+    Path - The scratch file.
+
+    Backend - The backend.
+
+    FlushEach - Whether to wait for each append to be durable.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ATTENDANCE_RECORD Records[STORAGE_BENCHMARK_BATCH] = {0};
+    PSTORAGE_WRITER Writer;
+    FILE* File;
+    UINT64 Start;
+    UINT64 Elapsed;
+    UINT64 Batches;
+    UINT64 WriteTime;
+    UINT32 i;
+
+    File = fopen(
+        Path,
+        "wb"
+        );
+    if ( !File )
+    {
+        LOG("Failed to create %s: %s (errno %d)\n", Path, ERRNO_STRING());
+        return;
+    }
+    fclose(File);
+
+    Writer = StorageOpen(
+        Path,
+        0,
+        Backend,
+        NULL
+        );
+    if ( !Writer )
+    {
+        return;
+    }
+    if ( Writer->Backend != Backend )
+    {
+        StorageClose(Writer);
+        return;
+    }
+
+    Start = TraceNow();
+    for ( i = 0; i < STORAGE_BENCHMARK_RECORDS; i += STORAGE_BENCHMARK_BATCH )
+    {
+        Records[0].Number = i;
+        StorageAppend(
+            Writer,
+            Records,
+            sizeof(Records)
+            );
+        if ( FlushEach )
+        {
+            StorageFlush(Writer);
+        }
+    }
+    StorageFlush(Writer);
+    Elapsed = MAX(TraceNow() - Start, 1);
+
+    MutexLock(&Writer->Lock);
+    Batches = MAX(Writer->Batches, 1);
+    WriteTime = Writer->WriteTime;
+    MutexUnlock(&Writer->Lock);
+
+    printf(
+        "%-10s %-8s %10.0f %10" PRIu64 " %12.1f\n",
+        BackendNames[Backend],
+        FlushEach ? "each" : "end",
+        STORAGE_BENCHMARK_RECORDS * 1e6 / Elapsed,
+        Batches,
+        (DOUBLE)WriteTime / Batches
+        );
+
+    StorageClose(Writer);
+}
+
+INT
+StorageBenchmark(
+    IN PCCHAR Path
+    )
+/*++
+
+Routine Description:
+
+    This routine appends journal records to a scratch file with each
+    backend, both waiting for every append and letting them batch, and
+    prints the records per second, the number of write and sync batches,
+    and the average time per batch.
+
+Arguments:
+
+    Path - The scratch file, which is overwritten and deleted.
+
+Return Value:
+
+    0.
+
+--*/
+{
+    printf(
+        "%u records of %zu bytes, %u per append\n",
+        STORAGE_BENCHMARK_RECORDS,
+        sizeof(ATTENDANCE_RECORD),
+        STORAGE_BENCHMARK_BATCH
+        );
+    printf(
+        "%-10s %-8s %10s %10s %12s\n",
+        "backend",
+        "flush",
+        "records/s",
+        "batches",
+        "us/batch"
+        );
+
+    BenchmarkBackend(
+        Path,
+        StorageBackendSync,
+        TRUE
+        );
+    BenchmarkBackend(
+        Path,
+        StorageBackendUring,
+        TRUE
+        );
+    BenchmarkBackend(
+        Path,
+        StorageBackendSync,
+        FALSE
+        );
+    BenchmarkBackend(
+        Path,
+        StorageBackendUring,
+        FALSE
+        );
+
+    remove(Path);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    storage.h
+
+Abstract:
+
+    This module contains definitions for asynchronous appends to files,
+    with io_uring on Linux and plain writes and syncs everywhere else.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Initial size of a writer's batch buffers, which grow as needed
+//
+
+#define STORAGE_INITIAL_BUFFER 4096
+
+//
+// Entries in the io_uring submission queue. Each batch is a write and a
+// sync linked to it.
+//
+
+#define STORAGE_URING_ENTRIES 8
+
+//
+// Times to retry an io_uring submission the kernel is too busy for, and
+// milliseconds to wait between them
+//
+
+#define STORAGE_URING_RETRIES 100
+#define STORAGE_URING_RETRY_DELAY 1
+
+//
+// Records per append and total records in the benchmark
+//
+
+#define STORAGE_BENCHMARK_BATCH 8
+#define STORAGE_BENCHMARK_RECORDS 20000
+
+//
+// How a writer writes
+//
+
+typedef enum _STORAGE_BACKEND
+{
+    StorageBackendAuto,
+    StorageBackendSync,
+    StorageBackendUring
+} STORAGE_BACKEND, *PSTORAGE_BACKEND;
+
+//
+// Called on the loop thread as appends become durable
+//
+
+typedef VOID (*PSTORAGE_COMPLETION)(
+    IN UINT64 Durable,
+    IN BOOLEAN Failed
+    );
+
+//
+// An append-only writer
+//
+
+typedef struct _STORAGE_WRITER STORAGE_WRITER, *PSTORAGE_WRITER;
+
+//
+// Parse a backend name from the configuration
+//
+
+BOOLEAN
+StorageParseBackend(
+    IN PCCHAR Name,
+    OUT PSTORAGE_BACKEND Backend
+    );
+
+//
+// Start a writer that appends to a file
+//
+
+PSTORAGE_WRITER
+StorageOpen(
+    IN PCCHAR Path,
+    IN UINT64 Offset,
+    IN STORAGE_BACKEND Backend,
+    IN PSTORAGE_COMPLETION Completion OPTIONAL
+    );
+
+//
+// Queue data to be appended
+//
+
+BOOLEAN
+StorageAppend(
+    IN PSTORAGE_WRITER Writer,
+    IN PCVOID Data,
+    IN SIZE_T Size
+    );
+
+//
+// Wait for everything appended so far to be durable
+//
+
+BOOLEAN
+StorageFlush(
+    IN PSTORAGE_WRITER Writer
+    );
+
+//
+// Get the name of the backend a writer ended up with
+//
+
+PCCHAR
+StorageGetBackendName(
+    IN PSTORAGE_WRITER Writer
+    );
+
+//
+// Flush and stop a writer
+//
+
+VOID
+StorageClose(
+    IN PSTORAGE_WRITER Writer
+    );
+
+//
+// Compare the backends on a scratch file
+//
+
+INT
+StorageBenchmark(
+    IN PCCHAR Path
+    );
@@ -0,0 +1,579 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    suggest.c
+
+Abstract:
+
+    This module implements name suggestions. Names are folded to lowercase
+    with single spaces and packed into one pool, and there's a key for the
+    start of each word of each name, so "smi" finds "John Smith". The keys
+    are sorted, so a prefix is found with a binary search and its matches
+    are the keys right after it.
+
+    The index is built on a worker from a copy of the roster and swapped in
+    on the loop thread, which is the only thread that searches it, so
+    searches never wait on a build.
+
+--*/
+
+#include "server.h"
+
+//
+// A member in the index, with the offset of their name in the pool
+//
+
+typedef struct _SUGGEST_NAME
+{
+    UINT32 Number;
+    UINT32 Display;
+} SUGGEST_NAME, *PSUGGEST_NAME;
+
+//
+// The offset of a word in the folded names, and whose name it's in
+//
+
+typedef struct _SUGGEST_KEY
+{
+    UINT32 Key;
+    UINT32 Name;
+} SUGGEST_KEY, *PSUGGEST_KEY;
+
+typedef struct _SUGGEST_INDEX
+{
+    PSUGGEST_NAME Names;
+    UINT32 NameCount;
+    PSUGGEST_KEY Keys;
+    UINT32 KeyCount;
+    PCHAR Pool;
+} SUGGEST_INDEX, *PSUGGEST_INDEX;
+
+//
+// A build in progress
+//
+
+typedef struct _SUGGEST_BUILD
+{
+    PROSTER_MEMBER Members;
+    UINT32 Count;
+    PSUGGEST_INDEX Index;
+} SUGGEST_BUILD, *PSUGGEST_BUILD;
+
+// Only touched on the loop thread
+static PSUGGEST_INDEX Index;
+static BOOLEAN Building;
+static BOOLEAN RebuildPending;
+
+// The pool keys are compared in while sorting, since qsort has no context
+static THREAD_LOCAL PCCHAR SortPool;
+
+SIZE_T
+FoldName(
+    IN PCCHAR Name,
+    OUT PCHAR Folded,
+    IN SIZE_T FoldedSize
+    )
+/*++
+
+Routine Description:
+
+    This routine lowercases a name and turns each run of whitespace into
+    one space, dropping it at the start. Bytes outside ASCII are kept as
+    they are.
+
+Arguments:
+
+    Name - The name.
+
+    Folded - Receives the folded name.
+
+    FoldedSize - The size of the buffer.
+
+Return Value:
+
+    The length of the folded name.
+
+--*/
+{
+    SIZE_T Length;
+    BOOLEAN Space;
+
+    Length = 0;
+    Space = FALSE;
+    for ( ; *Name && Length + 2 < FoldedSize; Name++ )
+    {
+        if ( isspace((UCHAR)*Name) )
+        {
+            Space = Length > 0;
+            continue;
+        }
+
+        if ( Space )
+        {
+            Folded[Length++] = ' ';
+            Space = FALSE;
+        }
+        Folded[Length++] = (CHAR)tolower((UCHAR)*Name);
+    }
+
+    // A trailing space only matches names with another word after it
+    if ( Space && Length + 1 < FoldedSize )
+    {
+        Folded[Length++] = ' ';
+    }
+    Folded[Length] = 0;
+    return Length;
+}
+
+static INT
+CompareKeys(
+    IN PCVOID First,
+    IN PCVOID Second
+    )
+/*++
+
+Routine Description:
+
+    This routine compares two keys by the words they point to.
+
+Arguments:
+
+    First - The first key.
+
+    Second - The second key.
+
+Return Value:
+
+    Less than, equal to or greater than 0 as First sorts before, with or
+    after Second.
+
+--*/
+{
+    return strcmp(
+        SortPool + ((const SUGGEST_KEY*)First)->Key,
+        SortPool + ((const SUGGEST_KEY*)Second)->Key
+        );
+}
+
+static VOID
+FreeIndex(
+    IN PSUGGEST_INDEX Index OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine frees an index.
+
+Arguments:
+
+    Index - The index.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( Index )
+    {
+        free(Index->Names);
+        free(Index->Keys);
+        free(Index->Pool);
+        free(Index);
+    }
+}
+
+static VOID
+BuildTask(
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    This routine builds an index from a copy of the roster, on a worker.
+    The pool holds each folded name followed by the name as it's shown.
+
+Arguments:
+
+    Context - The SUGGEST_BUILD.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSUGGEST_BUILD Build = Context;
+    PSUGGEST_INDEX NewIndex;
+    PCHAR Folded;
+    SIZE_T PoolSize;
+    SIZE_T Offset;
+    SIZE_T Length;
+    UINT32 KeyCount;
+    UINT32 i;
+    UINT32 j;
+
+    PoolSize = 0;
+    KeyCount = 0;
+    for ( i = 0; i < Build->Count; i++ )
+    {
+        Length = strlen(Build->Members[i].Name);
+        PoolSize += 2 * (Length + 1);
+
+        // A key per word, split the same way FoldName splits them
+        for ( j = 0; j < Length; j++ )
+        {
+            KeyCount += !isspace((UCHAR)Build->Members[i].Name[j]) &&
+                        (j == 0 ||
+                         isspace((UCHAR)Build->Members[i].Name[j - 1]));
+        }
+    }
+
+    NewIndex = calloc(
+        1,
+        sizeof(SUGGEST_INDEX)
+        );
+    if ( !NewIndex )
+    {
+        goto Failed;
+    }
+    NewIndex->Names = malloc(MAX(Build->Count, 1) * sizeof(SUGGEST_NAME));
+    NewIndex->Keys = malloc(MAX(KeyCount, 1) * sizeof(SUGGEST_KEY));
+    NewIndex->Pool = malloc(MAX(PoolSize, 1));
+    if ( !NewIndex->Names || !NewIndex->Keys || !NewIndex->Pool )
+    {
+        goto Failed;
+    }
+
+    Offset = 0;
+    for ( i = 0; i < Build->Count; i++ )
+    {
+        Folded = NewIndex->Pool + Offset;
+        Length = FoldName(
+            Build->Members[i].Name,
+            Folded,
+            PoolSize - Offset
+            );
+        if ( !Length )
+        {
+            continue;
+        }
+
+        // Every word starts a key, including the first
+        for ( j = 0; j < Length; j++ )
+        {
+            if ( (j == 0 || Folded[j - 1] == ' ') &&
+                 NewIndex->KeyCount < KeyCount )
+            {
+                NewIndex->Keys[NewIndex->KeyCount].Key = (UINT32)(Offset + j);
+                NewIndex->Keys[NewIndex->KeyCount].Name = NewIndex->NameCount;
+                NewIndex->KeyCount++;
+            }
+        }
+        Offset += Length + 1;
+
+        NewIndex->Names[NewIndex->NameCount].Number = Build->Members[i].Number;
+        NewIndex->Names[NewIndex->NameCount].Display = (UINT32)Offset;
+        NewIndex->NameCount++;
+        Length = strlen(Build->Members[i].Name);
+        memcpy(
+            NewIndex->Pool + Offset,
+            Build->Members[i].Name,
+            Length + 1
+            );
+        Offset += Length + 1;
+    }
+
+    SortPool = NewIndex->Pool;
+    qsort(
+        NewIndex->Keys,
+        NewIndex->KeyCount,
+        sizeof(SUGGEST_KEY),
+        CompareKeys
+        );
+
+    Build->Index = NewIndex;
+    free(Build->Members);
+    Build->Members = NULL;
+    return;
+
+Failed:
+    LOG("Failed to allocate name index: %s (errno %d)\n", ERRNO_STRING());
+    FreeIndex(NewIndex);
+    free(Build->Members);
+    Build->Members = NULL;
+}
+
+static VOID
+BuildCompletion(
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    This routine swaps in a finished index, and starts another build if the
+    roster changed while this one was running.
+
+Arguments:
+
+    Context - The SUGGEST_BUILD.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSUGGEST_BUILD Build = Context;
+
+    if ( Build->Index )
+    {
+        LOG("Built name index of %u members and %u words\n", Build->Index->NameCount, Build->Index->KeyCount);
+        FreeIndex(Index);
+        Index = Build->Index;
+    }
+    free(Build);
+
+    Building = FALSE;
+    if ( RebuildPending )
+    {
+        RebuildPending = FALSE;
+        SuggestRebuild();
+    }
+}
+
+VOID
+SuggestRebuild(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine copies the roster and builds a new index from it on a
+    worker. The old index is searched until the new one is ready, and a
+    rebuild asked for during a build runs once it's done.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PSUGGEST_BUILD Build;
+    PCROSTER_MEMBER Member;
+    UINT32 i;
+
+    if ( Building )
+    {
+        RebuildPending = TRUE;
+        return;
+    }
+
+    Build = calloc(
+        1,
+        sizeof(SUGGEST_BUILD)
+        );
+    if ( !Build )
+    {
+        LOG("Failed to allocate name index build: %s (errno %d)\n", ERRNO_STRING());
+        return;
+    }
+
+    Build->Count = RosterGetMemberCount();
+    Build->Members = malloc(MAX(Build->Count, 1) * sizeof(ROSTER_MEMBER));
+    if ( !Build->Members )
+    {
+        LOG("Failed to copy roster for name index: %s (errno %d)\n", ERRNO_STRING());
+        free(Build);
+        return;
+    }
+    for ( i = 0; i < Build->Count; i++ )
+    {
+        Member = RosterGetMember(i);
+        Build->Members[i] = *Member;
+    }
+
+    if ( !ExecutorSubmit(
+             BuildTask,
+             BuildCompletion,
+             Build
+             ) )
+    {
+        free(Build->Members);
+        free(Build);
+        return;
+    }
+    Building = TRUE;
+}
+
+VOID
+SuggestWriteJson(
+    IN struct mg_connection* Connection,
+    IN PCCHAR Prefix,
+    IN UINT32 Limit
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the members with a word in their name starting with
+    a prefix, in the order of the words, as a chunked response. A member
+    matching with more than one word is only written once.
+
+Arguments:
+
+    Connection - The connection to write to.
+
+    Prefix - The prefix, which is folded like the names.
+
+    Limit - The most members to write.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR Folded[SUGGEST_PREFIX_SIZE];
+    CHAR Output[JSON_WRITER_BUFFER_SIZE];
+    JSON_WRITER Writer;
+    UINT32 Seen[SUGGEST_MAX_LIMIT];
+    PSUGGEST_NAME Match;
+    SIZE_T Length;
+    UINT32 Written;
+    UINT32 Low;
+    UINT32 High;
+    UINT32 Middle;
+    UINT32 i;
+    UINT32 j;
+
+    Limit = CLAMP(Limit, 1, SUGGEST_MAX_LIMIT);
+    Length = FoldName(
+        Prefix,
+        Folded,
+        ARRAY_SIZE(Folded)
+        );
+
+    mg_printf(
+        Connection,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Cache-Control: no-store\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "\r\n"
+        );
+    JsonWriterInitialize(
+        &Writer,
+        Output,
+        ARRAY_SIZE(Output),
+        JsonSinkChunk,
+        Connection
+        );
+    JsonWriteRaw(
+        &Writer,
+        "{\"suggestions\":[",
+        16
+        );
+
+    Written = 0;
+    if ( Index && Length )
+    {
+        // First key not before the prefix
+        Low = 0;
+        High = Index->KeyCount;
+        while ( Low < High )
+        {
+            Middle = Low + (High - Low) / 2;
+            if ( strcmp(Index->Pool + Index->Keys[Middle].Key, Folded) < 0 )
+            {
+                Low = Middle + 1;
+            }
+            else
+            {
+                High = Middle;
+            }
+        }
+
+        for ( i = Low; i < Index->KeyCount && Written < Limit; i++ )
+        {
+            if ( strncmp(Index->Pool + Index->Keys[i].Key, Folded, Length) != 0 )
+            {
+                break;
+            }
+
+            for ( j = 0; j < Written && Seen[j] != Index->Keys[i].Name; j++ )
+            {
+            }
+            if ( j < Written )
+            {
+                continue;
+            }
+            Seen[Written] = Index->Keys[i].Name;
+
+            Match = &Index->Names[Index->Keys[i].Name];
+            JsonWritef(
+                &Writer,
+                "%s{\"number\":%u,\"name\":",
+                Written ? "," : "",
+                Match->Number
+                );
+            JsonWriteString(
+                &Writer,
+                Index->Pool + Match->Display
+                );
+            JsonWriteRaw(
+                &Writer,
+                "}",
+                1
+                );
+            Written++;
+        }
+    }
+
+    JsonWriteRaw(
+        &Writer,
+        "]}\n",
+        3
+        );
+    JsonWriterFlush(&Writer);
+    mg_http_printf_chunk(
+        Connection,
+        ""
+        );
+}
+
+VOID
+SuggestFree(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine frees the index. The executor has stopped by now, so no
+    build is still running.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FreeIndex(Index);
+    Index = NULL;
+}
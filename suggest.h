@@ -0,0 +1,72 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    suggest.h
+
+Abstract:
+
+    This module contains definitions for name suggestions, a sorted index
+    of roster names searched by prefix as names are typed.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Suggestions returned by default, and at most
+//
+
+#define DEFAULT_SUGGEST_LIMIT 8
+#define SUGGEST_MAX_LIMIT 32
+
+//
+// Longest prefix that's searched for
+//
+
+#define SUGGEST_PREFIX_SIZE 64
+
+//
+// Fold a name to lowercase with single spaces, for comparing names
+//
+
+SIZE_T
+FoldName(
+    IN PCCHAR Name,
+    OUT PCHAR Folded,
+    IN SIZE_T FoldedSize
+    );
+
+//
+// Rebuild the index from the roster on a worker, from the loop thread
+//
+
+VOID
+SuggestRebuild(
+    VOID
+    );
+
+//
+// Write the members whose names have a word starting with a prefix as a
+// response, from the loop thread
+//
+
+VOID
+SuggestWriteJson(
+    IN struct mg_connection* Connection,
+    IN PCCHAR Prefix,
+    IN UINT32 Limit
+    );
+
+//
+// Free the index
+//
+
+VOID
+SuggestFree(
+    VOID
+    );
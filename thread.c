@@ -0,0 +1,421 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    thread.c
+
+Abstract:
+
+    This module implements portable threads and locks on top of Win32 and
+    pthreads.
+
+--*/
+
+#include "server.h"
+
+typedef struct _THREAD_START
+{
+    PTHREAD_ROUTINE Routine;
+    PVOID Parameter;
+} THREAD_START, *PTHREAD_START;
+
+#ifdef _WIN32
+static DWORD WINAPI
+#else
+static PVOID
+#endif
+ThreadEntry(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine calls a thread's routine, hiding the platform's entry point
+    signature, and gives up the thread's trace ring when it returns.
+
+Arguments:
+
+    Parameter - The THREAD_START for the thread, freed before the routine
+                is called.
+
+Return Value:
+
+    0 or NULL.
+
+--*/
+{
+    THREAD_START Start = *(PTHREAD_START)Parameter;
+
+    free(Parameter);
+    Start.Routine(Start.Parameter);
+    TraceReleaseThread();
+
+    return 0;
+}
+
+static BOOLEAN
+StartThread(
+    IN PTHREAD_ROUTINE Routine,
+    IN PVOID Parameter OPTIONAL,
+    OUT PTHREAD Thread OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine starts a thread, detached unless its handle is wanted.
+
+Arguments:
+
+    Routine - The function to run on the thread.
+
+    Parameter - Passed to the routine.
+
+    Thread - Receives the thread to join, or NULL to detach it.
+
+Return Value:
+
+    TRUE - The thread was started.
+
+    FALSE - The thread couldn't be started.
+
+--*/
+{
+    PTHREAD_START Start;
+    THREAD NewThread;
+#ifndef _WIN32
+    INT Error;
+#endif
+
+    Start = malloc(sizeof(THREAD_START));
+    if ( !Start )
+    {
+        LOG("Failed to allocate thread parameters: %s (errno %d)\n", ERRNO_STRING());
+        return FALSE;
+    }
+    Start->Routine = Routine;
+    Start->Parameter = Parameter;
+
+#ifdef _WIN32
+    NewThread = CreateThread(
+        NULL,
+        0,
+        ThreadEntry,
+        Start,
+        0,
+        NULL
+        );
+    if ( !NewThread )
+    {
+        LOG("Failed to create thread: error %lu\n", GetLastError());
+        free(Start);
+        return FALSE;
+    }
+    if ( !Thread )
+    {
+        CloseHandle(NewThread);
+    }
+#else
+    Error = pthread_create(
+        &NewThread,
+        NULL,
+        ThreadEntry,
+        Start
+        );
+    if ( Error )
+    {
+        LOG("Failed to create thread: %s (errno %d)\n", strerror(Error), Error);
+        free(Start);
+        return FALSE;
+    }
+    if ( !Thread )
+    {
+        pthread_detach(NewThread);
+    }
+#endif
+
+    if ( Thread )
+    {
+        *Thread = NewThread;
+    }
+    return TRUE;
+}
+
+BOOLEAN
+ThreadStart(
+    IN PTHREAD_ROUTINE Routine,
+    IN PVOID Parameter OPTIONAL
+    )
+/*++
+
+Routine Description:
+
+    This routine starts a detached thread.
+
+Arguments:
+
+    Routine - The function to run on the thread.
+
+    Parameter - Passed to the routine.
+
+Return Value:
+
+    TRUE - The thread was started.
+
+    FALSE - The thread couldn't be started.
+
+--*/
+{
+    return StartThread(
+        Routine,
+        Parameter,
+        NULL
+        );
+}
+
+BOOLEAN
+ThreadCreate(
+    IN PTHREAD_ROUTINE Routine,
+    IN PVOID Parameter OPTIONAL,
+    OUT PTHREAD Thread
+    )
+/*++
+
+Routine Description:
+
+    This routine starts a thread that has to be joined with ThreadJoin.
+
+Arguments:
+
+    Routine - The function to run on the thread.
+
+    Parameter - Passed to the routine.
+
+    Thread - Receives the thread.
+
+Return Value:
+
+    TRUE - The thread was started.
+
+    FALSE - The thread couldn't be started.
+
+--*/
+{
+    return StartThread(
+        Routine,
+        Parameter,
+        Thread
+        );
+}
+
+VOID
+ThreadJoin(
+    IN THREAD Thread
+    )
+/*++
+
+Routine Description:
+
+    This routine waits for a thread to return and frees it.
+
+Arguments:
+
+    Thread - The thread, from ThreadCreate.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    WaitForSingleObject(
+        Thread,
+        INFINITE
+        );
+    CloseHandle(Thread);
+#else
+    pthread_join(
+        Thread,
+        NULL
+        );
+#endif
+}
+
+VOID
+MutexLock(
+    IN PMUTEX Mutex
+    )
+/*++
+
+Routine Description:
+
+    This routine acquires a mutex.
+
+Arguments:
+
+    Mutex - The mutex.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(Mutex);
+#else
+    pthread_mutex_lock(Mutex);
+#endif
+}
+
+VOID
+MutexUnlock(
+    IN PMUTEX Mutex
+    )
+/*++
+
+Routine Description:
+
+    This routine releases a mutex.
+
+Arguments:
+
+    Mutex - The mutex.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(Mutex);
+#else
+    pthread_mutex_unlock(Mutex);
+#endif
+}
+
+VOID
+ConditionWait(
+    IN PCONDITION Condition,
+    IN PMUTEX Mutex,
+    IN UINT32 Timeout
+    )
+/*++
+
+Routine Description:
+
+    This routine releases a mutex and waits for a condition to be signalled
+    or for a timeout, then reacquires the mutex. Wakeups can be spurious, so
+    callers have to check what they're waiting for again.
+
+Arguments:
+
+    Condition - The condition.
+
+    Mutex - The mutex, which must be held.
+
+    Timeout - Milliseconds to wait, or WAIT_FOREVER.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    SleepConditionVariableSRW(
+        Condition,
+        Mutex,
+        Timeout == WAIT_FOREVER ? INFINITE : Timeout,
+        0
+        );
+#else
+    struct timespec Deadline;
+
+    if ( Timeout == WAIT_FOREVER )
+    {
+        pthread_cond_wait(
+            Condition,
+            Mutex
+            );
+        return;
+    }
+
+    clock_gettime(
+        CLOCK_REALTIME,
+        &Deadline
+        );
+    Deadline.tv_sec += Timeout / 1000;
+    Deadline.tv_nsec += (long)(Timeout % 1000) * 1000000;
+    if ( Deadline.tv_nsec >= 1000000000 )
+    {
+        Deadline.tv_sec++;
+        Deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(
+        Condition,
+        Mutex,
+        &Deadline
+        );
+#endif
+}
+
+VOID
+ConditionSignal(
+    IN PCONDITION Condition
+    )
+/*++
+
+Routine Description:
+
+    This routine wakes a thread waiting on a condition.
+
+Arguments:
+
+    Condition - The condition.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    WakeConditionVariable(Condition);
+#else
+    pthread_cond_signal(Condition);
+#endif
+}
+
+VOID
+ConditionBroadcast(
+    IN PCONDITION Condition
+    )
+/*++
+
+Routine Description:
+
+    This routine wakes every thread waiting on a condition.
+
+Arguments:
+
+    Condition - The condition.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(Condition);
+#else
+    pthread_cond_broadcast(Condition);
+#endif
+}
@@ -0,0 +1,178 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    thread.h
+
+Abstract:
+
+    This module contains definitions for portable threads and locks.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Thread entry point
+//
+
+typedef VOID (*PTHREAD_ROUTINE)(
+    IN PVOID Parameter
+    );
+
+//
+// Thread that can be joined
+//
+
+#ifdef _WIN32
+typedef HANDLE THREAD;
+#else
+typedef pthread_t THREAD;
+#endif
+
+typedef THREAD* PTHREAD;
+
+//
+// Mutex
+//
+
+#ifdef _WIN32
+typedef SRWLOCK MUTEX;
+#define MUTEX_INITIALIZER SRWLOCK_INIT
+#else
+typedef pthread_mutex_t MUTEX;
+#define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+
+typedef MUTEX* PMUTEX;
+
+//
+// Condition variable
+//
+
+#ifdef _WIN32
+typedef CONDITION_VARIABLE CONDITION;
+#define CONDITION_INITIALIZER CONDITION_VARIABLE_INIT
+#else
+typedef pthread_cond_t CONDITION;
+#define CONDITION_INITIALIZER PTHREAD_COND_INITIALIZER
+#endif
+
+typedef CONDITION* PCONDITION;
+
+//
+// Atomic 64-bit load and compare-exchange, which is true if Target held
+// Expected and was replaced
+//
+
+#ifdef _WIN32
+#define ATOMIC_LOAD64(Target) ((UINT64)InterlockedOr64((volatile LONG64*)(Target), 0))
+#define ATOMIC_COMPARE_EXCHANGE64(Target, Expected, Desired) \
+    (InterlockedCompareExchange64((volatile LONG64*)(Target), (LONG64)(Desired), (LONG64)(Expected)) == (LONG64)(Expected))
+#else
+#define ATOMIC_LOAD64(Target) __atomic_load_n(Target, __ATOMIC_ACQUIRE)
+#define ATOMIC_COMPARE_EXCHANGE64(Target, Expected, Desired) \
+    __sync_bool_compare_and_swap(Target, Expected, Desired)
+#endif
+
+//
+// Atomic load and store of a flag shared between threads
+//
+
+#ifdef _WIN32
+#define ATOMIC_LOAD_BOOLEAN(Target) ((BOOLEAN)InterlockedOr8((volatile CHAR*)(Target), 0))
+#define ATOMIC_STORE_BOOLEAN(Target, Value) \
+    InterlockedExchange8((volatile CHAR*)(Target), (CHAR)(Value))
+#else
+#define ATOMIC_LOAD_BOOLEAN(Target) __atomic_load_n(Target, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_BOOLEAN(Target, Value) \
+    __atomic_store_n(Target, (BOOLEAN)(Value), __ATOMIC_RELEASE)
+#endif
+
+//
+// Wait forever
+//
+
+#define WAIT_FOREVER UINT32_MAX
+
+//
+// Start a detached thread
+//
+
+BOOLEAN
+ThreadStart(
+    IN PTHREAD_ROUTINE Routine,
+    IN PVOID Parameter OPTIONAL
+    );
+
+//
+// Start a thread that has to be joined
+//
+
+BOOLEAN
+ThreadCreate(
+    IN PTHREAD_ROUTINE Routine,
+    IN PVOID Parameter OPTIONAL,
+    OUT PTHREAD Thread
+    );
+
+//
+// Wait for a thread from ThreadCreate to return
+//
+
+VOID
+ThreadJoin(
+    IN THREAD Thread
+    );
+
+//
+// Acquire a mutex
+//
+
+VOID
+MutexLock(
+    IN PMUTEX Mutex
+    );
+
+//
+// Release a mutex
+//
+
+VOID
+MutexUnlock(
+    IN PMUTEX Mutex
+    );
+
+//
+// Release a mutex and wait for a condition to be signalled, then reacquire
+// the mutex
+//
+
+VOID
+ConditionWait(
+    IN PCONDITION Condition,
+    IN PMUTEX Mutex,
+    IN UINT32 Timeout
+    );
+
+//
+// Wake a thread waiting on a condition
+//
+
+VOID
+ConditionSignal(
+    IN PCONDITION Condition
+    );
+
+//
+// Wake every thread waiting on a condition
+//
+
+VOID
+ConditionBroadcast(
+    IN PCONDITION Condition
+    );
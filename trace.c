@@ -0,0 +1,558 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    trace.c
+
+Abstract:
+
+    This module implements request tracing. Each thread writes spans to its
+    own ring buffer, so recording a span is a clock read and a copy, and
+    the oldest spans are overwritten once the ring is full. Rings are only
+    allocated once tracing is enabled and a thread records something, and a
+    thread that exits leaves its ring for the next thread to start, so short
+    lived threads don't keep allocating them.
+
+    The rings are dumped on demand in the Chrome trace event format, which
+    chrome://tracing and Perfetto can open.
+
+--*/
+
+#include "server.h"
+
+#ifdef _WIN32
+#include <profileapi.h>
+#endif
+
+//
+// A span
+//
+
+typedef struct _TRACE_SPAN
+{
+    UINT64 Start;
+    UINT64 Duration;
+    PCCHAR Category;
+    PCCHAR Name;
+    CHAR Args[TRACE_ARGS_SIZE];
+} TRACE_SPAN, *PTRACE_SPAN;
+
+//
+// A thread's ring buffer. The lock is only contended while the ring is
+// being dumped.
+//
+
+typedef struct _TRACE_RING
+{
+    struct _TRACE_RING* Next;
+    MUTEX Lock;
+    BOOLEAN InUse;
+    UINT32 ThreadId;
+    CHAR ThreadName[TRACE_THREAD_NAME_SIZE];
+    UINT64 Written;
+    TRACE_SPAN Spans[TRACE_RING_SIZE];
+} TRACE_RING, *PTRACE_RING;
+
+BOOLEAN TraceEnabled;
+
+static MUTEX RingsLock = MUTEX_INITIALIZER;
+static PTRACE_RING Rings;
+static UINT32 RingCount;
+static THREAD_LOCAL PTRACE_RING CurrentRing;
+
+// Kept even while tracing is off, for when the thread gets a ring
+static THREAD_LOCAL CHAR CurrentName[TRACE_THREAD_NAME_SIZE];
+
+static PTRACE_RING
+GetRing(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the current thread's ring, taking a released one or
+    allocating one if the thread doesn't have one yet, and names it after
+    the thread.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The ring, or NULL if memory couldn't be allocated.
+
+--*/
+{
+    PTRACE_RING Ring;
+
+    if ( CurrentRing )
+    {
+        return CurrentRing;
+    }
+
+    MutexLock(&RingsLock);
+    for ( Ring = Rings; Ring && Ring->InUse; Ring = Ring->Next )
+    {
+    }
+
+    if ( !Ring )
+    {
+        Ring = calloc(
+            1,
+            sizeof(TRACE_RING)
+            );
+        if ( Ring )
+        {
+            Ring->Lock = (MUTEX)MUTEX_INITIALIZER;
+            Ring->ThreadId = ++RingCount;
+            Ring->Next = Rings;
+            Rings = Ring;
+        }
+    }
+
+    if ( Ring )
+    {
+        Ring->InUse = TRUE;
+    }
+    MutexUnlock(&RingsLock);
+
+    // A released ring still has the name of the thread that had it
+    if ( Ring )
+    {
+        MutexLock(&Ring->Lock);
+        if ( CurrentName[0] )
+        {
+            snprintf(
+                Ring->ThreadName,
+                ARRAY_SIZE(Ring->ThreadName),
+                "%s",
+                CurrentName
+                );
+        }
+        else
+        {
+            snprintf(
+                Ring->ThreadName,
+                ARRAY_SIZE(Ring->ThreadName),
+                "thread %u",
+                Ring->ThreadId
+                );
+        }
+        MutexUnlock(&Ring->Lock);
+    }
+
+    CurrentRing = Ring;
+    return Ring;
+}
+
+UINT64
+TraceNow(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine reads the monotonic clock spans are timed with.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Microseconds from an arbitrary point.
+
+--*/
+{
+#ifdef _WIN32
+    LARGE_INTEGER Counter;
+    LARGE_INTEGER Frequency;
+
+    QueryPerformanceCounter(&Counter);
+    QueryPerformanceFrequency(&Frequency);
+    return (UINT64)(Counter.QuadPart / Frequency.QuadPart * 1000000 +
+                    Counter.QuadPart % Frequency.QuadPart * 1000000 / Frequency.QuadPart);
+#else
+    struct timespec Time;
+
+    clock_gettime(
+        CLOCK_MONOTONIC,
+        &Time
+        );
+    return (UINT64)Time.tv_sec * 1000000 + Time.tv_nsec / 1000;
+#endif
+}
+
+VOID
+TraceSpan(
+    IN PCCHAR Category,
+    IN PCCHAR Name,
+    IN UINT64 Start,
+    IN UINT64 End,
+    IN PCCHAR ArgsFormat OPTIONAL,
+    ...
+    )
+/*++
+
+Routine Description:
+
+    This routine records a span on the current thread's ring, if tracing is
+    enabled.
+
+Arguments:
+
+    Category - The span's category, which has to be a string literal.
+
+    Name - The span's name, which has to be a string literal.
+
+    Start - When the span started, from TraceNow.
+
+    End - When the span ended, from TraceNow.
+
+    ArgsFormat - printf format for a JSON object with details to show with
+                 the span, or NULL. Strings in it have to be escaped.
+
+    ... - Arguments for the format.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PTRACE_RING Ring;
+    PTRACE_SPAN Span;
+    va_list Arguments;
+
+    if ( !ATOMIC_LOAD_BOOLEAN(&TraceEnabled) )
+    {
+        return;
+    }
+
+    Ring = GetRing();
+    if ( !Ring )
+    {
+        return;
+    }
+
+    MutexLock(&Ring->Lock);
+    Span = &Ring->Spans[Ring->Written++ % TRACE_RING_SIZE];
+    Span->Start = Start;
+    Span->Duration = End > Start ? End - Start : 0;
+    Span->Category = Category;
+    Span->Name = Name;
+    Span->Args[0] = 0;
+    if ( ArgsFormat )
+    {
+        va_start(
+            Arguments,
+            ArgsFormat
+            );
+        vsnprintf(
+            Span->Args,
+            ARRAY_SIZE(Span->Args),
+            ArgsFormat,
+            Arguments
+            );
+        va_end(Arguments);
+
+        // Don't dump an object that was cut off
+        if ( strlen(Span->Args) == ARRAY_SIZE(Span->Args) - 1 )
+        {
+            Span->Args[0] = 0;
+        }
+    }
+    MutexUnlock(&Ring->Lock);
+}
+
+VOID
+TraceCurl(
+    IN PCCHAR Name,
+    IN CURL* Curl,
+    IN UINT64 Start
+    )
+/*++
+
+Routine Description:
+
+    This routine records a span for a curl transfer, with child spans for
+    each phase of it from curl's timings: name lookup, connecting, the TLS
+    handshake, sending the request, waiting for the first byte and
+    receiving the response. Phases curl skipped, like lookups of cached
+    names, come out empty.
+
+Arguments:
+
+    Name - The span's name, which has to be a string literal.
+
+    Curl - The transfer, which must not have been cleaned up yet.
+
+    Start - When the transfer started, from TraceNow.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    static const PCCHAR PhaseNames[] = {
+        "dns",
+        "connect",
+        "tls",
+        "send",
+        "wait",
+        "receive"
+    };
+    static const CURLINFO PhaseInfo[] = {
+        CURLINFO_NAMELOOKUP_TIME_T,
+        CURLINFO_CONNECT_TIME_T,
+        CURLINFO_APPCONNECT_TIME_T,
+        CURLINFO_PRETRANSFER_TIME_T,
+        CURLINFO_STARTTRANSFER_TIME_T,
+        CURLINFO_TOTAL_TIME_T
+    };
+    curl_off_t Times[ARRAY_SIZE(PhaseInfo)];
+    curl_off_t Previous;
+    long Status;
+    UINT32 i;
+
+    if ( !ATOMIC_LOAD_BOOLEAN(&TraceEnabled) )
+    {
+        return;
+    }
+
+    for ( i = 0; i < ARRAY_SIZE(PhaseInfo); i++ )
+    {
+        Times[i] = 0;
+        curl_easy_getinfo(
+            Curl,
+            PhaseInfo[i],
+            &Times[i]
+            );
+    }
+    Status = 0;
+    curl_easy_getinfo(
+        Curl,
+        CURLINFO_RESPONSE_CODE,
+        &Status
+        );
+
+    TraceSpan(
+        "upstream",
+        Name,
+        Start,
+        Start + Times[ARRAY_SIZE(Times) - 1],
+        "{\"status\":%ld,\"dns_us\":%" PRId64 ",\"connect_us\":%" PRId64 ","
+        "\"tls_us\":%" PRId64 ",\"pretransfer_us\":%" PRId64 ","
+        "\"ttfb_us\":%" PRId64 ",\"total_us\":%" PRId64 "}",
+        Status,
+        (INT64)Times[0],
+        (INT64)Times[1],
+        (INT64)Times[2],
+        (INT64)Times[3],
+        (INT64)Times[4],
+        (INT64)Times[5]
+        );
+
+    // Times are from the start of the transfer, and 0 for skipped phases
+    Previous = 0;
+    for ( i = 0; i < ARRAY_SIZE(PhaseInfo); i++ )
+    {
+        if ( Times[i] > Previous )
+        {
+            TraceSpan(
+                "upstream",
+                PhaseNames[i],
+                Start + Previous,
+                Start + Times[i],
+                NULL
+                );
+            Previous = Times[i];
+        }
+    }
+}
+
+VOID
+TraceSetThreadName(
+    IN PCCHAR Name
+    )
+/*++
+
+Routine Description:
+
+    This routine names the current thread in traces. The name is kept
+    while tracing is off, and given to the thread's ring once it has one.
+
+Arguments:
+
+    Name - The name.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PTRACE_RING Ring;
+
+    snprintf(
+        CurrentName,
+        ARRAY_SIZE(CurrentName),
+        "%s",
+        Name
+        );
+
+    Ring = CurrentRing;
+    if ( Ring )
+    {
+        MutexLock(&Ring->Lock);
+        snprintf(
+            Ring->ThreadName,
+            ARRAY_SIZE(Ring->ThreadName),
+            "%s",
+            Name
+            );
+        MutexUnlock(&Ring->Lock);
+    }
+}
+
+VOID
+TraceReleaseThread(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine gives up the current thread's ring. Its spans stay in it
+    until they're overwritten.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( CurrentRing )
+    {
+        MutexLock(&RingsLock);
+        CurrentRing->InUse = FALSE;
+        MutexUnlock(&RingsLock);
+        CurrentRing = NULL;
+    }
+}
+
+VOID
+TraceWriteChromeJson(
+    IN struct mg_connection* Connection
+    )
+/*++
+
+Routine Description:
+
+    This routine writes every ring's spans as a Chrome trace, oldest first
+    in each ring, as chunks of a chunked response. Each ring is locked
+    while it's copied, so the threads writing to them only wait for one
+    ring's worth of formatting.
+
+Arguments:
+
+    Connection - The connection to write to.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR Output[JSON_WRITER_BUFFER_SIZE];
+    JSON_WRITER Writer;
+    PTRACE_RING Ring;
+    PTRACE_SPAN Span;
+    PCCHAR Separator;
+    UINT64 First;
+    UINT64 i;
+
+    JsonWriterInitialize(
+        &Writer,
+        Output,
+        ARRAY_SIZE(Output),
+        JsonSinkChunk,
+        Connection
+        );
+    JsonWriteRaw(
+        &Writer,
+        "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[",
+        39
+        );
+    Separator = "";
+
+    // Rings are only ever added to the front, so the list can be walked
+    // without holding RingsLock
+    MutexLock(&RingsLock);
+    Ring = Rings;
+    MutexUnlock(&RingsLock);
+
+    for ( ; Ring; Ring = Ring->Next )
+    {
+        MutexLock(&Ring->Lock);
+
+        JsonWritef(
+            &Writer,
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"name\":",
+            Separator,
+            Ring->ThreadId
+            );
+        JsonWriteString(
+            &Writer,
+            Ring->ThreadName
+            );
+        JsonWriteRaw(
+            &Writer,
+            "}}",
+            2
+            );
+        Separator = ",";
+
+        First = Ring->Written > TRACE_RING_SIZE ? Ring->Written - TRACE_RING_SIZE : 0;
+        for ( i = First; i < Ring->Written; i++ )
+        {
+            Span = &Ring->Spans[i % TRACE_RING_SIZE];
+            JsonWritef(
+                &Writer,
+                ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "%s%s}",
+                Span->Name,
+                Span->Category,
+                Ring->ThreadId,
+                Span->Start,
+                Span->Duration,
+                Span->Args[0] ? ",\"args\":" : "",
+                Span->Args
+                );
+        }
+
+        MutexUnlock(&Ring->Lock);
+    }
+
+    JsonWriteRaw(
+        &Writer,
+        "]}\n",
+        3
+        );
+    JsonWriterFlush(&Writer);
+    mg_http_printf_chunk(
+        Connection,
+        ""
+        );
+}
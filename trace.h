@@ -0,0 +1,106 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    trace.h
+
+Abstract:
+
+    This module contains definitions for request tracing. Spans are kept in
+    a ring buffer per thread and can be dumped as Chrome trace events.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Spans kept per thread
+//
+
+#define TRACE_RING_SIZE 4096
+
+//
+// Room for a span's arguments, a JSON object
+//
+
+#define TRACE_ARGS_SIZE 192
+
+//
+// Room for a thread's name
+//
+
+#define TRACE_THREAD_NAME_SIZE 32
+
+//
+// Whether spans are recorded. It can be changed while other threads are
+// tracing, so it's accessed with ATOMIC_LOAD_BOOLEAN and
+// ATOMIC_STORE_BOOLEAN once the server is running.
+//
+
+extern BOOLEAN TraceEnabled;
+
+//
+// Get the trace clock, in microseconds
+//
+
+UINT64
+TraceNow(
+    VOID
+    );
+
+//
+// Record a span on the current thread
+//
+
+VOID
+TraceSpan(
+    IN PCCHAR Category,
+    IN PCCHAR Name,
+    IN UINT64 Start,
+    IN UINT64 End,
+    IN PCCHAR ArgsFormat OPTIONAL,
+    ...
+    );
+
+//
+// Record a span for a finished curl transfer, with its timing breakdown
+//
+
+VOID
+TraceCurl(
+    IN PCCHAR Name,
+    IN CURL* Curl,
+    IN UINT64 Start
+    );
+
+//
+// Name the current thread in traces
+//
+
+VOID
+TraceSetThreadName(
+    IN PCCHAR Name
+    );
+
+//
+// Let another thread reuse the current thread's ring buffer, called when a
+// thread exits
+//
+
+VOID
+TraceReleaseThread(
+    VOID
+    );
+
+//
+// Write every thread's spans as the body of a chunked response
+//
+
+VOID
+TraceWriteChromeJson(
+    IN struct mg_connection* Connection
+    );
@@ -0,0 +1,832 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    watchdog.c
+
+Abstract:
+
+    This module implements the event loop watchdog. The loop marks the
+    start and end of each iteration and each event handler, which go into
+    histograms, and anything that runs over the stall threshold is logged
+    with the phase and route it was on and kept for the watchdog endpoint.
+
+    A separate thread checks on the loop, so a stall is reported while it's
+    still happening, even if it never ends. Where glibc's backtrace is
+    available, the loop thread is also sent SIGUSR2 and dumps its stack to
+    stderr, showing exactly where it's stuck.
+
+--*/
+
+#include "server.h"
+
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#define WATCHDOG_BACKTRACE 1
+#define WATCHDOG_BACKTRACE_SIGNAL SIGUSR2
+#define WATCHDOG_BACKTRACE_FRAMES 64
+#endif
+
+//
+// A histogram of durations
+//
+
+typedef struct _WATCHDOG_HISTOGRAM
+{
+    UINT64 Count;
+    UINT64 Total;
+    UINT64 Max;
+    UINT64 Buckets[WATCHDOG_BUCKETS];
+} WATCHDOG_HISTOGRAM, *PWATCHDOG_HISTOGRAM;
+
+//
+// A stall
+//
+
+typedef struct _WATCHDOG_STALL
+{
+    time_t Time;
+    UINT64 Duration;
+    PCCHAR Phase;
+    INT Event;
+    CHAR Route[WATCHDOG_ROUTE_SIZE];
+} WATCHDOG_STALL, *PWATCHDOG_STALL;
+
+UINT32 StallThreshold = DEFAULT_STALL_THRESHOLD;
+
+static MUTEX WatchdogLock = MUTEX_INITIALIZER;
+static CONDITION WatchdogCondition = CONDITION_INITIALIZER;
+static BOOLEAN Watching;
+
+// How long the current iteration can take, which includes its poll timeout
+static UINT64 LoopAllowance;
+
+// The loop's current iteration and handler, 0 when there isn't one
+static UINT64 LoopStart;
+static UINT64 HandlerStart;
+static PCCHAR HandlerPhase;
+static INT HandlerEvent;
+static CHAR HandlerRoute[WATCHDOG_ROUTE_SIZE];
+static BOOLEAN LoopReported;
+static BOOLEAN HandlerReported;
+static BOOLEAN HandlerStalled;
+
+static WATCHDOG_HISTOGRAM LoopHistogram;
+static WATCHDOG_HISTOGRAM HandlerHistogram;
+static WATCHDOG_STALL RecentStalls[WATCHDOG_RECENT_STALLS];
+static UINT64 StallCount;
+
+#ifdef WATCHDOG_BACKTRACE
+static pthread_t LoopThread;
+#endif
+
+static PCCHAR
+GetEventName(
+    IN INT Event
+    )
+/*++
+
+Routine Description:
+
+    This routine gets the name of a mongoose event.
+
+Arguments:
+
+    Event - The event, or -1 for timers.
+
+Return Value:
+
+    The name.
+
+--*/
+{
+    switch ( Event )
+    {
+    case -1:
+        return "timer";
+    case MG_EV_ACCEPT:
+        return "accept";
+    case MG_EV_READ:
+        return "read";
+    case MG_EV_WRITE:
+        return "write";
+    case MG_EV_POLL:
+        return "poll";
+    case MG_EV_CLOSE:
+        return "close";
+    case MG_EV_HTTP_MSG:
+        return "http_msg";
+    default:
+        return "other";
+    }
+}
+
+static VOID
+AddDuration(
+    IN PWATCHDOG_HISTOGRAM Histogram,
+    IN UINT64 Duration
+    )
+/*++
+
+Routine Description:
+
+    This routine adds a duration to a histogram. Bucket i holds durations
+    under 2^i microseconds that didn't fit in the one before it.
+
+Arguments:
+
+    Histogram - The histogram.
+
+    Duration - The duration, in microseconds.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 Bucket;
+
+    Bucket = 0;
+    while ( Bucket < WATCHDOG_BUCKETS - 1 && Duration >> Bucket )
+    {
+        Bucket++;
+    }
+
+    Histogram->Count++;
+    Histogram->Total += Duration;
+    Histogram->Max = MAX(Histogram->Max, Duration);
+    Histogram->Buckets[Bucket]++;
+}
+
+static VOID
+AddStall(
+    IN PCCHAR Phase,
+    IN INT Event,
+    IN PCCHAR Route,
+    IN UINT64 Duration,
+    OUT PWATCHDOG_STALL Copy
+    )
+/*++
+
+Routine Description:
+
+    This routine records a stall that's over, with WatchdogLock held. It's
+    reported with ReportStall once the lock is released.
+
+Arguments:
+
+    Phase - What the loop was doing.
+
+    Event - The event being handled, or -1.
+
+    Route - The route, or an empty string.
+
+    Duration - How long it lasted, in microseconds.
+
+    Copy - Receives a copy of the stall, to report.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PWATCHDOG_STALL Stall;
+
+    Stall = &RecentStalls[StallCount++ % WATCHDOG_RECENT_STALLS];
+    Stall->Time = time(NULL);
+    Stall->Duration = Duration;
+    Stall->Phase = Phase;
+    Stall->Event = Event;
+    snprintf(
+        Stall->Route,
+        ARRAY_SIZE(Stall->Route),
+        "%s",
+        Route
+        );
+    *Copy = *Stall;
+}
+
+static VOID
+ReportStall(
+    IN PWATCHDOG_STALL Stall,
+    IN UINT64 Start
+    )
+/*++
+
+Routine Description:
+
+    This routine logs and traces a stall recorded by AddStall, without
+    WatchdogLock held, since the watchdog thread needs it while logging
+    is slow.
+
+Arguments:
+
+    Stall - The copy of the stall.
+
+    Start - When the stall started, from TraceNow.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LOG("Loop stalled for %" PRIu64 "us in %s (%s) %s\n", Stall->Duration, Stall->Phase, GetEventName(Stall->Event), Stall->Route);
+    TraceSpan(
+        "watchdog",
+        "stall",
+        Start,
+        Start + Stall->Duration,
+        NULL
+        );
+}
+
+#ifdef WATCHDOG_BACKTRACE
+static VOID
+DumpBacktrace(
+    IN INT Signal
+    )
+/*++
+
+Routine Description:
+
+    This routine dumps the loop thread's stack to stderr. It runs as a
+    signal handler, so it only uses backtrace_symbols_fd, which doesn't
+    allocate.
+
+Arguments:
+
+    Signal - Not used.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PVOID Frames[WATCHDOG_BACKTRACE_FRAMES];
+    INT FrameCount;
+
+    (Signal);
+
+    FrameCount = backtrace(
+        Frames,
+        ARRAY_SIZE(Frames)
+        );
+    backtrace_symbols_fd(
+        Frames,
+        FrameCount,
+        STDERR_FILENO
+        );
+}
+#endif
+
+static VOID
+WatchdogThread(
+    IN PVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    This routine checks on the loop twice per stall threshold, and reports
+    a handler or loop iteration that's running over it once.
+
+Arguments:
+
+    Parameter - Not used.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    CHAR Route[WATCHDOG_ROUTE_SIZE];
+    PCCHAR Phase;
+    UINT64 Elapsed;
+    UINT64 Now;
+    INT Event;
+
+    (Parameter);
+
+    TraceSetThreadName("watchdog");
+
+    MutexLock(&WatchdogLock);
+    while ( TRUE )
+    {
+        ConditionWait(
+            &WatchdogCondition,
+            &WatchdogLock,
+            MAX(StallThreshold / 2, 1)
+            );
+
+        Now = TraceNow();
+        Phase = NULL;
+        if ( HandlerStart && !HandlerReported &&
+             Now - HandlerStart > (UINT64)StallThreshold * 1000 )
+        {
+            HandlerReported = TRUE;
+            Phase = HandlerPhase;
+            Event = HandlerEvent;
+            Elapsed = Now - HandlerStart;
+            snprintf(
+                Route,
+                ARRAY_SIZE(Route),
+                "%s",
+                HandlerRoute
+                );
+        }
+        else if ( !HandlerStart && LoopStart && !LoopReported &&
+                  Now - LoopStart > LoopAllowance )
+        {
+            LoopReported = TRUE;
+            Phase = "loop";
+            Event = -1;
+            Elapsed = Now - LoopStart;
+            Route[0] = 0;
+        }
+
+        if ( !Phase )
+        {
+            continue;
+        }
+
+        // Don't hold the lock while logging, the loop needs it to finish
+        MutexUnlock(&WatchdogLock);
+        LOG("Loop has been stuck for %" PRIu64 "ms in %s (%s) %s\n", Elapsed / 1000, Phase, GetEventName(Event), Route);
+#ifdef WATCHDOG_BACKTRACE
+        pthread_kill(
+            LoopThread,
+            WATCHDOG_BACKTRACE_SIGNAL
+            );
+#endif
+        MutexLock(&WatchdogLock);
+    }
+}
+
+BOOLEAN
+WatchdogStart(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine starts watching the loop, unless the stall threshold is 0.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE - The watchdog was started, or is disabled.
+
+    FALSE - The watchdog thread couldn't be started.
+
+--*/
+{
+#ifdef WATCHDOG_BACKTRACE
+    struct sigaction Action = {0};
+    PVOID Frame;
+#endif
+
+    if ( !StallThreshold )
+    {
+        return TRUE;
+    }
+
+#ifdef WATCHDOG_BACKTRACE
+    // backtrace loads libgcc the first time, which isn't safe in a signal
+    // handler
+    backtrace(
+        &Frame,
+        1
+        );
+
+    LoopThread = pthread_self();
+    Action.sa_handler = DumpBacktrace;
+    Action.sa_flags = SA_RESTART;
+    sigemptyset(&Action.sa_mask);
+    sigaction(
+        WATCHDOG_BACKTRACE_SIGNAL,
+        &Action,
+        NULL
+        );
+#endif
+
+    Watching = TRUE;
+    if ( !ThreadStart(
+             WatchdogThread,
+             NULL
+             ) )
+    {
+        Watching = FALSE;
+        return FALSE;
+    }
+
+    LOG("Reporting loop stalls over %ums\n", StallThreshold);
+    return TRUE;
+}
+
+VOID
+WatchdogLoopBegin(
+    IN INT Timeout
+    )
+/*++
+
+Routine Description:
+
+    This routine marks the start of a loop iteration. Iterations are allowed
+    their poll timeout on top of the threshold, since most of an idle one is
+    spent waiting in poll. An iteration that waits with no timeout is only
+    checked by its handlers, since it can be idle for any amount of time.
+
+Arguments:
+
+    Timeout - The iteration's poll timeout in milliseconds, or -1 for none.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( !Watching )
+    {
+        return;
+    }
+
+    MutexLock(&WatchdogLock);
+    LoopAllowance = Timeout < 0 ? UINT64_MAX : ((UINT64)Timeout + StallThreshold) * 1000;
+    LoopStart = TraceNow();
+    LoopReported = FALSE;
+    HandlerStalled = FALSE;
+    MutexUnlock(&WatchdogLock);
+}
+
+VOID
+WatchdogLoopEnd(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine marks the end of a loop iteration. Iterations aren't
+    counted as stalls if a handler in them already was.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WATCHDOG_STALL Stall;
+    UINT64 Start;
+    UINT64 Duration;
+
+    if ( !Watching )
+    {
+        return;
+    }
+
+    MutexLock(&WatchdogLock);
+    Start = LoopStart;
+    Duration = TraceNow() - Start;
+    AddDuration(
+        &LoopHistogram,
+        Duration
+        );
+    Stall.Phase = NULL;
+    if ( !HandlerStalled && Duration > LoopAllowance )
+    {
+        AddStall(
+            "loop",
+            -1,
+            "",
+            Duration,
+            &Stall
+            );
+    }
+    LoopStart = 0;
+    MutexUnlock(&WatchdogLock);
+
+    if ( Stall.Phase )
+    {
+        ReportStall(
+            &Stall,
+            Start
+            );
+    }
+}
+
+VOID
+WatchdogHandlerBegin(
+    IN PCCHAR Phase,
+    IN INT Event
+    )
+/*++
+
+Routine Description:
+
+    This routine marks the start of an event handler. Handlers don't nest,
+    since mongoose calls them one at a time from the loop.
+
+Arguments:
+
+    Phase - The handler, which has to be a string literal.
+
+    Event - The event being handled, or -1 for timers.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( !Watching )
+    {
+        return;
+    }
+
+    MutexLock(&WatchdogLock);
+    HandlerStart = TraceNow();
+    HandlerPhase = Phase;
+    HandlerEvent = Event;
+    HandlerRoute[0] = 0;
+    HandlerReported = FALSE;
+    MutexUnlock(&WatchdogLock);
+}
+
+VOID
+WatchdogSetRoute(
+    IN struct mg_str* Route
+    )
+/*++
+
+Routine Description:
+
+    This routine sets the route of the handler that's running, so a stall
+    in it can be tied to a request.
+
+Arguments:
+
+    Route - The route, usually the request URI.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if ( !Watching )
+    {
+        return;
+    }
+
+    MutexLock(&WatchdogLock);
+    snprintf(
+        HandlerRoute,
+        ARRAY_SIZE(HandlerRoute),
+        "%.*s",
+        (INT)Route->len,
+        Route->ptr
+        );
+    MutexUnlock(&WatchdogLock);
+}
+
+VOID
+WatchdogHandlerEnd(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    This routine marks the end of an event handler.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WATCHDOG_STALL Stall;
+    UINT64 Start;
+    UINT64 Duration;
+
+    if ( !Watching )
+    {
+        return;
+    }
+
+    MutexLock(&WatchdogLock);
+    Start = HandlerStart;
+    Duration = TraceNow() - Start;
+    AddDuration(
+        &HandlerHistogram,
+        Duration
+        );
+    Stall.Phase = NULL;
+    if ( Duration > (UINT64)StallThreshold * 1000 )
+    {
+        AddStall(
+            HandlerPhase,
+            HandlerEvent,
+            HandlerRoute,
+            Duration,
+            &Stall
+            );
+        HandlerStalled = TRUE;
+    }
+    HandlerStart = 0;
+    MutexUnlock(&WatchdogLock);
+
+    if ( Stall.Phase )
+    {
+        ReportStall(
+            &Stall,
+            Start
+            );
+    }
+}
+
+static VOID
+WriteHistogram(
+    IN OUT PJSON_WRITER Writer,
+    IN PCCHAR Name,
+    IN PWATCHDOG_HISTOGRAM Histogram
+    )
+/*++
+
+Routine Description:
+
+    This routine writes a histogram as a member of a JSON object.
+
+Arguments:
+
+    Writer - The writer.
+
+    Name - The histogram's key.
+
+    Histogram - The histogram.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UINT32 i;
+
+    JsonWritef(
+        Writer,
+        "\"%s\":{\"count\":%" PRIu64 ",\"mean_us\":%" PRIu64 ",\"max_us\":%" PRIu64 ",\"buckets\":[",
+        Name,
+        Histogram->Count,
+        Histogram->Count ? Histogram->Total / Histogram->Count : 0,
+        Histogram->Max
+        );
+    for ( i = 0; i < WATCHDOG_BUCKETS; i++ )
+    {
+        JsonWritef(
+            Writer,
+            "%s%" PRIu64,
+            i ? "," : "",
+            Histogram->Buckets[i]
+            );
+    }
+    JsonWriteRaw(
+        Writer,
+        "]}",
+        2
+        );
+}
+
+VOID
+WatchdogWriteJson(
+    IN struct mg_connection* Connection
+    )
+/*++
+
+Routine Description:
+
+    This routine writes the loop and handler histograms and the most recent
+    stalls, newest first, as a chunked response. Bucket i of each
+    histogram counts durations under 2^i microseconds.
+
+Arguments:
+
+    Connection - The connection to write to.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WATCHDOG_HISTOGRAM Loop;
+    WATCHDOG_HISTOGRAM Handlers;
+    WATCHDOG_STALL Stalls[WATCHDOG_RECENT_STALLS];
+    CHAR Output[JSON_WRITER_BUFFER_SIZE];
+    JSON_WRITER Writer;
+    UINT64 Count;
+    UINT32 Kept;
+    UINT32 i;
+
+    // Copied so the loop isn't held up while this is written
+    MutexLock(&WatchdogLock);
+    Loop = LoopHistogram;
+    Handlers = HandlerHistogram;
+    Count = StallCount;
+    memcpy(
+        Stalls,
+        RecentStalls,
+        sizeof(Stalls)
+        );
+    MutexUnlock(&WatchdogLock);
+
+    JsonWriterInitialize(
+        &Writer,
+        Output,
+        ARRAY_SIZE(Output),
+        JsonSinkChunk,
+        Connection
+        );
+    JsonWritef(
+        &Writer,
+        "{\"enabled\":%s,\"threshold_ms\":%u,\"stalls\":%" PRIu64 ",",
+        Watching ? "true" : "false",
+        StallThreshold,
+        Count
+        );
+    WriteHistogram(
+        &Writer,
+        "loop",
+        &Loop
+        );
+    JsonWriteRaw(
+        &Writer,
+        ",",
+        1
+        );
+    WriteHistogram(
+        &Writer,
+        "handlers",
+        &Handlers
+        );
+
+    JsonWriteRaw(
+        &Writer,
+        ",\"recent\":[",
+        11
+        );
+    Kept = (UINT32)MIN(Count, WATCHDOG_RECENT_STALLS);
+    for ( i = 0; i < Kept; i++ )
+    {
+        PWATCHDOG_STALL Stall = &Stalls[(Count - 1 - i) % WATCHDOG_RECENT_STALLS];
+
+        JsonWritef(
+            &Writer,
+            "%s{\"time\":%" PRIu64 ",\"phase\":\"%s\",\"event\":\"%s\",\"route\":",
+            i ? "," : "",
+            (UINT64)Stall->Time,
+            Stall->Phase,
+            GetEventName(Stall->Event)
+            );
+        JsonWriteString(
+            &Writer,
+            Stall->Route
+            );
+        JsonWritef(
+            &Writer,
+            ",\"duration_us\":%" PRIu64 "}",
+            Stall->Duration
+            );
+    }
+
+    JsonWriteRaw(
+        &Writer,
+        "]}\n",
+        3
+        );
+    JsonWriterFlush(&Writer);
+    mg_http_printf_chunk(
+        Connection,
+        ""
+        );
+}
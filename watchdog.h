@@ -0,0 +1,114 @@
+/*++
+
+Copyright (c) 2022 MobSlicer152
+
+Module Name:
+
+    watchdog.h
+
+Abstract:
+
+    This module contains definitions for the event loop watchdog, which
+    times loop iterations and event handlers and reports stalls.
+
+--*/
+
+#pragma once
+
+#include "types.h"
+
+//
+// Default time a handler can run before it's reported, in milliseconds
+//
+
+#define DEFAULT_STALL_THRESHOLD 100
+
+//
+// Histogram buckets, each twice as wide as the last, starting at 1us. The
+// last one holds everything over about 8 seconds.
+//
+
+#define WATCHDOG_BUCKETS 24
+
+//
+// Stalls kept for the watchdog endpoint
+//
+
+#define WATCHDOG_RECENT_STALLS 16
+
+//
+// Room for the route a stall happened on
+//
+
+#define WATCHDOG_ROUTE_SIZE 96
+
+//
+// Milliseconds a handler can run before it's reported, 0 to disable
+//
+
+extern UINT32 StallThreshold;
+
+//
+// Start watching the loop, which has to be running on the calling thread
+//
+
+BOOLEAN
+WatchdogStart(
+    VOID
+    );
+
+//
+// Mark the start of a loop iteration that polls for up to Timeout ms, or
+// with no timeout if it's -1
+//
+
+VOID
+WatchdogLoopBegin(
+    IN INT Timeout
+    );
+
+//
+// Mark the end of a loop iteration
+//
+
+VOID
+WatchdogLoopEnd(
+    VOID
+    );
+
+//
+// Mark the start of an event handler
+//
+
+VOID
+WatchdogHandlerBegin(
+    IN PCCHAR Phase,
+    IN INT Event
+    );
+
+//
+// Set the route of the handler that's running
+//
+
+VOID
+WatchdogSetRoute(
+    IN struct mg_str* Route
+    );
+
+//
+// Mark the end of an event handler
+//
+
+VOID
+WatchdogHandlerEnd(
+    VOID
+    );
+
+//
+// Write the histograms and recent stalls as the body of a chunked response
+//
+
+VOID
+WatchdogWriteJson(
+    IN struct mg_connection* Connection
+    );